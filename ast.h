@@ -0,0 +1,52 @@
+#ifndef MOSAIC_ECS_AST_H
+#define MOSAIC_ECS_AST_H
+
+#include <ostream>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "expr.h"
+#include "stmt.h"
+#include "token.h"
+#include "value.h"
+
+// A parsed script. Nodes are appended to flat, trivially destructible
+// arrays and never freed one by one; dropping the Ast releases the whole
+// tree in a handful of frees. Token lexemes still point into the source,
+// which must outlive the Ast.
+struct Ast {
+    std::vector<Token> tokens;
+    std::vector<Expr> exprs;
+    std::vector<Stmt> stmts;
+    // Child lists of blocks, calls and parameter lists, each contiguous.
+    std::vector<uint32_t> lists;
+    // Values of literals the optimizer computed.
+    std::vector<Value> values;
+    // Every distinct identifier, indexed by Token::symbol, and the other
+    // way round.
+    std::vector<std::string_view> symbols;
+    std::unordered_map<std::string_view, uint32_t> symbol_ids;
+    // Per expression, whether TypeInference proved its operands numbers.
+    // Empty unless inference ran.
+    std::vector<bool> numeric;
+    // The modules named by `import`, in order. Not statements: a module's
+    // imports are known before any of it runs.
+    std::vector<TokenIndex> imports;
+    // The top-level statements; only those parsed last when the tree was
+    // parsed a piece at a time.
+    ListIndex script = 0;
+    uint32_t script_count = 0;
+
+    const Token& token(TokenIndex index) const { return tokens[index]; }
+    const Expr& expr(ExprIndex index) const { return exprs[index]; }
+    const Stmt& stmt(StmtIndex index) const { return stmts[index]; }
+    const uint32_t* list(ListIndex index) const { return lists.data() + index; }
+};
+
+// False for string literals, whose value only exists once interned.
+bool literal_value(const Ast& ast, const Literal& literal, Value& value);
+void print_expr(std::ostream& os, const Ast& ast, ExprIndex index);
+void print_stmt(std::ostream& os, const Ast& ast, StmtIndex index);
+
+#endif
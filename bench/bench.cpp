@@ -0,0 +1,1066 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <new>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "compiler.h"
+#include "module.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "repl.h"
+#include "scanner.h"
+#include "ast.h"
+#include "tessera.h"
+#include "type_inference.h"
+#include "vm.h"
+
+// Every allocation made by the pipeline goes through these, so a stage's
+// allocation count is the difference of the counter around it. The whole
+// replaceable set is replaced, so that every form of new is counted and
+// every form of delete frees what its new allocated.
+static std::atomic<size_t> allocation_count = 0;
+
+static void* counted_alloc(size_t size, size_t alignment = 0) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (size == 0) size = 1;
+    if (alignment <= alignof(std::max_align_t)) return std::malloc(size);
+    // aligned_alloc wants a multiple of the alignment.
+    return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+static void* counted_new(size_t size, size_t alignment = 0) {
+    if (void* memory = counted_alloc(size, alignment)) return memory;
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size) { return counted_new(size); }
+void* operator new[](size_t size) { return counted_new(size); }
+void* operator new(size_t size, std::align_val_t alignment) { return counted_new(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment) { return counted_new(size, (size_t)alignment); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return counted_alloc(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return counted_alloc(size); }
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return counted_alloc(size, (size_t)alignment);
+}
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return counted_alloc(size, (size_t)alignment);
+}
+
+void operator delete(void* memory) noexcept { std::free(memory); }
+void operator delete[](void* memory) noexcept { std::free(memory); }
+void operator delete(void* memory, size_t) noexcept { std::free(memory); }
+void operator delete[](void* memory, size_t) noexcept { std::free(memory); }
+void operator delete(void* memory, std::align_val_t) noexcept { std::free(memory); }
+void operator delete[](void* memory, std::align_val_t) noexcept { std::free(memory); }
+void operator delete(void* memory, size_t, std::align_val_t) noexcept { std::free(memory); }
+void operator delete[](void* memory, size_t, std::align_val_t) noexcept { std::free(memory); }
+void operator delete(void* memory, const std::nothrow_t&) noexcept { std::free(memory); }
+void operator delete[](void* memory, const std::nothrow_t&) noexcept { std::free(memory); }
+void operator delete(void* memory, std::align_val_t, const std::nothrow_t&) noexcept { std::free(memory); }
+void operator delete[](void* memory, std::align_val_t, const std::nothrow_t&) noexcept { std::free(memory); }
+
+enum Stage {
+    STAGE_SCAN,
+    STAGE_PARSE,
+    STAGE_OPTIMIZE,
+    STAGE_COMPILE,
+    STAGE_WRITE,
+    STAGE_READ,
+    STAGE_EXECUTE,
+    STAGE_COUNT,
+};
+
+static const char* stage_names[STAGE_COUNT] = {
+        "scan", "parse", "optimize", "compile", "write", "read", "execute"
+};
+
+struct StageResult {
+    double ns_per_op = 0;
+    double allocs_per_op = 0;
+};
+
+struct BenchResult {
+    std::string name;
+    StageResult stages[STAGE_COUNT];
+};
+
+class StageTimer {
+public:
+    StageTimer(StageResult& result) : result(result) {
+        allocations = allocation_count.load(std::memory_order_relaxed);
+        start = std::chrono::steady_clock::now();
+    }
+    ~StageTimer() {
+        auto end = std::chrono::steady_clock::now();
+        result.ns_per_op += std::chrono::duration<double, std::nano>(end - start).count();
+        result.allocs_per_op += allocation_count.load(std::memory_order_relaxed) - allocations;
+    }
+private:
+    StageResult& result;
+    size_t allocations;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Scripts print, and so do the debug dumps; keep that off the JSON report.
+class SilenceStdout {
+public:
+    SilenceStdout() {
+        std::cout.flush();
+        fflush(stdout);
+        saved = dup(STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    }
+    ~SilenceStdout() {
+        std::cout.flush();
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+private:
+    int saved;
+};
+
+static std::string read_file(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Could not open file " << "\"" << path << "\"." << std::endl;
+        exit(74);
+    }
+    std::ostringstream ss;
+    ss << file.rdbuf();
+    return ss.str();
+}
+
+static BenchResult run_script(const std::string& path, int iterations) {
+    BenchResult bench;
+    bench.name = std::filesystem::path(path).stem().string();
+    std::string source = read_file(path);
+
+    SilenceStdout silence;
+    for (int i = 0; i < iterations; i++) {
+        std::vector<Token> tokens;
+        {
+            StageTimer timer(bench.stages[STAGE_SCAN]);
+            Scanner scanner = Scanner(source);
+            tokens = scanner.scan_tokens();
+        }
+        Ast ast;
+        {
+            StageTimer timer(bench.stages[STAGE_PARSE]);
+            Parser parser = Parser(std::move(tokens));
+            ast = parser.parse();
+        }
+        {
+            StageTimer timer(bench.stages[STAGE_OPTIMIZE]);
+            Optimizer optimizer = Optimizer(ast);
+            optimizer.optimize();
+            TypeInference inference = TypeInference(ast);
+            inference.infer();
+        }
+        Compiler compiler = Compiler(ast);
+        {
+            StageTimer timer(bench.stages[STAGE_COMPILE]);
+            compiler.compile();
+        }
+        {
+            StageTimer timer(bench.stages[STAGE_WRITE]);
+            compiler.write();
+        }
+        std::optional<VM> vm;
+        {
+            StageTimer timer(bench.stages[STAGE_READ]);
+            Image image;
+            if (!image.open("bytecode.dat")) {
+                std::cerr << "Could not load \"bytecode.dat\": " << image.error() << std::endl;
+                exit(74);
+            }
+            vm.emplace(std::move(image));
+        }
+        {
+            StageTimer timer(bench.stages[STAGE_EXECUTE]);
+            vm->run();
+        }
+    }
+
+    for (StageResult& stage : bench.stages) {
+        stage.ns_per_op /= iterations;
+        stage.allocs_per_op /= iterations;
+    }
+    return bench;
+}
+
+// A script of at least `bytes` bytes mixing everything the scanner sees:
+// indentation, keywords, identifiers, numbers, strings and both comment kinds.
+static std::string generate_lex_script(size_t bytes) {
+    std::string source;
+    source.reserve(bytes + 512);
+    for (size_t i = 0; source.size() < bytes; i++) {
+        std::string n = std::to_string(i);
+        source += "// Function " + n + " adds its arguments and reports large results.\n";
+        source += "fun function_" + n + "(first_argument, second_argument):\n";
+        source += "    let value_" + n + " = first_argument + second_argument * 42.5    /* scaled */\n";
+        source += "    while value_" + n + " > 1000 and value_" + n + " != 0:\n";
+        source += "        value_" + n + " = value_" + n + " / 2\n";
+        source += "    if value_" + n + " >= 100:\n";
+        source += "        print \"a string literal that is long enough to matter\"\n";
+        source += "    else:\n";
+        source += "        print nil\n";
+        source += "    return value_" + n + "\n";
+    }
+    return source;
+}
+
+// Tokens per second over a generated script, scanning only.
+static void run_lex(size_t megabytes, int iterations) {
+    std::string source = generate_lex_script(megabytes * 1024 * 1024);
+    size_t token_count = 0;
+    double best_ns = 0;
+    for (int i = 0; i < iterations; i++) {
+        auto start = std::chrono::steady_clock::now();
+        Scanner scanner = Scanner(source);
+        std::vector<Token> tokens = scanner.scan_tokens();
+        auto end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        if (i == 0 || ns < best_ns) best_ns = ns;
+        token_count = tokens.size();
+    }
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "{\n";
+    std::cout << "  \"iterations\": " << iterations << ",\n";
+    std::cout << "  \"lex\": {"
+              << "\"bytes\": " << source.size() << ", "
+              << "\"tokens\": " << token_count << ", "
+              << "\"best_ns\": " << best_ns << ", "
+              << "\"tokens_per_sec\": " << token_count / (best_ns / 1e9) << ", "
+              << "\"mb_per_sec\": " << source.size() / (1024.0 * 1024.0) / (best_ns / 1e9) << "}\n";
+    std::cout << "}\n";
+}
+
+// `depth` levels of nested ifs, each bumping a counter on the way in.
+static std::string generate_nested_script(int depth) {
+    std::string source = "let x = 0\n";
+    for (int level = 0; level < depth; level++) {
+        std::string indent(level, ' ');
+        source += indent + "x += 1\n";
+        source += indent + "if x > 0\n";
+    }
+    source += std::string(depth, ' ') + "print x\n";
+    return source;
+}
+
+// Compile time against nesting depth. The compiler walks each node once,
+// so ns_per_node should stay flat as the depth grows.
+static void run_depth(int max_depth, int iterations) {
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "{\n";
+    std::cout << "  \"iterations\": " << iterations << ",\n";
+    std::cout << "  \"depth\": [\n";
+    for (int depth = std::max(1, max_depth / 8); ; depth *= 2) {
+        depth = std::min(depth, max_depth);
+        std::string source = generate_nested_script(depth);
+        Scanner scanner = Scanner(source);
+        Parser parser = Parser(scanner.scan_tokens());
+        Ast ast = parser.parse();
+        size_t nodes = ast.exprs.size() + ast.stmts.size();
+
+        double best_ns = 0;
+        for (int i = 0; i < iterations; i++) {
+            auto start = std::chrono::steady_clock::now();
+            Compiler compiler = Compiler(ast);
+            compiler.compile();
+            auto end = std::chrono::steady_clock::now();
+            double ns = std::chrono::duration<double, std::nano>(end - start).count();
+            if (i == 0 || ns < best_ns) best_ns = ns;
+        }
+        std::cout << "    {\"depth\": " << depth << ", \"nodes\": " << nodes
+                  << ", \"compile_ns\": " << best_ns << ", \"ns_per_node\": " << best_ns / nodes << "}"
+                  << (depth < max_depth ? "," : "") << "\n";
+        if (depth == max_depth) break;
+    }
+    std::cout << "  ]\n";
+    std::cout << "}\n";
+}
+
+// `count` functions, every eighth with one nested in it, each calling the
+// one before. The script calls the first `called` of them, so with all of
+// them none is dead. Numbers repeat so the shared constant pool doesn't
+// overflow.
+static std::string generate_functions_script(int count, int called) {
+    std::string source;
+    for (int i = 0; i < count; i++) {
+        std::string n = std::to_string(i % 64);
+        std::string name = std::to_string(i);
+        source += "fun f" + name + "(a, b)\n";
+        source += "    let total = a\n";
+        source += "    let k = 0\n";
+        source += "    while k < b\n";
+        source += "        total += k * " + n + " - 1\n";
+        source += "        k += 1\n";
+        source += "    if total > " + n + "\n";
+        source += "        print \"f" + std::to_string(i % 16) + "\"\n";
+        if (i % 8 == 0) {
+            source += "    fun g" + name + "(x)\n";
+            source += "        return x * 2 + " + n + "\n";
+            source += "    total = g" + name + "(total)\n";
+        }
+        if (i > 0) source += "    return f" + std::to_string(i - 1) + "(total, 2)\n";
+        else source += "    return total\n";
+    }
+    source += "print f" + std::to_string(called - 1) + "(1, 3)\n";
+    return source;
+}
+
+static std::vector<uint8_t> compile_image(const Ast& ast, int optimize, unsigned threads) {
+    Compiler compiler = Compiler(ast, FFI(), optimize, DEBUG_NONE, threads);
+    compiler.compile();
+    return compiler.image();
+}
+
+static bool parse_optimized(const std::string& source, int optimize, Ast& ast) {
+    Scanner scanner = Scanner(source);
+    Parser parser = Parser(scanner.scan_tokens());
+    ast = parser.parse();
+    if (parser.failed()) return false;
+    if (optimize > OPTIMIZE_NONE) {
+        Optimizer optimizer = Optimizer(ast);
+        optimizer.optimize();
+        TypeInference inference = TypeInference(ast);
+        inference.infer();
+    }
+    return true;
+}
+
+// Compile time of many functions on one thread against every hardware
+// thread, at each level; the images must match byte for byte.
+static void run_functions(int count, int iterations) {
+    std::string source = generate_functions_script(count, count);
+    // At least two, so the parallel path runs and is checked even here.
+    unsigned threads = std::max(2u, std::thread::hardware_concurrency());
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "{\n";
+    std::cout << "  \"iterations\": " << iterations << ",\n";
+    std::cout << "  \"functions\": " << count << ",\n";
+    std::cout << "  \"threads\": " << threads << ",\n";
+    std::cout << "  \"levels\": [\n";
+    for (int level = OPTIMIZE_NONE; level <= OPTIMIZE_SSA; level++) {
+        Ast ast;
+        parse_optimized(source, level, ast);
+        double best[2] = {0, 0};
+        std::vector<uint8_t> images[2];
+        for (int i = 0; i < iterations; i++) {
+            for (int parallel = 0; parallel < 2; parallel++) {
+                auto start = std::chrono::steady_clock::now();
+                images[parallel] = compile_image(ast, level, parallel ? threads : 1);
+                auto end = std::chrono::steady_clock::now();
+                double ns = std::chrono::duration<double, std::nano>(end - start).count();
+                if (i == 0 || ns < best[parallel]) best[parallel] = ns;
+            }
+        }
+        std::cout << "    {\"level\": " << level << ", \"serial_ns\": " << best[0]
+                  << ", \"parallel_ns\": " << best[1] << ", \"speedup\": " << best[0] / best[1]
+                  << ", \"identical\": " << (images[0] == images[1] ? "true" : "false") << "}"
+                  << (level < OPTIMIZE_SSA ? "," : "") << "\n";
+    }
+    std::cout << "  ]\n";
+    std::cout << "}\n";
+}
+
+// Compiles and runs source, returning how long that took, what it printed
+// and, for a lazy program, how many of its functions were compiled.
+static double run_startup(const std::string& source, bool lazy, std::string& output, size_t& compiled,
+                          size_t& functions) {
+    std::ostringstream printed;
+    std::streambuf* saved = std::cout.rdbuf(printed.rdbuf());
+    auto start = std::chrono::steady_clock::now();
+    Program program;
+    if (compile_program(source, FFI(), program, DEBUG_NONE, OPTIMIZE_DEFAULT, lazy) == COMPILER_RESULT_OK) {
+        VM vm = VM(program);
+        vm.run();
+    }
+    auto end = std::chrono::steady_clock::now();
+    std::cout.rdbuf(saved);
+    output = printed.str();
+    if (program.lazy) {
+        compiled = program.lazy->compiled_count();
+        functions = program.lazy->function_count();
+    }
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+// Time from source to finished run of a library of many functions when
+// one, a tenth or all of them are called, compiling every body up front
+// against compiling each on its first call.
+static void run_lazy(int count, int iterations) {
+    int calls[] = {1, std::max(1, count / 10), count};
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "{\n";
+    std::cout << "  \"iterations\": " << iterations << ",\n";
+    std::cout << "  \"functions\": " << count << ",\n";
+    std::cout << "  \"runs\": [\n";
+    for (int i = 0; i < 3; i++) {
+        std::string source = generate_functions_script(count, calls[i]);
+        double best[2] = {0, 0};
+        std::string outputs[2];
+        size_t compiled = 0;
+        size_t functions = 0;
+        for (int j = 0; j < iterations; j++) {
+            for (int lazy = 0; lazy < 2; lazy++) {
+                double ns = run_startup(source, lazy, outputs[lazy], compiled, functions);
+                if (j == 0 || ns < best[lazy]) best[lazy] = ns;
+            }
+        }
+        std::cout << "    {\"called\": " << calls[i] << ", \"eager_ns\": " << best[0] << ", \"lazy_ns\": " << best[1]
+                  << ", \"speedup\": " << best[0] / best[1] << ", \"compiled\": " << compiled
+                  << ", \"uncompiled\": " << functions - compiled
+                  << ", \"identical\": " << (outputs[0] == outputs[1] ? "true" : "false") << "}"
+                  << (i < 2 ? "," : "") << "\n";
+    }
+    std::cout << "  ]\n";
+    std::cout << "}\n";
+}
+
+// Module `index` of a chain: 50 functions, the first calling the last one
+// of the module before it, which it imports. bump adds a term that changes
+// no result, for a change to a body only, and extra another exported
+// function, for a change to the module's interface.
+static std::string generate_module(int index, bool bump, bool extra) {
+    std::string prefix = "m" + std::to_string(index) + "_";
+    std::string source;
+    if (index > 0) source += "import m" + std::to_string(index - 1) + "\n";
+    for (int i = 0; i < 50; i++) {
+        std::string name = prefix + std::to_string(i);
+        source += "fun " + name + "(a)\n";
+        if (i == 0 && index > 0) {
+            source += "    return m" + std::to_string(index - 1) + "_49(a) + 1\n";
+        } else if (i == 0) {
+            source += "    return a\n";
+        } else {
+            source += "    let b = " + prefix + std::to_string(i - 1) + "(a) * " + std::to_string(i % 7 + 1) +
+                      (bump && i == 25 ? " + 0" : "") + "\n";
+            source += "    return b % 1000 + " + std::to_string(i % 64) + "\n";
+        }
+    }
+    if (extra) source += "fun " + prefix + "extra()\n    return 0\n";
+    return source;
+}
+
+static void write_file(const std::filesystem::path& path, const std::string& text) {
+    std::ofstream out(path);
+    out << text;
+}
+
+// Builds and runs the script at main, returning how long the build took,
+// how many modules it compiled and what the script printed.
+static double build_modules(const std::filesystem::path& main, const CompileCache& cache, size_t& compiled,
+                            std::string& output) {
+    std::ostringstream printed;
+    std::streambuf* saved = std::cout.rdbuf(printed.rdbuf());
+    auto start = std::chrono::steady_clock::now();
+    ModuleBuilder builder = ModuleBuilder(FFI(), OPTIMIZE_DEFAULT, DEBUG_NONE, &cache);
+    Program program;
+    bool built = builder.build(main.c_str(), program) == COMPILER_RESULT_OK;
+    auto end = std::chrono::steady_clock::now();
+    if (built) {
+        VM vm = VM(program);
+        vm.run();
+    }
+    std::cout.rdbuf(saved);
+    output = built ? printed.str() : "";
+    compiled = builder.compiled_count();
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+// Build time of a chain of modules, each importing the one before, with
+// the script importing the last: from nothing, with nothing changed, after
+// a change to one module's function body, and after a change to what one
+// module exports, which also recompiles the modules importing it.
+static void run_modules(int count, int iterations) {
+    std::filesystem::path directory = std::filesystem::temp_directory_path() / "tessera_bench_modules";
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    CompileCache cache((directory / "cache").string());
+    std::filesystem::path main = directory / "main.te";
+    int changed = count / 2;
+    for (int i = 0; i < count; i++) {
+        write_file(directory / ("m" + std::to_string(i) + ".te"), generate_module(i, false, false));
+    }
+    write_file(main, "import m" + std::to_string(count - 1) + "\nprint m" + std::to_string(count - 1) +
+                     "_49(3)\n");
+
+    const char* kinds[] = {"cold", "unchanged", "body", "interface"};
+    double best[4] = {0, 0, 0, 0};
+    size_t compiled[4] = {0, 0, 0, 0};
+    std::string outputs[4];
+    for (int j = 0; j < iterations; j++) {
+        for (int kind = 0; kind < 4; kind++) {
+            std::filesystem::path module = directory / ("m" + std::to_string(changed) + ".te");
+            if (kind == 0) std::filesystem::remove_all(directory / "cache");
+            // Each change is undone by the next cold build.
+            if (kind == 0) write_file(module, generate_module(changed, false, false));
+            if (kind == 2) write_file(module, generate_module(changed, j % 2 == 0, false));
+            if (kind == 3) write_file(module, generate_module(changed, j % 2 == 0, true));
+            double ns = build_modules(main, cache, compiled[kind], outputs[kind]);
+            if (j == 0 || ns < best[kind]) best[kind] = ns;
+        }
+    }
+    std::filesystem::remove_all(directory);
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "{\n";
+    std::cout << "  \"iterations\": " << iterations << ",\n";
+    std::cout << "  \"modules\": " << count + 1 << ",\n";
+    std::cout << "  \"functions\": " << count * 50 << ",\n";
+    std::cout << "  \"builds\": [\n";
+    for (int kind = 0; kind < 4; kind++) {
+        std::cout << "    {\"change\": \"" << kinds[kind] << "\", \"ns\": " << best[kind]
+                  << ", \"compiled\": " << compiled[kind] << ", \"speedup\": " << best[0] / best[kind]
+                  << ", \"identical\": " << (!outputs[kind].empty() && outputs[kind] == outputs[0] ? "true" : "false")
+                  << "}" << (kind < 3 ? "," : "") << "\n";
+    }
+    std::cout << "  ]\n";
+    std::cout << "}\n";
+}
+
+// count entities with a Position, and systems that add and remove a
+// Marker on every one of them, by entity and from run blocks, mark every
+// other one, and read the marked ones' Positions and Markers. Entities
+// spawned into a fresh world are numbered from 0.
+static std::string generate_ecs(int count, const char* storage) {
+    std::string entities = std::to_string(count);
+    return std::string("comp Position\n    x\n    y\n") +
+           "comp Marker: " + storage + "\n    value\n" +
+           "let i = 0\nwhile i < " + entities + "\n    spawn(Position(i, 0))\n    i += 1\n" +
+           "sys Churn\n"
+           "    let e = 0\n    while e < " + entities + "\n        insert(e, Marker(1))\n        e += 1\n"
+           "    e = 0\n    while e < " + entities + "\n        remove(e, Marker)\n        e += 1\n" +
+           "sys DeferredChurn\n"
+           "    query all\n        e: Entity\n        pos: Position\n"
+           "    run\n        insert(e, Marker(1))\n"
+           "    query marked\n        e: Entity\n        with Marker\n"
+           "    run\n        remove(e, Marker)\n"
+           "sys Mark\n"
+           "    let e = 0\n    while e < " + entities + "\n        insert(e, Marker(e))\n        e += 2\n" +
+           "sys Iterate\n"
+           "    query marked\n        pos: Position\n        m: Marker\n"
+           "    run\n        pos.x += m.value\n";
+}
+
+// Best time of a call to a system, over iterations calls.
+static double time_system(VM& vm, const char* name, int iterations) {
+    int function = vm.find_function(name);
+    double best = 0;
+    for (int i = 0; i < iterations; i++) {
+        Value result;
+        auto start = std::chrono::steady_clock::now();
+        if (vm.call_function(function, {}, result) != RUNTIME_OK) return 0;
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        if (i == 0 || ns < best) best = ns;
+    }
+    return best;
+}
+
+// Adding and removing a component on every entity, and iterating a query
+// over half of them, with the component in the archetypes' tables and in a
+// sparse set. Churn moves every entity between archetypes twice with the
+// first and only touches the set with the second; iterating the table is
+// a walk down its columns and the sparse set a join, an entity at a time.
+// Churning from run blocks defers the moves to the end of each block,
+// where they go an archetype's worth at a time.
+static void run_ecs(int count, int iterations) {
+    const char* storages[] = {"table", "sparse"};
+    double churn[2] = {0, 0};
+    double deferred[2] = {0, 0};
+    double iterate[2] = {0, 0};
+    for (int storage = 0; storage < 2; storage++) {
+        Program program;
+        if (compile_program(generate_ecs(count, storages[storage]), FFI(), program, DEBUG_NONE,
+                            OPTIMIZE_DEFAULT) != COMPILER_RESULT_OK) {
+            exit(65);
+        }
+        VM vm = VM(program);
+        if (vm.run() != RUNTIME_OK) exit(70);
+        churn[storage] = time_system(vm, "Churn", iterations);
+        deferred[storage] = time_system(vm, "DeferredChurn", iterations);
+        time_system(vm, "Mark", 1);
+        iterate[storage] = time_system(vm, "Iterate", iterations);
+    }
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "{\n";
+    std::cout << "  \"iterations\": " << iterations << ",\n";
+    std::cout << "  \"entities\": " << count << ",\n";
+    std::cout << "  \"storages\": [\n";
+    for (int storage = 0; storage < 2; storage++) {
+        std::cout << "    {\"storage\": \"" << storages[storage] << "\", \"churn_ns\": " << churn[storage]
+                  << ", \"churn_ns_per_entity\": " << churn[storage] / count << ", \"deferred_churn_ns\": "
+                  << deferred[storage] << ", \"deferred_speedup\": " << churn[storage] / deferred[storage]
+                  << ", \"iterate_ns\": " << iterate[storage]
+                  << ", \"iterate_ns_per_entity\": " << iterate[storage] / (count / 2 + count % 2) << "}"
+                  << (storage == 0 ? "," : "") << "\n";
+    }
+    std::cout << "  ],\n";
+    std::cout << "  \"sparse_churn_speedup\": " << churn[0] / churn[1] << ",\n";
+    std::cout << "  \"sparse_iterate_speedup\": " << iterate[0] / iterate[1] << "\n";
+    std::cout << "}\n";
+}
+
+// count moving entities and four systems over them: two whose run blocks
+// touch only the entity they are on, one of them through a function call,
+// the same as the first declared serial, and one summing into a local.
+static std::string generate_systems(int count) {
+    return "comp Position\n    x\n    y\n"
+           "comp Velocity\n    dx\n    dy\n"
+           "let i = 0\nwhile i < " + std::to_string(count) + "\n"
+           "    spawn(Position(i, 0), Velocity(1, i % 3))\n    i += 1\n"
+           "fun drag(v)\n    return v * 0.5 + 1\n"
+           "sys Move\n"
+           "    query moving\n        pos: Position\n        vel: Velocity\n"
+           "    run\n        pos.x += vel.dx\n        pos.y += vel.dy\n"
+           "sys Drag\n"
+           "    query slowing\n        vel: Velocity\n"
+           "    run\n        vel.dx = drag(vel.dx)\n        vel.dy = drag(vel.dy)\n"
+           "serial sys SerialMove\n"
+           "    query moving\n        pos: Position\n        vel: Velocity\n"
+           "    run\n        pos.x += vel.dx\n        pos.y += vel.dy\n"
+           "sys Sum\n"
+           "    let total = 0\n"
+           "    query all\n        pos: Position\n"
+           "    run\n        total += pos.x\n"
+           "fun checksum()\n"
+           "    let total = 0\n"
+           "    query all\n        pos: Position\n"
+           "    run\n        total += pos.x + pos.y\n"
+           "    return total\n";
+}
+
+// Each system called alone, on one thread and with its run blocks split
+// across threads, and whether the two worlds ended up the same.
+static void run_systems(int count, int iterations, unsigned threads) {
+    const char* systems[] = {"Move", "Drag", "SerialMove", "Sum"};
+    double best[2][4] = {};
+    double checksums[2] = {0, 0};
+    for (int parallel = 0; parallel < 2; parallel++) {
+        Program program;
+        if (compile_program(generate_systems(count), FFI(), program, DEBUG_NONE, OPTIMIZE_DEFAULT) !=
+            COMPILER_RESULT_OK) {
+            exit(65);
+        }
+        VM vm = VM(program);
+        vm.set_threads(parallel ? threads : 1);
+        if (vm.run() != RUNTIME_OK) exit(70);
+        for (int system = 0; system < 4; system++) {
+            best[parallel][system] = time_system(vm, systems[system], iterations);
+        }
+        Value result;
+        if (vm.call_function(vm.find_function("checksum"), {}, result) != RUNTIME_OK) exit(70);
+        checksums[parallel] = AS_NUMBER(result);
+    }
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "{\n";
+    std::cout << "  \"iterations\": " << iterations << ",\n";
+    std::cout << "  \"entities\": " << count << ",\n";
+    std::cout << "  \"threads\": " << (threads ? threads : std::max(1u, std::thread::hardware_concurrency()))
+              << ",\n";
+    std::cout << "  \"identical\": " << (checksums[0] == checksums[1] ? "true" : "false") << ",\n";
+    std::cout << "  \"systems\": [\n";
+    for (int system = 0; system < 4; system++) {
+        std::cout << "    {\"system\": \"" << systems[system] << "\", \"serial_ns\": " << best[0][system]
+                  << ", \"parallel_ns\": " << best[1][system] << ", \"speedup\": "
+                  << best[0][system] / best[1][system] << "}" << (system < 3 ? "," : "") << "\n";
+    }
+    std::cout << "  ]\n";
+    std::cout << "}\n";
+}
+
+// Latency of a REPL entry after `count` functions and a couple of hundred
+// locals have been typed in, for a line that calls one of them and one
+// that declares another.
+static void run_repl(int count, int iterations) {
+    std::ostringstream printed;
+    std::streambuf* saved = std::cout.rdbuf(printed.rdbuf());
+    Repl session;
+    bool ok = true;
+    for (int i = 0; i < count; i++) {
+        std::string name = std::to_string(i);
+        ok &= session.evaluate("fun f" + name + "(a)\n    return a * 2 + " + std::to_string(i % 64) + "\n");
+        // Locals live in the script's frame, which has 256 slots.
+        if (i % (count / 200 + 1) == 0 && i / (count / 200 + 1) < 200) {
+            ok &= session.evaluate("let v" + name + " = f" + name + "(1)\n");
+        }
+    }
+    const char* kinds[] = {"call", "define"};
+    double best[2] = {0, 0};
+    double total[2] = {0, 0};
+    int entries = 0;
+    for (int i = 0; i < iterations; i++) {
+        for (int j = 0; j < 100; j++, entries++) {
+            std::string name = std::to_string(entries);
+            std::string entries_source[2] = {
+                "f" + std::to_string(entries % count) + "(v0 + " + name + ")\n",
+                "fun g" + name + "(x)\n    return x - " + std::to_string(entries % 64) + "\n",
+            };
+            for (int kind = 0; kind < 2; kind++) {
+                auto start = std::chrono::steady_clock::now();
+                ok &= session.evaluate(entries_source[kind]);
+                auto end = std::chrono::steady_clock::now();
+                double ns = std::chrono::duration<double, std::nano>(end - start).count();
+                if (entries == 0 || ns < best[kind]) best[kind] = ns;
+                total[kind] += ns;
+            }
+        }
+    }
+    std::cout.rdbuf(saved);
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "{\n";
+    std::cout << "  \"functions\": " << count << ",\n";
+    std::cout << "  \"entries\": " << entries << ",\n";
+    std::cout << "  \"ok\": " << (ok ? "true" : "false") << ",\n";
+    for (int kind = 0; kind < 2; kind++) {
+        std::cout << "  \"" << kinds[kind] << "\": {\"best_ns\": " << best[kind]
+                  << ", \"mean_ns\": " << total[kind] / entries << "}" << (kind == 0 ? "," : "") << "\n";
+    }
+    std::cout << "}\n";
+}
+
+// Just enough JSON to read back what write_results() produces.
+class JsonReader {
+public:
+    JsonReader(std::string text) : text(text), current(0) {}
+
+    std::vector<BenchResult> results() {
+        std::vector<BenchResult> results;
+        expect('{');
+        while (!match('}')) {
+            std::string key = string();
+            expect(':');
+            if (key == "benchmarks") {
+                expect('[');
+                while (!match(']')) {
+                    results.push_back(benchmark());
+                    match(',');
+                }
+            } else {
+                skip_value();
+            }
+            match(',');
+        }
+        return results;
+    }
+private:
+    BenchResult benchmark() {
+        BenchResult bench;
+        expect('{');
+        while (!match('}')) {
+            std::string key = string();
+            expect(':');
+            if (key == "name") {
+                bench.name = string();
+            } else if (key == "stages") {
+                expect('{');
+                while (!match('}')) {
+                    std::string stage_name = string();
+                    expect(':');
+                    StageResult* stage = find_stage(bench, stage_name);
+                    expect('{');
+                    while (!match('}')) {
+                        std::string field = string();
+                        expect(':');
+                        double value = number();
+                        if (stage && field == "ns_per_op") stage->ns_per_op = value;
+                        if (stage && field == "allocs_per_op") stage->allocs_per_op = value;
+                        match(',');
+                    }
+                    match(',');
+                }
+            } else {
+                skip_value();
+            }
+            match(',');
+        }
+        return bench;
+    }
+
+    StageResult* find_stage(BenchResult& bench, const std::string& name) {
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            if (name == stage_names[i]) return &bench.stages[i];
+        }
+        return nullptr;
+    }
+
+    std::string string() {
+        expect('"');
+        size_t end = text.find('"', current);
+        if (end == std::string::npos) error("Unterminated string.");
+        std::string value = text.substr(current, end - current);
+        current = end + 1;
+        return value;
+    }
+
+    double number() {
+        skip_whitespace();
+        size_t length = 0;
+        double value = std::stod(text.substr(current), &length);
+        current += length;
+        return value;
+    }
+
+    void skip_value() {
+        skip_whitespace();
+        if (peek() == '"') { string(); return; }
+        if (peek() != '{' && peek() != '[') { number(); return; }
+        int depth = 0;
+        do {
+            char c = text[current++];
+            if (c == '{' || c == '[') depth++;
+            if (c == '}' || c == ']') depth--;
+        } while (depth > 0 && current < text.size());
+    }
+
+    bool match(char expected) {
+        skip_whitespace();
+        if (peek() != expected) return false;
+        current++;
+        return true;
+    }
+
+    void expect(char expected) {
+        if (!match(expected)) error("Malformed baseline file.");
+    }
+
+    char peek() {
+        return current < text.size() ? text[current] : '\0';
+    }
+
+    void skip_whitespace() {
+        while (current < text.size() && isspace((unsigned char)text[current])) current++;
+    }
+
+    void error(const char* message) {
+        std::cerr << message << std::endl;
+        exit(65);
+    }
+
+    std::string text;
+    size_t current;
+};
+
+static void write_results(std::ostream& out, const std::vector<BenchResult>& results, int iterations,
+                          const std::vector<BenchResult>* baseline) {
+    std::map<std::string, const BenchResult*> baseline_by_name;
+    if (baseline) {
+        for (const BenchResult& bench : *baseline) baseline_by_name[bench.name] = &bench;
+    }
+
+    out << std::fixed << std::setprecision(1);
+    out << "{\n";
+    out << "  \"iterations\": " << iterations << ",\n";
+    out << "  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& bench = results[i];
+        auto old = baseline_by_name.find(bench.name);
+        out << "    {\n";
+        out << "      \"name\": \"" << bench.name << "\",\n";
+        out << "      \"stages\": {\n";
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            const StageResult& stage = bench.stages[s];
+            out << "        \"" << stage_names[s] << "\": {"
+                << "\"ns_per_op\": " << stage.ns_per_op << ", "
+                << "\"allocs_per_op\": " << stage.allocs_per_op;
+            if (old != baseline_by_name.end()) {
+                const StageResult& before = old->second->stages[s];
+                out << ", \"baseline_ns_per_op\": " << before.ns_per_op
+                    << ", \"baseline_allocs_per_op\": " << before.allocs_per_op
+                    << ", \"speedup\": " << (stage.ns_per_op > 0 ? before.ns_per_op / stage.ns_per_op : 0);
+            }
+            out << "}" << (s + 1 < STAGE_COUNT ? "," : "") << "\n";
+        }
+        out << "      }\n";
+        out << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n";
+    out << "}\n";
+}
+
+// Runs a script compiled at the given level, returning everything it printed.
+static std::string run_output(const std::string& source, int optimize, bool& ok) {
+    Program program;
+    if (compile_program(source, FFI(), program, DEBUG_NONE, optimize) != COMPILER_RESULT_OK) {
+        ok = false;
+        return "";
+    }
+    std::ostringstream output;
+    std::streambuf* saved = std::cout.rdbuf(output.rdbuf());
+    VM vm = VM(program);
+    ok = vm.run() == RUNTIME_OK;
+    std::cout.rdbuf(saved);
+    return output.str();
+}
+
+// The optimizers must never change what a script does: every script has to
+// print the same thing, and succeed or fail alike, at every level. A
+// parallel compile must produce the serial compile's image exactly.
+static int run_verify(const std::vector<std::string>& scripts) {
+    int failures = 0;
+    for (const std::string& script : scripts) {
+        std::string source = read_file(script);
+        bool unoptimized_ok;
+        std::string unoptimized = run_output(source, OPTIMIZE_NONE, unoptimized_ok);
+        bool same = true;
+        for (int level = OPTIMIZE_DEFAULT; level <= OPTIMIZE_SSA; level++) {
+            bool optimized_ok;
+            std::string optimized = run_output(source, level, optimized_ok);
+            if (unoptimized == optimized && unoptimized_ok == optimized_ok) continue;
+            if (same) {
+                std::cout << "FAIL " << script << std::endl;
+                std::cout << "  -O0" << (unoptimized_ok ? "" : " (failed)") << ":\n" << unoptimized;
+            }
+            std::cout << "  -O" << level << (optimized_ok ? "" : " (failed)") << ":\n" << optimized;
+            same = false;
+        }
+        for (int level = OPTIMIZE_NONE; level <= OPTIMIZE_SSA; level++) {
+            Ast ast;
+            if (!parse_optimized(source, level, ast)) continue;
+            if (compile_image(ast, level, 1) == compile_image(ast, level, 4)) continue;
+            if (same) std::cout << "FAIL " << script << std::endl;
+            std::cout << "  -O" << level << ": parallel image differs from serial" << std::endl;
+            same = false;
+        }
+        if (same) std::cout << "ok   " << script << std::endl;
+        else failures++;
+    }
+    std::cout << scripts.size() - failures << "/" << scripts.size() << " scripts unchanged by the optimizers" << std::endl;
+    return failures ? 1 : 0;
+}
+
+static void usage() {
+    std::cerr << "Usage: mosaic_bench [--iterations N] [--baseline FILE] [--save FILE] [script.te ...]\n"
+              << "       mosaic_bench --lex MB [--iterations N]\n"
+              << "       mosaic_bench --depth N [--iterations N]\n"
+              << "       mosaic_bench --functions N [--iterations N]\n"
+              << "       mosaic_bench --lazy N [--iterations N]\n"
+              << "       mosaic_bench --repl N [--iterations N]\n"
+              << "       mosaic_bench --modules N [--iterations N]\n"
+              << "       mosaic_bench --ecs N [--iterations N]\n"
+              << "       mosaic_bench --systems N [--threads N] [--iterations N]\n"
+              << "       mosaic_bench --verify [script.te ...]" << std::endl;
+    exit(64);
+}
+
+int main(int argc, const char* argv[]) {
+    int iterations = 5;
+    const char* baseline_path = nullptr;
+    const char* save_path = nullptr;
+    size_t lex_megabytes = 0;
+    int max_depth = 0;
+    int function_count = 0;
+    int lazy_count = 0;
+    int repl_count = 0;
+    int module_count = 0;
+    int entity_count = 0;
+    int system_entities = 0;
+    unsigned threads = 0;
+    bool verify = false;
+    std::vector<std::string> scripts;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--iterations" && i + 1 < argc) iterations = std::max(1, atoi(argv[++i]));
+        else if (arg == "--baseline" && i + 1 < argc) baseline_path = argv[++i];
+        else if (arg == "--save" && i + 1 < argc) save_path = argv[++i];
+        else if (arg == "--lex" && i + 1 < argc) lex_megabytes = std::max(1, atoi(argv[++i]));
+        else if (arg == "--depth" && i + 1 < argc) max_depth = std::max(1, atoi(argv[++i]));
+        else if (arg == "--functions" && i + 1 < argc) function_count = std::max(1, atoi(argv[++i]));
+        else if (arg == "--lazy" && i + 1 < argc) lazy_count = std::max(1, atoi(argv[++i]));
+        else if (arg == "--repl" && i + 1 < argc) repl_count = std::max(1, atoi(argv[++i]));
+        else if (arg == "--modules" && i + 1 < argc) module_count = std::max(1, atoi(argv[++i]));
+        else if (arg == "--ecs" && i + 1 < argc) entity_count = std::max(1, atoi(argv[++i]));
+        else if (arg == "--systems" && i + 1 < argc) system_entities = std::max(1, atoi(argv[++i]));
+        else if (arg == "--threads" && i + 1 < argc) threads = std::max(0, atoi(argv[++i]));
+        else if (arg == "--verify") verify = true;
+        else if (arg.starts_with("--")) usage();
+        else scripts.push_back(arg);
+    }
+
+    if (lex_megabytes) {
+        run_lex(lex_megabytes, iterations);
+        return 0;
+    }
+    if (max_depth) {
+        run_depth(max_depth, iterations);
+        return 0;
+    }
+    if (function_count) {
+        run_functions(function_count, iterations);
+        return 0;
+    }
+    if (lazy_count) {
+        run_lazy(lazy_count, iterations);
+        return 0;
+    }
+    if (repl_count) {
+        run_repl(repl_count, iterations);
+        return 0;
+    }
+    if (module_count) {
+        run_modules(module_count, iterations);
+        return 0;
+    }
+    if (entity_count) {
+        run_ecs(entity_count, iterations);
+        return 0;
+    }
+    if (system_entities) {
+        run_systems(system_entities, iterations, threads);
+        return 0;
+    }
+
+    if (scripts.empty()) {
+        for (auto& entry : std::filesystem::directory_iterator(MOSAIC_BENCH_SCRIPTS)) {
+            if (entry.path().extension() == ".te") scripts.push_back(entry.path().string());
+        }
+        // The corpus exercises the optimizer rather than the pipeline's speed.
+        if (verify) {
+            for (auto& entry : std::filesystem::directory_iterator(MOSAIC_BENCH_CORPUS)) {
+                if (entry.path().extension() == ".te") scripts.push_back(entry.path().string());
+            }
+        }
+        std::sort(scripts.begin(), scripts.end());
+    }
+    if (verify) return run_verify(scripts);
+
+    std::vector<BenchResult> baseline;
+    if (baseline_path) baseline = JsonReader(read_file(baseline_path)).results();
+
+    std::vector<BenchResult> results;
+    for (const std::string& script : scripts) {
+        results.push_back(run_script(script, iterations));
+    }
+
+    write_results(std::cout, results, iterations, baseline_path ? &baseline : nullptr);
+    if (save_path) {
+        std::ofstream out(save_path);
+        write_results(out, results, iterations, nullptr);
+    }
+    return 0;
+}
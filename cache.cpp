@@ -0,0 +1,71 @@
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+#include <unistd.h>
+
+#include "cache.h"
+#include "image.h"
+
+CompileCache::CompileCache(std::string directory) : directory(directory) {}
+
+std::string CompileCache::key(std::string_view source, const FFI& ffi, int optimize) const {
+    std::string abi = COMPILER_VERSION;
+    abi += '\0';
+    abi += std::to_string(IMAGE_VERSION);
+    abi += '\0';
+    abi += std::to_string(optimize);
+    for (const NativeFunction& native : ffi.native_functions) {
+        abi += '\0';
+        abi += native.name;
+        abi += '/';
+        abi += std::to_string(native.arity);
+    }
+    return key(source, abi);
+}
+
+std::string CompileCache::key(std::string_view source, int optimize) const {
+    std::string abi = COMPILER_VERSION;
+    abi += '\0';
+    abi += std::to_string(IMAGE_VERSION);
+    abi += '\0';
+    abi += std::to_string(optimize);
+    abi += "\0module";
+    return key(source, abi);
+}
+
+std::string CompileCache::key(std::string_view source, std::string abi) const {
+    uint64_t abi_hash = image_checksum((const uint8_t*)abi.data(), abi.size());
+    uint64_t source_hash = image_checksum((const uint8_t*)source.data(), source.size());
+
+    char key[40];
+    snprintf(key, sizeof(key), "%016llx%016llx", (unsigned long long)source_hash, (unsigned long long)abi_hash);
+    return key;
+}
+
+std::string CompileCache::path(const std::string& key) const {
+    return directory + "/" + key + ".teb";
+}
+
+bool CompileCache::store(const std::string& key, const Image& image) const {
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    if (error) return false;
+
+    // Write beside the final name and rename over it, so a concurrent run
+    // never maps a half-written image.
+    std::string final_path = path(key);
+    std::string temp_path = final_path + "." + std::to_string(getpid()) + "." +
+                            std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id())) + ".tmp";
+    {
+        std::ofstream out(temp_path, std::ios::binary);
+        if (!out.is_open()) return false;
+        out.write((const char*)image.bytes(), image.byte_size());
+        if (!out) {
+            std::filesystem::remove(temp_path, error);
+            return false;
+        }
+    }
+    std::filesystem::rename(temp_path, final_path, error);
+    return !error;
+}
@@ -0,0 +1,34 @@
+#ifndef MOSAIC_ECS_CACHE_H
+#define MOSAIC_ECS_CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ffi.h"
+
+// Bump whenever the compiler's output changes for the same source, so
+// images cached by an older compiler are never picked up.
+#define COMPILER_VERSION "tessera-compiler-10"
+
+// Compiled images keyed by everything that determines their contents:
+// the source text, the compiler and image versions, the optimization level,
+// and the natives the bytecode was compiled against (OP_CALL_NATIVE bakes in
+// their indices).
+class CompileCache {
+public:
+    CompileCache(std::string directory = ".tessera_cache");
+    std::string key(std::string_view source, const FFI& ffi, int optimize) const;
+    // For one module of a program that imports others. Its image names the
+    // natives it calls, for the linker to resolve, so they are left out.
+    std::string key(std::string_view source, int optimize) const;
+    std::string path(const std::string& key) const;
+    // Safe to call from several threads at once.
+    bool store(const std::string& key, const class Image& image) const;
+private:
+    std::string key(std::string_view source, std::string abi) const;
+    std::string directory;
+};
+
+#endif
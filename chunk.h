@@ -1,6 +1,7 @@
 #ifndef MOSAIC_ECS_CHUNK_H
 #define MOSAIC_ECS_CHUNK_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <string>
 #include <vector>
@@ -45,13 +46,90 @@ enum OpCode {
     OP_CALL,
     OP_CALL_NATIVE,
     OP_RETURN,
+    // Operands proven numbers by TypeInference; no type checks.
+    OP_ADD_NN,
+    OP_SUBTRACT_NN,
+    OP_MULTIPLY_NN,
+    OP_DIVIDE_NN,
+    OP_LESS_NN,
+    OP_LESS_EQUAL_NN,
+    OP_GREATER_NN,
+    OP_GREATER_EQUAL_NN,
+    OP_ADD_ASSIGN_NN,
+    OP_SUBTRACT_ASSIGN_NN,
+    OP_MULTIPLY_ASSIGN_NN,
+    OP_DIVIDE_ASSIGN_NN,
+    // Entity queries and structural commands; see ecs.h.
+    OP_QUERY_BEGIN,
+    OP_QUERY_NEXT,
+    OP_QUERY_END,
+    OP_GET_FIELD,
+    OP_SET_FIELD,
+    OP_GET_ENTITY,
+    OP_SPAWN,
+    OP_DESPAWN,
+    OP_INSERT,
+    OP_REMOVE,
+    // Runs the systems of a stage, by its place among the image's stages.
+    OP_RUN_STAGE,
+    // Ends a piece of a script typed in at the REPL, leaving its frame's
+    // locals on the stack for the next piece.
+    OP_SUSPEND,
 };
 
+// Bytes an instruction takes, operands included.
+inline size_t instruction_size(const uint8_t* instruction) {
+    switch (*instruction) {
+        case OP_CONSTANT:
+        case OP_STRING:
+        case OP_POP_N:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_ADD_ASSIGN:
+        case OP_SUBTRACT_ASSIGN:
+        case OP_MULTIPLY_ASSIGN:
+        case OP_DIVIDE_ASSIGN:
+        case OP_MODULO_ASSIGN:
+        case OP_ADD_ASSIGN_NN:
+        case OP_SUBTRACT_ASSIGN_NN:
+        case OP_MULTIPLY_ASSIGN_NN:
+        case OP_DIVIDE_ASSIGN_NN:
+        case OP_GET_FIELD:
+        case OP_SET_FIELD:
+        case OP_RUN_STAGE:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_CALL:
+        case OP_CALL_NATIVE:
+        case OP_QUERY_NEXT:
+            return 3;
+        case OP_QUERY_BEGIN: return 2 + 3 * instruction[1];
+        case OP_SPAWN:
+        case OP_INSERT:
+        case OP_REMOVE:
+            return 2 + 2 * instruction[1];
+        default: return 1;
+    }
+}
+
 struct Chunk {
     std::vector<uint8_t> code;
     std::vector<int> lines;
 };
 
+enum FunctionFlags {
+    // Declared in another module; its code is that module's, found by the
+    // linker.
+    FUNCTION_IMPORTED = 1 << 0,
+    // Declared at the top level, so other modules can import it.
+    FUNCTION_EXPORTED = 1 << 1,
+};
+
 struct ObjFunction {
     ObjFunction() {};
     ObjFunction(Token name, int arity) {
@@ -59,6 +137,7 @@ struct ObjFunction {
         this->arity = arity;
     }
     int arity = 0;
+    uint32_t flags = 0;
     Chunk chunk;
     Token name;
 };
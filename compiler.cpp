@@ -1,277 +1,823 @@
+#include <algorithm>
+#include <atomic>
+#include <climits>
 #include <fstream>
+#include <thread>
 
 #include "compiler.h"
-
-Local::Local(std::string name, int depth, size_t stack_offset, size_t array_index, LocalType type) {
-    this->name = name;
+#include "ecs.h"
+#include "image.h"
+#include "ir_builder.h"
+#include "ir_lowering.h"
+#include "ir_optimizer.h"
+
+Local::Local(uint32_t symbol, int depth, size_t stack_offset, size_t array_index, LocalType type) {
+    this->symbol = symbol;
     this->resolution.depth = depth;
     this->resolution.stack_offset = stack_offset;
     this->resolution.array_index = array_index;
     this->resolution.type = type;
 }
 
-CompilerState::CompilerState(Compiler *compiler, std::vector<StmtPtr> &stmts) {
-    this->stmts = stmts;
-    current_stmt = stmts[0];
-    previous_stmt = current_stmt;
-    next = 0;
-}
+Compiler::Compiler(const Ast& ast, FFI ffi, int optimize, int debug_flags, unsigned threads)
+        : ast(ast), program(this), ffi(ffi), optimize(optimize), debug_flags(debug_flags), threads(threads),
+          failed(false), unresolved(0, 0, 0, -1, LOCAL_VARIABLE) {
+    push_locals();
+    unresolved.resolution.fresh_function = false;
 
-Compiler::Compiler(std::vector<StmtPtr> stmts) {
-    if (stmts.empty()) exit(0);
-    push_state(stmts);
+    bind_symbols();
+    declare_components();
+    declare_stages();
 
     scope_depth = 0;
 
     functions.push_back(ObjFunction());
+    function_declarations.push_back(AST_NONE);
+    function_ends.push_back(INT_MAX);
+    function_roots.push_back(0);
     current_function = 0;
+    visible_functions = 1;
 }
 
-void Compiler::compile() {
-    while (!is_at_end()) {
-        declaration();
+// Sizes the tables indexed by symbol for symbols the tree has gained, which
+// aren't bound to anything but the native of the same name, if any.
+void Compiler::bind_symbols() {
+    size_t first = function_bindings.size();
+    local_bindings.resize(ast.symbols.size());
+    function_bindings.resize(ast.symbols.size(), -1);
+    native_bindings.resize(ast.symbols.size(), -1);
+    component_bindings.resize(ast.symbols.size(), -1);
+    // Later definitions of a native win, as they always have.
+    std::unordered_map<std::string_view, int> natives;
+    for (size_t i = 0; i < ffi.native_functions.size(); i++) {
+        natives[ffi.native_functions[i].name] = i;
     }
-    emit_byte(OP_RETURN);
-#ifdef BYTECODE_DEBUG
-    for(int i = functions.size() - 1; i >= 0; i--) {
-        current_function = i;
-        Debugger debugger = Debugger(chunk(), functions, ffi, constants, strings);
-        debugger.disassemble_chunk(functions[i].name.lexeme.empty() ? "Script" : functions[i].name.lexeme);
+    for (size_t symbol = first; symbol < ast.symbols.size(); symbol++) {
+        auto native = natives.find(ast.symbols[symbol]);
+        if (native != natives.end()) native_bindings[symbol] = native->second;
+    }
+}
+
+// Components are declared at the script's top level, and are known
+// throughout it, whatever their place.
+void Compiler::declare_components() {
+    const StmtIndex* stmts = ast.list(ast.script);
+    for (uint32_t i = 0; i < ast.script_count; i++) {
+        const Stmt& stmt = this->stmt(stmts[i]);
+        if (stmt.type != STMT_COMP) continue;
+        const Token& name = token(stmt.comp.name);
+        if (component_bindings[name.symbol] != -1) {
+            error() << "[line " << name.line << "] Already a component named " << name.lexeme << "." << std::endl;
+            continue;
+        }
+        const TokenIndex* fields = ast.list(stmt.comp.fields);
+        for (uint32_t field = 0; field < stmt.comp.field_count; field++) {
+            for (uint32_t other = 0; other < field; other++) {
+                if (token(fields[other]).symbol != token(fields[field]).symbol) continue;
+                error() << "[line " << name.line << "] Component " << name.lexeme << " has two fields named "
+                        << token(fields[field]).lexeme << "." << std::endl;
+            }
+        }
+        if (components.size() > UINT16_MAX) {
+            error() << "Too many components." << std::endl;
+            return;
+        }
+        component_bindings[name.symbol] = components.size();
+        components.push_back(CompilerComponent{stmt.comp.name, stmt.comp.fields, stmt.comp.field_count,
+                                               stmt.comp.sparse ? (uint32_t)COMPONENT_SPARSE : 0});
+    }
+}
+
+void Compiler::declare_stages() {
+    const StmtIndex* stmts = ast.list(ast.script);
+    for (uint32_t i = 0; i < ast.script_count; i++) {
+        const Stmt& stmt = this->stmt(stmts[i]);
+        if (stmt.type != STMT_FUN || !stmt.fun.system) continue;
+        std::string_view stage = stage_name(stmt.fun);
+        if (std::find(stages.begin(), stages.end(), stage) != stages.end()) continue;
+        if (stages.size() > UINT8_MAX) {
+            error() << "[line " << token(stmt.fun.name).line << "] Too many stages." << std::endl;
+            return;
+        }
+        stages.push_back(stage);
+    }
+}
+
+std::string_view Compiler::stage_name(const FunStmt& system) const {
+    TokenIndex stage = ast.list(system.parameters)[0];
+    return stage == AST_NONE ? DEFAULT_STAGE : token(stage).lexeme;
+}
+
+bool Compiler::import_module(std::string_view name, uint64_t interface, const std::vector<ModuleFunction>& exports) {
+    imports.push_back(ModuleImport{std::string(name), interface});
+    bool imported = true;
+    for (const ModuleFunction& function : exports) {
+        // A name this module never mentions can't be called from it.
+        auto symbol = ast.symbol_ids.find(function.name);
+        if (symbol == ast.symbol_ids.end()) continue;
+        if (function_bindings[symbol->second] != -1) {
+            std::cerr << "'" << function.name << "' is imported from more than one module." << std::endl;
+            imported = false;
+            continue;
+        }
+        Token token = {TOKEN_IDENTIFIER, 0, 0, symbol->second, function.name};
+        ObjFunction stub = ObjFunction(token, function.arity);
+        stub.flags = FUNCTION_IMPORTED;
+        functions.push_back(stub);
+        function_declarations.push_back(AST_NONE);
+        function_ends.push_back(functions.size());
+        function_roots.push_back(functions.size() - 1);
+        function_bindings[symbol->second] = functions.size() - 1;
+    }
+    first_declared = functions.size();
+    visible_functions = first_declared;
+    return imported;
+}
+
+CompilerResult Compiler::compile() {
+    if (!compile_parallel()) compile_script();
+    return failed ? COMPILER_RESULT_ERROR : COMPILER_RESULT_OK;
+}
+
+void Compiler::compile_script() {
+    if (compile_ir("Script", nullptr, 0, ast.list(ast.script), ast.script_count)) return;
+    declarations(ast.list(ast.script), ast.script_count);
+    emit_return();
+}
+
+// Declares every function up front, then compiles the bodies on a pool of
+// workers, each with its own locals and its own staging for constants and
+// strings. Returns false, having changed nothing, wherever the serial
+// compile must run instead.
+bool Compiler::compile_parallel() {
+    unsigned count = threads ? threads : std::thread::hardware_concurrency();
+    // The dumps print as they compile, in compile order.
+    if (count <= 1 || (debug_flags & (DEBUG_IR | DEBUG_INLINE))) return false;
+
+    const StmtIndex* stmts = ast.list(ast.script);
+    for (uint32_t i = 0; i < ast.script_count; i++) {
+        if (!declare_functions(stmts[i])) {
+            undeclare_functions();
+            return false;
+        }
+    }
+    size_t declared = functions.size() - first_declared;
+    if (declared == 0 || (threads == 0 && declared + 1 < COMPILER_PARALLEL_MIN_FUNCTIONS)) {
+        undeclare_functions();
+        return false;
+    }
+
+    std::vector<CompiledBody> bodies(functions.size());
+    std::atomic<size_t> next = 0;
+    auto work = [&]() {
+        Compiler worker = Compiler(ast, ffi, optimize, debug_flags, 1);
+        worker.program = this;
+        for (size_t function; (function = next.fetch_add(1)) < bodies.size();) {
+            // Imported functions' code is another module's.
+            if (function != 0 && function < (size_t)first_declared) continue;
+            worker.compile_body(function, bodies[function]);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < std::min<size_t>(count, bodies.size()); i++) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+
+    for (const CompiledBody& body : bodies) {
+        if (body.failed) {
+            undeclare_functions();
+            return false;
+        }
+    }
+    link(bodies, 0);
+    return true;
+}
+
+bool Compiler::compile_functions(const std::vector<int>& selected) {
+    // Declared once; later calls only pay for the bodies they compile.
+    if (functions.size() == (size_t)first_declared) {
+        const StmtIndex* stmts = ast.list(ast.script);
+        for (uint32_t i = 0; i < ast.script_count; i++) {
+            if (!declare_functions(stmts[i])) {
+                undeclare_functions();
+                std::cerr << "Functions can't be compiled one at a time in a script that redeclares one." << std::endl;
+                return false;
+            }
+        }
+    }
+    constants.clear();
+    constant_intern.clear();
+    strings.clear();
+    string_intern.clear();
+
+    // Kept, as setting one up costs as much as a small body.
+    if (!worker) {
+        worker = std::make_unique<Compiler>(ast, ffi, optimize, debug_flags, 1);
+        worker->program = this;
+        worker->diagnostics.rdbuf(std::cerr.rdbuf());
+    }
+    for (int function : selected) {
+        CompiledBody body;
+        worker->compile_body(function, body);
+        if (body.failed) return false;
+        // Nested functions are only linked if they were selected too.
+        for (const CompilerFixup& fixup : body.fixups) {
+            body.chunk.code[fixup.offset] = fixup.string ? make_string(fixup.text) : make_constant(fixup.constant);
+        }
+        functions[function].chunk = std::move(body.chunk);
+    }
+    return true;
+}
+
+bool Compiler::compile_entry(std::vector<int>& declared) {
+    bind_symbols();
+    interactive = true;
+    failed = false;
+    diagnostics.rdbuf(std::cerr.rdbuf());
+    functions[0].chunk = Chunk();
+    constants.clear();
+    constant_intern.clear();
+    strings.clear();
+    string_intern.clear();
+
+    size_t first_function = functions.size();
+    entry_locals = locals().size();
+    declarations(ast.list(ast.script), ast.script_count);
+    emit_byte(OP_SUSPEND);
+
+    if (failed) {
+        // As if the piece had never been typed in.
+        abandon_entry();
+        for (size_t function = first_function; function < functions.size(); function++) {
+            function_bindings[functions[function].name.symbol] = -1;
+        }
+        functions.resize(first_function);
+        function_declarations.resize(first_function);
+        function_ends.resize(first_function);
+        function_roots.resize(first_function);
+        inline_scans.resize(std::min(inline_scans.size(), first_function));
+        inline_scanned.resize(inline_scans.size());
+        visible_functions = first_function;
+        return false;
+    }
+    declared = {0};
+    for (size_t function = first_function; function < functions.size(); function++) {
+        declared.push_back(function);
+    }
+    return true;
+}
+
+void Compiler::abandon_entry() {
+    while (locals().size() > entry_locals) pop_local();
+}
+
+// Gives every function the index the serial compile would, which is the
+// order they are declared in: a function before the ones nested in it.
+// False on a redeclaration, which the serial compile handles its own way.
+bool Compiler::declare_functions(StmtIndex index) {
+    const Stmt& stmt = this->stmt(index);
+    switch (stmt.type) {
+        case STMT_BLOCK: {
+            const StmtIndex* stmts = ast.list(stmt.block.stmts);
+            for (uint32_t i = 0; i < stmt.block.count; i++) {
+                if (!declare_functions(stmts[i])) return false;
+            }
+            return true;
+        }
+        case STMT_FUN: {
+            if (function_bindings[token(stmt.fun.name).symbol] != -1) return false;
+            size_t function = new_function(ObjFunction(token(stmt.fun.name), stmt.fun.arity), index);
+            int enclosing = current_function;
+            current_function = function;
+            bool declared = declare_functions(stmt.fun.body);
+            current_function = enclosing;
+            function_ends[function] = functions.size();
+            return declared;
+        }
+        case STMT_IF:
+            return declare_functions(stmt.if_stmt.then_branch) &&
+                   (stmt.if_stmt.else_branch == AST_NONE || declare_functions(stmt.if_stmt.else_branch));
+        case STMT_RUN: return declare_functions(stmt.run.body);
+        case STMT_WHILE: return declare_functions(stmt.while_stmt.body);
+        default: return true;
+    }
+}
+
+void Compiler::undeclare_functions() {
+    functions.resize(first_declared);
+    function_declarations.resize(first_declared);
+    function_ends.resize(first_declared);
+    function_roots.resize(first_declared);
+    function_bindings.assign(ast.symbols.size(), -1);
+    for (int function = 1; function < first_declared; function++) {
+        function_bindings[functions[function].name.symbol] = function;
+    }
+    visible_functions = first_declared;
+}
+
+// Runs on a worker: compiles function's body, or the script's for 0, as
+// the serial compile would at the point it got to it.
+void Compiler::compile_body(int function, CompiledBody& body) {
+    functions[0].chunk = Chunk();
+    fixups.clear();
+    nested.clear();
+    queries.clear();
+    first_query = 0;
+    running_query = -1;
+    failed = false;
+    visible_functions = function == 0 ? program->first_declared : function + 1;
+    if (function == 0) {
+        compile_script();
+        while (!locals().empty()) pop_local();
+    } else {
+        function_body(declaration_of(function), true);
     }
-#endif
+    body.chunk = std::move(functions[0].chunk);
+    body.fixups = std::move(fixups);
+    body.nested = std::move(nested);
+    body.failed = failed;
+}
 
-    write();
+// Fills in a body's constants and strings from the shared pools in the
+// order the serial compile adds them, with each nested function's at the
+// point it was declared, so the image comes out byte for byte the same.
+void Compiler::link(std::vector<CompiledBody>& bodies, int function) {
+    CompiledBody& body = bodies[function];
+    size_t next_nested = 0;
+    for (size_t i = 0;; i++) {
+        while (next_nested < body.nested.size() && body.nested[next_nested].fixup == i) {
+            link(bodies, body.nested[next_nested++].function);
+        }
+        if (i == body.fixups.size()) break;
+        const CompilerFixup& fixup = body.fixups[i];
+        body.chunk.code[fixup.offset] = fixup.string ? make_string(fixup.text) : make_constant(fixup.constant);
+    }
+    functions[function].chunk = std::move(body.chunk);
+}
+
+void Compiler::disassemble() {
+    Image image;
+    image.load(this->image());
+    for (int i = functions.size() - 1; i >= 0; i--) {
+        Debugger debugger = Debugger(image, i, ffi, strings);
+        debugger.disassemble_chunk(functions[i].name.lexeme.empty() ? "Script" : std::string(functions[i].name.lexeme));
+    }
 }
 
-void Compiler::declaration() {
-    if (match(STMT_FUN)) fun_declaration();
-    else if (match(STMT_LET)) let_declaration();
-    else statement();
+void Compiler::declarations(const StmtIndex* stmts, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        declaration(stmts[i]);
+    }
 }
 
-void Compiler::fun_declaration() {
-    FunStmt& fun = previous()->as<FunStmt>();
+void Compiler::declaration(StmtIndex index) {
+    const Stmt& stmt = this->stmt(index);
+    if (stmt.type == STMT_FUN) fun_declaration(index);
+    else if (stmt.type == STMT_LET) let_declaration(stmt.let);
+    else if (stmt.type == STMT_QUERY) query_declaration(stmt.query);
+    else statement(stmt);
+}
 
+void Compiler::fun_declaration(StmtIndex declaration) {
+    const FunStmt& fun = stmt(declaration).fun;
+    // A worker leaves nested functions to other workers; they were
+    // declared in this order, so the next one is this.
+    if (program != this) {
+        nested.push_back(NestedFunction{visible_functions, fixups.size()});
+        visible_functions = program->function_ends[visible_functions];
+        return;
+    }
     size_t previous_function = current_function;
-    size_t index = new_function(ObjFunction(fun.name, fun.parameters.size()));
+    size_t index = new_function(ObjFunction(token(fun.name), fun.arity), declaration);
     current_function = index;
+    // A redeclaration lands in the script, which only the Ast path does.
+    function_body(fun, index != 0);
+    if (index != 0) function_ends[index] = functions.size();
+    current_function = previous_function;
+}
+
+void Compiler::function_body(const FunStmt& fun, bool allow_ir) {
+    if (allow_ir && compile_ir(token(fun.name).lexeme, ast.list(fun.parameters), fun.arity, &fun.body, 1)) return;
+
+    // The enclosing function's queries, and any run block it is in, stay
+    // its own.
+    size_t enclosing_queries = queries.size();
+    size_t enclosing_first_query = first_query;
+    int enclosing_running_query = running_query;
+    size_t enclosing_run_locals = run_locals;
+    first_query = queries.size();
+    running_query = -1;
 
     push_locals();
-    for (Token& param : fun.parameters) {
-        new_variable(param);
+    const TokenIndex* parameters = ast.list(fun.parameters);
+    for (uint32_t i = 0; i < fun.arity; i++) {
+        new_variable(token(parameters[i]));
         mark_initialized();
     }
 
-    push_state({fun.body});
-    while(!is_at_end()) {
-        declaration();
-    }
-    pop_state();
+    declaration(fun.body);
     pop_locals();
 
     emit_return();
-    current_function = previous_function;
+
+    queries.resize(enclosing_queries);
+    first_query = enclosing_first_query;
+    running_query = enclosing_running_query;
+    run_locals = enclosing_run_locals;
+}
+
+bool Compiler::compile_ir(std::string_view name, const TokenIndex* parameters, uint32_t arity,
+                          const StmtIndex* body, uint32_t count) {
+    if (optimize < OPTIMIZE_SSA) return false;
+    IrBuilder builder = IrBuilder(*this);
+    if (!builder.supported(parameters, arity, body, count)) return false;
+    IrFunction function = builder.build(name, parameters, arity, body, count);
+
+    IrOptimizer optimizer = IrOptimizer(function);
+    optimizer.optimize();
+    if (debug_flags & DEBUG_IR) dump_ir(function, ast);
+
+    IrLowering lowering = IrLowering(*this, function);
+    lowering.lower();
+    return true;
 }
 
-void Compiler::let_declaration() {
-    Let& let = previous()->as<Let>();
-    new_variable(let.name);
-    expression(*let.initializer);
+void Compiler::let_declaration(const Let& let) {    new_variable(token(let.name));
+    if (let.initializer != AST_NONE) expression(let.initializer);
+    else emit_byte(OP_NIL);
     // Initialize variable.
     mark_initialized();
 }
 
-void Compiler::statement() {
-    if (match(STMT_BLOCK)) block_statement();
-    else if (match(STMT_EXPR)) {
-        expression(*previous()->as<ExprStmt>().expr);
-        emit_byte(OP_POP);
-    }
-    else if (match(STMT_IF)) if_statement();
-    else if (match(STMT_PRINT)) print_statement();
-    else if (match(STMT_RETURN)) {
-        expression(*previous()->as<Return>().value);
-        emit_byte(OP_RETURN);
+void Compiler::statement(const Stmt& stmt) {
+    switch (stmt.type) {
+        case STMT_BLOCK: block_statement(stmt.block); break;
+        case STMT_EXPR:
+            expression(stmt.expr_stmt.expr);
+            emit_byte(OP_POP);
+            break;
+        case STMT_IF: if_statement(stmt.if_stmt); break;
+        case STMT_PRINT: print_statement(stmt.print); break;
+        case STMT_RETURN:
+            if (running_query != -1) {
+                error() << "[line " << token(stmt.return_stmt.debug).line << "] Can't return from a run block."
+                        << std::endl;
+            }
+            expression(stmt.return_stmt.value);
+            emit_byte(OP_RETURN);
+            break;
+        case STMT_RUN: run_statement(stmt.run); break;
+        case STMT_WHILE: while_statement(stmt.while_stmt); break;
+        default: break;
     }
-    else if (match(STMT_WHILE)) while_statement();
 }
 
-void Compiler::block_statement() {
-    push_state(previous()->as<Block>().stmts);
-
+void Compiler::block_statement(const Block& block) {
     begin_scope();
-    while (!is_at_end()) {
-        declaration();
-    }
+    declarations(ast.list(block.stmts), block.count);
     end_scope();
-
-    pop_state();
 }
 
-void Compiler::if_statement() {
-    If& if_stmt = previous()->as<If>();
-    expression(*if_stmt.condition);
+void Compiler::if_statement(const If& if_stmt) {
+    expression(if_stmt.condition);
 
     int then_jump = emit_jump(OP_JUMP_IF_FALSE);
     emit_byte(OP_POP);
 
-    push_state({if_stmt.then_branch});
-
-    //begin_scope();
-    while (!is_at_end()) {
-        declaration();
-    }
-    //end_scope();
-
-    pop_state();
+    declaration(if_stmt.then_branch);
     int else_jump = emit_jump(OP_JUMP);
 
     patch_jump(then_jump);
     emit_byte(OP_POP);
 
-    if (if_stmt.else_branch) {
-        push_state({if_stmt.else_branch});
-
-        //begin_scope();
-        while (!is_at_end()) {
-            declaration();
-        }
-        //end_scope();
-
-        pop_state();
-    }
+    if (if_stmt.else_branch != AST_NONE) declaration(if_stmt.else_branch);
     patch_jump(else_jump);
 }
 
-void Compiler::print_statement() {
-    expression(*previous()->as<Print>().value);
+void Compiler::print_statement(const Print& print) {
+    expression(print.value);
     emit_byte(OP_PRINT);
 }
 
-void Compiler::while_statement() {
-    While& while_stmt = previous()->as<While>();
+void Compiler::while_statement(const While& while_stmt) {
     int loop_start = chunk().code.size();
-    expression(*while_stmt.condition);
+    expression(while_stmt.condition);
 
     int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
     emit_byte(OP_POP);
-    push_state({while_stmt.body});
-    while (!is_at_end()) {
-        declaration();
-    }
-    pop_state();
+    declaration(while_stmt.body);
     emit_loop(loop_start);
 
     patch_jump(exit_jump);
     emit_byte(OP_POP);
 }
 
-void Compiler::expression(Expr& expr) {
+// Only compiles the query's terms; the run blocks over it do the work.
+void Compiler::query_declaration(const QueryStmt& query) {
+    CompilerQuery compiled = {token(query.name).symbol, {}, {}};
+    const TokenIndex* terms = ast.list(query.terms);
+    int slots = 0;
+    for (uint32_t i = 0; i < query.term_count; i++) {
+        const Token& name = token(terms[2 * i]);
+        const Token& bound = token(terms[2 * i + 1]);
+        if (name.type == TOKEN_WITH || name.type == TOKEN_WITHOUT) {
+            int component = component_of(bound);
+            if (component == -1) {
+                error() << "[line " << bound.line << "] Undeclared component: " << bound.lexeme << std::endl;
+                continue;
+            }
+            compiled.terms.push_back(name.type == TOKEN_WITH ? QUERY_TERM_WITH : QUERY_TERM_WITHOUT);
+            compiled.terms.push_back((component >> 8) & 0xff);
+            compiled.terms.push_back(component & 0xff);
+            continue;
+        }
+        for (const QueryBinding& binding : compiled.bindings) {
+            if (binding.symbol != name.symbol) continue;
+            error() << "[line " << name.line << "] Query " << token(query.name).lexeme << " binds " << name.lexeme
+                    << " twice." << std::endl;
+        }
+        if (bound.type == TOKEN_ENTITY) {
+            compiled.bindings.push_back(QueryBinding{name.symbol, -1, 0});
+            continue;
+        }
+        int component = component_of(bound);
+        if (component == -1) {
+            error() << "[line " << bound.line << "] Undeclared component: " << bound.lexeme << std::endl;
+            continue;
+        }
+        compiled.bindings.push_back(QueryBinding{name.symbol, component, slots});
+        compiled.terms.push_back(QUERY_TERM_BIND);
+        compiled.terms.push_back((component >> 8) & 0xff);
+        compiled.terms.push_back(component & 0xff);
+        slots += components[component].field_count;
+    }
+    // Such a query would match nothing.
+    for (size_t i = 0; i < compiled.terms.size(); i += 3) {
+        if (compiled.terms[i] != QUERY_TERM_WITHOUT) continue;
+        for (size_t j = 0; j < compiled.terms.size(); j += 3) {
+            if (compiled.terms[j] == QUERY_TERM_WITHOUT || compiled.terms[j + 1] != compiled.terms[i + 1] ||
+                compiled.terms[j + 2] != compiled.terms[i + 2]) {
+                continue;
+            }
+            int component = (compiled.terms[i + 1] << 8) | compiled.terms[i + 2];
+            error() << "[line " << token(query.name).line << "] Query " << token(query.name).lexeme
+                    << " both needs and excludes " << token(components[component].name).lexeme << "." << std::endl;
+            break;
+        }
+    }
+    if (slots > UINT8_MAX + 1 || compiled.terms.size() / 3 > UINT8_MAX) {
+        error() << "[line " << token(query.name).line << "] Query " << token(query.name).lexeme
+                << " reads too many fields." << std::endl;
+    }
+    queries.push_back(std::move(compiled));
+}
+
+// Runs the body once per entity the query matches:
+//
+//   OP_QUERY_BEGIN terms
+//   start: OP_QUERY_NEXT exit
+//   body
+//   OP_LOOP start
+//   exit: OP_QUERY_END
+void Compiler::run_statement(const RunStmt& run) {
+    int line = token(run.keyword).line;
+    if (running_query != -1) {
+        error() << "[line " << line << "] Run blocks don't nest." << std::endl;
+        return;
+    }
+    int query = -1;
+    if (run.query == AST_NONE) {
+        if (queries.size() > first_query) query = queries.size() - 1;
+    } else {
+        for (int i = queries.size() - 1; i >= (int)first_query && query == -1; i--) {
+            if (queries[i].symbol == token(run.query).symbol) query = i;
+        }
+    }
+    if (query == -1) {
+        if (run.query == AST_NONE) error() << "[line " << line << "] No query to run." << std::endl;
+        else error() << "[line " << line << "] Undeclared query: " << token(run.query).lexeme << std::endl;
+        return;
+    }
+
+    const std::vector<uint8_t>& terms = queries[query].terms;
+    emit_bytes(OP_QUERY_BEGIN, terms.size() / 3);
+    for (uint8_t byte : terms) emit_byte(byte);
+    int loop_start = chunk().code.size();
+    int exit_jump = emit_jump(OP_QUERY_NEXT);
+
+    running_query = query;
+    run_locals = locals().size();
+    declaration(run.body);
+    running_query = -1;
+
+    emit_loop(loop_start);
+    patch_jump(exit_jump);
+    emit_byte(OP_QUERY_END);
+}
+
+void Compiler::expression(ExprIndex index) {
+    const Expr& expr = ast.expr(index);
     switch (expr.type) {
         case EXPR_ASSIGN: assign_expr(expr); break;
         case EXPR_COMPOUND_ASSIGN: compound_assign_expr(expr); break;
         case EXPR_BINARY: binary_expr(expr); break;
         case EXPR_CALL: call_expr(expr); break;
+        case EXPR_COMMAND: command_expr(expr); break;
+        case EXPR_GET: get_expr(expr); break;
         case EXPR_LITERAL: literal_expr(expr); break;
         case EXPR_LOGICAL: logical_expr(expr); break;
+        case EXPR_SET: set_expr(expr); break;
         case EXPR_UNARY: unary_expr(expr); break;
         case EXPR_VARIABLE: variable_expr(expr); break;
     }
 }
 
-void Compiler::assign_expr(Expr &expr) {
-    Assign& assign = expr.as<Assign>();
-    uint8_t offset = resolve_variable(assign.name).resolution.stack_offset;
+void Compiler::assign_expr(const Expr& expr) {
+    const Assign& assign = expr.assign;
+    if (run_binding(token(assign.name).symbol)) {
+        error() << "[line " << token(assign.name).line << "] Can't assign to a query binding." << std::endl;
+    }
+    uint8_t offset = resolve_variable(token(assign.name)).resolution.stack_offset;
 
-    expression(*assign.value);
+    expression(assign.value);
     emit_bytes(OP_SET_LOCAL, offset);
 }
 
-void Compiler::compound_assign_expr(Expr &expr) {
-    CompoundAssign& comp_assign = expr.as<CompoundAssign>();
-    uint8_t offset = resolve_variable(comp_assign.name).resolution.stack_offset;
-
-    expression(*comp_assign.value);
-    switch (comp_assign.op.type) {
-        case TOKEN_PLUS_EQUAL: emit_bytes(OP_ADD_ASSIGN, offset); break;
-        case TOKEN_MINUS_EQUAL: emit_bytes(OP_SUBTRACT_ASSIGN, offset); break;
-        case TOKEN_STAR_EQUAL: emit_bytes(OP_MULTIPLY_ASSIGN, offset); break;
-        case TOKEN_SLASH_EQUAL: emit_bytes(OP_DIVIDE_ASSIGN, offset); break;
+void Compiler::compound_assign_expr(const Expr& expr) {
+    const CompoundAssign& comp_assign = expr.compound_assign;
+    uint8_t offset = resolve_variable(token(comp_assign.name)).resolution.stack_offset;
+
+    expression(comp_assign.value);
+    bool unchecked = numeric(expr);
+    switch (token(comp_assign.op).type) {
+        case TOKEN_PLUS_EQUAL: emit_bytes(unchecked ? OP_ADD_ASSIGN_NN : OP_ADD_ASSIGN, offset); break;
+        case TOKEN_MINUS_EQUAL: emit_bytes(unchecked ? OP_SUBTRACT_ASSIGN_NN : OP_SUBTRACT_ASSIGN, offset); break;
+        case TOKEN_STAR_EQUAL: emit_bytes(unchecked ? OP_MULTIPLY_ASSIGN_NN : OP_MULTIPLY_ASSIGN, offset); break;
+        case TOKEN_SLASH_EQUAL: emit_bytes(unchecked ? OP_DIVIDE_ASSIGN_NN : OP_DIVIDE_ASSIGN, offset); break;
     }
 }
 
-void Compiler::binary_expr(Expr &expr) {
-    expression(*expr.as<Binary>().left);
-    expression(*expr.as<Binary>().right);
-    switch (expr.as<Binary>().op.type) {
-        case TOKEN_PLUS: emit_byte(OP_ADD); break;
+void Compiler::binary_expr(const Expr& expr) {
+    const Binary& binary = expr.binary;
+    expression(binary.left);
+    expression(binary.right);
+    bool unchecked = numeric(expr);
+    switch (token(binary.op).type) {
+        case TOKEN_PLUS: emit_byte(unchecked ? OP_ADD_NN : OP_ADD); break;
         case TOKEN_PLUS_EQUAL: emit_byte(OP_ADD_ASSIGN); break;
-        case TOKEN_MINUS: emit_byte(OP_SUBTRACT); break;
+        case TOKEN_MINUS: emit_byte(unchecked ? OP_SUBTRACT_NN : OP_SUBTRACT); break;
         case TOKEN_MINUS_EQUAL: emit_byte(OP_SUBTRACT_ASSIGN); break;
-        case TOKEN_STAR: emit_byte(OP_MULTIPLY); break;
+        case TOKEN_STAR: emit_byte(unchecked ? OP_MULTIPLY_NN : OP_MULTIPLY); break;
         case TOKEN_STAR_EQUAL: emit_byte(OP_MULTIPLY_ASSIGN); break;
-        case TOKEN_SLASH: emit_byte(OP_DIVIDE); break;
+        case TOKEN_SLASH: emit_byte(unchecked ? OP_DIVIDE_NN : OP_DIVIDE); break;
         case TOKEN_SLASH_EQUAL: emit_byte(OP_DIVIDE_ASSIGN); break;
         case TOKEN_MODULO: emit_byte(OP_MODULO); break;
         case TOKEN_MODULO_EQUAL: emit_byte(OP_MODULO_ASSIGN); break;
         case TOKEN_EQUAL_EQUAL: emit_byte(OP_EQUAL); break;
         case TOKEN_BANG_EQUAL: emit_byte(OP_NOT_EQUAL); break;
-        case TOKEN_GREATER: emit_byte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emit_byte(OP_GREATER_EQUAL); break;
-        case TOKEN_LESS: emit_byte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL: emit_byte(OP_LESS_EQUAL); break;
+        case TOKEN_GREATER: emit_byte(unchecked ? OP_GREATER_NN : OP_GREATER); break;
+        case TOKEN_GREATER_EQUAL: emit_byte(unchecked ? OP_GREATER_EQUAL_NN : OP_GREATER_EQUAL); break;
+        case TOKEN_LESS: emit_byte(unchecked ? OP_LESS_NN : OP_LESS); break;
+        case TOKEN_LESS_EQUAL: emit_byte(unchecked ? OP_LESS_EQUAL_NN : OP_LESS_EQUAL); break;
         default:
-            std::cerr << "Invalid binary operator '" << expr.as<Binary>().op.lexeme << "'." << std::endl;
+            error() << "Invalid binary operator '" << token(binary.op).lexeme << "'." << std::endl;
             break;
     }
 }
 
-void Compiler::call_expr(Expr &expr) {
-    Call& call = expr.as<Call>();
+void Compiler::call_expr(const Expr& expr) {
+    const Call& call = expr.call;
+    if (component_of(token(call.callee)) != -1) {
+        error() << "[line " << token(call.callee).line << "] Component " << token(call.callee).lexeme
+                << " is only built in spawn or insert." << std::endl;
+        return;
+    }
+
+    if (int stage = stage_of(token(call.callee)); stage != -1) {
+        if (call.argument_count != 0) {
+            error() << "[line " << token(call.callee).line << "] Stage " << token(call.callee).lexeme
+                    << " takes no arguments." << std::endl;
+        }
+        emit_bytes(OP_RUN_STAGE, stage);
+        return;
+    }
 
-    Local local_function = resolve_function(call.callee);
+    Local local_function = resolve_function(token(call.callee));
 
-    for (ExprPtr& arg : call.arguments) {
-        expression(*arg);
+    const ExprIndex* arguments = ast.list(call.arguments);
+    for (uint32_t i = 0; i < call.argument_count; i++) {
+        expression(arguments[i]);
     }
     switch (local_function.resolution.type) {
         case LOCAL_FUNCTION:
-            emit_bytes(OP_CALL, local_function.resolution.array_index);
+            emit_byte(OP_CALL);
+            emit_short(local_function.resolution.array_index);
             break;
         case LOCAL_NATIVE_FUNCTION:
-            emit_bytes(OP_CALL_NATIVE, local_function.resolution.array_index);
+            emit_byte(OP_CALL_NATIVE);
+            emit_short(local_function.resolution.array_index);
             break;
+        default: break;
     }
 }
 
-void Compiler::literal_expr(Expr &expr) {
-    Value& value = expr.as<Literal>().value;
-    Token& token = expr.as<Literal>().token;
-    switch (value_type(value)) {
-        case VAL_STRING_INDEX: {
-            std::string string = token.lexeme.substr(1, token.lexeme.length() - 2);
-            auto result = string_intern.find(string);
-            if (result != string_intern.end()) {
-                emit_byte(OP_STRING);
-                emit_byte(string_intern[string]);
-                return;
-            }
-            StringIndex string_value = {strings.size()};
-            emit_byte(OP_STRING);
-            emit_byte((uint8_t)string_value.index);
-            string_intern[string] = (uint8_t)string_value.index;
-            strings.append(string);
-            strings.push_back('\0');
-        } break;
-        default: emit_constant(value);
+// Leaves the entity on the stack for spawn, and nil for the others. spawn
+// and insert take components built like calls, Position(1, 2), whose
+// fields go on the stack in turn; remove takes them by name.
+void Compiler::command_expr(const Expr& expr) {
+    const Command& command = expr.command;
+    const Token& keyword = token(command.keyword);
+    const ExprIndex* arguments = ast.list(command.arguments);
+    uint32_t first = keyword.type == TOKEN_SPAWN ? 0 : 1;
+    if (command.argument_count < first || (keyword.type == TOKEN_DESPAWN && command.argument_count != 1)) {
+        error() << "[line " << keyword.line << "] " << keyword.lexeme << " takes an entity"
+                << (keyword.type == TOKEN_DESPAWN ? "." : ", then components.") << std::endl;
+        return;
+    }
+    if (first == 1) expression(arguments[0]);
+    if (keyword.type == TOKEN_DESPAWN) {
+        emit_byte(OP_DESPAWN);
+        return;
+    }
+
+    std::vector<uint16_t> ids;
+    for (uint32_t i = first; i < command.argument_count; i++) {
+        const Expr& argument = ast.expr(arguments[i]);
+        TokenIndex name = argument.type == EXPR_CALL ? argument.call.callee
+                          : argument.type == EXPR_VARIABLE ? argument.variable.name : AST_NONE;
+        int component = name == AST_NONE ? -1 : component_of(token(name));
+        bool built = argument.type == EXPR_CALL;
+        if (component == -1 || built == (keyword.type == TOKEN_REMOVE)) {
+            error() << "[line " << keyword.line << "] " << keyword.lexeme << " takes components"
+                    << (keyword.type == TOKEN_REMOVE ? " by name." : " built like calls.") << std::endl;
+            return;
+        }
+        for (uint16_t id : ids) {
+            if (id != component) continue;
+            error() << "[line " << keyword.line << "] " << token(name).lexeme << " is named twice." << std::endl;
+        }
+        ids.push_back(component);
+        if (!built) continue;
+        if (argument.call.argument_count != components[component].field_count) {
+            error() << "[line " << keyword.line << "] " << token(name).lexeme << " has "
+                    << components[component].field_count << " fields, not " << argument.call.argument_count << "."
+                    << std::endl;
+            return;
+        }
+        const ExprIndex* fields = ast.list(argument.call.arguments);
+        for (uint32_t field = 0; field < argument.call.argument_count; field++) {
+            expression(fields[field]);
+        }
+    }
+    emit_bytes(keyword.type == TOKEN_SPAWN ? OP_SPAWN : keyword.type == TOKEN_INSERT ? OP_INSERT : OP_REMOVE,
+               ids.size());
+    for (uint16_t id : ids) emit_short(id);
+}
+
+void Compiler::get_expr(const Expr& expr) {
+    emit_bytes(OP_GET_FIELD, field_slot(expr.get));
+}
+
+// A compound assignment reads the field, then writes it back.
+void Compiler::set_expr(const Expr& expr) {
+    const Set& set = expr.set;
+    uint8_t slot = field_slot(ast.expr(set.target).get);
+    TokenType op = token(set.op).type;
+    if (op != TOKEN_EQUAL) emit_bytes(OP_GET_FIELD, slot);
+    expression(set.value);
+    switch (op) {
+        case TOKEN_PLUS_EQUAL: emit_byte(OP_ADD); break;
+        case TOKEN_MINUS_EQUAL: emit_byte(OP_SUBTRACT); break;
+        case TOKEN_STAR_EQUAL: emit_byte(OP_MULTIPLY); break;
+        case TOKEN_SLASH_EQUAL: emit_byte(OP_DIVIDE); break;
+        case TOKEN_MODULO_EQUAL: emit_byte(OP_MODULO); break;
+        default: break;
     }
+    emit_bytes(OP_SET_FIELD, slot);
 }
 
-void Compiler::logical_expr(Expr &expr) {
-    Logical& logical = expr.as<Logical>();
-    expression(*logical.left);
+void Compiler::literal_expr(const Expr& expr) {
+    Value value;
+    if (literal_value(ast, expr.literal, value)) {
+        emit_constant(value);
+        return;
+    }
+    const Token& token = this->token(expr.literal.token);
+    switch (token.type) {
+        case TOKEN_STRING: emit_string(token); break;
+        default: break;
+    }
+}
+
+void Compiler::logical_expr(const Expr& expr) {
+    const Logical& logical = expr.logical;
+    expression(logical.left);
 
-    switch (logical.op.type) {
+    switch (token(logical.op).type) {
         case TOKEN_OR: {
             int else_jump = emit_jump(OP_JUMP_IF_FALSE);
             int end_jump = emit_jump(OP_JUMP);
@@ -279,7 +825,7 @@ void Compiler::logical_expr(Expr &expr) {
             patch_jump(else_jump);
             emit_byte(OP_POP);
 
-            expression(*logical.right);
+            expression(logical.right);
             patch_jump(end_jump);
             break;
         }
@@ -287,7 +833,7 @@ void Compiler::logical_expr(Expr &expr) {
             int end_jump = emit_jump(OP_JUMP_IF_FALSE);
 
             emit_byte(OP_POP);
-            expression(*logical.right);
+            expression(logical.right);
 
             patch_jump(end_jump);
             break;
@@ -295,17 +841,24 @@ void Compiler::logical_expr(Expr &expr) {
     }
 }
 
-void Compiler::unary_expr(Expr &expr) {
-    expression(*expr.as<Unary>().right);
-    switch (expr.as<Unary>().op.type) {
+void Compiler::unary_expr(const Expr& expr) {
+    expression(expr.unary.right);
+    switch (token(expr.unary.op).type) {
         case TOKEN_MINUS: emit_byte(OP_NEGATE); break;
         case TOKEN_BANG: emit_byte(OP_NOT); break;
     }
 }
 
-void Compiler::variable_expr(Expr &expr) {
-    Variable& variable = expr.as<Variable>();
-    Local& local = resolve_variable(variable.name);
+void Compiler::variable_expr(const Expr& expr) {
+    if (const QueryBinding* binding = run_binding(token(expr.variable.name).symbol)) {
+        if (binding->component != -1) {
+            error() << "[line " << token(expr.variable.name).line << "] Read the fields of "
+                    << token(expr.variable.name).lexeme << ", not the binding itself." << std::endl;
+        }
+        emit_byte(OP_GET_ENTITY);
+        return;
+    }
+    Local& local = resolve_variable(token(expr.variable.name));
 
     if (!local.resolution.fresh_function) {
         emit_bytes(OP_GET_LOCAL, local.resolution.stack_offset);
@@ -324,120 +877,118 @@ void Compiler::end_scope() {
     for (int i  = locals().size() - 1; i >= 0; i--) {
         if (locals()[i].resolution.depth <= scope_depth) break;
         pop_count++;
-        locals().pop_back();
+        pop_local();
     }
     if (pop_count) emit_bytes(OP_POP_N, pop_count);
 }
 
-void Compiler::new_variable(Token &name) {
-    size_t stack_offset = locals().size();
-    if (stack_offset != 0) {
-        for (auto local = locals().rbegin(); local != locals().rend(); local++) {
-            if (local->resolution.depth != -1 && local->resolution.depth < scope_depth) {
-                break;
-            }
+void Compiler::pop_local() {
+    local_bindings[locals().back().symbol] = locals().back().shadowed;
+    locals().pop_back();
+}
 
-            if (name.lexeme == local->name) {
-                //error("Already a variable with this name in this scope.");
-                std::cerr << "Already a variable with this name in this scope." << std::endl;
-            }
+void Compiler::new_variable(const Token& name) {
+    size_t stack_offset = locals().size();
+    int frame = locals_stack.size() - 1;
+    LocalBinding& binding = local_bindings[name.symbol];
+    if (binding.frame == frame) {
+        const Local& other = locals()[binding.index];
+        if (other.resolution.depth == -1 || other.resolution.depth >= scope_depth) {
+            //error("Already a variable with this name in this scope.");
+            error() << "Already a variable with this name in this scope." << std::endl;
         }
+    }
 
-        if (locals().size() - 1 == UINT8_MAX) {
-            //error("Too many local variables in function_index.");
-            std::cerr << "Too many local variables in function_index." << std::endl;
-            return;
-        }
-    // Depth of -1 marks uninitialized.
-        locals().push_back(Local(name.lexeme, -1, stack_offset, -1, LOCAL_UNINITIALIZED));
-    } else {
-        locals_stack.push_back({Local(name.lexeme, -1, stack_offset, -1, LOCAL_UNINITIALIZED)});
+    if (stack_offset == UINT8_MAX + 1) {
+        //error("Too many local variables in function_index.");
+        error() << "Too many local variables in function_index." << std::endl;
+        return;
     }
+    // Depth of -1 marks uninitialized.
+    Local local = Local(name.symbol, -1, stack_offset, -1, LOCAL_UNINITIALIZED);
+    local.shadowed = binding;
+    locals().push_back(local);
+    binding = {frame, (int)stack_offset};
 }
 
-Local& Compiler::resolve_variable(Token &name) {
-    for (int i = locals().size() - 1; i >= 0; --i) {
-        Local& local = locals()[i];
-        if (name.lexeme == local.name) {
-            if (local.resolution.depth == -1) {
-                //error("Can't read local variable in its own initializer.");
-                std::cerr << "[line " << name.line << "]" << std::endl;
-                std::cerr << "Can't read local variable in its own initializer." << std::endl;
-            }
-            if (local.resolution.type == LOCAL_UNINITIALIZED) {
-                local.resolution.type = LOCAL_VARIABLE;
-                local.resolution.fresh_function = false;
-                if (local.resolution.array_index != -1)
-                    std::cerr << "ERROR NOT LOCAL_VARIABLE" << std::endl;
-            }
-            return local;
+Local& Compiler::resolve_variable(const Token& name) {
+    LocalBinding binding = local_bindings[name.symbol];
+    // Functions don't see their callers' locals.
+    if (binding.frame == (int)locals_stack.size() - 1) {
+        Local& local = locals()[binding.index];
+        if (local.resolution.depth == -1) {
+            //error("Can't read local variable in its own initializer.");
+            error() << "[line " << name.line << "]" << std::endl;
+            error() << "Can't read local variable in its own initializer." << std::endl;
         }
+        if (local.resolution.type == LOCAL_UNINITIALIZED) {
+            local.resolution.type = LOCAL_VARIABLE;
+            local.resolution.fresh_function = false;
+            if (local.resolution.array_index != -1)
+                error() << "ERROR NOT LOCAL_VARIABLE" << std::endl;
+        }
+        return local;
     }
     // TODO: Potential redundancy with resolve_function
-    for (int i = 0; i < functions.size(); i++) {
-        ObjFunction& func = functions[i];
-        if (name.lexeme == func.name.lexeme) {
-            locals().back().resolution.type = LOCAL_FUNCTION;
-            locals().back().resolution.array_index = i;
-            locals().back().resolution.fresh_function = true;
-            // TODO: Potentially unecessary
-            locals().back().resolution.stack_offset = locals().size() - 1;
-            emit_constant(FunctionIndex(i, USER_FUNCTION));
-            return locals().back();
-        }
+    if (int function = function_binding(name.symbol); function != -1) {
+        locals().back().resolution.type = LOCAL_FUNCTION;
+        locals().back().resolution.array_index = function;
+        locals().back().resolution.fresh_function = true;
+        // TODO: Potentially unecessary
+        locals().back().resolution.stack_offset = locals().size() - 1;
+        emit_constant(FunctionIndex(function, USER_FUNCTION));
+        return locals().back();
     }
-    for (int i = ffi.native_functions.size() - 1; i >= 0; --i) {
-        NativeFunction& native_func = ffi.native_functions[i];
-        if (name.lexeme == native_func.name) {
-            locals().back().resolution.type = LOCAL_NATIVE_FUNCTION;
-            locals().back().resolution.array_index = i;
-            locals().back().resolution.fresh_function = true;
-            // TODO: Potentially unecessary
-            locals().back().resolution.stack_offset = locals().size() - 1;
-            emit_constant(FunctionIndex(i, NATIVE_FUNCTION));
-            return locals().back();
-        }
+    if (int native = native_bindings[name.symbol]; native != -1) {
+        locals().back().resolution.type = LOCAL_NATIVE_FUNCTION;
+        locals().back().resolution.array_index = native;
+        locals().back().resolution.fresh_function = true;
+        // TODO: Potentially unecessary
+        locals().back().resolution.stack_offset = locals().size() - 1;
+        emit_constant(FunctionIndex(native, NATIVE_FUNCTION));
+        return locals().back();
     }
-    std::cerr << "[line " << name.line << "] " << "Undeclared variable: " << name.lexeme << std::endl;
-    exit(-1);
+    error() << "[line " << name.line << "] " << "Undeclared variable: " << name.lexeme << std::endl;
+    return unresolved;
 }
 
-size_t Compiler::new_function(ObjFunction func) {
-    // TODO: Potential redundancy with resolve_function again
-    for (ObjFunction& other_func : functions){
-        if (func.name.lexeme == other_func.name.lexeme) {
-            //error("Already a function with this.");
-            std::cerr << "Already a function with this name ." << std::endl;
-            return 0;
-        }
+size_t Compiler::new_function(ObjFunction func, StmtIndex declaration) {
+    int& binding = function_bindings[func.name.symbol];
+    if (binding != -1) {
+        //error("Already a function with this.");
+        error() << "Already a function with this name ." << std::endl;
+        return 0;
     }
+    if (current_function == 0) func.flags |= FUNCTION_EXPORTED;
     functions.push_back(func);
+    function_declarations.push_back(declaration);
+    binding = functions.size() - 1;
+    visible_functions = functions.size();
+    function_ends.push_back(INT_MAX);
+    function_roots.push_back(current_function == 0 ? binding : function_roots[current_function]);
     return functions.size() - 1;
 }
 
-Local Compiler::resolve_function(Token &name) {
-    for (int i = functions.size() - 1; i >= 0; --i) {
-        ObjFunction& func = functions[i];
-        if (name.lexeme == func.name.lexeme) {
-            return Local(name.lexeme, -1, 0, i, LOCAL_FUNCTION);
-        }
+// The function bound to symbol at the point compilation has got to, or -1.
+int Compiler::function_binding(uint32_t symbol) const {
+    int function = program->function_bindings[symbol];
+    return function < visible_functions ? function : -1;
+}
+
+Local Compiler::resolve_function(const Token& name) {
+    if (int function = function_binding(name.symbol); function != -1) {
+        return Local(name.symbol, -1, 0, function, LOCAL_FUNCTION);
     }
-    for (int i = ffi.native_functions.size() - 1; i >= 0; --i) {
-        NativeFunction& native_func = ffi.native_functions[i];
-        if (name.lexeme == native_func.name) {
-            return Local(name.lexeme, -1, 0, i, LOCAL_NATIVE_FUNCTION);
-        }
+    if (int native = native_bindings[name.symbol]; native != -1) {
+        return Local(name.symbol, -1, 0, native, LOCAL_NATIVE_FUNCTION);
     }
-    for (int i = locals().size() - 1; i >= 0; --i) {
-        Local& local = locals()[i];
-        if (name.lexeme == local.name) {
-            if (local.resolution.type == LOCAL_VARIABLE) break;
-            return local;
-            //{(uint8_t)i, false};
-        }
+    LocalBinding binding = local_bindings[name.symbol];
+    if (binding.frame == (int)locals_stack.size() - 1) {
+        const Local& local = locals()[binding.index];
+        if (local.resolution.type != LOCAL_VARIABLE) return local;
     }
-    std::cerr << "[line " << name.line << "] " << "Undeclared function: " << name.lexeme << std::endl;
-    exit(-1);
+    error() << "[line " << name.line << "] " << "Undeclared function: " << name.lexeme << std::endl;
+    return Local(name.symbol, -1, 0, -1, LOCAL_UNINITIALIZED);
 }
 
 void Compiler::mark_initialized() {
@@ -445,20 +996,47 @@ void Compiler::mark_initialized() {
     locals().back().resolution.depth = scope_depth;
 }
 
-bool Compiler::match(StmtType type) {
-    if (!current()->is_type(type)) return false;
-    advance();
-    return true;
+// The stage a call names, unless a function or native of the same name
+// hides it.
+int Compiler::stage_of(const Token& name) const {
+    if (function_binding(name.symbol) != -1 || native_bindings[name.symbol] != -1) return -1;
+    auto stage = std::find(stages.begin(), stages.end(), name.lexeme);
+    return stage == stages.end() ? -1 : stage - stages.begin();
 }
 
-void Compiler::advance() {
-    next()++;
-    previous() = current();
-    if (!is_at_end()) current() = stmts()[next()];
+int Compiler::component_of(const Token& name) const {
+    return name.symbol < component_bindings.size() ? component_bindings[name.symbol] : -1;
 }
 
-bool Compiler::is_at_end() {
-    return (size_t)next() >= stmts().size();
+// What symbol names in the run block being compiled, unless a local
+// declared inside the block hides it.
+const QueryBinding* Compiler::run_binding(uint32_t symbol) const {
+    if (running_query == -1) return nullptr;
+    LocalBinding local = local_bindings[symbol];
+    if (local.frame == (int)locals_stack.size() - 1 && (size_t)local.index >= run_locals) return nullptr;
+    for (const QueryBinding& binding : queries[running_query].bindings) {
+        if (binding.symbol == symbol) return &binding;
+    }
+    return nullptr;
+}
+
+uint8_t Compiler::field_slot(const Get& get) {
+    const Token& object = token(get.object);
+    const Token& name = token(get.name);
+    const QueryBinding* binding = run_binding(object.symbol);
+    if (!binding || binding->component == -1) {
+        error() << "[line " << object.line << "] " << object.lexeme << " isn't a component a run block binds."
+                << std::endl;
+        return 0;
+    }
+    const CompilerComponent& component = components[binding->component];
+    const TokenIndex* fields = ast.list(component.fields);
+    for (uint32_t field = 0; field < component.field_count; field++) {
+        if (token(fields[field]).symbol == name.symbol) return binding->first_slot + field;
+    }
+    error() << "[line " << name.line << "] " << token(component.name).lexeme << " has no field " << name.lexeme
+            << "." << std::endl;
+    return 0;
 }
 
 void Compiler::emit_constant(Value value) {
@@ -466,9 +1044,24 @@ void Compiler::emit_constant(Value value) {
         AS_BOOL(value) ? emit_byte(OP_TRUE) : emit_byte(OP_FALSE);
         return;
     }
+    if (program != this) {
+        fixups.push_back(CompilerFixup{(uint32_t)chunk().code.size() + 1, false, value, {}});
+        emit_bytes(OP_CONSTANT, 0);
+        return;
+    }
     emit_bytes(OP_CONSTANT, make_constant(value));
 }
 
+void Compiler::emit_string(const Token& token) {
+    std::string_view text = token.lexeme.substr(1, token.lexeme.length() - 2);
+    if (program != this) {
+        fixups.push_back(CompilerFixup{(uint32_t)chunk().code.size() + 1, true, Nil{}, text});
+        emit_bytes(OP_STRING, 0);
+        return;
+    }
+    emit_bytes(OP_STRING, make_string(text));
+}
+
 uint8_t Compiler::make_constant(Value value) {
     if (constant_intern.contains(value)) {
         return constant_intern[value];
@@ -477,7 +1070,7 @@ uint8_t Compiler::make_constant(Value value) {
     int constant = constants.size() - 1;
     if (constant > UINT8_MAX) {
         //error("Too many constants in one chunk.");
-        std::cerr << "Too many constants in one chunk." << std::endl;
+        error() << "Too many constants in one chunk." << std::endl;
         return 0;
     }
 
@@ -485,6 +1078,17 @@ uint8_t Compiler::make_constant(Value value) {
     return (uint8_t)constant;
 }
 
+uint8_t Compiler::make_string(std::string_view text) {
+    std::string string = std::string(text);
+    auto result = string_intern.find(string);
+    if (result != string_intern.end()) return result->second;
+    StringIndex string_value = {strings.size()};
+    string_intern[string] = (uint8_t)string_value.index;
+    strings.append(string);
+    strings.push_back('\0');
+    return (uint8_t)string_value.index;
+}
+
 void Compiler::emit_byte(uint8_t byte) {
     chunk().code.push_back(byte);
     chunk().lines.push_back(0);
@@ -495,13 +1099,18 @@ void Compiler::emit_bytes(uint8_t byte1, uint8_t byte2) {
     emit_byte(byte2);
 }
 
+void Compiler::emit_short(uint16_t value) {
+    emit_byte((value >> 8) & 0xff);
+    emit_byte(value & 0xff);
+}
+
 void Compiler::emit_loop(int loop_start) {
     emit_byte(OP_LOOP);
 
     int offset = chunk().code.size() - loop_start + 2;
     if (offset > UINT16_MAX) {
         //error("Loop body too large.");
-        std::cerr << "Loop body too large." << std::endl;
+        error() << "Loop body too large." << std::endl;
     }
 
     emit_byte((offset >> 8) & 0xff);
@@ -522,7 +1131,7 @@ void Compiler::patch_jump(int offset) {
 
     if (jump > UINT16_MAX) {
         //error("Too much code to jump over.");
-        std::cerr << "Too much code to jump over." << std::endl;
+        error() << "Too much code to jump over." << std::endl;
     }
 
     // Patch in the 16 bit jump in two uint_8.
@@ -535,18 +1144,6 @@ void Compiler::emit_return() {
     emit_byte(OP_RETURN);
 }
 
-void Compiler::push_state(std::vector<StmtPtr> stmts) {
-    state_stack.push_back(CompilerState(this, stmts));
-}
-
-void Compiler::pop_state() {
-    state_stack.pop_back();
-}
-
-std::vector<StmtPtr>& Compiler::stmts() {
-    return state_stack.back().stmts;
-}
-
 Chunk& Compiler::chunk() {
     return functions[current_function].chunk;
 }
@@ -560,54 +1157,47 @@ void Compiler::push_locals() {
 }
 
 void Compiler::pop_locals() {
+    while (!locals().empty()) pop_local();
     locals_stack.pop_back();
 }
 
-
-StmtPtr& Compiler::current() {
-    return state_stack.back().current_stmt;
+// Marks the compile failed. The serial compile reports straight to
+// std::cerr and goes on, so one run lists every error.
+std::ostream& Compiler::error() {
+    failed = true;
+    if (program == this && !interactive) return std::cerr;
+    return diagnostics;
 }
 
-StmtPtr& Compiler::previous() {
-    return state_stack.back().previous_stmt;
+std::vector<uint8_t> Compiler::image() {
+    std::vector<ComponentDeclaration> declared;
+    for (const CompilerComponent& component : components) {
+        declared.push_back(ComponentDeclaration{std::string(token(component.name).lexeme), component.field_count,
+                                                component.flags});
+    }
+    std::vector<SystemDeclaration> systems;
+    for (size_t function = first_declared; function < functions.size(); function++) {
+        const FunStmt& system = declaration_of(function);
+        if (!system.system) continue;
+        uint32_t flags = ast.list(system.parameters)[1] != AST_NONE ? SYSTEM_SERIAL : 0;
+        systems.push_back(SystemDeclaration{(uint32_t)function, std::string(stage_name(system)), flags});
+    }
+    return write_image(functions, constants, strings, ffi.native_functions, imports, declared, systems);
 }
 
-int& Compiler::next() {
-    return state_stack.back().next;
+std::vector<uint8_t> Compiler::image(const std::vector<int>& selected) {
+    std::vector<ObjFunction> subset;
+    for (int function : selected) {
+        subset.push_back(functions[function]);
+    }
+    return write_image(subset, constants, strings, ffi.native_functions);
 }
 
 void Compiler::write() {
+    std::vector<uint8_t> image = this->image();
     std::ofstream out("bytecode.dat", std::ios::binary);
     if (out.is_open()) {
-        // Function Count
-        size_t functions_size = functions.size();
-        out.write(reinterpret_cast<char*>(&functions_size), sizeof(size_t));
-        for (size_t i = 0; i < functions_size; i++) {
-            // Function Token
-            size_t name_size = functions[i].name.lexeme.size();
-            out.write(reinterpret_cast<char*>(&name_size), sizeof(size_t));
-            out.write(reinterpret_cast<char*>(functions[i].name.lexeme.data()), name_size * sizeof(char));
-            // Function Arity
-            out.write(reinterpret_cast<char*>(&functions[i].arity), 1 * sizeof(int));
-            // CHUNK
-            // Bytecode:
-            size_t bytecode_size = functions[i].chunk.code.size();
-            out.write(reinterpret_cast<char*>(&bytecode_size), sizeof(size_t));
-            out.write(reinterpret_cast<char*>(functions[i].chunk.code.data()), bytecode_size * sizeof(uint8_t));
-            // Lines:
-            size_t lines_size = functions[i].chunk.lines.size();
-            out.write(reinterpret_cast<char*>(&lines_size), sizeof(size_t));
-            out.write(reinterpret_cast<char*>(functions[i].chunk.lines.data()), bytecode_size * sizeof(int));
-        }
-        // Constants:
-        size_t constants_size = constants.size();
-        out.write(reinterpret_cast<char*>(&constants_size), sizeof(size_t));
-        out.write(reinterpret_cast<char*>(constants.data()), constants_size * sizeof(Value));
-        // StringExpr Constants:
-        size_t str_constants_size = strings.size();
-        out.write(reinterpret_cast<char*>(&str_constants_size), sizeof(size_t));
-        out.write(reinterpret_cast<char*>(strings.data()), str_constants_size * sizeof(char));
-
+        out.write(reinterpret_cast<char*>(image.data()), image.size());
         out.close();
     }
 }
@@ -1,15 +1,21 @@
 #ifndef MOSAIC_ECS_COMPILER_H
 #define MOSAIC_ECS_COMPILER_H
 
+#include <memory>
+#include <ostream>
 #include <stdint.h>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
 #include "chunk.h"
 #include "debug.h"
 #include "ffi.h"
-#include "stmt.h"
+#include "image.h"
+#include "ir_builder.h"
+#include "ast.h"
+#include "optimizer.h"
 
 enum LocalType {
     LOCAL_UNINITIALIZED,
@@ -27,22 +33,83 @@ struct LocalResolution {
     bool fresh_function;
 };
 
+// Where the innermost local bound to a symbol lives in locals_stack.
+struct LocalBinding {
+    int frame = -1;
+    int index = -1;
+};
+
 struct Local {
-    Local(std::string name, int depth, size_t stack_offset, size_t array_index, LocalType type);
-    std::string name;
+    Local(uint32_t symbol, int depth, size_t stack_offset, size_t array_index, LocalType type);
+    uint32_t symbol;
+    // The binding this local hides, put back when it goes out of scope.
+    LocalBinding shadowed;
     LocalResolution resolution;
 };
 
-class Compiler;
+// An operand byte a worker left for Compiler::link() to fill in: a
+// constant, or a string's text.
+struct CompilerFixup {
+    uint32_t offset;
+    bool string;
+    Value constant;
+    std::string_view text;
+};
+
+// A function declared inside a body a worker compiled, and how many of
+// that body's fixups came before it.
+struct NestedFunction {
+    int function;
+    size_t fixup;
+};
+
+// One function body compiled by a worker, waiting to be linked.
+struct CompiledBody {
+    Chunk chunk;
+    std::vector<CompilerFixup> fixups;
+    std::vector<NestedFunction> nested;
+    bool failed = false;
+};
+
+// A comp declaration; its id is its place in Compiler::components.
+struct CompilerComponent {
+    TokenIndex name;
+    // TokenIndex entries in Ast::lists.
+    ListIndex fields;
+    uint32_t field_count;
+    // ComponentFlags.
+    uint32_t flags;
+};
+
+// A name a query binds, as the run blocks over it read it.
+struct QueryBinding {
+    uint32_t symbol;
+    // -1 for the entity itself.
+    int component;
+    // Where the component's first field is among the cursor's columns.
+    int first_slot;
+};
 
-struct CompilerState {
-    CompilerState(Compiler* compiler, std::vector<StmtPtr>& stmts);
-    std::vector<StmtPtr> stmts;
-    StmtPtr current_stmt;
-    StmtPtr previous_stmt;
-    int next;
+struct CompilerQuery {
+    uint32_t symbol;
+    std::vector<QueryBinding> bindings;
+    // OP_QUERY_BEGIN's terms.
+    std::vector<uint8_t> terms;
 };
 
+// A function another module exports, as far as calling it is concerned.
+struct ModuleFunction {
+    std::string_view name;
+    int arity;
+};
+
+// The stage of a system declared without one.
+#define DEFAULT_STAGE "update"
+
+// Below this many functions a script compiles faster on one thread than
+// it takes to start the others.
+#define COMPILER_PARALLEL_MIN_FUNCTIONS 64
+
 enum CompilerResult {
     COMPILER_RESULT_ERROR,
     COMPILER_RESULT_OK,
@@ -50,62 +117,143 @@ enum CompilerResult {
 
 class Compiler {
 public:
-    Compiler(std::vector<StmtPtr> stmts);
-    void compile();
-    friend struct CompilerState;
+    // ast must outlive the Compiler. threads of 0 uses every hardware
+    // thread once a script has enough functions; 1 compiles serially.
+    Compiler(const Ast& ast, FFI ffi = FFI(), int optimize = OPTIMIZE_NONE, int debug_flags = DEBUG_NONE,
+             unsigned threads = 0);
+    // Makes another module's exported functions callable from this one, as
+    // functions declared ahead of the script's own, so calls to them compile
+    // to plain OP_CALLs. They get no code here: the linker points them at
+    // the module's. interface is recorded in the image, for telling later
+    // whether the module has changed what it exports. Before compile();
+    // false, having reported it, if a name is imported twice.
+    bool import_module(std::string_view name, uint64_t interface, const std::vector<ModuleFunction>& exports);
+    // Reports every error it finds, and whether there were any.
+    CompilerResult compile();
+    // Compiles only the bodies of the given functions, 0 being the
+    // script, for a hot reload or a lazy program; the rest are left without
+    // code. May be called again for others, with the constants and strings
+    // started over. Reports what fails and returns false.
+    bool compile_functions(const std::vector<int>& selected);
+    void disassemble();
+    std::vector<uint8_t> image();
+    // An image of just the given functions, in that order.
+    std::vector<uint8_t> image(const std::vector<int>& selected);
+    // Compiles the statements in the tree's script list as the next piece
+    // of a script typed in a piece at a time, for the REPL. The tree may
+    // have grown since the last piece. The piece continues the script's
+    // top level: what earlier pieces declared is in scope, and it ends in
+    // OP_SUSPEND, leaving its own locals on the stack for the next. Fills
+    // declared with 0, for the piece, and the functions it declared, ready
+    // for image(). On an error, reports it and returns false, with the
+    // piece forgotten.
+    bool compile_entry(std::vector<int>& declared);
+    // The piece compiled last stopped on a runtime error, before the
+    // locals it declares were all on the stack: forgets them. Its
+    // functions stay.
+    void abandon_entry();
+    void write();
     friend class Debugger;
+    friend class IrBuilder;
+    friend class IrLowering;
 private:
-    void declaration();
-    void fun_declaration();
-    void let_declaration();
-    void statement();
-    void block_statement();
-    void if_statement();
-    void print_statement();
-    void while_statement();
-    void expression(Expr& expr);
-    void assign_expr(Expr& expr);
-    void compound_assign_expr(Expr& expr);
-    void binary_expr(Expr& expr);
-    void call_expr(Expr& expr);
-    void literal_expr(Expr& expr);
-    void logical_expr(Expr& expr);
-    void unary_expr(Expr& expr);
-    void variable_expr(Expr& expr);
+    void bind_symbols();
+    void compile_script();
+    bool compile_parallel();
+    bool declare_functions(StmtIndex index);
+    void undeclare_functions();
+    void compile_body(int function, CompiledBody& body);
+    void link(std::vector<CompiledBody>& bodies, int function);
+    void declare_components();
+    void declare_stages();
+    std::string_view stage_name(const FunStmt& system) const;
+    int stage_of(const Token& name) const;
+    void declarations(const StmtIndex* stmts, uint32_t count);
+    void declaration(StmtIndex index);
+    void fun_declaration(StmtIndex index);
+    void function_body(const FunStmt& fun, bool allow_ir);
+    // Compiles through the IR when optimizing at OPTIMIZE_SSA and the body
+    // allows it; false leaves the body to the Ast path.
+    bool compile_ir(std::string_view name, const TokenIndex* parameters, uint32_t arity,
+                    const StmtIndex* body, uint32_t count);
+    void let_declaration(const Let& let);
+    void statement(const Stmt& stmt);
+    void block_statement(const Block& block);
+    void if_statement(const If& if_stmt);
+    void print_statement(const Print& print);
+    void while_statement(const While& while_stmt);
+    void query_declaration(const QueryStmt& query);
+    void run_statement(const RunStmt& run);
+    void expression(ExprIndex index);
+    void assign_expr(const Expr& expr);
+    void compound_assign_expr(const Expr& expr);
+    void binary_expr(const Expr& expr);
+    void call_expr(const Expr& expr);
+    void command_expr(const Expr& expr);
+    void get_expr(const Expr& expr);
+    void set_expr(const Expr& expr);
+    void literal_expr(const Expr& expr);
+    void logical_expr(const Expr& expr);
+    void unary_expr(const Expr& expr);
+    void variable_expr(const Expr& expr);
     void begin_scope();
     void end_scope();
-    void new_variable(Token& name);
-    Local& resolve_variable(Token& name);
-    size_t new_function(ObjFunction func);
-    Local resolve_function(Token& name);
+    void pop_local();
+    void new_variable(const Token& name);
+    Local& resolve_variable(const Token& name);
+    size_t new_function(ObjFunction func, StmtIndex declaration);
+    int function_binding(uint32_t symbol) const;
+    Local resolve_function(const Token& name);
     void mark_initialized();
-    bool match(StmtType type);
-    void advance();
-    bool is_at_end();
+    int component_of(const Token& name) const;
+    const QueryBinding* run_binding(uint32_t symbol) const;
+    uint8_t field_slot(const Get& get);
     void emit_constant(Value value);
+    void emit_string(const Token& token);
     uint8_t make_constant(Value value);
+    uint8_t make_string(std::string_view text);
     void emit_byte(uint8_t byte);
     void emit_bytes(uint8_t byte_1, uint8_t byte_2);
+    void emit_short(uint16_t value);
     void emit_loop(int loop_start);
     int emit_jump(uint8_t instruction);
     void patch_jump(int offset);
     void emit_return();
-    void push_state(std::vector<StmtPtr> stmts);
-    void pop_state();
-    std::vector<StmtPtr>& stmts();
+    const Stmt& stmt(StmtIndex index) const { return ast.stmt(index); }
+    const Token& token(TokenIndex index) const { return ast.token(index); }
+    const FunStmt& declaration_of(int function) const { return ast.stmt(program->function_declarations[function]).fun; }
+    // Whether TypeInference proved the operands of expr numbers.
+    bool numeric(const Expr& expr) const { return !ast.numeric.empty() && ast.numeric[&expr - ast.exprs.data()]; }
     Chunk& chunk();
     std::vector<Local>& locals();
     void push_locals();
     void pop_locals();
-    StmtPtr& current();
-    StmtPtr& previous();
-    int& next();
-    void write();
+    std::ostream& error();
 
+    const Ast& ast;
+    // The Compiler holding the function declarations: this one, or the one
+    // a worker compiles bodies for.
+    const Compiler* program;
     std::vector<ObjFunction> functions;
+    // The first function declared in the tree. Those between it and the
+    // script are imported.
+    int first_declared = 1;
+    std::vector<ModuleImport> imports;
+    // The declaration of each function, for the inliner; AST_NONE for the
+    // script. Indices, as the tree may grow while it is compiled.
+    std::vector<StmtIndex> function_declarations;
     int current_function;
-
-    std::vector<CompilerState> state_stack;
+    // Functions declared so far in compile order. Calls can't see the
+    // rest yet, however early a parallel compile declared them.
+    int visible_functions;
+    // Per function, the index past the last function nested in it, or
+    // INT_MAX while that isn't known yet.
+    std::vector<int> function_ends;
+    // Per function, its outermost enclosing function, or itself.
+    std::vector<int> function_roots;
+    // The inliner's scans of function bodies, by function.
+    std::vector<IrInlineScan> inline_scans;
+    std::vector<bool> inline_scanned;
 
     std::vector<Value> constants;
     std::unordered_map<Value, uint8_t, ValueHash> constant_intern;
@@ -115,6 +263,44 @@ private:
     std::vector<std::vector<Local>> locals_stack;
     int scope_depth;
 
+    // Indexed by symbol, so every name resolves with a single lookup.
+    std::vector<LocalBinding> local_bindings;
+    std::vector<int> function_bindings;
+    std::vector<int> native_bindings;
+    std::vector<int> component_bindings;
+
+    std::vector<CompilerComponent> components;
+    // Named by the script's systems, in the order they are first named.
+    // Calling one runs its systems.
+    std::vector<std::string_view> stages;
+    // The queries in scope: those of the function being compiled start at
+    // first_query. running_query is the one the run block being compiled
+    // iterates, or -1, and run_locals the locals there were when it began,
+    // as later ones hide its bindings.
+    std::vector<CompilerQuery> queries;
+    size_t first_query = 0;
+    int running_query = -1;
+    size_t run_locals = 0;
+
     FFI ffi;
+    int optimize;
+    int debug_flags;
+    unsigned threads;
+
+    // Worker state: the operands left for link() and the nested functions
+    // skipped over, per body.
+    std::vector<CompilerFixup> fixups;
+    std::vector<NestedFunction> nested;
+    // Set by any error. A worker reports nothing unless given somewhere to:
+    // the serial compile that follows reports everything in order.
+    bool failed;
+    std::ostream diagnostics{nullptr};
+    Local unresolved;
+    // Compiling pieces typed in at the REPL.
+    bool interactive = false;
+    // The script's locals before the last piece.
+    size_t entry_locals = 0;
+    // The worker compile_functions() compiles on.
+    std::unique_ptr<Compiler> worker;
 };
 #endif
@@ -1,44 +1,84 @@
 #include <cstdint>
+#include <sstream>
 
-#include "chunk.h"
 #include "debug.h"
+#include "ecs.h"
 #include "ffi.h"
+#include "image.h"
+#include "ir.h"
 
-Debugger::Debugger(Chunk& chunk,
-        std::vector<ObjFunction>& functions,
-        FFI& ffi,
-        std::vector<Value>& constants,
-        std::string& strings)
-        : chunk(chunk), functions(functions), ffi(ffi), constants(constants), strings(strings) {}
+Debugger::Debugger(const Image& image, size_t function, FFI& ffi, const std::string& strings, const Image* names)
+        : image(image), names(names ? *names : image), code(image.code(function)), lines(image.lines(function)),
+          code_size(image.function(function).code_size), ffi(ffi), strings(strings) {}
+
+void dump_tokens(const std::vector<Token>& tokens) {
+    std::cout << "==<Tokens>==" << std::endl;
+    bool had_error = false;
+    std::ostringstream error_log;
+    for (const Token& token : tokens) {
+        std::cout << token << std::endl;
+        if (token.type == TOKEN_ERROR) {
+            had_error = true;
+            error_log << token << std::endl;
+        }
+    }
+    if (had_error) std::cerr << error_log.str();
+}
+
+void dump_ast(const Ast& ast) {
+    std::cout << "==<AST>==" << std::endl;
+    const StmtIndex* stmts = ast.list(ast.script);
+    for (uint32_t i = 0; i < ast.script_count; i++) {
+        print_stmt(std::cout, ast, stmts[i]);
+        std::cout << std::endl;
+    }
+}
+
+void dump_ir(const IrFunction& function, const Ast& ast) {
+    std::cout << "==<IR " << (function.name.empty() ? "Script" : function.name) << ">==" << std::endl;
+    print_ir(std::cout, function, ast);
+}
+
+void dump_inline(std::string_view caller, std::string_view callee, std::string_view decision) {
+    std::cout << "[inline] " << (caller.empty() ? "Script" : caller) << " <- " << callee << ": " << decision << std::endl;
+}
 
 void Debugger::disassemble_chunk(std::string name) {
     std::cout << "==<" << name << ">==" << std::endl;
 
-    for (int offset = 0; offset < chunk.code.size();) {
+    for (int offset = 0; offset < (int)code_size;) {
         offset = disassemble_instruction(offset);
     }
 }
 
 int Debugger::constant_instruction(const char* name, int offset) {
-    uint8_t constant = chunk.code[offset + 1];
+    uint8_t constant = code[offset + 1];
     printf("%-16s %4d '", name, constant);
-    print_value(constants[constant], strings, functions, ffi);
+    print_value(decode_constant(image.constants()[constant]), strings, names, ffi);
     std::cout << '\'' << std::endl;
     return offset + 2;
 }
 
 int Debugger::string_instruction(const char* name, int offset) {
-    uint8_t constant = chunk.code[offset + 1];
+    uint8_t constant = code[offset + 1];
     printf("%-16s %4d '", name, constant);
-    std::cout << &strings[constant] << '\'' << std::endl;
+    std::cout << image.strings() + constant << '\'' << std::endl;
     return offset + 2;
 }
 
 int Debugger::function_instruction(const char* name, int offset) {
-    uint8_t constant = chunk.code[offset + 1];
-    printf("%-16s %4d '", name, constant);
-    std::cout << functions[constant].name.lexeme << '\'' << std::endl;
-    return offset + 2;
+    uint16_t function = (uint16_t)(code[offset + 1] << 8) | code[offset + 2];
+    printf("%-16s %4d '", name, function);
+    if (function < names.function_count()) std::cout << names.function_name(function);
+    std::cout << '\'' << std::endl;
+    return offset + 3;
+}
+
+int Debugger::native_instruction(const char* name, int offset) {
+    uint16_t native = (uint16_t)(code[offset + 1] << 8) | code[offset + 2];
+    printf("%-16s %4d '", name, native);
+    std::cout << ffi.native_functions[native].name << '\'' << std::endl;
+    return offset + 3;
 }
 
 int Debugger::simple_instruction(const char* name, int offset) {
@@ -48,27 +88,59 @@ int Debugger::simple_instruction(const char* name, int offset) {
 
 int Debugger::byte_instruction(const char* name, int offset) {
     // No support for local variable identifier in debug
-    uint8_t slot = chunk.code[offset + 1];
+    uint8_t slot = code[offset + 1];
     printf("%-16s %4d\n", name, slot);
     return offset + 2;
 }
 
 int Debugger::jump_instruction(const char* name, int sign, int offset) {
-    uint16_t jump = (uint16_t)(chunk.code[offset + 1] << 8);
-    jump |= chunk.code[offset + 2];
+    uint16_t jump = (uint16_t)(code[offset + 1] << 8);
+    jump |= code[offset + 2];
     printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
     return offset + 3;
 }
 
+void Debugger::print_component(uint16_t component) {
+    if (component < names.component_count()) std::cout << names.component_name(component);
+    else std::cout << '?';
+}
+
+// A count, then that many components.
+int Debugger::component_instruction(const char* name, int offset) {
+    uint8_t count = code[offset + 1];
+    printf("%-16s %4d '", name, count);
+    for (int i = 0; i < count; i++) {
+        if (i > 0) std::cout << ", ";
+        print_component((uint16_t)(code[offset + 2 + 2 * i] << 8) | code[offset + 3 + 2 * i]);
+    }
+    std::cout << '\'' << std::endl;
+    return offset + 2 + 2 * count;
+}
+
+// A count, then that many terms of a kind and a component.
+int Debugger::query_instruction(const char* name, int offset) {
+    uint8_t count = code[offset + 1];
+    printf("%-16s %4d '", name, count);
+    for (int i = 0; i < count; i++) {
+        const uint8_t* term = code + offset + 2 + 3 * i;
+        if (i > 0) std::cout << ", ";
+        if (term[0] == QUERY_TERM_WITH) std::cout << "with ";
+        if (term[0] == QUERY_TERM_WITHOUT) std::cout << "without ";
+        print_component((uint16_t)(term[1] << 8) | term[2]);
+    }
+    std::cout << '\'' << std::endl;
+    return offset + 2 + 3 * count;
+}
+
 int Debugger::disassemble_instruction(int offset) {
     printf("%04d ", offset);
-    if (offset > 0 && chunk.lines[offset] == chunk.lines[offset - 1]) {
+    if (offset > 0 && lines[offset] == lines[offset - 1]) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk.lines[offset]);
+        printf("%4d ", lines[offset]);
     }
 
-    uint8_t instruction = chunk.code[offset];
+    uint8_t instruction = code[offset];
     switch (instruction) {
         case OP_CONSTANT:
             return constant_instruction("OP_CONSTANT", offset);
@@ -141,9 +213,57 @@ int Debugger::disassemble_instruction(int offset) {
         case OP_CALL:
             return function_instruction("OP_CALL", offset);
         case OP_CALL_NATIVE:
-            return byte_instruction("OP_CALL_NATIVE", offset);
+            return native_instruction("OP_CALL_NATIVE", offset);
         case OP_RETURN:
             return simple_instruction("OP_RETURN", offset);
+        case OP_ADD_NN:
+            return simple_instruction("OP_ADD_NN", offset);
+        case OP_SUBTRACT_NN:
+            return simple_instruction("OP_SUBTRACT_NN", offset);
+        case OP_MULTIPLY_NN:
+            return simple_instruction("OP_MULTIPLY_NN", offset);
+        case OP_DIVIDE_NN:
+            return simple_instruction("OP_DIVIDE_NN", offset);
+        case OP_LESS_NN:
+            return simple_instruction("OP_LESS_NN", offset);
+        case OP_LESS_EQUAL_NN:
+            return simple_instruction("OP_LESS_EQUAL_NN", offset);
+        case OP_GREATER_NN:
+            return simple_instruction("OP_GREATER_NN", offset);
+        case OP_GREATER_EQUAL_NN:
+            return simple_instruction("OP_GREATER_EQUAL_NN", offset);
+        case OP_ADD_ASSIGN_NN:
+            return byte_instruction("OP_ADD_ASSIGN_NN", offset);
+        case OP_SUBTRACT_ASSIGN_NN:
+            return byte_instruction("OP_SUBTRACT_ASSIGN_NN", offset);
+        case OP_MULTIPLY_ASSIGN_NN:
+            return byte_instruction("OP_MULTIPLY_ASSIGN_NN", offset);
+        case OP_DIVIDE_ASSIGN_NN:
+            return byte_instruction("OP_DIVIDE_ASSIGN_NN", offset);
+        case OP_QUERY_BEGIN:
+            return query_instruction("OP_QUERY_BEGIN", offset);
+        case OP_QUERY_NEXT:
+            return jump_instruction("OP_QUERY_NEXT", 1, offset);
+        case OP_QUERY_END:
+            return simple_instruction("OP_QUERY_END", offset);
+        case OP_GET_FIELD:
+            return byte_instruction("OP_GET_FIELD", offset);
+        case OP_SET_FIELD:
+            return byte_instruction("OP_SET_FIELD", offset);
+        case OP_GET_ENTITY:
+            return simple_instruction("OP_GET_ENTITY", offset);
+        case OP_SPAWN:
+            return component_instruction("OP_SPAWN", offset);
+        case OP_DESPAWN:
+            return simple_instruction("OP_DESPAWN", offset);
+        case OP_INSERT:
+            return component_instruction("OP_INSERT", offset);
+        case OP_REMOVE:
+            return component_instruction("OP_REMOVE", offset);
+        case OP_RUN_STAGE:
+            return byte_instruction("OP_RUN_STAGE", offset);
+        case OP_SUSPEND:
+            return simple_instruction("OP_SUSPEND", offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -1,36 +1,62 @@
 #ifndef MOSAIC_ECS_DEBUG_H
 #define MOSAIC_ECS_DEBUG_H
 
-#define TOKEN_DEBUG
-#define STMT_DEBUG
-#define BYTECODE_DEBUG
-#define VM_DEBUG
-
 #include <vector>
 
+#include "ast.h"
+#include "token.h"
 #include "value.h"
 
-class Chunk;
-class ObjFunction;
+// Selected at runtime from the command line. The VM loop is compiled twice,
+// once with tracing and once without, so none of this costs anything unless
+// it is asked for.
+enum DebugFlag {
+    DEBUG_NONE = 0,
+    DEBUG_TOKENS = 1 << 0,
+    DEBUG_AST = 1 << 1,
+    DEBUG_BYTECODE = 1 << 2,
+    DEBUG_VM = 1 << 3,
+    DEBUG_CACHE = 1 << 4,
+    DEBUG_IR = 1 << 5,
+    DEBUG_INLINE = 1 << 6,
+    DEBUG_LAZY = 1 << 7,
+    DEBUG_SCHEDULE = 1 << 8,
+};
+
+void dump_tokens(const std::vector<Token>& tokens);
+void dump_ast(const Ast& ast);
+void dump_ir(const struct IrFunction& function, const Ast& ast);
+void dump_inline(std::string_view caller, std::string_view callee, std::string_view decision);
+
+class Image;
 
 class Debugger {
 public:
-    Debugger(Chunk& chunk, std::vector<ObjFunction>& functions, class FFI& ffi, std::vector<Value>& constants, std::string& strings);
+    // names is the image declaring every function calls can go to, when
+    // image only holds some of them.
+    Debugger(const Image& image, size_t function, class FFI& ffi, const std::string& strings,
+             const Image* names = nullptr);
     void disassemble_chunk(std::string name);
     int disassemble_instruction(int offset);
 private:
     int constant_instruction(const char* name, int offset);
     int string_instruction(const char* name, int offset);
     int function_instruction(const char* name, int offset);
+    int native_instruction(const char* name, int offset);
     int simple_instruction(const char* name, int offset);
     int byte_instruction(const char* name, int offset);
     int jump_instruction(const char* name, int sign, int offset);
+    int component_instruction(const char* name, int offset);
+    int query_instruction(const char* name, int offset);
+    void print_component(uint16_t component);
 
-    Chunk& chunk;
-    std::vector<ObjFunction>& functions;
+    const Image& image;
+    const Image& names;
+    const uint8_t* code;
+    const int32_t* lines;
+    size_t code_size;
     FFI& ffi;
-    std::vector<Value>& constants;
-    std::string& strings;
+    const std::string& strings;
 };
 
 #endif
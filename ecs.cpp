@@ -0,0 +1,705 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "ecs.h"
+
+static size_t align_column(size_t offset) {
+    return (offset + ECS_COLUMN_ALIGNMENT - 1) & ~(size_t)(ECS_COLUMN_ALIGNMENT - 1);
+}
+
+// Bytes a chunk of capacity entities with the given columns takes.
+static size_t chunk_bytes(size_t capacity, size_t columns) {
+    return align_column(capacity * sizeof(Entity)) + columns * align_column(capacity * sizeof(Value));
+}
+
+void SparseSet::set(Entity entity, const Value* fields) {
+    uint32_t index = ENTITY_INDEX(entity);
+    if (!contains(index)) {
+        if (index >= sparse.size()) sparse.resize(index + 1, UINT32_MAX);
+        sparse[index] = dense.size();
+        dense.push_back(entity);
+        values.resize(values.size() + field_count);
+    }
+    std::copy(fields, fields + field_count, this->fields(index));
+}
+
+void SparseSet::erase(uint32_t index) {
+    uint32_t at = sparse[index];
+    uint32_t last = dense.size() - 1;
+    if (at != last) {
+        dense[at] = dense[last];
+        std::copy(values.begin() + (size_t)last * field_count, values.end(),
+                  values.begin() + (size_t)at * field_count);
+        sparse[ENTITY_INDEX(dense[at])] = at;
+    }
+    dense.pop_back();
+    values.resize(values.size() - field_count);
+    sparse[index] = UINT32_MAX;
+}
+
+void CommandBuffer::clear() {
+    commands.clear();
+    ids.clear();
+    values.clear();
+}
+
+void CommandBuffer::add(CommandKind kind, Entity entity, const uint16_t* ids, uint8_t count, const Value* values,
+                        size_t fields) {
+    commands.push_back(Command{kind, count, (uint32_t)this->ids.size(), (uint32_t)this->values.size(), entity});
+    this->ids.insert(this->ids.end(), ids, ids + count);
+    this->values.insert(this->values.end(), values, values + fields);
+}
+
+void CommandBuffer::spawn(Entity entity, const uint16_t* ids, uint8_t count, const Value* values, size_t fields) {
+    add(COMMAND_SPAWN, entity, ids, count, values, fields);
+}
+
+void CommandBuffer::despawn(Entity entity) {
+    add(COMMAND_DESPAWN, entity, nullptr, 0, nullptr, 0);
+}
+
+void CommandBuffer::insert(Entity entity, const uint16_t* ids, uint8_t count, const Value* values, size_t fields) {
+    add(COMMAND_INSERT, entity, ids, count, values, fields);
+}
+
+void CommandBuffer::remove(Entity entity, const uint16_t* ids, uint8_t count) {
+    add(COMMAND_REMOVE, entity, ids, count, nullptr, 0);
+}
+
+void ChunkQueue::deal(const std::vector<ChunkRef>& chunks, unsigned threads) {
+    shares.clear();
+    for (unsigned thread = 0; thread < threads; thread++) {
+        shares.push_back(std::make_unique<Share>());
+        size_t first = chunks.size() * thread / threads;
+        size_t last = chunks.size() * (thread + 1) / threads;
+        shares.back()->chunks.assign(chunks.begin() + first, chunks.begin() + last);
+    }
+}
+
+bool ChunkQueue::take(unsigned thread, ChunkRef& chunk) {
+    {
+        Share& own = *shares[thread];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.chunks.empty()) {
+            chunk = own.chunks.front();
+            own.chunks.pop_front();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < shares.size(); i++) {
+        Share& other = *shares[(thread + i) % shares.size()];
+        std::lock_guard<std::mutex> lock(other.mutex);
+        if (other.chunks.empty()) continue;
+        chunk = other.chunks.back();
+        other.chunks.pop_back();
+        return true;
+    }
+    return false;
+}
+
+World::World(std::vector<ComponentInfo> components) : components(std::move(components)) {
+    sparse_sets.resize(this->components.size());
+    for (size_t component = 0; component < this->components.size(); component++) {
+        sparse_sets[component].field_count = this->components[component].field_count;
+    }
+    // Entities without components live in the first archetype.
+    find_archetype({});
+}
+
+World::~World() {
+    for (Archetype& archetype : archetypes) {
+        for (uint8_t* chunk : archetype.chunks) {
+            free(chunk);
+        }
+    }
+}
+
+Entity World::spawn(const uint16_t* ids, uint8_t count, const Value* values) {
+    uint32_t archetype = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        if (!sparse(ids[i])) archetype = move_edge(archetype, ids[i], true);
+    }
+    uint32_t index;
+    if (!free_records.empty()) {
+        index = free_records.back();
+        free_records.pop_back();
+    } else {
+        index = records.size();
+        records.push_back(EntityRecord{0, 0, 0});
+    }
+    EntityRecord& record = records[index];
+    Entity entity = MAKE_ENTITY(index, record.generation);
+    record.archetype = archetype;
+    record.row = add_row(archetypes[archetype], entity);
+    write(entity, ids, count, values);
+    return entity;
+}
+
+void World::despawn(Entity entity) {
+    if (!alive(entity)) return;
+    EntityRecord& record = records[ENTITY_INDEX(entity)];
+    remove_row(record.archetype, record.row);
+    for (SparseSet& set : sparse_sets) {
+        if (set.contains(ENTITY_INDEX(entity))) set.erase(ENTITY_INDEX(entity));
+    }
+    record.generation = (record.generation + 1) & ENTITY_GENERATION_MASK;
+    free_records.push_back(ENTITY_INDEX(entity));
+}
+
+void World::insert(Entity entity, const uint16_t* ids, uint8_t count, const Value* values) {
+    uint32_t archetype = records[ENTITY_INDEX(entity)].archetype;
+    uint32_t target = archetype;
+    for (uint8_t i = 0; i < count; i++) {
+        if (!sparse(ids[i]) && !archetypes[target].has(ids[i])) target = move_edge(target, ids[i], true);
+    }
+    if (target != archetype) move_entity(entity, target);
+    write(entity, ids, count, values);
+}
+
+void World::remove(Entity entity, const uint16_t* ids, uint8_t count) {
+    uint32_t archetype = records[ENTITY_INDEX(entity)].archetype;
+    uint32_t target = archetype;
+    for (uint8_t i = 0; i < count; i++) {
+        if (sparse(ids[i])) {
+            SparseSet& set = sparse_sets[ids[i]];
+            if (set.contains(ENTITY_INDEX(entity))) set.erase(ENTITY_INDEX(entity));
+        } else if (archetypes[target].has(ids[i])) {
+            target = move_edge(target, ids[i], false);
+        }
+    }
+    if (target != archetype) move_entity(entity, target);
+}
+
+bool World::alive(Entity entity) const {
+    uint32_t index = ENTITY_INDEX(entity);
+    if (index >= records.size()) return index < records.size() + reserved && ENTITY_GENERATION(entity) == 0;
+    return records[index].generation == ENTITY_GENERATION(entity);
+}
+
+// A freed record's generation was already moved on when it was freed, so
+// the id is new either way.
+Entity World::reserve() {
+    std::lock_guard<std::mutex> lock(reserve_mutex);
+    if (free_records.empty()) return MAKE_ENTITY(records.size() + reserved++, 0);
+    uint32_t index = free_records.back();
+    free_records.pop_back();
+    return MAKE_ENTITY(index, records[index].generation);
+}
+
+void World::apply(const std::vector<CommandBuffer*>& buffers) {
+    records.resize(records.size() + reserved, EntityRecord{0, 0, 0});
+    reserved = 0;
+
+    // Where each entity the commands name ends up.
+    struct Fate {
+        Entity entity;
+        uint32_t from;
+        uint32_t to;
+        bool spawned;
+        bool despawned;
+    };
+    std::vector<Fate> fates;
+    size_t commands = 0;
+    for (CommandBuffer* buffer : buffers) commands += buffer->commands.size();
+    fates.reserve(commands);
+    fate_of.resize(records.size(), UINT32_MAX);
+    // A block's commands mostly make the same change from the same
+    // archetype, so the last edge taken is kept at hand.
+    uint32_t edge_from = UINT32_MAX, edge_to = 0;
+    uint16_t edge_component = 0;
+    bool edge_add = false;
+    for (CommandBuffer* buffer : buffers) {
+        for (const CommandBuffer::Command& command : buffer->commands) {
+            uint32_t index = ENTITY_INDEX(command.entity);
+            if (fate_of[index] == UINT32_MAX) {
+                // A despawn may name an entity long gone.
+                if (!alive(command.entity)) continue;
+                bool spawned = command.kind == COMMAND_SPAWN;
+                uint32_t at = spawned ? 0 : records[index].archetype;
+                fate_of[index] = fates.size();
+                fates.push_back(Fate{command.entity, at, at, spawned, false});
+            }
+            Fate& fate = fates[fate_of[index]];
+            if (fate.entity != command.entity || fate.despawned) continue;
+            const uint16_t* ids = buffer->ids.data() + command.ids;
+            for (uint8_t i = 0; i < command.count; i++) {
+                if (sparse(ids[i])) continue;
+                bool add = command.kind != COMMAND_REMOVE;
+                if (archetypes[fate.to].has(ids[i]) == add) continue;
+                if (fate.to != edge_from || ids[i] != edge_component || add != edge_add) {
+                    edge_from = fate.to, edge_component = ids[i], edge_add = add;
+                    edge_to = move_edge(fate.to, ids[i], add);
+                }
+                fate.to = edge_to;
+            }
+            if (command.kind == COMMAND_DESPAWN) fate.despawned = true;
+        }
+    }
+
+    // Despawns, from the end of each archetype back, so the rows still to
+    // go never move.
+    std::vector<std::pair<uint32_t, size_t>> gone;
+    for (Fate& fate : fates) {
+        if (!fate.despawned) continue;
+        EntityRecord& record = records[ENTITY_INDEX(fate.entity)];
+        if (!fate.spawned) {
+            gone.emplace_back(record.archetype, record.row);
+            for (SparseSet& set : sparse_sets) {
+                if (set.contains(ENTITY_INDEX(fate.entity))) set.erase(ENTITY_INDEX(fate.entity));
+            }
+        }
+        record.generation = (record.generation + 1) & ENTITY_GENERATION_MASK;
+        free_records.push_back(ENTITY_INDEX(fate.entity));
+    }
+    std::sort(gone.begin(), gone.end(), [](const auto& a, const auto& b) {
+        return a.first != b.first ? a.first < b.first : a.second > b.second;
+    });
+    for (const auto& [archetype, row] : gone) remove_row(archetype, row);
+
+    // Moves, a pair of archetypes at a time. Every entity leaving an
+    // archetype is copied out before any of their rows are filled.
+    struct Move {
+        uint32_t from;
+        uint32_t to;
+        size_t row;
+        uint32_t index;
+    };
+    std::vector<Move> moving;
+    moving.reserve(fates.size());
+    for (Fate& fate : fates) {
+        if (fate.despawned || fate.spawned || fate.to == fate.from) continue;
+        uint32_t index = ENTITY_INDEX(fate.entity);
+        moving.push_back(Move{fate.from, fate.to, records[index].row, index});
+    }
+    auto before = [](const Move& a, const Move& b) {
+        if (a.from != b.from) return a.from < b.from;
+        if (a.to != b.to) return a.to < b.to;
+        return a.row < b.row;
+    };
+    // Commands made walking a query come in that order already.
+    if (!std::is_sorted(moving.begin(), moving.end(), before)) std::sort(moving.begin(), moving.end(), before);
+    std::vector<size_t> rows, left;
+    for (size_t source = 0; source < moving.size();) {
+        uint32_t from = moving[source].from;
+        left.clear();
+        size_t end = source;
+        while (end < moving.size() && moving[end].from == from) {
+            uint32_t to = moving[end].to;
+            rows.clear();
+            size_t group = end;
+            for (; end < moving.size() && moving[end].from == from && moving[end].to == to; end++) {
+                rows.push_back(moving[end].row);
+            }
+            size_t first = add_rows(archetypes[to], rows.size());
+            copy_rows(from, to, rows, first);
+            for (size_t i = 0; i < rows.size(); i++) {
+                EntityRecord& record = records[moving[group + i].index];
+                record.archetype = to;
+                record.row = first + i;
+            }
+            left.insert(left.end(), rows.begin(), rows.end());
+        }
+        std::sort(left.begin(), left.end(), std::greater<size_t>());
+        for (size_t row : left) remove_row(from, row);
+        source = end;
+    }
+
+    // Spawns, an archetype at a time.
+    std::vector<Fate*> spawning;
+    for (Fate& fate : fates) {
+        if (fate.spawned && !fate.despawned) spawning.push_back(&fate);
+    }
+    std::stable_sort(spawning.begin(), spawning.end(), [](const Fate* a, const Fate* b) { return a->to < b->to; });
+    for (size_t i = 0; i < spawning.size();) {
+        Archetype& archetype = archetypes[spawning[i]->to];
+        size_t end = i;
+        while (end < spawning.size() && spawning[end]->to == spawning[i]->to) end++;
+        size_t first = add_rows(archetype, end - i);
+        for (size_t k = i; k < end; k++) {
+            size_t row = first + (k - i);
+            archetype.entities(row / archetype.capacity)[row % archetype.capacity] = spawning[k]->entity;
+            EntityRecord& record = records[ENTITY_INDEX(spawning[k]->entity)];
+            record.archetype = spawning[k]->to;
+            record.row = row;
+        }
+        i = end;
+    }
+
+    // Every entity is where it ends up; the fields go in last, in order.
+    for (CommandBuffer* buffer : buffers) {
+        for (const CommandBuffer::Command& command : buffer->commands) {
+            uint32_t fate = fate_of[ENTITY_INDEX(command.entity)];
+            if (fate == UINT32_MAX || fates[fate].entity != command.entity || fates[fate].despawned) continue;
+            replay(command, *buffer);
+        }
+        buffer->clear();
+    }
+    for (const Fate& fate : fates) {
+        fate_of[ENTITY_INDEX(fate.entity)] = UINT32_MAX;
+    }
+}
+
+// A command's fields, on the entity where it ended up: those of components
+// a later command removed are dropped.
+void World::replay(const CommandBuffer::Command& command, const CommandBuffer& buffer) {
+    const EntityRecord& record = records[ENTITY_INDEX(command.entity)];
+    const Archetype& archetype = archetypes[record.archetype];
+    size_t chunk = record.row / archetype.capacity, at = record.row % archetype.capacity;
+    const uint16_t* ids = buffer.ids.data() + command.ids;
+    const Value* values = buffer.values.data() + command.values;
+    for (uint8_t i = 0; i < command.count; i++) {
+        uint16_t id = ids[i];
+        if (command.kind == COMMAND_REMOVE) {
+            SparseSet& set = sparse_sets[id];
+            if (sparse(id) && set.contains(ENTITY_INDEX(command.entity))) set.erase(ENTITY_INDEX(command.entity));
+            continue;
+        }
+        if (sparse(id)) sparse_sets[id].set(command.entity, values);
+        else if (archetype.has(id)) {
+            int first = archetype.component_columns[id];
+            for (uint32_t field = 0; field < components[id].field_count; field++) {
+                archetype.column(chunk, first + field)[at] = values[field];
+            }
+        }
+        values += components[id].field_count;
+    }
+}
+
+void World::begin(QueryCursor& cursor, const uint8_t* terms, uint8_t term_count, size_t frame) {
+    cursor.query = find_query(terms, term_count);
+    cursor.frame = frame;
+    cursor.match = 0;
+    cursor.archetype = 0;
+    cursor.chunk = 0;
+    cursor.row = cursor.next = cursor.rows = 0;
+    cursor.driver = -1;
+    cursor.position = 0;
+    cursor.chunk_rows = 0;
+    cursor.split = nullptr;
+    const Query& query = queries[cursor.query];
+    cursor.joined = !query.sparse_required.empty() || !query.sparse_excluded.empty();
+    size_t smallest = SIZE_MAX;
+    for (uint16_t component : query.sparse_required) {
+        if (sparse_sets[component].dense.size() < smallest) {
+            smallest = sparse_sets[component].dense.size();
+            cursor.driver = component;
+        }
+    }
+    if (cursor.joined && matching_entities(query) <= smallest) cursor.driver = -1;
+    cursor.columns.resize(query.slots.size());
+}
+
+bool World::advance(QueryCursor& cursor) {
+    return cursor.joined ? next_joined(cursor) : next_chunk(cursor);
+}
+
+std::vector<ChunkRef> World::chunks(const QueryCursor& cursor) const {
+    const Query& query = queries[cursor.query];
+    std::vector<ChunkRef> chunks;
+    for (uint32_t match = 0; match < query.archetypes.size(); match++) {
+        const Archetype& archetype = archetypes[query.archetypes[match]];
+        for (uint32_t chunk = 0; archetype.rows(chunk) != 0; chunk++) chunks.push_back(ChunkRef{match, chunk});
+    }
+    return chunks;
+}
+
+bool World::next_chunk(QueryCursor& cursor) const {
+    if (cursor.split) {
+        ChunkRef chunk;
+        if (!cursor.split->take(cursor.thread, chunk)) return false;
+        enter_chunk(cursor, chunk.match, chunk.chunk);
+        return true;
+    }
+    const Query& query = queries[cursor.query];
+    for (; cursor.match < query.archetypes.size(); cursor.match++, cursor.chunk = 0) {
+        if (archetypes[query.archetypes[cursor.match]].rows(cursor.chunk) == 0) continue;
+        enter_chunk(cursor, cursor.match, cursor.chunk++);
+        return true;
+    }
+    return false;
+}
+
+void World::enter_chunk(QueryCursor& cursor, size_t match, size_t chunk) const {
+    const Query& query = queries[cursor.query];
+    const Archetype& archetype = archetypes[query.archetypes[match]];
+    cursor.archetype = query.archetypes[match];
+    cursor.entities = archetype.entities(chunk);
+    cursor.row = 0;
+    cursor.next = 1;
+    cursor.rows = archetype.rows(chunk);
+    const std::vector<int>& columns = query.columns[match];
+    for (size_t slot = 0; slot < columns.size(); slot++) {
+        // A join points a sparse component's an entity at a time.
+        if (columns[slot] != -1) cursor.columns[slot] = archetype.column(chunk, columns[slot]);
+    }
+}
+
+bool World::next_joined(QueryCursor& cursor) {
+    if (cursor.driver != -1) {
+        const SparseSet& set = sparse_sets[cursor.driver];
+        while (cursor.position < set.dense.size()) {
+            const Entity* entity = &set.dense[cursor.position++];
+            if (!join(cursor, *entity)) continue;
+            cursor.entities = entity;
+            return true;
+        }
+        return false;
+    }
+    while (true) {
+        while (cursor.position < cursor.chunk_rows) {
+            const Entity* entity = archetypes[cursor.archetype].entities(cursor.chunk - 1) + cursor.position++;
+            if (!join(cursor, *entity)) continue;
+            cursor.entities = entity;
+            return true;
+        }
+        if (!next_chunk(cursor)) return false;
+        cursor.chunk_rows = cursor.rows;
+        cursor.position = 0;
+        cursor.next = cursor.rows = 0;
+    }
+}
+
+// Whether entity matches the cursor's query, and if so points its columns
+// at the entity's fields.
+bool World::join(QueryCursor& cursor, Entity entity) {
+    uint32_t index = ENTITY_INDEX(entity);
+    const Query& query = queries[cursor.query];
+    for (uint16_t component : query.sparse_required) {
+        if (!sparse_sets[component].contains(index)) return false;
+    }
+    for (uint16_t component : query.sparse_excluded) {
+        if (sparse_sets[component].contains(index)) return false;
+    }
+    const EntityRecord& record = records[index];
+    const Archetype& archetype = archetypes[record.archetype];
+    if (cursor.driver != -1 && !matches(archetype, query)) return false;
+
+    size_t chunk = record.row / archetype.capacity, at = record.row % archetype.capacity;
+    for (size_t slot = 0; slot < query.slots.size(); slot++) {
+        const Query::Slot& read = query.slots[slot];
+        if (sparse(read.component)) {
+            cursor.columns[slot] = sparse_sets[read.component].fields(index) + read.field;
+        } else {
+            int column = archetype.component_columns[read.component] + read.field;
+            cursor.columns[slot] = archetype.column(chunk, column) + at;
+        }
+    }
+    cursor.row = 0;
+    return true;
+}
+
+// The query with the given terms, compiled and matched against every
+// archetype if it is new.
+uint32_t World::find_query(const uint8_t* terms, uint8_t term_count) {
+    auto found = query_index.find(std::string_view((const char*)terms, 3 * term_count));
+    if (found != query_index.end()) return found->second;
+
+    Query query;
+    query.terms.assign(terms, terms + 3 * term_count);
+    query.required.assign((components.size() + 63) / 64, 0);
+    query.excluded.assign(query.required.size(), 0);
+    for (uint8_t i = 0; i < term_count; i++) {
+        const uint8_t* term = terms + 3 * i;
+        uint16_t component = (uint16_t)(term[1] << 8) | term[2];
+        if (term[0] == QUERY_TERM_BIND) {
+            for (uint32_t field = 0; field < components[component].field_count; field++) {
+                query.slots.push_back(Query::Slot{component, field});
+            }
+        }
+        bool excluded = term[0] == QUERY_TERM_WITHOUT;
+        if (sparse(component)) {
+            (excluded ? query.sparse_excluded : query.sparse_required).push_back(component);
+        } else {
+            (excluded ? query.excluded : query.required)[component / 64] |= (uint64_t)1 << (component % 64);
+        }
+    }
+    for (uint32_t archetype = 0; archetype < archetypes.size(); archetype++) {
+        if (matches(archetypes[archetype], query)) add_match(query, archetype);
+    }
+    queries.push_back(std::move(query));
+    const std::vector<uint8_t>& key = queries.back().terms;
+    query_index.emplace(std::string_view((const char*)key.data(), key.size()), queries.size() - 1);
+    return queries.size() - 1;
+}
+
+void World::add_match(Query& query, uint32_t archetype) {
+    std::vector<int> columns;
+    for (const Query::Slot& read : query.slots) {
+        int first = archetypes[archetype].component_columns[read.component];
+        columns.push_back(sparse(read.component) ? -1 : first + (int)read.field);
+    }
+    query.archetypes.push_back(archetype);
+    query.columns.push_back(std::move(columns));
+}
+
+uint32_t World::find_archetype(std::vector<uint16_t> sorted) {
+    auto found = archetype_index.find(sorted);
+    if (found != archetype_index.end()) return found->second;
+
+    Archetype archetype;
+    archetype.component_columns.assign(components.size(), -1);
+    archetype.mask.assign((components.size() + 63) / 64, 0);
+    size_t columns = 0;
+    for (uint16_t component : sorted) {
+        archetype.component_columns[component] = columns;
+        archetype.mask[component / 64] |= (uint64_t)1 << (component % 64);
+        columns += components[component].field_count;
+    }
+    // As many entities as fit the chunk, or one to a chunk of its own size
+    // for components too wide to share.
+    size_t capacity = ECS_CHUNK_SIZE / (sizeof(Entity) + columns * sizeof(Value));
+    while (capacity > 1 && chunk_bytes(capacity, columns) > ECS_CHUNK_SIZE) capacity--;
+    if (capacity == 0) capacity = 1;
+    archetype.capacity = capacity;
+    archetype.chunk_size = std::max<size_t>(ECS_CHUNK_SIZE, chunk_bytes(capacity, columns));
+    for (size_t column = 0; column < columns; column++) {
+        archetype.column_offsets.push_back(align_column(capacity * sizeof(Entity)) +
+                                           column * align_column(capacity * sizeof(Value)));
+    }
+    archetype.components = sorted;
+    archetypes.push_back(std::move(archetype));
+    archetype_index.emplace(std::move(sorted), archetypes.size() - 1);
+    for (Query& query : queries) {
+        if (matches(archetypes.back(), query)) add_match(query, archetypes.size() - 1);
+    }
+    return archetypes.size() - 1;
+}
+
+// The archetype an entity in from moves to when component is added or
+// removed, remembered on from for next time.
+uint32_t World::move_edge(uint32_t from, uint16_t component, bool add) {
+    auto& edges = add ? archetypes[from].add_edges : archetypes[from].remove_edges;
+    auto found = edges.find(component);
+    if (found != edges.end()) return found->second;
+
+    std::vector<uint16_t> sorted = archetypes[from].components;
+    auto at = std::lower_bound(sorted.begin(), sorted.end(), component);
+    if (add) sorted.insert(at, component);
+    else sorted.erase(at);
+    uint32_t to = find_archetype(std::move(sorted));
+    // find_archetype may have moved the archetypes.
+    (add ? archetypes[from].add_edges : archetypes[from].remove_edges)[component] = to;
+    return to;
+}
+
+// A row at the end for entity, its fields left for the caller to write.
+size_t World::add_row(Archetype& archetype, Entity entity) {
+    if (archetype.count == archetype.chunks.size() * archetype.capacity) {
+        archetype.chunks.push_back((uint8_t*)aligned_alloc(ECS_COLUMN_ALIGNMENT, archetype.chunk_size));
+    }
+    size_t row = archetype.count++;
+    archetype.entities(row / archetype.capacity)[row % archetype.capacity] = entity;
+    return row;
+}
+
+// count rows at the end, their entities and fields left for the caller.
+size_t World::add_rows(Archetype& archetype, size_t count) {
+    size_t first = archetype.count;
+    archetype.count += count;
+    while (archetype.count > archetype.chunks.size() * archetype.capacity) {
+        archetype.chunks.push_back((uint8_t*)aligned_alloc(ECS_COLUMN_ALIGNMENT, archetype.chunk_size));
+    }
+    return first;
+}
+
+// Copies the entities in rows of from, in ascending order, to the rows of
+// to from first on, with the fields both archetypes have. Rows next to
+// each other in both go in one copy per column.
+void World::copy_rows(uint32_t from, uint32_t to, const std::vector<size_t>& rows, size_t first) {
+    const Archetype& source = archetypes[from];
+    const Archetype& target = archetypes[to];
+    std::vector<std::pair<uint32_t, uint32_t>> columns;
+    for (uint16_t component : source.components) {
+        if (!target.has(component)) continue;
+        int from_column = source.component_columns[component];
+        int to_column = target.component_columns[component];
+        for (uint32_t field = 0; field < components[component].field_count; field++) {
+            columns.emplace_back(from_column + field, to_column + field);
+        }
+    }
+    for (size_t i = 0; i < rows.size();) {
+        size_t from_chunk = rows[i] / source.capacity, from_at = rows[i] % source.capacity;
+        size_t to_chunk = (first + i) / target.capacity, to_at = (first + i) % target.capacity;
+        size_t length = 1;
+        while (i + length < rows.size() && rows[i + length] == rows[i] + length &&
+               from_at + length < source.capacity && to_at + length < target.capacity) {
+            length++;
+        }
+        memcpy(target.entities(to_chunk) + to_at, source.entities(from_chunk) + from_at, length * sizeof(Entity));
+        for (const auto& [source_column, target_column] : columns) {
+            memcpy(target.column(to_chunk, target_column) + to_at, source.column(from_chunk, source_column) + from_at,
+                   length * sizeof(Value));
+        }
+        i += length;
+    }
+}
+
+// Fills the row with the archetype's last entity.
+void World::remove_row(uint32_t index, size_t row) {
+    Archetype& archetype = archetypes[index];
+    size_t last = --archetype.count;
+    if (row == last) return;
+    size_t chunk = row / archetype.capacity, at = row % archetype.capacity;
+    size_t last_chunk = last / archetype.capacity, last_at = last % archetype.capacity;
+    Entity moved = archetype.entities(last_chunk)[last_at];
+    archetype.entities(chunk)[at] = moved;
+    for (size_t column = 0; column < archetype.column_offsets.size(); column++) {
+        archetype.column(chunk, column)[at] = archetype.column(last_chunk, column)[last_at];
+    }
+    records[ENTITY_INDEX(moved)].row = row;
+}
+
+// Copies the fields both archetypes have; the rest are the caller's.
+void World::move_entity(Entity entity, uint32_t to) {
+    EntityRecord& record = records[ENTITY_INDEX(entity)];
+    Archetype& source = archetypes[record.archetype];
+    Archetype& target = archetypes[to];
+    size_t row = add_row(target, entity);
+    size_t from_chunk = record.row / source.capacity, from_at = record.row % source.capacity;
+    size_t to_chunk = row / target.capacity, to_at = row % target.capacity;
+    for (uint16_t component : source.components) {
+        if (!target.has(component)) continue;
+        int from_column = source.component_columns[component];
+        int to_column = target.component_columns[component];
+        for (uint32_t field = 0; field < components[component].field_count; field++) {
+            target.column(to_chunk, to_column + field)[to_at] = source.column(from_chunk, from_column + field)[from_at];
+        }
+    }
+    remove_row(record.archetype, record.row);
+    record.archetype = to;
+    record.row = row;
+}
+
+void World::write(Entity entity, const uint16_t* ids, uint8_t count, const Value* values) {
+    const EntityRecord& record = records[ENTITY_INDEX(entity)];
+    const Archetype& archetype = archetypes[record.archetype];
+    size_t chunk = record.row / archetype.capacity, at = record.row % archetype.capacity;
+    for (uint8_t i = 0; i < count; i++) {
+        if (sparse(ids[i])) {
+            sparse_sets[ids[i]].set(entity, values);
+            values += components[ids[i]].field_count;
+            continue;
+        }
+        int first = archetype.component_columns[ids[i]];
+        for (uint32_t field = 0; field < components[ids[i]].field_count; field++) {
+            archetype.column(chunk, first + field)[at] = *values++;
+        }
+    }
+}
+
+// Sparse components are left to the join.
+bool World::matches(const Archetype& archetype, const Query& query) const {
+    for (size_t word = 0; word < archetype.mask.size(); word++) {
+        if ((archetype.mask[word] & query.required[word]) != query.required[word]) return false;
+        if (archetype.mask[word] & query.excluded[word]) return false;
+    }
+    return true;
+}
+
+size_t World::matching_entities(const Query& query) const {
+    size_t count = 0;
+    for (uint32_t archetype : query.archetypes) {
+        count += archetypes[archetype].count;
+    }
+    return count;
+}
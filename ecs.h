@@ -0,0 +1,330 @@
+#ifndef MOSAIC_ECS_ECS_H
+#define MOSAIC_ECS_ECS_H
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "value.h"
+
+// Entities and their components, stored by archetype: every entity with
+// exactly the same set of components lives in the same archetype, in
+// chunks of ECS_CHUNK_SIZE bytes. A chunk holds its entities' ids, then
+// one column per component field, each a contiguous run of Values (a
+// structure of arrays), so a run block walks memory front to back.
+// Archetypes are kept dense: removing an entity moves the last one into
+// its row.
+//
+// A component declared `comp Name: sparse` lives in a sparse set of its
+// own instead, so adding and removing it every frame doesn't move the
+// entity between archetypes. Queries join the two.
+//
+// A query is compiled once, the first time it runs, into signatures: a
+// bit per component it requires and a bit per component it excludes. It
+// keeps the archetypes that match them, and every archetype created after
+// is checked against it once, so running it only walks matching chunks.
+//
+// Spawning, despawning, inserting and removing from a run block would move
+// entities under the query walking them, so there they go into a command
+// buffer instead, and the world applies them all once the block ends: the
+// moves sorted so each pair of archetypes copies its rows in runs.
+#define ECS_CHUNK_SIZE (16 * 1024)
+// Columns start on a cache line.
+#define ECS_COLUMN_ALIGNMENT 64
+
+// An entity is its index in the world's records and the generation of
+// that record, so an id outlives the entity without ever naming another.
+// Scripts see it as a number, which holds 53 bits exactly.
+typedef uint64_t Entity;
+#define ENTITY_INDEX(entity) ((uint32_t)(entity))
+#define ENTITY_GENERATION(entity) ((uint32_t)((entity) >> 32))
+#define ENTITY_GENERATION_MASK 0x1fffff
+#define MAKE_ENTITY(index, generation) (((Entity)(generation) << 32) | (index))
+
+// Fields are copied between chunks as raw bytes.
+static_assert(std::is_trivially_copyable_v<Value>);
+
+enum ComponentFlags {
+    COMPONENT_SPARSE = 1 << 0,
+};
+
+struct ComponentInfo {
+    std::string name;
+    uint32_t field_count;
+    uint32_t flags;
+};
+
+enum QueryTermKind : uint8_t {
+    // The entity must have the component, and the run block reads it.
+    QUERY_TERM_BIND,
+    // The entity must have the component; `with Component`.
+    QUERY_TERM_WITH,
+    // The entity must not have the component; `without Component`.
+    QUERY_TERM_WITHOUT,
+};
+
+// A bit per component id.
+typedef std::vector<uint64_t> ComponentMask;
+
+struct Archetype {
+    // Sorted.
+    std::vector<uint16_t> components;
+    ComponentMask mask;
+    // By component id, the component's first column, or -1.
+    std::vector<int> component_columns;
+    // Byte offset of each column in a chunk. The entity ids come first.
+    std::vector<uint32_t> column_offsets;
+    // Entities a chunk holds.
+    uint32_t capacity;
+    uint32_t chunk_size;
+    std::vector<uint8_t*> chunks;
+    // Entities in the archetype; every chunk but the last is full.
+    size_t count = 0;
+    // Where adding or removing a component leads, as found so far.
+    std::unordered_map<uint16_t, uint32_t> add_edges;
+    std::unordered_map<uint16_t, uint32_t> remove_edges;
+
+    bool has(uint16_t component) const { return component_columns[component] != -1; }
+    Entity* entities(size_t chunk) const { return (Entity*)chunks[chunk]; }
+    Value* column(size_t chunk, size_t column) const { return (Value*)(chunks[chunk] + column_offsets[column]); }
+    // Entities in the given chunk.
+    uint32_t rows(size_t chunk) const {
+        size_t first = chunk * capacity;
+        return first >= count ? 0 : (uint32_t)std::min<size_t>(capacity, count - first);
+    }
+};
+
+// A sparse component's values: dense arrays of the entities that have it
+// and their fields, and where each entity is in them, by entity index.
+struct SparseSet {
+    uint32_t field_count = 0;
+    std::vector<uint32_t> sparse;
+    std::vector<Entity> dense;
+    // field_count per entity, in the order of dense.
+    std::vector<Value> values;
+
+    bool contains(uint32_t index) const { return index < sparse.size() && sparse[index] != UINT32_MAX; }
+    Value* fields(uint32_t index) { return values.data() + (size_t)sparse[index] * field_count; }
+    // Adds the entity, or overwrites its fields.
+    void set(Entity entity, const Value* fields);
+    // Moves the last entity into the removed one's place.
+    void erase(uint32_t index);
+};
+
+// A query's terms, compiled. The masks only name table components; the
+// sparse ones are checked an entity at a time.
+struct Query {
+    // As OP_QUERY_BEGIN has them.
+    std::vector<uint8_t> terms;
+    ComponentMask required;
+    ComponentMask excluded;
+    std::vector<uint16_t> sparse_required;
+    std::vector<uint16_t> sparse_excluded;
+    // The fields bound terms read, in order: a table component's as
+    // columns of the archetype, a sparse one's as itself.
+    struct Slot {
+        uint16_t component;
+        uint32_t field;
+    };
+    std::vector<Slot> slots;
+    // Matching archetypes, in the order they were created, and by each
+    // the column of every slot, or -1 for a sparse component's.
+    std::vector<uint32_t> archetypes;
+    std::vector<std::vector<int>> columns;
+};
+
+// Where an entity is: its archetype and its row there, counted across
+// chunks.
+struct EntityRecord {
+    uint32_t archetype;
+    uint32_t generation;
+    size_t row;
+};
+
+enum CommandKind : uint8_t {
+    COMMAND_SPAWN,
+    COMMAND_DESPAWN,
+    COMMAND_INSERT,
+    COMMAND_REMOVE,
+};
+
+// The structural changes a run block makes, kept until it ends: making
+// them as they come would move rows out from under it. Each thread records
+// into a buffer of its own, and the world applies them all at once.
+class CommandBuffer {
+public:
+    bool empty() const { return commands.empty(); }
+    void clear();
+    // values holds fields values, as for the World's.
+    void spawn(Entity entity, const uint16_t* ids, uint8_t count, const Value* values, size_t fields);
+    void despawn(Entity entity);
+    void insert(Entity entity, const uint16_t* ids, uint8_t count, const Value* values, size_t fields);
+    void remove(Entity entity, const uint16_t* ids, uint8_t count);
+private:
+    friend class World;
+    struct Command {
+        CommandKind kind;
+        uint8_t count;
+        // Into ids and values.
+        uint32_t ids;
+        uint32_t values;
+        Entity entity;
+    };
+    void add(CommandKind kind, Entity entity, const uint16_t* ids, uint8_t count, const Value* values, size_t fields);
+
+    std::vector<Command> commands;
+    std::vector<uint16_t> ids;
+    std::vector<Value> values;
+};
+
+// A chunk a query matches: the query's archetype it is in, and its index
+// there.
+struct ChunkRef {
+    uint32_t match;
+    uint32_t chunk;
+};
+
+// The chunks of a run block split across threads. Each thread gets a run
+// of neighbouring chunks, takes them from the front and, once it runs out,
+// steals from the back of another's, so no thread waits long on one that
+// drew the fuller chunks.
+class ChunkQueue {
+public:
+    void deal(const std::vector<ChunkRef>& chunks, unsigned threads);
+    bool take(unsigned thread, ChunkRef& chunk);
+private:
+    struct Share {
+        std::mutex mutex;
+        std::deque<ChunkRef> chunks;
+    };
+    std::vector<std::unique_ptr<Share>> shares;
+};
+
+// A run block's place in a query: the next of the query's archetypes, the
+// archetype it is in and its chunk after the one it is in, and the columns
+// the block's fields read, one per slot. The block reads row of each, and
+// the rows up to rows are the chunk's.
+//
+// A query with sparse components is joined an entity at a time instead,
+// driven by whichever side has fewer entities: its archetypes' chunks, or
+// its smallest sparse set. Each entity's fields are then found on their
+// own, so row is always 0 and rows too.
+struct QueryCursor {
+    uint32_t query;
+    // The call frame running the block.
+    size_t frame;
+    size_t match = 0;
+    uint32_t archetype = 0;
+    size_t chunk = 0;
+    uint32_t row = 0;
+    uint32_t next = 0;
+    uint32_t rows = 0;
+    const Entity* entities = nullptr;
+    std::vector<Value*> columns;
+    bool joined = false;
+    // The sparse component a join walks, or -1 for the archetypes, and
+    // its place there: the next of the set's entities, or the next row of
+    // the chunk before chunk, which has chunk_rows.
+    int driver = -1;
+    size_t position = 0;
+    uint32_t chunk_rows = 0;
+    // A thread's part of a split run block takes its chunks from there
+    // instead.
+    ChunkQueue* split = nullptr;
+    unsigned thread = 0;
+};
+
+class World {
+public:
+    World() = default;
+    explicit World(std::vector<ComponentInfo> components);
+    World(const World&) = delete;
+    World& operator=(const World&) = delete;
+    ~World();
+
+    size_t component_count() const { return components.size(); }
+    const ComponentInfo& component(uint16_t id) const { return components[id]; }
+
+    // values holds each component's fields in turn, in the order given.
+    // No component may be named twice.
+    Entity spawn(const uint16_t* ids, uint8_t count, const Value* values);
+    // Nothing if the entity is already gone.
+    void despawn(Entity entity);
+    // Components the entity has are overwritten.
+    void insert(Entity entity, const uint16_t* ids, uint8_t count, const Value* values);
+    // Components the entity hasn't are skipped.
+    void remove(Entity entity, const uint16_t* ids, uint8_t count);
+    // Counts the entities reserve() has handed out.
+    bool alive(Entity entity) const;
+
+    // An id for an entity a command buffer will spawn. Safe to call from
+    // several threads at once, while nothing else changes the world.
+    Entity reserve();
+    // Applies the buffers' commands, in order, and empties them. The
+    // changes are batched: each entity's commands are followed through the
+    // archetype graph to where it ends up, and the entities moving between
+    // the same two archetypes go together, a run of rows per copy.
+    // Commands after an entity's despawn are dropped.
+    void apply(const std::vector<CommandBuffer*>& buffers);
+
+    // Starts cursor on a query's terms: a kind and a big-endian component
+    // per term. The query is compiled the first time its terms are seen.
+    void begin(QueryCursor& cursor, const uint8_t* terms, uint8_t term_count, size_t frame);
+    // Compiles a query ahead of its first run, so run blocks running at
+    // once on several threads only ever look it up.
+    void prepare(const uint8_t* terms, uint8_t term_count) { find_query(terms, term_count); }
+    // Moves cursor to its next chunk with entities in it, or for a join
+    // its next entity, and points its columns there. False once there are
+    // none.
+    bool advance(QueryCursor& cursor);
+    // The chunks with entities in them a cursor's query matches, for
+    // splitting its run block. Not for a join.
+    std::vector<ChunkRef> chunks(const QueryCursor& cursor) const;
+private:
+    bool sparse(uint16_t component) const { return components[component].flags & COMPONENT_SPARSE; }
+    uint32_t find_query(const uint8_t* terms, uint8_t term_count);
+    void add_match(Query& query, uint32_t archetype);
+    bool next_chunk(QueryCursor& cursor) const;
+    void enter_chunk(QueryCursor& cursor, size_t match, size_t chunk) const;
+    bool next_joined(QueryCursor& cursor);
+    bool join(QueryCursor& cursor, Entity entity);
+    uint32_t find_archetype(std::vector<uint16_t> components);
+    uint32_t move_edge(uint32_t from, uint16_t component, bool add);
+    size_t add_row(Archetype& archetype, Entity entity);
+    size_t add_rows(Archetype& archetype, size_t count);
+    void remove_row(uint32_t archetype, size_t row);
+    void move_entity(Entity entity, uint32_t to);
+    void write(Entity entity, const uint16_t* ids, uint8_t count, const Value* values);
+    void copy_rows(uint32_t from, uint32_t to, const std::vector<size_t>& rows, size_t first);
+    void replay(const CommandBuffer::Command& command, const CommandBuffer& buffer);
+    bool matches(const Archetype& archetype, const Query& query) const;
+    size_t matching_entities(const Query& query) const;
+
+    std::vector<ComponentInfo> components;
+    std::vector<Archetype> archetypes;
+    std::map<std::vector<uint16_t>, uint32_t> archetype_index;
+    std::vector<EntityRecord> records;
+    std::vector<uint32_t> free_records;
+    // Handed out past the end of records since the last apply().
+    std::atomic<uint32_t> reserved{0};
+    std::mutex reserve_mutex;
+    // By entity index, where apply() keeps the entity's fate; UINT32_MAX
+    // for none, and always between calls.
+    std::vector<uint32_t> fate_of;
+    // By component id; only sparse components' are used.
+    std::vector<SparseSet> sparse_sets;
+    std::vector<Query> queries;
+    // By the queries' terms, which they point into.
+    std::unordered_map<std::string_view, uint32_t> query_index;
+};
+
+#endif
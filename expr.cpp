@@ -1,26 +1,57 @@
-#include "expr.h"
+#include <charconv>
 
-std::ostream& operator<<(std::ostream& os, const Expr& expr) {
+#include "ast.h"
+
+bool literal_value(const Ast& ast, const Literal& literal, Value& value) {
+    if (literal.value != AST_NONE) {
+        value = ast.values[literal.value];
+        return true;
+    }
+    const Token& token = ast.token(literal.token);
+    switch (token.type) {
+        case TOKEN_NUMBER: {
+            double number = 0;
+            std::from_chars(token.lexeme.data(), token.lexeme.data() + token.lexeme.size(), number);
+            value = number;
+            return true;
+        }
+        case TOKEN_TRUE: value = true; return true;
+        case TOKEN_FALSE: value = false; return true;
+        case TOKEN_NIL: value = Nil{}; return true;
+        default: return false;
+    }
+}
+
+void print_expr(std::ostream& os, const Ast& ast, ExprIndex index) {
+    const Expr& expr = ast.expr(index);
     switch (expr.type) {
-        case EXPR_ASSIGN: os << "Assign(" << expr.as<Assign>().name.lexeme << ", " << *expr.as<Assign>().value << ")"; break;
+        case EXPR_ASSIGN:
+            os << "Assign(" << ast.token(expr.assign.name).lexeme << ", ";
+            print_expr(os, ast, expr.assign.value);
+            os << ")";
+            break;
         case EXPR_COMPOUND_ASSIGN: {
-            CompoundAssign& comp_assign = expr.as<CompoundAssign>();
-            switch (comp_assign.op.type) {
+            const CompoundAssign& comp_assign = expr.compound_assign;
+            switch (ast.token(comp_assign.op).type) {
                 case TOKEN_PLUS_EQUAL: os << "AddEqual("; break;
                 case TOKEN_MINUS_EQUAL: os << "SubtractEqual("; break;
                 case TOKEN_STAR_EQUAL: os << "MultiplyEqual("; break;
                 case TOKEN_SLASH_EQUAL: os << "DivideEqual("; break;
+                default: os << "ModuloEqual("; break;
             }
-            os << comp_assign.name.lexeme << ", " << *comp_assign.value << ")";
+            os << ast.token(comp_assign.name).lexeme << ", ";
+            print_expr(os, ast, comp_assign.value);
+            os << ")";
             break;
         }
         case EXPR_BINARY: {
-            Binary& binary = expr.as<Binary>();
-            switch (binary.op.type) {
+            const Binary& binary = expr.binary;
+            switch (ast.token(binary.op).type) {
                 case TOKEN_PLUS: os << "Add("; break;
                 case TOKEN_MINUS: os << "Subtract("; break;
                 case TOKEN_STAR: os << "Multiply("; break;
                 case TOKEN_SLASH: os << "Divide("; break;
+                case TOKEN_MODULO: os << "Modulo("; break;
                 case TOKEN_EQUAL_EQUAL: os << "Equal("; break;
                 case TOKEN_BANG_EQUAL: os << "!Equal("; break;
                 case TOKEN_LESS: os << "Less("; break;
@@ -29,92 +60,74 @@ std::ostream& operator<<(std::ostream& os, const Expr& expr) {
                 case TOKEN_GREATER_EQUAL: os << "GreaterEqual("; break;
                 default: os << "ERROR";
             }
-            os << *binary.left << ", " << *binary.right << ")";
+            print_expr(os, ast, binary.left);
+            os << ", ";
+            print_expr(os, ast, binary.right);
+            os << ")";
             break;
         }
         case EXPR_CALL: {
-            Call& call = expr.as<Call>();
-            os << "Call(" << call.callee.lexeme << "(";
-            for (int i = 0; i < call.arguments.size(); i++) {
-                os << *call.arguments[i];
-                if (i + 1 < call.arguments.size()) os << ", ";
+            const Call& call = expr.call;
+            os << "Call(" << ast.token(call.callee).lexeme << "(";
+            const uint32_t* arguments = ast.list(call.arguments);
+            for (uint32_t i = 0; i < call.argument_count; i++) {
+                print_expr(os, ast, arguments[i]);
+                if (i + 1 < call.argument_count) os << ", ";
             }
             os << "))";
             break;
         }
-        case EXPR_LITERAL: os << expr.as<Literal>().token.lexeme; break;
-        case EXPR_LOGICAL: {
-            Logical& logical = expr.as<Logical>();
-            switch (logical.op.type) {
-                case TOKEN_OR: os << "Or("; break;
-                case TOKEN_AND: os << "And("; break;
+        case EXPR_COMMAND: {
+            const Command& command = expr.command;
+            switch (ast.token(command.keyword).type) {
+                case TOKEN_SPAWN: os << "Spawn("; break;
+                case TOKEN_DESPAWN: os << "Despawn("; break;
+                case TOKEN_INSERT: os << "Insert("; break;
+                default: os << "Remove("; break;
             }
-            os << *logical.left << ", " << *logical.right << ")";
+            const uint32_t* arguments = ast.list(command.arguments);
+            for (uint32_t i = 0; i < command.argument_count; i++) {
+                print_expr(os, ast, arguments[i]);
+                if (i + 1 < command.argument_count) os << ", ";
+            }
+            os << ")";
             break;
         }
-        case EXPR_SET: os << "Set(" << expr.as<Set>().name.lexeme << ", " << *expr.as<Set>().value << ")"; break;
-        case EXPR_VARIABLE: os << "Variable(" << expr.as<Variable>().name.lexeme << ")"; break;
+        case EXPR_GET:
+            os << "Get(" << ast.token(expr.get.object).lexeme << "." << ast.token(expr.get.name).lexeme << ")";
+            break;
+        case EXPR_LITERAL: {
+            if (expr.literal.value == AST_NONE) {
+                os << ast.token(expr.literal.token).lexeme;
+                break;
+            }
+            const Value& value = ast.values[expr.literal.value];
+            if (IS_NUMBER(value)) os << AS_NUMBER(value);
+            else if (IS_BOOL(value)) os << (AS_BOOL(value) ? "true" : "false");
+            else os << "nil";
+            break;
+        }
+        case EXPR_LOGICAL: {
+            const Logical& logical = expr.logical;
+            os << (ast.token(logical.op).type == TOKEN_OR ? "Or(" : "And(");
+            print_expr(os, ast, logical.left);
+            os << ", ";
+            print_expr(os, ast, logical.right);
+            os << ")";
+            break;
+        }
+        case EXPR_SET:
+            os << "Set(";
+            print_expr(os, ast, expr.set.target);
+            os << ", " << ast.token(expr.set.op).lexeme << ", ";
+            print_expr(os, ast, expr.set.value);
+            os << ")";
+            break;
+        case EXPR_UNARY:
+            os << (ast.token(expr.unary.op).type == TOKEN_BANG ? "Not(" : "Negate(");
+            print_expr(os, ast, expr.unary.right);
+            os << ")";
+            break;
+        case EXPR_VARIABLE: os << "Variable(" << ast.token(expr.variable.name).lexeme << ")"; break;
     }
-    return os;
-}
-
-bool Expr::is_type(ExprType type) const {
-    return this->type == type;
-}
-
-Assign::Assign(Token name, ExprPtr value) {
-    this->type = EXPR_ASSIGN;
-    this->name = name;
-    this->value = value;
-}
-
-CompoundAssign::CompoundAssign(Token name, Token op, ExprPtr value) {
-    this->type = EXPR_COMPOUND_ASSIGN;
-    this->name = name;
-    this->op = op;
-    this->value = value;
-}
-
-Binary::Binary(ExprPtr left, Token op, ExprPtr right) {
-    this->type = EXPR_BINARY;
-    this->left = left;
-    this->op = op;
-    this->right = right;
-}
-
-Call::Call(Token callee, std::vector<ExprPtr> &arguments) {
-    this->type = EXPR_CALL;
-    this->callee = callee;
-    this->arguments = arguments;
-}
-
-Literal::Literal(Token token, Value value) {
-    this->type = EXPR_LITERAL;
-    this->token = token;
-    this->value = value;
-}
-
-Logical::Logical(ExprPtr left, Token op, ExprPtr right) {
-    this->type = EXPR_LOGICAL;
-    this->left = left;
-    this->op = op;
-    this->right = right;
-}
-
-Set::Set(ExprPtr object, Token name, ExprPtr value) {
-    this->type = EXPR_SET;
-    this->object = object;
-    this->name = name;
-    this->value = value;
-}
-
-Unary::Unary(Token op, ExprPtr right) {
-    this->type = EXPR_UNARY;
-    this->op = op;
-    this->right = right;
-}
-
-Variable::Variable(Token name) {
-    this->type = EXPR_VARIABLE;
-    this->name = name;
 }
@@ -1,28 +1,24 @@
 #ifndef MOSAIC_ECS_EXPR_H
 #define MOSAIC_ECS_EXPR_H
 
-#include <memory>
-#include <variant>
-#include <vector>
-
-#include "token.h"
-#include "value.h"
-
-class Assign;
-class CompoundAssign;
-class Binary;
-class Call;
-class Literal;
-class Logical;
-class Set;
-class Unary;
-class Variable;
-
-enum ExprType {
+#include <stdint.h>
+
+// AST nodes live in the flat arrays of an Ast and refer to each other, to
+// tokens and to lists of children by 32-bit index.
+typedef uint32_t ExprIndex;
+typedef uint32_t StmtIndex;
+typedef uint32_t TokenIndex;
+typedef uint32_t ListIndex;
+
+#define AST_NONE UINT32_MAX
+
+enum ExprType : uint32_t {
     EXPR_ASSIGN,
     EXPR_COMPOUND_ASSIGN,
     EXPR_BINARY,
     EXPR_CALL,
+    EXPR_COMMAND,
+    EXPR_GET,
     EXPR_LITERAL,
     EXPR_LOGICAL,
     EXPR_SET,
@@ -30,92 +26,91 @@ enum ExprType {
     EXPR_VARIABLE,
 };
 
-class Expr {
-public:
-    virtual ~Expr() = default;
-    bool is_type(ExprType type) const;
-
-    template<class T>
-    T& as() const {
-        return *(T*)this;
-    }
-
-    template<class T>
-    static std::shared_ptr<Expr> ptr(T expr) {
-        return std::make_shared<T>(expr);
-    }
+struct Assign {
+    TokenIndex name;
+    ExprIndex value;
+};
 
-    ExprType type;
+struct CompoundAssign {
+    TokenIndex name;
+    TokenIndex op;
+    ExprIndex value;
 };
 
-using ExprPtr = std::shared_ptr<Expr>;
+struct Binary {
+    ExprIndex left;
+    TokenIndex op;
+    ExprIndex right;
+};
 
-class Assign : public Expr {
-public:
-    Token name;
-    ExprPtr value;
-    Assign(Token name, ExprPtr value);
+struct Call {
+    TokenIndex callee;
+    // ExprIndex entries in Ast::lists.
+    ListIndex arguments;
+    uint32_t argument_count;
 };
 
-class CompoundAssign : public Expr {
-public:
-    Token name;
-    Token op;
-    ExprPtr value;
-    CompoundAssign(Token name, Token op, ExprPtr value);
+// spawn, despawn, insert or remove, named by keyword.
+struct Command {
+    TokenIndex keyword;
+    // ExprIndex entries in Ast::lists.
+    ListIndex arguments;
+    uint32_t argument_count;
 };
 
-class Binary : public Expr {
-public:
-    ExprPtr left;
-    Token op;
-    ExprPtr right;
-    Binary(ExprPtr left, Token op, ExprPtr right);
+// A field of the component a query binding names, read in a run block.
+struct Get {
+    TokenIndex object;
+    TokenIndex name;
 };
 
-class Call : public Expr {
-public:
-    Token callee;
-    std::vector<ExprPtr> arguments;
-    Call(Token callee, std::vector<ExprPtr>& arguments);
+struct Literal {
+    TokenIndex token;
+    // Index into Ast::values for constants made by the optimizer. AST_NONE
+    // means the value is read back from the token.
+    uint32_t value;
 };
 
-class Literal : public Expr {
-public:
-    Token token;
-    Value value;
-    Literal(Token token, Value value);
+struct Logical {
+    ExprIndex left;
+    TokenIndex op;
+    ExprIndex right;
 };
 
-class Logical : public Expr {
-public:
-    ExprPtr left;
-    Token op;
-    ExprPtr right;
-    Logical(ExprPtr left, Token op, ExprPtr right);
+// Assigns to a field, plainly or compounded as op says.
+struct Set {
+    // Always an EXPR_GET.
+    ExprIndex target;
+    TokenIndex op;
+    ExprIndex value;
 };
 
-class Set : public Expr {
-public:
-    ExprPtr object;
-    Token name;
-    ExprPtr value;
-    Set(ExprPtr object, Token name, ExprPtr value);
+struct Unary {
+    TokenIndex op;
+    ExprIndex right;
 };
 
-class Unary : public Expr {
-public:
-    Token op;
-    ExprPtr right;
-    Unary(Token op, ExprPtr right);
+struct Variable {
+    TokenIndex name;
 };
 
-class Variable : public Expr {
-public:
-    Token name;
-    Variable(Token name);
+struct Expr {
+    ExprType type;
+    union {
+        Assign assign;
+        CompoundAssign compound_assign;
+        Binary binary;
+        Call call;
+        Command command;
+        Get get;
+        Literal literal;
+        Logical logical;
+        Set set;
+        Unary unary;
+        Variable variable;
+    };
 };
 
-std::ostream& operator<<(std::ostream& os, const Expr& expr);
+static_assert(sizeof(Expr) == 16);
 
 #endif
@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "hot_reload.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "scanner.h"
+#include "source.h"
+#include "type_inference.h"
+
+static bool parse(std::string_view text, Ast& ast) {
+    Scanner scanner = Scanner(text);
+    Parser parser = Parser(scanner.scan_tokens());
+    ast = parser.parse();
+    return !parser.failed();
+}
+
+// Every function declaration in the order the Compiler numbers them, so
+// entry i is function i + 1.
+static void collect_functions(const Ast& ast, StmtIndex index, std::vector<StmtIndex>& functions) {
+    const Stmt& stmt = ast.stmt(index);
+    switch (stmt.type) {
+        case STMT_BLOCK: {
+            const StmtIndex* stmts = ast.list(stmt.block.stmts);
+            for (uint32_t i = 0; i < stmt.block.count; i++) {
+                collect_functions(ast, stmts[i], functions);
+            }
+            break;
+        }
+        case STMT_FUN:
+            functions.push_back(index);
+            collect_functions(ast, stmt.fun.body, functions);
+            break;
+        case STMT_IF:
+            collect_functions(ast, stmt.if_stmt.then_branch, functions);
+            if (stmt.if_stmt.else_branch != AST_NONE) collect_functions(ast, stmt.if_stmt.else_branch, functions);
+            break;
+        case STMT_RUN: collect_functions(ast, stmt.run.body, functions); break;
+        case STMT_WHILE: collect_functions(ast, stmt.while_stmt.body, functions); break;
+        default: break;
+    }
+}
+
+static std::vector<StmtIndex> collect_functions(const Ast& ast) {
+    std::vector<StmtIndex> functions;
+    const StmtIndex* stmts = ast.list(ast.script);
+    for (uint32_t i = 0; i < ast.script_count; i++) {
+        collect_functions(ast, stmts[i], functions);
+    }
+    return functions;
+}
+
+// Trees are compared as parsed, token by token, so moving code around in
+// the file or reformatting it changes nothing.
+static bool same_token(const Ast& a, TokenIndex i, const Ast& b, TokenIndex j) {
+    return a.token(i).type == b.token(j).type && a.token(i).lexeme == b.token(j).lexeme;
+}
+
+static bool same_expr(const Ast& a, ExprIndex i, const Ast& b, ExprIndex j) {
+    if (i == AST_NONE || j == AST_NONE) return i == j;
+    const Expr& x = a.expr(i);
+    const Expr& y = b.expr(j);
+    if (x.type != y.type) return false;
+    switch (x.type) {
+        case EXPR_ASSIGN:
+            return same_token(a, x.assign.name, b, y.assign.name) && same_expr(a, x.assign.value, b, y.assign.value);
+        case EXPR_COMPOUND_ASSIGN:
+            return same_token(a, x.compound_assign.name, b, y.compound_assign.name) &&
+                   same_token(a, x.compound_assign.op, b, y.compound_assign.op) &&
+                   same_expr(a, x.compound_assign.value, b, y.compound_assign.value);
+        case EXPR_BINARY:
+            return same_token(a, x.binary.op, b, y.binary.op) && same_expr(a, x.binary.left, b, y.binary.left) &&
+                   same_expr(a, x.binary.right, b, y.binary.right);
+        case EXPR_CALL: {
+            if (!same_token(a, x.call.callee, b, y.call.callee) || x.call.argument_count != y.call.argument_count) {
+                return false;
+            }
+            for (uint32_t k = 0; k < x.call.argument_count; k++) {
+                if (!same_expr(a, a.list(x.call.arguments)[k], b, b.list(y.call.arguments)[k])) return false;
+            }
+            return true;
+        }
+        case EXPR_COMMAND: {
+            if (!same_token(a, x.command.keyword, b, y.command.keyword) ||
+                x.command.argument_count != y.command.argument_count) {
+                return false;
+            }
+            for (uint32_t k = 0; k < x.command.argument_count; k++) {
+                if (!same_expr(a, a.list(x.command.arguments)[k], b, b.list(y.command.arguments)[k])) return false;
+            }
+            return true;
+        }
+        case EXPR_GET:
+            return same_token(a, x.get.object, b, y.get.object) && same_token(a, x.get.name, b, y.get.name);
+        case EXPR_LITERAL: return same_token(a, x.literal.token, b, y.literal.token);
+        case EXPR_LOGICAL:
+            return same_token(a, x.logical.op, b, y.logical.op) && same_expr(a, x.logical.left, b, y.logical.left) &&
+                   same_expr(a, x.logical.right, b, y.logical.right);
+        case EXPR_SET:
+            return same_token(a, x.set.op, b, y.set.op) && same_expr(a, x.set.target, b, y.set.target) &&
+                   same_expr(a, x.set.value, b, y.set.value);
+        case EXPR_UNARY:
+            return same_token(a, x.unary.op, b, y.unary.op) && same_expr(a, x.unary.right, b, y.unary.right);
+        case EXPR_VARIABLE: return same_token(a, x.variable.name, b, y.variable.name);
+    }
+    return false;
+}
+
+// Pairs of tokens, as query terms are listed.
+static bool same_tokens(const Ast& a, ListIndex i, const Ast& b, ListIndex j, uint32_t count) {
+    for (uint32_t k = 0; k < count; k++) {
+        if (!same_token(a, a.list(i)[k], b, b.list(j)[k])) return false;
+    }
+    return true;
+}
+
+// A nested function only counts by name: its body is compiled, and
+// compared, on its own.
+static bool same_stmt(const Ast& a, StmtIndex i, const Ast& b, StmtIndex j) {
+    if (i == AST_NONE || j == AST_NONE) return i == j;
+    const Stmt& x = a.stmt(i);
+    const Stmt& y = b.stmt(j);
+    if (x.type != y.type) return false;
+    switch (x.type) {
+        case STMT_BLOCK: {
+            if (x.block.count != y.block.count) return false;
+            for (uint32_t k = 0; k < x.block.count; k++) {
+                if (!same_stmt(a, a.list(x.block.stmts)[k], b, b.list(y.block.stmts)[k])) return false;
+            }
+            return true;
+        }
+        case STMT_COMP:
+            return same_token(a, x.comp.name, b, y.comp.name) && x.comp.sparse == y.comp.sparse &&
+                   x.comp.field_count == y.comp.field_count &&
+                   same_tokens(a, x.comp.fields, b, y.comp.fields, x.comp.field_count);
+        case STMT_EXPR: return same_expr(a, x.expr_stmt.expr, b, y.expr_stmt.expr);
+        case STMT_FUN: return same_token(a, x.fun.name, b, y.fun.name);
+        case STMT_IF:
+            return same_expr(a, x.if_stmt.condition, b, y.if_stmt.condition) &&
+                   same_stmt(a, x.if_stmt.then_branch, b, y.if_stmt.then_branch) &&
+                   same_stmt(a, x.if_stmt.else_branch, b, y.if_stmt.else_branch);
+        case STMT_LET:
+            return same_token(a, x.let.name, b, y.let.name) && same_expr(a, x.let.initializer, b, y.let.initializer);
+        case STMT_PRINT: return same_expr(a, x.print.value, b, y.print.value);
+        case STMT_QUERY:
+            return same_token(a, x.query.name, b, y.query.name) && x.query.term_count == y.query.term_count &&
+                   same_tokens(a, x.query.terms, b, y.query.terms, 2 * x.query.term_count);
+        case STMT_RETURN: return same_expr(a, x.return_stmt.value, b, y.return_stmt.value);
+        case STMT_RUN:
+            return (x.run.query == AST_NONE ? y.run.query == AST_NONE
+                                            : y.run.query != AST_NONE && same_token(a, x.run.query, b, y.run.query)) &&
+                   same_stmt(a, x.run.body, b, y.run.body);
+        case STMT_WHILE:
+            return same_expr(a, x.while_stmt.condition, b, y.while_stmt.condition) &&
+                   same_stmt(a, x.while_stmt.body, b, y.while_stmt.body);
+    }
+    return false;
+}
+
+static bool same_script(const Ast& a, const Ast& b) {
+    if (a.script_count != b.script_count) return false;
+    for (uint32_t i = 0; i < a.script_count; i++) {
+        if (!same_stmt(a, a.list(a.script)[i], b, b.list(b.script)[i])) return false;
+    }
+    return true;
+}
+
+// The running world's layout can't change under it.
+static bool same_components(const Ast& a, const Ast& b) {
+    std::vector<StmtIndex> x, y;
+    for (uint32_t i = 0; i < a.script_count; i++) {
+        if (a.stmt(a.list(a.script)[i]).type == STMT_COMP) x.push_back(a.list(a.script)[i]);
+    }
+    for (uint32_t i = 0; i < b.script_count; i++) {
+        if (b.stmt(b.list(b.script)[i]).type == STMT_COMP) y.push_back(b.list(b.script)[i]);
+    }
+    if (x.size() != y.size()) return false;
+    for (size_t i = 0; i < x.size(); i++) {
+        if (!same_stmt(a, x[i], b, y[i])) return false;
+    }
+    return true;
+}
+
+static bool same_parameters(const FunStmt& x, const Ast& a, const FunStmt& y, const Ast& b) {
+    if (x.arity != y.arity) return false;
+    for (uint32_t k = 0; k < x.arity; k++) {
+        if (!same_token(a, a.list(x.parameters)[k], b, b.list(y.parameters)[k])) return false;
+    }
+    return true;
+}
+
+// Stages are numbered in the order the script first names them, and the
+// VM reads which systems are serial once.
+static bool same_stage(const FunStmt& x, const Ast& a, const FunStmt& y, const Ast& b) {
+    if (!x.system) return true;
+    const TokenIndex* i = a.list(x.parameters);
+    const TokenIndex* j = b.list(y.parameters);
+    if ((i[1] == AST_NONE) != (j[1] == AST_NONE)) return false;
+    if (i[0] == AST_NONE || j[0] == AST_NONE) return i[0] == j[0];
+    return same_token(a, i[0], b, j[0]);
+}
+
+HotReloader::HotReloader(const char* path, std::string_view source, VM& vm, const FFI& ffi, int optimize)
+        : path(path), vm(vm), ffi(ffi), optimize(std::min(optimize, OPTIMIZE_DEFAULT)),
+          source(std::make_unique<std::string>(source)) {
+    parse(*this->source, ast);
+}
+
+HotReloader::~HotReloader() {
+    if (watcher.joinable()) {
+        char byte = 0;
+        if (write(wake[1], &byte, 1) == 1) watcher.join();
+        else watcher.detach();
+    }
+    if (inotify >= 0) close(inotify);
+    if (wake[0] >= 0) close(wake[0]);
+    if (wake[1] >= 0) close(wake[1]);
+}
+
+bool HotReloader::start() {
+    inotify = inotify_init1(IN_CLOEXEC);
+    if (inotify < 0 || pipe(wake) != 0) return false;
+    // Editors often save by writing a new file and renaming it over the
+    // old one, which only the directory sees.
+    std::filesystem::path directory = std::filesystem::path(path).parent_path();
+    if (directory.empty()) directory = ".";
+    if (inotify_add_watch(inotify, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) return false;
+    watcher = std::thread(&HotReloader::watch, this);
+    return true;
+}
+
+void HotReloader::watch() {
+    std::string name = std::filesystem::path(path).filename();
+    alignas(inotify_event) char buffer[4096];
+    pollfd fds[2] = {{inotify, POLLIN, 0}, {wake[0], POLLIN, 0}};
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (fds[1].revents) return;
+
+        ssize_t length = read(inotify, buffer, sizeof(buffer));
+        bool saved = false;
+        for (ssize_t offset = 0; offset < length;) {
+            const inotify_event* event = (const inotify_event*)(buffer + offset);
+            if (event->len && name == event->name) saved = true;
+            offset += sizeof(inotify_event) + event->len;
+        }
+        if (saved) reload();
+    }
+}
+
+void HotReloader::reload() {
+    SourceFile file;
+    if (!file.open(path.c_str())) {
+        std::cerr << "[reload] Could not open file \"" << path << "\"." << std::endl;
+        return;
+    }
+    std::unique_ptr<std::string> text = std::make_unique<std::string>(file.text());
+    Ast changed;
+    if (!parse(*text, changed)) {
+        std::cerr << "[reload] Keeping the running code." << std::endl;
+        return;
+    }
+
+    std::vector<StmtIndex> before = collect_functions(ast);
+    std::vector<StmtIndex> after = collect_functions(changed);
+    bool same_functions = before.size() == after.size();
+    for (size_t i = 0; same_functions && i < before.size(); i++) {
+        const FunStmt& x = ast.stmt(before[i]).fun;
+        const FunStmt& y = changed.stmt(after[i]).fun;
+        same_functions = same_token(ast, x.name, changed, y.name) && x.system == y.system &&
+                         same_parameters(x, ast, y, changed);
+    }
+    if (!same_functions) {
+        std::cerr << "[reload] Functions were added, removed, reordered or changed parameters; restart to apply."
+                  << std::endl;
+        return;
+    }
+    if (!same_components(ast, changed)) {
+        std::cerr << "[reload] Components were added, removed or changed fields; restart to apply." << std::endl;
+        return;
+    }
+    for (size_t i = 0; i < before.size(); i++) {
+        if (same_stage(ast.stmt(before[i]).fun, ast, changed.stmt(after[i]).fun, changed)) continue;
+        std::cerr << "[reload] Systems moved between stages or became serial; restart to apply." << std::endl;
+        return;
+    }
+
+    std::vector<int> selected;
+    for (size_t i = 0; i < before.size(); i++) {
+        if (!same_stmt(ast, ast.stmt(before[i]).fun.body, changed, changed.stmt(after[i]).fun.body)) {
+            selected.push_back(i + 1);
+        }
+    }
+    if (!same_script(ast, changed)) {
+        std::cerr << "[reload] The script's top level changed; restart to apply it." << std::endl;
+    }
+
+    if (!selected.empty()) {
+        Ast optimized = changed;
+        if (optimize > OPTIMIZE_NONE) {
+            Optimizer optimizer = Optimizer(optimized);
+            optimizer.optimize();
+            TypeInference inference = TypeInference(optimized);
+            inference.infer();
+        }
+        Compiler compiler = Compiler(optimized, ffi, optimize, DEBUG_NONE, 1);
+        std::shared_ptr<Image> patch = std::make_shared<Image>();
+        if (!compiler.compile_functions(selected) || !patch->load(compiler.image(selected))) {
+            std::cerr << "[reload] Keeping the running code." << std::endl;
+            return;
+        }
+        vm.reload(patch, selected);
+
+        std::cerr << "[reload]";
+        for (int function : selected) {
+            std::cerr << " " << changed.token(changed.stmt(after[function - 1]).fun.name).lexeme;
+        }
+        std::cerr << std::endl;
+    }
+
+    source = std::move(text);
+    ast = std::move(changed);
+}
@@ -0,0 +1,53 @@
+#ifndef MOSAIC_ECS_HOT_RELOAD_H
+#define MOSAIC_ECS_HOT_RELOAD_H
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ast.h"
+#include "ffi.h"
+#include "vm.h"
+
+// Watches a script with inotify while a VM runs it. Each time the file is
+// saved it is parsed again, the functions whose declarations changed are
+// recompiled on their own, and their code is handed to VM::reload() to
+// swap in between calls.
+//
+// Only function bodies are reloaded. Adding, removing, renaming or
+// reordering functions, changing their parameters, changing components, or
+// changing the script's top level needs a restart, and is reported as such. Bodies are
+// compiled at no more than OPTIMIZE_DEFAULT, since the inliner would copy
+// one function's code into others; the VM's program must be compiled the
+// same way.
+class HotReloader {
+public:
+    // source is the text vm's program was compiled from.
+    HotReloader(const char* path, std::string_view source, VM& vm, const FFI& ffi, int optimize);
+    HotReloader(const HotReloader&) = delete;
+    HotReloader& operator=(const HotReloader&) = delete;
+    ~HotReloader();
+    // Starts watching on a thread of its own. False if the file can't be
+    // watched.
+    bool start();
+private:
+    void watch();
+    void reload();
+
+    std::string path;
+    VM& vm;
+    FFI ffi;
+    int optimize;
+    // The text the VM runs, parsed but not optimized. The Ast points into
+    // the text, so both move together.
+    std::unique_ptr<std::string> source;
+    Ast ast;
+
+    int inotify = -1;
+    // Written to on destruction, to wake the watcher.
+    int wake[2] = {-1, -1};
+    std::thread watcher;
+};
+
+#endif
@@ -0,0 +1,320 @@
+#include <cstring>
+#include <limits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+
+static_assert(std::numeric_limits<double>::is_iec559, "Images store IEEE 754 doubles.");
+
+static size_t align(size_t offset) {
+    return (offset + IMAGE_ALIGNMENT - 1) & ~(size_t)(IMAGE_ALIGNMENT - 1);
+}
+
+ImageConstant encode_constant(const Value& value) {
+    ImageConstant constant = {};
+    switch (value_type(value)) {
+        case VAL_NIL: constant.type = CONSTANT_NIL; break;
+        case VAL_BOOL:
+            constant.type = CONSTANT_BOOL;
+            constant.index = AS_BOOL(value);
+            break;
+        case VAL_NUMBER:
+            constant.type = CONSTANT_NUMBER;
+            constant.number = AS_NUMBER(value);
+            break;
+        case VAL_FUNCTION_INDEX: {
+            const FunctionIndex& function = AS_FUNCTION_INDEX(value);
+            if (function.user_index != -1) {
+                constant.type = CONSTANT_USER_FUNCTION;
+                constant.index = function.user_index;
+            } else {
+                constant.type = CONSTANT_NATIVE_FUNCTION;
+                constant.index = function.native_index;
+            }
+            break;
+        }
+        case VAL_STRING_INDEX:
+            constant.type = CONSTANT_STRING;
+            constant.index = AS_STRING_INDEX(value).index;
+            break;
+    }
+    return constant;
+}
+
+uint64_t image_checksum(const uint8_t* data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+std::vector<uint8_t> write_image(const std::vector<ObjFunction>& functions,
+                                 const std::vector<Value>& constants,
+                                 const std::string& strings,
+                                 const std::vector<NativeFunction>& natives,
+                                 const std::vector<ModuleImport>& imports,
+                                 const std::vector<ComponentDeclaration>& components,
+                                 const std::vector<SystemDeclaration>& systems) {
+    std::vector<ImageFunction> table;
+    std::string names;
+    size_t code_size = 0;
+    for (const ObjFunction& function : functions) {
+        ImageFunction entry = {};
+        entry.name_offset = names.size();
+        entry.name_length = function.name.lexeme.size();
+        entry.arity = function.arity;
+        entry.code_offset = code_size;
+        entry.code_size = function.chunk.code.size();
+        entry.flags = function.flags;
+        table.push_back(entry);
+        names.append(function.name.lexeme);
+        code_size += function.chunk.code.size();
+    }
+    std::vector<ImageNative> native_table;
+    for (const NativeFunction& native : natives) {
+        native_table.push_back(
+                ImageNative{(uint32_t)names.size(), (uint32_t)native.name.size(), (uint32_t)native.arity, 0});
+        names.append(native.name);
+    }
+    std::vector<ImageImport> import_table;
+    for (const ModuleImport& module : imports) {
+        import_table.push_back(ImageImport{(uint32_t)names.size(), (uint32_t)module.name.size(), module.interface});
+        names.append(module.name);
+    }
+    std::vector<ImageComponent> component_table;
+    for (const ComponentDeclaration& component : components) {
+        component_table.push_back(ImageComponent{(uint32_t)names.size(), (uint32_t)component.name.size(),
+                                                 component.field_count, component.flags});
+        names.append(component.name);
+    }
+    std::vector<ImageSystem> system_table;
+    for (const SystemDeclaration& system : systems) {
+        system_table.push_back(ImageSystem{system.function, (uint32_t)names.size(), (uint32_t)system.stage.size(),
+                                            system.flags});
+        names.append(system.stage);
+    }
+
+    ImageSection sections[SECTION_COUNT] = {};
+    sections[SECTION_FUNCTIONS].size = table.size() * sizeof(ImageFunction);
+    sections[SECTION_CODE].size = code_size;
+    sections[SECTION_LINES].size = code_size * sizeof(int32_t);
+    sections[SECTION_CONSTANTS].size = constants.size() * sizeof(ImageConstant);
+    sections[SECTION_STRINGS].size = strings.size();
+    sections[SECTION_NAMES].size = names.size();
+    sections[SECTION_NATIVES].size = native_table.size() * sizeof(ImageNative);
+    sections[SECTION_IMPORTS].size = import_table.size() * sizeof(ImageImport);
+    sections[SECTION_COMPONENTS].size = component_table.size() * sizeof(ImageComponent);
+    sections[SECTION_SYSTEMS].size = system_table.size() * sizeof(ImageSystem);
+
+    size_t offset = align(sizeof(ImageHeader) + sizeof(sections));
+    for (uint32_t kind = 0; kind < SECTION_COUNT; kind++) {
+        sections[kind].kind = kind;
+        sections[kind].offset = offset;
+        offset = align(offset + sections[kind].size);
+    }
+
+    std::vector<uint8_t> bytes(offset, 0);
+    uint8_t* data = bytes.data();
+    memcpy(data + sizeof(ImageHeader), sections, sizeof(sections));
+    if (!table.empty()) {
+        memcpy(data + sections[SECTION_FUNCTIONS].offset, table.data(), sections[SECTION_FUNCTIONS].size);
+    }
+    uint8_t* code = data + sections[SECTION_CODE].offset;
+    int32_t* lines = (int32_t*)(data + sections[SECTION_LINES].offset);
+    for (const ObjFunction& function : functions) {
+        const Chunk& chunk = function.chunk;
+        if (!chunk.code.empty()) memcpy(code, chunk.code.data(), chunk.code.size());
+        for (size_t i = 0; i < chunk.code.size(); i++) {
+            lines[i] = i < chunk.lines.size() ? chunk.lines[i] : 0;
+        }
+        code += chunk.code.size();
+        lines += chunk.code.size();
+    }
+    ImageConstant* constant = (ImageConstant*)(data + sections[SECTION_CONSTANTS].offset);
+    for (const Value& value : constants) {
+        *constant++ = encode_constant(value);
+    }
+    memcpy(data + sections[SECTION_STRINGS].offset, strings.data(), strings.size());
+    memcpy(data + sections[SECTION_NAMES].offset, names.data(), names.size());
+    if (!native_table.empty()) {
+        memcpy(data + sections[SECTION_NATIVES].offset, native_table.data(), sections[SECTION_NATIVES].size);
+    }
+    if (!import_table.empty()) {
+        memcpy(data + sections[SECTION_IMPORTS].offset, import_table.data(), sections[SECTION_IMPORTS].size);
+    }
+    if (!component_table.empty()) {
+        memcpy(data + sections[SECTION_COMPONENTS].offset, component_table.data(),
+               sections[SECTION_COMPONENTS].size);
+    }
+    if (!system_table.empty()) {
+        memcpy(data + sections[SECTION_SYSTEMS].offset, system_table.data(), sections[SECTION_SYSTEMS].size);
+    }
+
+    ImageHeader header = {};
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.byte_order = IMAGE_BYTE_ORDER;
+    header.section_count = SECTION_COUNT;
+    header.size = bytes.size();
+    header.checksum = image_checksum(data + sizeof(ImageHeader), bytes.size() - sizeof(ImageHeader));
+    memcpy(data, &header, sizeof(header));
+
+    return bytes;
+}
+
+Image::Image(Image&& other) noexcept {
+    *this = std::move(other);
+}
+
+Image& Image::operator=(Image&& other) noexcept {
+    if (this == &other) return *this;
+    release();
+    data = other.data;
+    size = other.size;
+    memcpy(sections, other.sections, sizeof(sections));
+    code_base = other.code_base;
+    lines_base = other.lines_base;
+    mapping = other.mapping;
+    // Moving the vector keeps its buffer, so data stays valid.
+    owned = std::move(other.owned);
+    error_message = other.error_message;
+    other.mapping = nullptr;
+    other.release();
+    return *this;
+}
+
+Image::~Image() {
+    release();
+}
+
+bool Image::open(const char* path) {
+    release();
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) return fail("Could not open image.");
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(ImageHeader)) {
+        ::close(fd);
+        return fail("Image is truncated.");
+    }
+
+    void* memory = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) return fail("Could not map image.");
+
+    mapping = memory;
+    data = (const uint8_t*)memory;
+    size = info.st_size;
+    return validate();
+}
+
+bool Image::load(std::vector<uint8_t> bytes) {
+    release();
+    owned = std::move(bytes);
+    data = owned.data();
+    size = owned.size();
+    return validate();
+}
+
+std::string_view Image::function_name(size_t index) const {
+    return name(function(index).name_offset, function(index).name_length);
+}
+
+bool Image::validate() {
+    if (size < sizeof(ImageHeader)) return fail("Image is truncated.");
+
+    ImageHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0) return fail("Not a bytecode image.");
+    if (header.byte_order != IMAGE_BYTE_ORDER) return fail("Image was written with a different byte order.");
+    if (header.version != IMAGE_VERSION) return fail("Unsupported image version.");
+    if (header.size != size) return fail("Image size does not match its header.");
+    if (sizeof(ImageHeader) + (size_t)header.section_count * sizeof(ImageSection) > size) {
+        return fail("Section table is truncated.");
+    }
+    if (image_checksum(data + sizeof(ImageHeader), size - sizeof(ImageHeader)) != header.checksum) {
+        return fail("Image checksum mismatch.");
+    }
+
+    // Sections this version does not know about are skipped.
+    uint32_t seen = 0;
+    const ImageSection* table = (const ImageSection*)(data + sizeof(ImageHeader));
+    for (uint32_t i = 0; i < header.section_count; i++) {
+        const ImageSection& entry = table[i];
+        if (entry.kind >= SECTION_COUNT) continue;
+        if (entry.offset % IMAGE_ALIGNMENT != 0 || entry.offset > size || entry.size > size - entry.offset) {
+            return fail("Section lies outside the image.");
+        }
+        sections[entry.kind] = entry;
+        seen |= 1u << entry.kind;
+    }
+    if (seen != (1u << SECTION_COUNT) - 1) return fail("Image is missing a section.");
+
+    if (section_size(SECTION_FUNCTIONS) % sizeof(ImageFunction) != 0 ||
+        section_size(SECTION_CONSTANTS) % sizeof(ImageConstant) != 0 ||
+        section_size(SECTION_NATIVES) % sizeof(ImageNative) != 0 ||
+        section_size(SECTION_IMPORTS) % sizeof(ImageImport) != 0 ||
+        section_size(SECTION_COMPONENTS) % sizeof(ImageComponent) != 0 ||
+        section_size(SECTION_SYSTEMS) % sizeof(ImageSystem) != 0 ||
+        section_size(SECTION_LINES) != section_size(SECTION_CODE) * sizeof(int32_t)) {
+        return fail("Section sizes are inconsistent.");
+    }
+    if (function_count() == 0) return fail("Image has no script function.");
+    for (size_t i = 0; i < function_count(); i++) {
+        const ImageFunction& entry = function(i);
+        if ((uint64_t)entry.code_offset + entry.code_size > section_size(SECTION_CODE) ||
+            (uint64_t)entry.name_offset + entry.name_length > section_size(SECTION_NAMES)) {
+            return fail("Function lies outside its section.");
+        }
+    }
+    for (size_t i = 0; i < native_count(); i++) {
+        if ((uint64_t)native(i).name_offset + native(i).name_length > section_size(SECTION_NAMES)) {
+            return fail("Native lies outside its section.");
+        }
+    }
+    for (size_t i = 0; i < import_count(); i++) {
+        if ((uint64_t)module_import(i).name_offset + module_import(i).name_length > section_size(SECTION_NAMES)) {
+            return fail("Import lies outside its section.");
+        }
+    }
+    for (size_t i = 0; i < component_count(); i++) {
+        if ((uint64_t)component(i).name_offset + component(i).name_length > section_size(SECTION_NAMES)) {
+            return fail("Component lies outside its section.");
+        }
+    }
+    for (size_t i = 0; i < system_count(); i++) {
+        if (system(i).function >= function_count() ||
+            (uint64_t)system(i).stage_offset + system(i).stage_length > section_size(SECTION_NAMES)) {
+            return fail("System lies outside its section.");
+        }
+    }
+
+    code_base = section(SECTION_CODE);
+    lines_base = (const int32_t*)section(SECTION_LINES);
+    error_message = nullptr;
+    return true;
+}
+
+bool Image::fail(const char* message) {
+    release();
+    error_message = message;
+    return false;
+}
+
+void Image::release() {
+    if (mapping) munmap(mapping, size);
+    mapping = nullptr;
+    owned.clear();
+    owned.shrink_to_fit();
+    data = nullptr;
+    size = 0;
+    memset(sections, 0, sizeof(sections));
+    code_base = nullptr;
+    lines_base = nullptr;
+}
@@ -0,0 +1,252 @@
+#ifndef MOSAIC_ECS_IMAGE_H
+#define MOSAIC_ECS_IMAGE_H
+
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "chunk.h"
+#include "ffi.h"
+#include "value.h"
+
+// A compiled program as it sits on disk and in memory:
+//
+//   ImageHeader | ImageSection[section_count] | section data...
+//
+// Every section starts on an IMAGE_ALIGNMENT boundary and only holds
+// fixed-width fields and offsets relative to its own start, so a mapped
+// image can be executed where it lies without fixups or copies.
+#define IMAGE_MAGIC "TESB"
+#define IMAGE_VERSION 6
+#define IMAGE_BYTE_ORDER 0x01020304u
+#define IMAGE_ALIGNMENT 16
+
+enum ImageSectionKind : uint32_t {
+    SECTION_FUNCTIONS,  // ImageFunction[]
+    SECTION_CODE,       // uint8_t[], every function's bytecode back to back
+    SECTION_LINES,      // int32_t[], one per byte of SECTION_CODE
+    SECTION_CONSTANTS,  // ImageConstant[]
+    SECTION_STRINGS,    // '\0' terminated string literals, indexed by OP_STRING
+    SECTION_NAMES,      // Function, native, module, component and stage names, not terminated
+    SECTION_NATIVES,    // ImageNative[], the natives OP_CALL_NATIVE indexes
+    SECTION_IMPORTS,    // ImageImport[], the modules a module was compiled against
+    SECTION_COMPONENTS, // ImageComponent[], the script's comp declarations in order
+    SECTION_SYSTEMS,    // ImageSystem[], the script's sys declarations in order
+    SECTION_COUNT,
+};
+
+struct ImageHeader {
+    char magic[4];
+    uint32_t version;
+    // IMAGE_BYTE_ORDER as the producer stored it, a loader on a machine of
+    // the other byte order reads it back swapped and rejects the image.
+    uint32_t byte_order;
+    uint32_t section_count;
+    uint64_t size;
+    // FNV-1a over every byte after the header.
+    uint64_t checksum;
+};
+
+struct ImageSection {
+    uint32_t kind;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct ImageFunction {
+    uint32_t name_offset;
+    uint32_t name_length;
+    uint32_t arity;
+    uint32_t code_offset;
+    uint32_t code_size;
+    // FunctionFlags.
+    uint32_t flags;
+};
+
+struct ImageNative {
+    uint32_t name_offset;
+    uint32_t name_length;
+    uint32_t arity;
+    uint32_t reserved;
+};
+
+struct ImageImport {
+    uint32_t name_offset;
+    uint32_t name_length;
+    // module_interface() of what the module exported when this one was
+    // compiled.
+    uint64_t interface;
+};
+
+struct ImageComponent {
+    uint32_t name_offset;
+    uint32_t name_length;
+    uint32_t field_count;
+    // ComponentFlags.
+    uint32_t flags;
+};
+
+enum SystemFlags {
+    // Declared `serial sys`: its run blocks aren't split across threads.
+    SYSTEM_SERIAL = 1 << 0,
+};
+
+struct ImageSystem {
+    uint32_t function;
+    uint32_t stage_offset;
+    uint32_t stage_length;
+    // SystemFlags.
+    uint32_t flags;
+};
+
+enum ImageConstantType : uint32_t {
+    CONSTANT_NIL,
+    CONSTANT_BOOL,
+    CONSTANT_NUMBER,
+    CONSTANT_USER_FUNCTION,
+    CONSTANT_NATIVE_FUNCTION,
+    CONSTANT_STRING,
+};
+
+struct ImageConstant {
+    uint32_t type;
+    uint32_t reserved;
+    union {
+        double number;
+        uint64_t index;
+    };
+};
+
+static_assert(sizeof(ImageHeader) == 32);
+static_assert(sizeof(ImageSection) == 24);
+static_assert(sizeof(ImageFunction) == 24);
+static_assert(sizeof(ImageConstant) == 16);
+static_assert(sizeof(ImageNative) == 16);
+static_assert(sizeof(ImageImport) == 16);
+static_assert(sizeof(ImageComponent) == 16);
+static_assert(sizeof(ImageSystem) == 16);
+
+// A module imported by the one being written, as ImageImport records it.
+struct ModuleImport {
+    std::string name;
+    uint64_t interface;
+};
+
+// A component the script declares, as ImageComponent records it. Its id is
+// its place in the list.
+struct ComponentDeclaration {
+    std::string name;
+    uint32_t field_count;
+    uint32_t flags;
+};
+
+// A system the script declares, as ImageSystem records it. Stages are
+// numbered in the order they are first named.
+struct SystemDeclaration {
+    uint32_t function;
+    std::string stage;
+    uint32_t flags;
+};
+
+inline Value decode_constant(const ImageConstant& constant) {
+    switch (constant.type) {
+        case CONSTANT_BOOL: return constant.index != 0;
+        case CONSTANT_NUMBER: return constant.number;
+        case CONSTANT_USER_FUNCTION: return FunctionIndex((int)constant.index, USER_FUNCTION);
+        case CONSTANT_NATIVE_FUNCTION: return FunctionIndex((int)constant.index, NATIVE_FUNCTION);
+        case CONSTANT_STRING: return StringIndex{constant.index};
+        default: return Nil{};
+    }
+}
+
+ImageConstant encode_constant(const Value& value);
+uint64_t image_checksum(const uint8_t* data, size_t size);
+std::vector<uint8_t> write_image(const std::vector<ObjFunction>& functions,
+                                 const std::vector<Value>& constants,
+                                 const std::string& strings,
+                                 const std::vector<NativeFunction>& natives = {},
+                                 const std::vector<ModuleImport>& imports = {},
+                                 const std::vector<ComponentDeclaration>& components = {},
+                                 const std::vector<SystemDeclaration>& systems = {});
+
+class Image {
+public:
+    Image() = default;
+    Image(const Image&) = delete;
+    Image& operator=(const Image&) = delete;
+    Image(Image&& other) noexcept;
+    Image& operator=(Image&& other) noexcept;
+    ~Image();
+
+    // Maps the file read-only. Code and constants are then used in place.
+    bool open(const char* path);
+    // Takes ownership of an image built in memory.
+    bool load(std::vector<uint8_t> bytes);
+    const char* error() const { return error_message; }
+    const uint8_t* bytes() const { return data; }
+    size_t byte_size() const { return size; }
+
+    size_t function_count() const { return section_size(SECTION_FUNCTIONS) / sizeof(ImageFunction); }
+    const ImageFunction& function(size_t index) const { return functions()[index]; }
+    std::string_view function_name(size_t index) const;
+    const uint8_t* code(size_t index) const { return code_base + function(index).code_offset; }
+    const int32_t* lines(size_t index) const { return lines_base + function(index).code_offset; }
+
+    size_t native_count() const { return section_size(SECTION_NATIVES) / sizeof(ImageNative); }
+    const ImageNative& native(size_t index) const { return natives()[index]; }
+    std::string_view native_name(size_t index) const {
+        return name(native(index).name_offset, native(index).name_length);
+    }
+
+    size_t import_count() const { return section_size(SECTION_IMPORTS) / sizeof(ImageImport); }
+    const ImageImport& module_import(size_t index) const { return imports()[index]; }
+    std::string_view import_name(size_t index) const {
+        return name(module_import(index).name_offset, module_import(index).name_length);
+    }
+
+    size_t component_count() const { return section_size(SECTION_COMPONENTS) / sizeof(ImageComponent); }
+    const ImageComponent& component(size_t index) const { return components()[index]; }
+    std::string_view component_name(size_t index) const {
+        return name(component(index).name_offset, component(index).name_length);
+    }
+
+    size_t system_count() const { return section_size(SECTION_SYSTEMS) / sizeof(ImageSystem); }
+    const ImageSystem& system(size_t index) const { return systems()[index]; }
+    std::string_view system_stage(size_t index) const {
+        return name(system(index).stage_offset, system(index).stage_length);
+    }
+
+    size_t constant_count() const { return section_size(SECTION_CONSTANTS) / sizeof(ImageConstant); }
+    const ImageConstant* constants() const { return (const ImageConstant*)section(SECTION_CONSTANTS); }
+
+    size_t strings_size() const { return section_size(SECTION_STRINGS); }
+    const char* strings() const { return (const char*)section(SECTION_STRINGS); }
+private:
+    bool validate();
+    bool fail(const char* message);
+    void release();
+    const ImageFunction* functions() const { return (const ImageFunction*)section(SECTION_FUNCTIONS); }
+    const ImageNative* natives() const { return (const ImageNative*)section(SECTION_NATIVES); }
+    const ImageImport* imports() const { return (const ImageImport*)section(SECTION_IMPORTS); }
+    const ImageComponent* components() const { return (const ImageComponent*)section(SECTION_COMPONENTS); }
+    const ImageSystem* systems() const { return (const ImageSystem*)section(SECTION_SYSTEMS); }
+    const uint8_t* section(ImageSectionKind kind) const { return data + sections[kind].offset; }
+    std::string_view name(uint32_t offset, uint32_t length) const {
+        return std::string_view((const char*)section(SECTION_NAMES) + offset, length);
+    }
+    size_t section_size(ImageSectionKind kind) const { return sections[kind].size; }
+
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    ImageSection sections[SECTION_COUNT] = {};
+    const uint8_t* code_base = nullptr;
+    const int32_t* lines_base = nullptr;
+
+    void* mapping = nullptr;
+    std::vector<uint8_t> owned;
+    const char* error_message = nullptr;
+};
+
+#endif
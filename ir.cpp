@@ -0,0 +1,255 @@
+#include <bit>
+#include <cmath>
+
+#include "ir.h"
+
+static const char* op_names[] = {
+        "parameter", "constant", "string", "phi", "copy",
+        "add", "subtract", "multiply", "divide", "modulo",
+        "equal", "not_equal", "greater", "greater_equal", "less", "less_equal",
+        "not", "negate",
+        "add_assign", "subtract_assign", "multiply_assign", "divide_assign",
+        "call", "call_native", "print",
+        "jump", "branch", "return",
+};
+
+bool IrFunction::terminated(IrBlockIndex block) const {
+    const std::vector<IrValue>& instructions = blocks[block].instructions;
+    return !instructions.empty() && ir_terminator(this->instructions[instructions.back()].op);
+}
+
+IrValue IrFunction::add(IrBlockIndex block, IrOp op, std::initializer_list<IrValue> operands, uint32_t index) {
+    IrValue value = instructions.size();
+    instructions.push_back(IrInstruction{op, false, block, (uint32_t)this->operands.size(), (uint32_t)operands.size(),
+                                         index, AST_NONE, {IR_NONE, IR_NONE}});
+    this->operands.insert(this->operands.end(), operands.begin(), operands.end());
+
+    std::vector<IrValue>& list = blocks[block].instructions;
+    if (op == IR_PHI) {
+        auto first = list.begin();
+        while (first != list.end() && instructions[*first].op == IR_PHI) first++;
+        list.insert(first, value);
+    } else {
+        list.push_back(value);
+    }
+    return value;
+}
+
+IrValue IrFunction::add(IrBlockIndex block, IrOp op, const std::vector<IrValue>& operands, uint32_t index) {
+    IrValue value = add(block, op, {}, index);
+    instructions[value].operand_count = operands.size();
+    this->operands.insert(this->operands.end(), operands.begin(), operands.end());
+    return value;
+}
+
+uint32_t IrFunction::intern(Value value) {
+    if (IS_NUMBER(value)) {
+        auto [constant, inserted] = constant_intern.try_emplace(std::bit_cast<uint64_t>(AS_NUMBER(value)),
+                                                                constants.size());
+        if (inserted) constants.push_back(value);
+        return constant->second;
+    }
+    // Only nil, true and false are left, so a scan is enough.
+    for (size_t i = 0; i < constants.size(); i++) {
+        if (!IS_NUMBER(constants[i]) && values_equal(constants[i], value)) return i;
+    }
+    constants.push_back(value);
+    return constants.size() - 1;
+}
+
+std::vector<uint32_t> IrFunction::positions() const {
+    std::vector<uint32_t> positions(blocks.size(), IR_NONE);
+    for (size_t i = 0; i < layout.size(); i++) {
+        positions[layout[i]] = i;
+    }
+    return positions;
+}
+
+// Cooper, Harvey and Kennedy's iterative algorithm. The layout already
+// places every block after the blocks that dominate it.
+std::vector<IrBlockIndex> IrFunction::dominators() const {
+    std::vector<uint32_t> position = positions();
+    std::vector<IrBlockIndex> idom(blocks.size(), IR_NONE);
+    idom[layout[0]] = layout[0];
+
+    auto intersect = [&](IrBlockIndex a, IrBlockIndex b) {
+        while (a != b) {
+            while (position[a] > position[b]) a = idom[a];
+            while (position[b] > position[a]) b = idom[b];
+        }
+        return a;
+    };
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 1; i < layout.size(); i++) {
+            IrBlockIndex block = layout[i];
+            IrBlockIndex dominator = IR_NONE;
+            for (IrBlockIndex predecessor : blocks[block].predecessors) {
+                if (idom[predecessor] == IR_NONE) continue;
+                dominator = dominator == IR_NONE ? predecessor : intersect(predecessor, dominator);
+            }
+            if (idom[block] != dominator) {
+                idom[block] = dominator;
+                changed = true;
+            }
+        }
+    }
+    return idom;
+}
+
+std::vector<uint32_t> IrFunction::use_counts() const {
+    std::vector<uint32_t> uses(instructions.size(), 0);
+    for (IrBlockIndex block : layout) {
+        for (IrValue value : blocks[block].instructions) {
+            const IrValue* operands = operands_of(value);
+            for (uint32_t i = 0; i < instructions[value].operand_count; i++) {
+                uses[operands[i]]++;
+            }
+        }
+    }
+    return uses;
+}
+
+bool ir_terminator(IrOp op) {
+    return op == IR_JUMP || op == IR_BRANCH || op == IR_RETURN;
+}
+
+bool ir_rematerializable(IrOp op) {
+    return op == IR_CONSTANT || op == IR_STRING;
+}
+
+static bool numeric(const IrFunction& function, IrValue value, const std::vector<bool>& numeric_values) {
+    const IrInstruction& instruction = function[value];
+    const IrValue* operands = function.operands_of(value);
+    switch (instruction.op) {
+        case IR_CONSTANT: return IS_NUMBER(function.constants[instruction.index]);
+        case IR_ADD: return numeric_values[operands[0]] && numeric_values[operands[1]];
+        case IR_COPY: return numeric_values[operands[0]];
+        case IR_PHI:
+            for (uint32_t i = 0; i < instruction.operand_count; i++) {
+                if (!numeric_values[operands[i]]) return false;
+            }
+            return true;
+        // These fail rather than produce anything else.
+        case IR_SUBTRACT:
+        case IR_MULTIPLY:
+        case IR_DIVIDE:
+        case IR_MODULO:
+        case IR_NEGATE:
+        case IR_ADD_ASSIGN:
+        case IR_SUBTRACT_ASSIGN:
+        case IR_MULTIPLY_ASSIGN:
+        case IR_DIVIDE_ASSIGN:
+            return true;
+        default: return false;
+    }
+}
+
+std::vector<bool> ir_numeric_values(const IrFunction& function) {
+    // Phis start optimistic so loop-carried numbers are found; everything
+    // only ever flips from numeric to not, so this settles.
+    std::vector<bool> numeric_values(function.instructions.size(), false);
+    for (const IrInstruction& instruction : function.instructions) {
+        if (instruction.op == IR_PHI) numeric_values[&instruction - function.instructions.data()] = true;
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (IrBlockIndex block : function.layout) {
+            for (IrValue value : function.blocks[block].instructions) {
+                bool is_numeric = numeric(function, value, numeric_values);
+                if (is_numeric != numeric_values[value]) {
+                    numeric_values[value] = is_numeric;
+                    changed = true;
+                }
+            }
+        }
+    }
+    return numeric_values;
+}
+
+bool ir_speculatable(const IrFunction& function, IrValue value, const std::vector<bool>& numeric) {
+    const IrInstruction& instruction = function[value];
+    const IrValue* operands = function.operands_of(value);
+    switch (instruction.op) {
+        case IR_PARAMETER:
+        case IR_CONSTANT:
+        case IR_STRING:
+        case IR_PHI:
+        case IR_COPY:
+        case IR_NOT:
+        case IR_EQUAL:
+        case IR_NOT_EQUAL:
+            return true;
+        case IR_ADD:
+        case IR_SUBTRACT:
+        case IR_MULTIPLY:
+        case IR_DIVIDE:
+        case IR_GREATER:
+        case IR_GREATER_EQUAL:
+        case IR_LESS:
+        case IR_LESS_EQUAL:
+        case IR_ADD_ASSIGN:
+        case IR_SUBTRACT_ASSIGN:
+        case IR_MULTIPLY_ASSIGN:
+        case IR_DIVIDE_ASSIGN:
+            return numeric[operands[0]] && numeric[operands[1]];
+        case IR_NEGATE: return numeric[operands[0]];
+        case IR_MODULO: {
+            // The VM works in longs, which trap on x % 0 and LONG_MIN % -1.
+            if (!numeric[operands[0]] || function[operands[1]].op != IR_CONSTANT) return false;
+            Value divisor = function.constants[function[operands[1]].index];
+            if (!IS_NUMBER(divisor) || !(std::fabs(AS_NUMBER(divisor)) < 9.0e18)) return false;
+            long divisor_long = AS_NUMBER(divisor);
+            return divisor_long != 0 && divisor_long != -1;
+        }
+        default: return false;
+    }
+}
+
+static void print_constant(std::ostream& os, const Value& value) {
+    if (IS_NUMBER(value)) os << AS_NUMBER(value);
+    else if (IS_BOOL(value)) os << (AS_BOOL(value) ? "true" : "false");
+    else os << "nil";
+}
+
+void print_ir(std::ostream& os, const IrFunction& function, const Ast& ast) {
+    for (IrBlockIndex block : function.layout) {
+        os << "b" << block << ":";
+        const std::vector<IrBlockIndex>& predecessors = function.blocks[block].predecessors;
+        for (size_t i = 0; i < predecessors.size(); i++) {
+            os << (i == 0 ? " <- " : ", ") << "b" << predecessors[i];
+        }
+        for (const IrLoop& loop : function.loops) {
+            if (loop.header == block) os << " (loop to b" << loop.latch << ")";
+        }
+        os << std::endl;
+
+        for (IrValue value : function.blocks[block].instructions) {
+            const IrInstruction& instruction = function[value];
+            const IrValue* operands = function.operands_of(value);
+            os << "    ";
+            if (!ir_terminator(instruction.op) && instruction.op != IR_PRINT) os << "v" << value << " = ";
+            os << op_names[instruction.op];
+            switch (instruction.op) {
+                case IR_PARAMETER: os << " " << instruction.index; break;
+                case IR_CONSTANT: os << " "; print_constant(os, function.constants[instruction.index]); break;
+                case IR_STRING: os << " " << ast.token(instruction.token).lexeme; break;
+                case IR_CALL:
+                case IR_CALL_NATIVE: os << " " << ast.token(instruction.token).lexeme; break;
+                default: break;
+            }
+            for (uint32_t i = 0; i < instruction.operand_count; i++) {
+                os << (i == 0 ? " " : ", ") << "v" << operands[i];
+                if (instruction.op == IR_PHI) os << " (b" << function.blocks[block].predecessors[i] << ")";
+            }
+            if (instruction.op == IR_JUMP) os << " b" << instruction.successors[0];
+            if (instruction.op == IR_BRANCH) {
+                os << ", b" << instruction.successors[0] << ", b" << instruction.successors[1];
+            }
+            os << std::endl;
+        }
+    }
+}
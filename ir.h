@@ -0,0 +1,130 @@
+#ifndef MOSAIC_ECS_IR_H
+#define MOSAIC_ECS_IR_H
+
+#include <ostream>
+#include <stdint.h>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "ast.h"
+#include "value.h"
+
+// The SSA form function bodies take at -O2, between the Ast and bytecode.
+// Every instruction defines at most one value, named by its index, and
+// each block ends in exactly one terminator.
+typedef uint32_t IrValue;
+typedef uint32_t IrBlockIndex;
+#define IR_NONE UINT32_MAX
+
+enum IrOp : uint8_t {
+    // index: the parameter's slot.
+    IR_PARAMETER,
+    // index: IrFunction::constants. Rematerialized at each use, never stored.
+    IR_CONSTANT,
+    // token: the literal. Rematerialized like constants.
+    IR_STRING,
+    // One operand per predecessor, in IrBlock::predecessors order.
+    IR_PHI,
+    IR_COPY,
+    IR_ADD,
+    IR_SUBTRACT,
+    IR_MULTIPLY,
+    IR_DIVIDE,
+    IR_MODULO,
+    IR_EQUAL,
+    IR_NOT_EQUAL,
+    IR_GREATER,
+    IR_GREATER_EQUAL,
+    IR_LESS,
+    IR_LESS_EQUAL,
+    IR_NOT,
+    IR_NEGATE,
+    // `x op= e` with operands x and e. The bytecode updates x's slot in
+    // place, so the result is given the same slot whenever x dies here.
+    IR_ADD_ASSIGN,
+    IR_SUBTRACT_ASSIGN,
+    IR_MULTIPLY_ASSIGN,
+    IR_DIVIDE_ASSIGN,
+    // index: the function or native; token: the callee's name.
+    IR_CALL,
+    IR_CALL_NATIVE,
+    IR_PRINT,
+    // Terminators. successors[0] for jumps; truthy then falsey for branches.
+    IR_JUMP,
+    IR_BRANCH,
+    IR_RETURN,
+};
+
+struct IrInstruction {
+    IrOp op;
+    // Removed by a pass and no longer in any block.
+    bool dead;
+    IrBlockIndex block;
+    // Operands live in IrFunction::operands[first_operand, + operand_count).
+    uint32_t first_operand;
+    uint32_t operand_count;
+    uint32_t index;
+    TokenIndex token;
+    IrBlockIndex successors[2];
+};
+
+struct IrBlock {
+    // Phis first, the terminator last.
+    std::vector<IrValue> instructions;
+    std::vector<IrBlockIndex> predecessors;
+};
+
+// A while loop. Its body is every block laid out from header to latch.
+struct IrLoop {
+    // Jumps only to the header; invariant code is hoisted to its end.
+    IrBlockIndex preheader;
+    IrBlockIndex header;
+    IrBlockIndex latch;
+};
+
+struct IrFunction {
+    std::string_view name;
+    uint32_t arity = 0;
+    std::vector<IrInstruction> instructions;
+    std::vector<IrValue> operands;
+    std::vector<IrBlock> blocks;
+    // Emission order; the first block is the entry.
+    std::vector<IrBlockIndex> layout;
+    // Innermost loops first.
+    std::vector<IrLoop> loops;
+    std::vector<Value> constants;
+
+    const IrInstruction& operator[](IrValue value) const { return instructions[value]; }
+    IrInstruction& operator[](IrValue value) { return instructions[value]; }
+    IrValue* operands_of(IrValue value) { return operands.data() + instructions[value].first_operand; }
+    const IrValue* operands_of(IrValue value) const { return operands.data() + instructions[value].first_operand; }
+    bool terminated(IrBlockIndex block) const;
+    // Appends an instruction to the end of block, or before its first
+    // non-phi instruction for phis.
+    IrValue add(IrBlockIndex block, IrOp op, std::initializer_list<IrValue> operands = {}, uint32_t index = 0);
+    IrValue add(IrBlockIndex block, IrOp op, const std::vector<IrValue>& operands, uint32_t index = 0);
+    // Constants are shared by bit pattern, so equal constants are one value
+    // to value numbering.
+    uint32_t intern(Value value);
+    // Position of every block in layout, IR_NONE for blocks not laid out.
+    std::vector<uint32_t> positions() const;
+    // Immediate dominator of every laid out block; the entry's is itself.
+    std::vector<IrBlockIndex> dominators() const;
+    // Use counts of every live instruction's operands.
+    std::vector<uint32_t> use_counts() const;
+private:
+    std::unordered_map<uint64_t, uint32_t> constant_intern;
+};
+
+bool ir_terminator(IrOp op);
+// Constants and strings, which are cheaper to push again than to keep.
+bool ir_rematerializable(IrOp op);
+// Values that are certainly numbers whenever they have been computed.
+std::vector<bool> ir_numeric_values(const IrFunction& function);
+// Whether computing value can neither fail nor have an effect, so it may
+// be executed where it wasn't, or not at all.
+bool ir_speculatable(const IrFunction& function, IrValue value, const std::vector<bool>& numeric);
+void print_ir(std::ostream& os, const IrFunction& function, const Ast& ast);
+
+#endif
@@ -0,0 +1,724 @@
+#include <string>
+
+#include "compiler.h"
+#include "ir_builder.h"
+
+IrBuilder::IrBuilder(Compiler& compiler) : compiler(compiler), ast(compiler.ast), current(0) {}
+
+bool IrBuilder::supported(const TokenIndex* parameters, uint32_t arity, const StmtIndex* body, uint32_t count) {
+    reset_scopes();
+    declared_functions.clear();
+    begin_scope();
+    for (uint32_t i = 0; i < arity; i++) {
+        int variable = declare(parameters[i]);
+        if (variable == -1) return false;
+        variables[variable].initialized = true;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (!check_stmt(body[i])) return false;
+    }
+    return true;
+}
+
+// Everything the Compiler would report as an error, or compile in a way
+// that only works by accident, is left to it.
+bool IrBuilder::check_stmt(StmtIndex index) {
+    const Stmt& stmt = ast.stmt(index);
+    switch (stmt.type) {
+        case STMT_BLOCK: {
+            begin_scope();
+            const StmtIndex* stmts = ast.list(stmt.block.stmts);
+            for (uint32_t i = 0; i < stmt.block.count; i++) {
+                if (!check_stmt(stmts[i])) return false;
+            }
+            end_scope();
+            return true;
+        }
+        case STMT_EXPR: return check_expr(stmt.expr_stmt.expr);
+        case STMT_FUN: return check_function(stmt.fun);
+        case STMT_IF:
+            return check_expr(stmt.if_stmt.condition) && check_branch(stmt.if_stmt.then_branch) &&
+                   (stmt.if_stmt.else_branch == AST_NONE || check_branch(stmt.if_stmt.else_branch));
+        case STMT_LET: {
+            int variable = declare(stmt.let.name);
+            if (variable == -1) return false;
+            if (stmt.let.initializer != AST_NONE && !check_expr(stmt.let.initializer)) return false;
+            variables[variable].initialized = true;
+            return true;
+        }
+        case STMT_PRINT: return check_expr(stmt.print.value);
+        case STMT_RETURN: return check_expr(stmt.return_stmt.value);
+        case STMT_WHILE: return check_expr(stmt.while_stmt.condition) && check_branch(stmt.while_stmt.body);
+        // Only declares; the Compiler reads components off the script.
+        case STMT_COMP: return true;
+        // Queries iterate the world, which the IR knows nothing of.
+        case STMT_QUERY:
+        case STMT_RUN: return false;
+    }
+    return false;
+}
+
+// A let as the whole branch of an if or body of a while leaves the stack
+// unbalanced in the Compiler's output.
+bool IrBuilder::check_branch(StmtIndex index) {
+    return ast.stmt(index).type != STMT_LET && check_stmt(index);
+}
+
+bool IrBuilder::check_expr(ExprIndex index) {
+    const Expr& expr = ast.expr(index);
+    switch (expr.type) {
+        case EXPR_ASSIGN: return check_variable(expr.assign.name) && check_expr(expr.assign.value);
+        case EXPR_COMPOUND_ASSIGN:
+            return check_variable(expr.compound_assign.name) && check_expr(expr.compound_assign.value);
+        case EXPR_BINARY: return check_expr(expr.binary.left) && check_expr(expr.binary.right);
+        case EXPR_CALL: {
+            const ExprIndex* arguments = ast.list(expr.call.arguments);
+            for (uint32_t i = 0; i < expr.call.argument_count; i++) {
+                if (!check_expr(arguments[i])) return false;
+            }
+            // Resolved as Compiler::resolve_function does, without calls
+            // through locals holding functions.
+            uint32_t symbol = ast.token(expr.call.callee).symbol;
+            uint32_t arity;
+            if (int function = compiler.function_binding(symbol); function != -1) {
+                arity = compiler.program->functions[function].arity;
+            } else if (auto declared = declared_functions.find(symbol); declared != declared_functions.end()) {
+                arity = declared->second;
+            } else if (int native = compiler.native_bindings[symbol]; native != -1) {
+                arity = compiler.ffi.native_functions[native].arity;
+            } else {
+                return false;
+            }
+            return expr.call.argument_count == arity;
+        }
+        case EXPR_LITERAL: return true;
+        case EXPR_LOGICAL: return check_expr(expr.logical.left) && check_expr(expr.logical.right);
+        case EXPR_COMMAND:
+        case EXPR_GET:
+        case EXPR_SET: return false;
+        case EXPR_UNARY: return check_expr(expr.unary.right);
+        // Functions read as values are left to the Compiler too.
+        case EXPR_VARIABLE: return check_variable(expr.variable.name);
+    }
+    return false;
+}
+
+bool IrBuilder::check_variable(TokenIndex name) {
+    int variable = lookup(name);
+    return variable != -1 && variables[variable].initialized;
+}
+
+// Records the function and every function nested in it, which all become
+// callable once it is compiled. Redeclarations are left to the Compiler.
+bool IrBuilder::check_function(const FunStmt& fun) {
+    uint32_t symbol = ast.token(fun.name).symbol;
+    if (compiler.function_binding(symbol) != -1 || declared_functions.contains(symbol)) return false;
+    declared_functions[symbol] = fun.arity;
+    return check_declarations(fun.body);
+}
+
+bool IrBuilder::check_declarations(StmtIndex index) {
+    const Stmt& stmt = ast.stmt(index);
+    switch (stmt.type) {
+        case STMT_BLOCK: {
+            const StmtIndex* stmts = ast.list(stmt.block.stmts);
+            for (uint32_t i = 0; i < stmt.block.count; i++) {
+                if (!check_declarations(stmts[i])) return false;
+            }
+            return true;
+        }
+        case STMT_FUN: return check_function(stmt.fun);
+        case STMT_IF:
+            return check_declarations(stmt.if_stmt.then_branch) &&
+                   (stmt.if_stmt.else_branch == AST_NONE || check_declarations(stmt.if_stmt.else_branch));
+        case STMT_WHILE: return check_declarations(stmt.while_stmt.body);
+        default: return true;
+    }
+}
+
+IrFunction IrBuilder::build(std::string_view name, const TokenIndex* parameters, uint32_t arity,
+                            const StmtIndex* body, uint32_t count) {
+    reset_scopes();
+    function = IrFunction();
+    function.name = name;
+    function.arity = arity;
+    sealed.clear();
+    incomplete_phis.clear();
+    definitions.clear();
+    inlines.clear();
+
+    IrBlockIndex entry = new_block();
+    seal(entry);
+    start(entry);
+    begin_scope();
+    for (uint32_t i = 0; i < arity; i++) {
+        int variable = declare(parameters[i]);
+        variables[variable].initialized = true;
+        write_variable(variable, current, add(IR_PARAMETER, {}, i));
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        statement(body[i]);
+    }
+    end_scope();
+    if (!function.terminated(current)) add(IR_RETURN, {constant(Nil{})});
+
+    remove_unreachable();
+    return std::move(function);
+}
+
+void IrBuilder::statement(StmtIndex index) {
+    const Stmt& stmt = ast.stmt(index);
+    switch (stmt.type) {
+        case STMT_BLOCK: {
+            begin_scope();
+            const StmtIndex* stmts = ast.list(stmt.block.stmts);
+            for (uint32_t i = 0; i < stmt.block.count; i++) {
+                statement(stmts[i]);
+            }
+            end_scope();
+            break;
+        }
+        case STMT_COMP: break;
+        case STMT_EXPR: value(stmt.expr_stmt.expr); break;
+        case STMT_FUN: compiler.fun_declaration(index); break;
+        case STMT_IF: {
+            IrBlockIndex then_block = new_block();
+            IrBlockIndex else_block = new_block();
+            IrBlockIndex end = new_block();
+            condition(stmt.if_stmt.condition, then_block, else_block);
+
+            seal(then_block);
+            start(then_block);
+            statement(stmt.if_stmt.then_branch);
+            jump(end);
+
+            seal(else_block);
+            start(else_block);
+            if (stmt.if_stmt.else_branch != AST_NONE) statement(stmt.if_stmt.else_branch);
+            jump(end);
+
+            seal(end);
+            start(end);
+            break;
+        }
+        case STMT_LET: {
+            int variable = declare(stmt.let.name);
+            IrValue initializer = stmt.let.initializer != AST_NONE ? value(stmt.let.initializer) : constant(Nil{});
+            write_variable(variable, current, add(IR_COPY, {initializer}));
+            variables[variable].initialized = true;
+            break;
+        }
+        case STMT_PRINT: add(IR_PRINT, {value(stmt.print.value)}); break;
+        case STMT_RETURN: {
+            IrValue result = value(stmt.return_stmt.value);
+            if (inlines.empty()) add(IR_RETURN, {result});
+            else inline_return(result);
+            // Whatever follows is unreachable, but may still declare functions.
+            IrBlockIndex rest = new_block();
+            seal(rest);
+            start(rest);
+            break;
+        }
+        case STMT_WHILE: {
+            IrBlockIndex preheader = current;
+            IrBlockIndex header = new_block();
+            IrBlockIndex body = new_block();
+            IrBlockIndex exit = new_block();
+            jump(header);
+
+            start(header);
+            condition(stmt.while_stmt.condition, body, exit);
+
+            seal(body);
+            start(body);
+            statement(stmt.while_stmt.body);
+            IrBlockIndex latch = current;
+            jump(header);
+            seal(header);
+
+            seal(exit);
+            start(exit);
+            function.loops.push_back(IrLoop{preheader, header, latch});
+            break;
+        }
+        default: break;
+    }
+}
+
+IrValue IrBuilder::value(ExprIndex index) {
+    const Expr& expr = ast.expr(index);
+    switch (expr.type) {
+        case EXPR_ASSIGN: {
+            IrValue value = add(IR_COPY, {this->value(expr.assign.value)});
+            write_variable(lookup(expr.assign.name), current, value);
+            return value;
+        }
+        case EXPR_COMPOUND_ASSIGN: {
+            const CompoundAssign& assign = expr.compound_assign;
+            // The Compiler evaluates the right side first and then updates
+            // the slot in place, so the variable is read afterwards.
+            IrValue value = this->value(assign.value);
+            IrOp op;
+            switch (ast.token(assign.op).type) {
+                case TOKEN_PLUS_EQUAL: op = IR_ADD_ASSIGN; break;
+                case TOKEN_MINUS_EQUAL: op = IR_SUBTRACT_ASSIGN; break;
+                case TOKEN_STAR_EQUAL: op = IR_MULTIPLY_ASSIGN; break;
+                case TOKEN_SLASH_EQUAL: op = IR_DIVIDE_ASSIGN; break;
+                // The Compiler has no instruction for %= and leaves the
+                // variable alone.
+                default: return value;
+            }
+            int variable = lookup(assign.name);
+            write_variable(variable, current, add(op, {read_variable(variable, current), value}));
+            // Like the bytecode, the expression is worth its right side.
+            return value;
+        }
+        case EXPR_BINARY: {
+            IrValue left = value(expr.binary.left);
+            IrValue right = value(expr.binary.right);
+            IrOp op;
+            switch (ast.token(expr.binary.op).type) {
+                case TOKEN_PLUS: op = IR_ADD; break;
+                case TOKEN_MINUS: op = IR_SUBTRACT; break;
+                case TOKEN_STAR: op = IR_MULTIPLY; break;
+                case TOKEN_SLASH: op = IR_DIVIDE; break;
+                case TOKEN_MODULO: op = IR_MODULO; break;
+                case TOKEN_EQUAL_EQUAL: op = IR_EQUAL; break;
+                case TOKEN_BANG_EQUAL: op = IR_NOT_EQUAL; break;
+                case TOKEN_GREATER: op = IR_GREATER; break;
+                case TOKEN_GREATER_EQUAL: op = IR_GREATER_EQUAL; break;
+                case TOKEN_LESS: op = IR_LESS; break;
+                default: op = IR_LESS_EQUAL; break;
+            }
+            return add(op, {left, right});
+        }
+        case EXPR_CALL: {
+            std::vector<IrValue> arguments;
+            const ExprIndex* argument_exprs = ast.list(expr.call.arguments);
+            for (uint32_t i = 0; i < expr.call.argument_count; i++) {
+                arguments.push_back(value(argument_exprs[i]));
+            }
+            uint32_t symbol = ast.token(expr.call.callee).symbol;
+            int function_index = compiler.function_binding(symbol);
+            if (function_index != -1) {
+                IrValue inlined = inline_call(function_index, arguments);
+                if (inlined != IR_NONE) return inlined;
+            }
+            IrValue call = function_index != -1
+                    ? function.add(current, IR_CALL, arguments, function_index)
+                    : function.add(current, IR_CALL_NATIVE, arguments, compiler.native_bindings[symbol]);
+            function[call].token = expr.call.callee;
+            return call;
+        }
+        case EXPR_LITERAL: {
+            Value literal;
+            if (literal_value(ast, expr.literal, literal)) return constant(literal);
+            IrValue string = add(IR_STRING);
+            function[string].token = expr.literal.token;
+            return string;
+        }
+        case EXPR_LOGICAL: return logical(expr.logical);
+        case EXPR_UNARY: {
+            IrValue right = value(expr.unary.right);
+            return add(ast.token(expr.unary.op).type == TOKEN_BANG ? IR_NOT : IR_NEGATE, {right});
+        }
+        case EXPR_VARIABLE: return read_variable(lookup(expr.variable.name), current);
+        default: return constant(Nil{});
+    }
+}
+
+// `a || b` is a when a is truthy and `a && b` is a when it is falsey;
+// otherwise both are b.
+IrValue IrBuilder::logical(const Logical& logical) {
+    IrValue left = value(logical.left);
+    bool is_or = ast.token(logical.op).type == TOKEN_OR;
+    IrBlockIndex right_block = new_block();
+    IrBlockIndex left_block = new_block();
+    IrBlockIndex end = new_block();
+    IrValue right = IR_NONE;
+
+    if (is_or) {
+        branch(left, left_block, right_block);
+        seal(left_block);
+        start(left_block);
+        jump(end);
+        seal(right_block);
+        start(right_block);
+        right = value(logical.right);
+        jump(end);
+    } else {
+        branch(left, right_block, left_block);
+        seal(right_block);
+        start(right_block);
+        right = value(logical.right);
+        jump(end);
+        seal(left_block);
+        start(left_block);
+        jump(end);
+    }
+
+    seal(end);
+    start(end);
+    std::vector<IrValue> operands;
+    for (IrBlockIndex predecessor : function.blocks[end].predecessors) {
+        operands.push_back(predecessor == left_block ? left : right);
+    }
+    return function.add(end, IR_PHI, operands);
+}
+
+// Conditions of ifs and whiles branch straight to their targets, without
+// materializing the value of && and ||.
+void IrBuilder::condition(ExprIndex index, IrBlockIndex truthy, IrBlockIndex falsey) {
+    const Expr& expr = ast.expr(index);
+    if (expr.type != EXPR_LOGICAL) {
+        branch(value(index), truthy, falsey);
+        return;
+    }
+    IrBlockIndex right = new_block();
+    if (ast.token(expr.logical.op).type == TOKEN_OR) condition(expr.logical.left, truthy, right);
+    else condition(expr.logical.left, right, falsey);
+    seal(right);
+    start(right);
+    condition(expr.logical.right, truthy, falsey);
+}
+
+IrValue IrBuilder::read_variable(int variable, IrBlockIndex block) {
+    auto definition = definitions.find((uint64_t)variable << 32 | block);
+    if (definition != definitions.end()) return definition->second;
+    return read_variable_recursive(variable, block);
+}
+
+IrValue IrBuilder::read_variable_recursive(int variable, IrBlockIndex block) {
+    IrValue value;
+    size_t predecessor_count = function.blocks[block].predecessors.size();
+    if (!sealed[block]) {
+        value = function.add(block, IR_PHI);
+        incomplete_phis[block].push_back({variable, value});
+    } else if (predecessor_count == 0) {
+        // Only in unreachable code, which is dropped.
+        value = function.add(block, IR_CONSTANT, {}, function.intern(Nil{}));
+        std::vector<IrValue>& instructions = function.blocks[block].instructions;
+        if (instructions.size() > 1 && ir_terminator(function[instructions[instructions.size() - 2]].op)) {
+            std::swap(instructions[instructions.size() - 1], instructions[instructions.size() - 2]);
+        }
+    } else if (predecessor_count == 1) {
+        value = read_variable(variable, function.blocks[block].predecessors[0]);
+    } else {
+        // Defined first so that reads around a loop find the phi.
+        value = function.add(block, IR_PHI);
+        write_variable(variable, block, value);
+        add_phi_operands(variable, value);
+    }
+    write_variable(variable, block, value);
+    return value;
+}
+
+void IrBuilder::write_variable(int variable, IrBlockIndex block, IrValue value) {
+    definitions[(uint64_t)variable << 32 | block] = value;
+}
+
+void IrBuilder::add_phi_operands(int variable, IrValue phi) {
+    // Reads may add phis of their own, so gather before appending.
+    std::vector<IrValue> operands;
+    IrBlockIndex block = function[phi].block;
+    for (size_t i = 0; i < function.blocks[block].predecessors.size(); i++) {
+        operands.push_back(read_variable(variable, function.blocks[block].predecessors[i]));
+    }
+    function[phi].first_operand = function.operands.size();
+    function[phi].operand_count = operands.size();
+    function.operands.insert(function.operands.end(), operands.begin(), operands.end());
+}
+
+IrBlockIndex IrBuilder::new_block() {
+    function.blocks.emplace_back();
+    sealed.push_back(false);
+    incomplete_phis.emplace_back();
+    return function.blocks.size() - 1;
+}
+
+// Called once every predecessor of block is known.
+void IrBuilder::seal(IrBlockIndex block) {
+    std::vector<std::pair<int, IrValue>> phis = std::move(incomplete_phis[block]);
+    for (auto [variable, phi] : phis) {
+        add_phi_operands(variable, phi);
+    }
+    sealed[block] = true;
+}
+
+void IrBuilder::start(IrBlockIndex block) {
+    current = block;
+    function.layout.push_back(block);
+}
+
+IrValue IrBuilder::add(IrOp op, std::initializer_list<IrValue> operands, uint32_t index) {
+    return function.add(current, op, operands, index);
+}
+
+IrValue IrBuilder::constant(Value value) {
+    return add(IR_CONSTANT, {}, function.intern(value));
+}
+
+void IrBuilder::jump(IrBlockIndex target) {
+    IrValue jump = add(IR_JUMP);
+    function[jump].successors[0] = target;
+    function.blocks[target].predecessors.push_back(current);
+}
+
+void IrBuilder::branch(IrValue condition, IrBlockIndex truthy, IrBlockIndex falsey) {
+    IrValue branch = add(IR_BRANCH, {condition});
+    function[branch].successors[0] = truthy;
+    function[branch].successors[1] = falsey;
+    function.blocks[truthy].predecessors.push_back(current);
+    function.blocks[falsey].predecessors.push_back(current);
+}
+
+// Drops the blocks after returns, and their edges into reachable blocks.
+void IrBuilder::remove_unreachable() {
+    std::vector<bool> reachable(function.blocks.size(), false);
+    std::vector<IrBlockIndex> work = {function.layout[0]};
+    reachable[function.layout[0]] = true;
+    while (!work.empty()) {
+        IrBlockIndex block = work.back();
+        work.pop_back();
+        const IrInstruction& terminator = function[function.blocks[block].instructions.back()];
+        for (int i = 0; i < (terminator.op == IR_BRANCH ? 2 : terminator.op == IR_JUMP ? 1 : 0); i++) {
+            if (!reachable[terminator.successors[i]]) {
+                reachable[terminator.successors[i]] = true;
+                work.push_back(terminator.successors[i]);
+            }
+        }
+    }
+
+    std::vector<IrBlockIndex> layout;
+    for (IrBlockIndex block : function.layout) {
+        IrBlock& data = function.blocks[block];
+        if (!reachable[block]) {
+            for (IrValue value : data.instructions) {
+                function[value].dead = true;
+            }
+            data.instructions.clear();
+            data.predecessors.clear();
+            continue;
+        }
+        layout.push_back(block);
+
+        for (IrValue value : data.instructions) {
+            if (function[value].op != IR_PHI) break;
+            IrValue* operands = function.operands_of(value);
+            uint32_t kept = 0;
+            for (uint32_t i = 0; i < function[value].operand_count; i++) {
+                if (reachable[data.predecessors[i]]) operands[kept++] = operands[i];
+            }
+            function[value].operand_count = kept;
+        }
+        std::erase_if(data.predecessors, [&](IrBlockIndex predecessor) { return !reachable[predecessor]; });
+    }
+    function.layout = std::move(layout);
+
+    std::erase_if(function.loops, [&](const IrLoop& loop) {
+        return !reachable[loop.preheader] || !reachable[loop.header] || !reachable[loop.latch];
+    });
+}
+
+// Inlines the call if the callee allows it, returning IR_NONE otherwise.
+// Arguments have been evaluated in order already, as for a real call.
+IrValue IrBuilder::inline_call(int callee, const std::vector<IrValue>& arguments) {
+    // An imported function's body is in another module's tree.
+    if (compiler.program->function_declarations[callee] == AST_NONE) return IR_NONE;
+    const FunStmt& fun = compiler.declaration_of(callee);
+    IrInlineScan body = function_scan(callee);
+
+    std::string decision;
+    if (fun.noinline) {
+        decision = "kept, declared noinline";
+    } else if (body.declares_functions) {
+        decision = "kept, declares functions";
+    } else if (body.nodes > IR_INLINE_LIMIT) {
+        decision = "kept, " + std::to_string(body.nodes) + " nodes over the limit of " +
+                   std::to_string(IR_INLINE_LIMIT);
+    } else if (inlines.size() >= IR_INLINE_DEPTH) {
+        decision = "kept, inlined too deep";
+    } else if (recursive(callee)) {
+        decision = "kept, recursive";
+    } else {
+        IrBuilder checker = IrBuilder(compiler);
+        if (!checker.supported(ast.list(fun.parameters), fun.arity, &fun.body, 1)) {
+            decision = "kept, body needs the Ast compiler";
+        }
+    }
+    if (compiler.debug_flags & DEBUG_INLINE) {
+        dump_inline(function.name, ast.token(fun.name).lexeme,
+                    decision.empty() ? "inlined, " + std::to_string(body.nodes) + " nodes" : decision);
+    }
+    if (!decision.empty()) return IR_NONE;
+
+    inlines.push_back(IrInline{new_block(), {}});
+    begin_scope();
+    const TokenIndex* parameters = ast.list(fun.parameters);
+    for (uint32_t i = 0; i < fun.arity; i++) {
+        int variable = declare(parameters[i]);
+        variables[variable].initialized = true;
+        write_variable(variable, current, add(IR_COPY, {arguments[i]}));
+    }
+    statement(fun.body);
+    end_scope();
+    if (!function.terminated(current)) inline_return(constant(Nil{}));
+
+    IrInline inlined = std::move(inlines.back());
+    inlines.pop_back();
+    seal(inlined.exit);
+    start(inlined.exit);
+    std::vector<IrValue> operands;
+    for (IrBlockIndex predecessor : function.blocks[inlined.exit].predecessors) {
+        for (auto [block, value] : inlined.returns) {
+            if (block == predecessor) operands.push_back(value);
+        }
+    }
+    return function.add(inlined.exit, IR_PHI, operands);
+}
+
+void IrBuilder::inline_return(IrValue value) {
+    inlines.back().returns.push_back({current, value});
+    jump(inlines.back().exit);
+}
+
+// Whether function can reach itself through the calls in its body and in
+// the bodies of everything it calls. Calls only reach functions declared
+// before them, or nested in a function they are in, so nothing nested in
+// an outermost function that ends before function can get back to it.
+bool IrBuilder::recursive(int function) {
+    const Compiler& program = *compiler.program;
+    std::vector<bool> visited(program.functions.size(), false);
+    std::vector<int> work = {function};
+    while (!work.empty()) {
+        int caller = work.back();
+        work.pop_back();
+        if (compiler.program->function_declarations[caller] == AST_NONE) continue;
+        for (uint32_t symbol : function_scan(caller).callees) {
+            int callee = compiler.function_binding(symbol);
+            if (callee == -1 || program.function_ends[program.function_roots[callee]] <= function) continue;
+            if (callee == function) return true;
+            if (!visited[callee]) {
+                visited[callee] = true;
+                work.push_back(callee);
+            }
+        }
+    }
+    return false;
+}
+
+const IrInlineScan& IrBuilder::function_scan(int function) {
+    std::vector<IrInlineScan>& scans = compiler.inline_scans;
+    if (scans.size() < compiler.program->functions.size()) {
+        scans.resize(compiler.program->functions.size());
+        compiler.inline_scanned.resize(scans.size(), false);
+    }
+    if (!compiler.inline_scanned[function]) {
+        scan(compiler.declaration_of(function).body, scans[function]);
+        compiler.inline_scanned[function] = true;
+    }
+    return scans[function];
+}
+
+void IrBuilder::scan(StmtIndex index, IrInlineScan& scan) const {
+    const Stmt& stmt = ast.stmt(index);
+    scan.nodes++;
+    switch (stmt.type) {
+        case STMT_BLOCK: {
+            const StmtIndex* stmts = ast.list(stmt.block.stmts);
+            for (uint32_t i = 0; i < stmt.block.count; i++) {
+                this->scan(stmts[i], scan);
+            }
+            break;
+        }
+        case STMT_EXPR: scan_expr(stmt.expr_stmt.expr, scan); break;
+        // Its calls are its own, made only when it is called.
+        case STMT_FUN: scan.declares_functions = true; break;
+        case STMT_IF:
+            scan_expr(stmt.if_stmt.condition, scan);
+            this->scan(stmt.if_stmt.then_branch, scan);
+            if (stmt.if_stmt.else_branch != AST_NONE) this->scan(stmt.if_stmt.else_branch, scan);
+            break;
+        case STMT_LET:
+            if (stmt.let.initializer != AST_NONE) scan_expr(stmt.let.initializer, scan);
+            break;
+        case STMT_PRINT: scan_expr(stmt.print.value, scan); break;
+        case STMT_RETURN: scan_expr(stmt.return_stmt.value, scan); break;
+        case STMT_RUN: this->scan(stmt.run.body, scan); break;
+        case STMT_WHILE:
+            scan_expr(stmt.while_stmt.condition, scan);
+            this->scan(stmt.while_stmt.body, scan);
+            break;
+        case STMT_COMP:
+        case STMT_QUERY: break;
+    }
+}
+
+void IrBuilder::scan_expr(ExprIndex index, IrInlineScan& scan) const {
+    const Expr& expr = ast.expr(index);
+    scan.nodes++;
+    switch (expr.type) {
+        case EXPR_ASSIGN: scan_expr(expr.assign.value, scan); break;
+        case EXPR_COMPOUND_ASSIGN: scan_expr(expr.compound_assign.value, scan); break;
+        case EXPR_BINARY:
+            scan_expr(expr.binary.left, scan);
+            scan_expr(expr.binary.right, scan);
+            break;
+        case EXPR_CALL: {
+            const ExprIndex* arguments = ast.list(expr.call.arguments);
+            for (uint32_t i = 0; i < expr.call.argument_count; i++) {
+                scan_expr(arguments[i], scan);
+            }
+            scan.callees.push_back(ast.token(expr.call.callee).symbol);
+            break;
+        }
+        case EXPR_LOGICAL:
+            scan_expr(expr.logical.left, scan);
+            scan_expr(expr.logical.right, scan);
+            break;
+        case EXPR_COMMAND: {
+            const ExprIndex* arguments = ast.list(expr.command.arguments);
+            for (uint32_t i = 0; i < expr.command.argument_count; i++) {
+                scan_expr(arguments[i], scan);
+            }
+            break;
+        }
+        case EXPR_SET: scan_expr(expr.set.value, scan); break;
+        case EXPR_UNARY: scan_expr(expr.unary.right, scan); break;
+        default: break;
+    }
+}
+
+int IrBuilder::declare(TokenIndex name) {
+    uint32_t symbol = ast.token(name).symbol;
+    int existing = symbol_variables[symbol];
+    if (existing != -1 && variables[existing].depth == (int)scopes.size()) return -1;
+    variables.push_back(IrVariable{symbol, existing, (int)scopes.size(), false});
+    symbol_variables[symbol] = variables.size() - 1;
+    scope_variables.push_back(variables.size() - 1);
+    return variables.size() - 1;
+}
+
+int IrBuilder::lookup(TokenIndex name) const {
+    return symbol_variables[ast.token(name).symbol];
+}
+
+void IrBuilder::begin_scope() {
+    scopes.push_back(scope_variables.size());
+}
+
+void IrBuilder::end_scope() {
+    while (scope_variables.size() > scopes.back()) {
+        const IrVariable& variable = variables[scope_variables.back()];
+        symbol_variables[variable.symbol] = variable.shadowed;
+        scope_variables.pop_back();
+    }
+    scopes.pop_back();
+}
+
+void IrBuilder::reset_scopes() {
+    variables.clear();
+    symbol_variables.assign(ast.symbols.size(), -1);
+    scope_variables.clear();
+    scopes.clear();
+}
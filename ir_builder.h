@@ -0,0 +1,116 @@
+#ifndef MOSAIC_ECS_IR_BUILDER_H
+#define MOSAIC_ECS_IR_BUILDER_H
+
+#include <unordered_map>
+#include <vector>
+
+#include "ast.h"
+#include "ir.h"
+
+class Compiler;
+
+// Calls to functions of at most this many Ast nodes are inlined, through at
+// most IR_INLINE_DEPTH levels of functions inlined into each other.
+#define IR_INLINE_LIMIT 32
+#define IR_INLINE_DEPTH 4
+
+struct IrVariable {
+    uint32_t symbol;
+    // The variable of the same symbol this one hides, or -1.
+    int shadowed;
+    // Its scope, counted from the function's parameters.
+    int depth;
+    // Unreadable within its own initializer, as in the Compiler.
+    bool initialized;
+};
+
+// A function body being inlined, whose returns jump to exit instead.
+struct IrInline {
+    IrBlockIndex exit;
+    // The value returned along each edge into exit.
+    std::vector<std::pair<IrBlockIndex, IrValue>> returns;
+};
+
+// What inlining a function body would bring along.
+struct IrInlineScan {
+    uint32_t nodes = 0;
+    bool declares_functions = false;
+    // Names it calls, resolved at each use: what a name calls depends on
+    // how far compilation has got, and scans are cached per Compiler.
+    std::vector<uint32_t> callees;
+};
+
+// Turns a function body, or the script, into SSA form as in Braun et al.,
+// "Simple and Efficient Construction of Static Single Assignment Form".
+// Nested function declarations are handed back to the Compiler as they are
+// reached, so functions are numbered and become callable exactly when they
+// would have without the IR. Calls to small functions that can't reach
+// themselves are replaced by their bodies, with the arguments bound to
+// fresh variables.
+class IrBuilder {
+public:
+    IrBuilder(Compiler& compiler);
+    // Whether the body only uses what the IR gives the same meaning as the
+    // Compiler. Changes nothing, so the Compiler can still take the body.
+    bool supported(const TokenIndex* parameters, uint32_t arity, const StmtIndex* body, uint32_t count);
+    IrFunction build(std::string_view name, const TokenIndex* parameters, uint32_t arity,
+                     const StmtIndex* body, uint32_t count);
+private:
+    bool check_stmt(StmtIndex index);
+    bool check_branch(StmtIndex index);
+    bool check_expr(ExprIndex index);
+    bool check_variable(TokenIndex name);
+    bool check_function(const FunStmt& fun);
+    bool check_declarations(StmtIndex index);
+
+    void statement(StmtIndex index);
+    IrValue value(ExprIndex index);
+    IrValue logical(const Logical& logical);
+    void condition(ExprIndex index, IrBlockIndex truthy, IrBlockIndex falsey);
+    IrValue read_variable(int variable, IrBlockIndex block);
+    IrValue read_variable_recursive(int variable, IrBlockIndex block);
+    void write_variable(int variable, IrBlockIndex block, IrValue value);
+    void add_phi_operands(int variable, IrValue phi);
+    IrBlockIndex new_block();
+    void seal(IrBlockIndex block);
+    void start(IrBlockIndex block);
+    IrValue add(IrOp op, std::initializer_list<IrValue> operands = {}, uint32_t index = 0);
+    IrValue constant(Value value);
+    void jump(IrBlockIndex target);
+    void branch(IrValue condition, IrBlockIndex truthy, IrBlockIndex falsey);
+    void remove_unreachable();
+
+    IrValue inline_call(int callee, const std::vector<IrValue>& arguments);
+    void inline_return(IrValue value);
+    bool recursive(int function);
+    const IrInlineScan& function_scan(int function);
+    void scan(StmtIndex index, IrInlineScan& scan) const;
+    void scan_expr(ExprIndex index, IrInlineScan& scan) const;
+
+    int declare(TokenIndex name);
+    int lookup(TokenIndex name) const;
+    void begin_scope();
+    void end_scope();
+    void reset_scopes();
+
+    Compiler& compiler;
+    const Ast& ast;
+    IrFunction function;
+    IrBlockIndex current;
+    std::vector<bool> sealed;
+    // Phis made before all of a block's predecessors were known.
+    std::vector<std::vector<std::pair<int, IrValue>>> incomplete_phis;
+    // The value of each variable at the end of each block, by (variable, block).
+    std::unordered_map<uint64_t, IrValue> definitions;
+    std::vector<IrInline> inlines;
+
+    std::vector<IrVariable> variables;
+    // Innermost variable per symbol, or -1.
+    std::vector<int> symbol_variables;
+    std::vector<int> scope_variables;
+    std::vector<size_t> scopes;
+    // Functions the body declares, nested ones included, with their arity.
+    std::unordered_map<uint32_t, uint32_t> declared_functions;
+};
+
+#endif
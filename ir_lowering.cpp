@@ -0,0 +1,487 @@
+#include <algorithm>
+#include <bit>
+
+#include "compiler.h"
+#include "ir_lowering.h"
+
+static bool compound(IrOp op) {
+    return op >= IR_ADD_ASSIGN && op <= IR_DIVIDE_ASSIGN;
+}
+
+static void set_bit(uint64_t* bits, uint32_t index) {
+    bits[index / 64] |= (uint64_t)1 << (index % 64);
+}
+
+static void reset_bit(uint64_t* bits, uint32_t index) {
+    bits[index / 64] &= ~((uint64_t)1 << (index % 64));
+}
+
+static bool test_bit(const uint64_t* bits, uint32_t index) {
+    return bits[index / 64] >> (index % 64) & 1;
+}
+
+template <typename F>
+static void for_each_bit(const uint64_t* bits, size_t words, F f) {
+    for (size_t i = 0; i < words; i++) {
+        for (uint64_t word = bits[i]; word; word &= word - 1) {
+            f((uint32_t)(i * 64 + std::countr_zero(word)));
+        }
+    }
+}
+
+IrLowering::IrLowering(Compiler& compiler, IrFunction& function)
+        : compiler(compiler), function(function), words(0), slot_count(0), stored_slot(-1), stored_end(0) {}
+
+void IrLowering::lower() {
+    split_critical_edges();
+    uses = function.use_counts();
+    numeric = ir_numeric_values(function);
+    select_stack_values();
+    compute_liveness();
+    build_interference();
+    coalesce();
+    assign_slots();
+
+    if (slot_count > UINT8_MAX + 1) {
+        //error("Too many local variables in function_index.");
+        compiler.error() << "Too many local variables in function_index." << std::endl;
+    }
+    for (int i = function.arity; i < slot_count; i++) {
+        compiler.emit_byte(OP_NIL);
+    }
+
+    block_starts.assign(function.blocks.size(), -1);
+    pending_jumps.assign(function.blocks.size(), {});
+    for (size_t i = 0; i < function.layout.size(); i++) {
+        emit_block(function.layout[i], i + 1 < function.layout.size() ? function.layout[i + 1] : IR_NONE);
+    }
+}
+
+// Phi moves happen at the end of a predecessor, which a branch can't give
+// one edge alone; neither can it pop its condition on one edge only. Such
+// edges get a block of their own, laid out last.
+void IrLowering::split_critical_edges() {
+    auto needs_split = [&](IrBlockIndex target) {
+        const IrBlock& block = function.blocks[target];
+        if (block.predecessors.size() < 2) return false;
+        if (function[block.instructions.front()].op == IR_PHI) return true;
+        for (IrBlockIndex predecessor : block.predecessors) {
+            if (function[function.blocks[predecessor].instructions.back()].op != IR_BRANCH) return true;
+        }
+        return false;
+    };
+
+    size_t count = function.layout.size();
+    for (size_t i = 0; i < count; i++) {
+        IrBlockIndex block = function.layout[i];
+        IrValue terminator = function.blocks[block].instructions.back();
+        if (function[terminator].op != IR_BRANCH) continue;
+        for (int j = 0; j < 2; j++) {
+            IrBlockIndex target = function[terminator].successors[j];
+            if (!needs_split(target)) continue;
+            IrBlockIndex split = function.blocks.size();
+            function.blocks.emplace_back();
+            function.blocks[split].predecessors.push_back(block);
+            IrValue jump = function.add(split, IR_JUMP);
+            function[jump].successors[0] = target;
+            function[terminator].successors[j] = split;
+            std::vector<IrBlockIndex>& predecessors = function.blocks[target].predecessors;
+            *std::find(predecessors.begin(), predecessors.end(), block) = split;
+            function.layout.push_back(split);
+        }
+    }
+}
+
+bool IrLowering::stack_operand(IrValue user, uint32_t operand) const {
+    IrOp op = function[user].op;
+    if (op == IR_PHI) return false;
+    // The variable of a compound assignment is updated in its slot.
+    if (compound(op)) return operand == 1;
+    return true;
+}
+
+// A value stays on the stack when its only use consumes it there, and
+// nothing that isn't part of the same expression runs in between. The
+// operands of a user must then be the instructions right before it.
+void IrLowering::select_stack_values() {
+    on_stack.assign(function.instructions.size(), false);
+    std::vector<uint32_t> position(function.instructions.size(), IR_NONE);
+    for (IrBlockIndex block : function.layout) {
+        const std::vector<IrValue>& instructions = function.blocks[block].instructions;
+        std::vector<int> start(instructions.size());
+        auto previous = [&](int index) {
+            while (index >= 0 && ir_rematerializable(function[instructions[index]].op)) index--;
+            return index;
+        };
+
+        for (size_t i = 0; i < instructions.size(); i++) {
+            IrValue user = instructions[i];
+            position[user] = i;
+            start[i] = i;
+            int expected = previous(i - 1);
+            const IrValue* operands = function.operands_of(user);
+            for (int j = function[user].operand_count - 1; j >= 0; j--) {
+                IrValue operand = operands[j];
+                IrOp op = function[operand].op;
+                if (!stack_operand(user, j) || ir_rematerializable(op)) continue;
+                if (function[operand].block != block || (int)position[operand] != expected) continue;
+                if (uses[operand] != 1 || op == IR_PARAMETER || op == IR_PHI || compound(op)) continue;
+                on_stack[operand] = true;
+                start[i] = start[expected];
+                expected = previous(start[i] - 1);
+            }
+        }
+    }
+}
+
+void IrLowering::compute_liveness() {
+    dense.assign(function.instructions.size(), IR_NONE);
+    for (IrBlockIndex block : function.layout) {
+        for (IrValue value : function.blocks[block].instructions) {
+            IrOp op = function[value].op;
+            if (ir_terminator(op) || op == IR_PRINT || ir_rematerializable(op) || on_stack[value]) continue;
+            if (uses[value] == 0 && !compound(op)) continue;
+            dense[value] = slotted.size();
+            slotted.push_back(value);
+        }
+    }
+    words = (slotted.size() + 63) / 64;
+    live_in.assign(function.blocks.size() * words, 0);
+    live_out.assign(function.blocks.size() * words, 0);
+
+    std::vector<uint64_t> live(words);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto block = function.layout.rbegin(); block != function.layout.rend(); block++) {
+            std::fill(live.begin(), live.end(), 0);
+            const std::vector<IrValue>& instructions = function.blocks[*block].instructions;
+            const IrInstruction& terminator = function[instructions.back()];
+            int successors = terminator.op == IR_BRANCH ? 2 : terminator.op == IR_JUMP ? 1 : 0;
+            for (int i = 0; i < successors; i++) {
+                IrBlockIndex successor = terminator.successors[i];
+                const uint64_t* successor_live = row(live_in, successor);
+                for (size_t j = 0; j < words; j++) live[j] |= successor_live[j];
+
+                const IrBlock& target = function.blocks[successor];
+                size_t edge = std::find(target.predecessors.begin(), target.predecessors.end(), *block) -
+                              target.predecessors.begin();
+                for (IrValue phi : target.instructions) {
+                    if (function[phi].op != IR_PHI) break;
+                    IrValue operand = function.operands_of(phi)[edge];
+                    if (dense[operand] != IR_NONE) set_bit(live.data(), dense[operand]);
+                }
+            }
+            std::copy(live.begin(), live.end(), row(live_out, *block));
+
+            for (auto value = instructions.rbegin(); value != instructions.rend(); value++) {
+                if (dense[*value] != IR_NONE) reset_bit(live.data(), dense[*value]);
+                if (function[*value].op == IR_PHI) continue;
+                const IrValue* operands = function.operands_of(*value);
+                for (uint32_t i = 0; i < function[*value].operand_count; i++) {
+                    if (dense[operands[i]] != IR_NONE) set_bit(live.data(), dense[operands[i]]);
+                }
+            }
+            uint64_t* block_live = row(live_in, *block);
+            if (!std::equal(live.begin(), live.end(), block_live)) {
+                std::copy(live.begin(), live.end(), block_live);
+                changed = true;
+            }
+        }
+    }
+}
+
+// Two values interfere when one is defined while the other is live. Phis
+// are defined both at the end of each predecessor, where their moves are,
+// and at the start of their block.
+void IrLowering::build_interference() {
+    interference.assign(slotted.size() * words, 0);
+    std::vector<uint64_t> live(words);
+    auto define = [&](IrValue value) {
+        for_each_bit(live.data(), words, [&](uint32_t other) {
+            if (other != dense[value]) interfere(dense[value], other);
+        });
+    };
+
+    for (IrBlockIndex block : function.layout) {
+        const std::vector<IrValue>& instructions = function.blocks[block].instructions;
+        const IrInstruction& terminator = function[instructions.back()];
+        if (terminator.op == IR_JUMP) {
+            const IrBlock& target = function.blocks[terminator.successors[0]];
+            const uint64_t* target_live = row(live_in, terminator.successors[0]);
+            std::copy(target_live, target_live + words, live.begin());
+            for (IrValue phi : target.instructions) {
+                if (function[phi].op != IR_PHI) break;
+                if (dense[phi] != IR_NONE) set_bit(live.data(), dense[phi]);
+            }
+            for (IrValue phi : target.instructions) {
+                if (function[phi].op != IR_PHI) break;
+                if (dense[phi] != IR_NONE) define(phi);
+            }
+        }
+
+        const uint64_t* block_live = row(live_out, block);
+        std::copy(block_live, block_live + words, live.begin());
+        for (auto value = instructions.rbegin(); value != instructions.rend(); value++) {
+            if (function[*value].op == IR_PHI) {
+                // Whatever is still live now is live along with the phis.
+                if (dense[*value] != IR_NONE) define(*value);
+                continue;
+            }
+            if (dense[*value] != IR_NONE) {
+                define(*value);
+                reset_bit(live.data(), dense[*value]);
+            }
+            const IrValue* operands = function.operands_of(*value);
+            for (uint32_t i = 0; i < function[*value].operand_count; i++) {
+                if (dense[operands[i]] != IR_NONE) set_bit(live.data(), dense[operands[i]]);
+            }
+        }
+    }
+}
+
+void IrLowering::interfere(uint32_t a, uint32_t b) {
+    set_bit(row(interference, a), b);
+    set_bit(row(interference, b), a);
+}
+
+uint32_t IrLowering::find(uint32_t index) {
+    while (parent[index] != index) {
+        parent[index] = parent[parent[index]];
+        index = parent[index];
+    }
+    return index;
+}
+
+void IrLowering::merge(IrValue a, IrValue b) {
+    if (dense[a] == IR_NONE || dense[b] == IR_NONE) return;
+    uint32_t into = find(dense[a]);
+    uint32_t from = find(dense[b]);
+    if (into == from || test_bit(row(interference, into), from)) return;
+    if (fixed_slot[into] != -1 && fixed_slot[from] != -1) return;
+
+    uint64_t* into_row = row(interference, into);
+    const uint64_t* from_row = row(interference, from);
+    for (size_t i = 0; i < words; i++) into_row[i] |= from_row[i];
+    for_each_bit(from_row, words, [&](uint32_t other) { set_bit(row(interference, other), into); });
+    parent[from] = into;
+    if (fixed_slot[into] == -1) fixed_slot[into] = fixed_slot[from];
+}
+
+// Compound assignments first, as they otherwise cost a copy and the
+// Compiler's code never pays it; then values carried around loops.
+void IrLowering::coalesce() {
+    parent.resize(slotted.size());
+    fixed_slot.assign(slotted.size(), -1);
+    for (uint32_t i = 0; i < slotted.size(); i++) {
+        parent[i] = i;
+        if (function[slotted[i]].op == IR_PARAMETER) fixed_slot[i] = function[slotted[i]].index;
+    }
+
+    for (IrValue value : slotted) {
+        if (compound(function[value].op)) merge(value, function.operands_of(value)[0]);
+    }
+    auto merge_phis = [&](IrBlockIndex block) {
+        for (IrValue phi : function.blocks[block].instructions) {
+            if (function[phi].op != IR_PHI) break;
+            const IrValue* operands = function.operands_of(phi);
+            for (uint32_t i = 0; i < function[phi].operand_count; i++) {
+                merge(phi, operands[i]);
+            }
+        }
+    };
+    for (const IrLoop& loop : function.loops) {
+        merge_phis(loop.header);
+    }
+    for (IrBlockIndex block : function.layout) {
+        merge_phis(block);
+    }
+}
+
+void IrLowering::assign_slots() {
+    std::vector<int> class_slots(slotted.size(), -1);
+    slot_count = function.arity;
+    for (uint32_t i = 0; i < slotted.size(); i++) {
+        if (find(i) == i && fixed_slot[i] != -1) class_slots[i] = fixed_slot[i];
+    }
+    std::vector<bool> taken;
+    for (uint32_t i = 0; i < slotted.size(); i++) {
+        uint32_t root = find(i);
+        if (class_slots[root] == -1) {
+            taken.assign(slot_count + 1, false);
+            for_each_bit(row(interference, root), words, [&](uint32_t other) {
+                int slot = class_slots[find(other)];
+                if (slot != -1 && slot < (int)taken.size()) taken[slot] = true;
+            });
+            class_slots[root] = std::find(taken.begin(), taken.end(), false) - taken.begin();
+        }
+        slot_count = std::max(slot_count, class_slots[root] + 1);
+    }
+
+    slots.assign(function.instructions.size(), -1);
+    for (uint32_t i = 0; i < slotted.size(); i++) {
+        slots[slotted[i]] = class_slots[find(i)];
+    }
+}
+
+void IrLowering::emit_block(IrBlockIndex block, IrBlockIndex next) {
+    block_starts[block] = compiler.chunk().code.size();
+    for (int offset : pending_jumps[block]) {
+        compiler.patch_jump(offset);
+    }
+    stored_slot = -1;
+
+    // Branches leave their condition on the stack along both edges.
+    const std::vector<IrBlockIndex>& predecessors = function.blocks[block].predecessors;
+    if (!predecessors.empty() && function[function.blocks[predecessors[0]].instructions.back()].op == IR_BRANCH) {
+        compiler.emit_byte(OP_POP);
+    }
+
+    for (IrValue value : function.blocks[block].instructions) {
+        IrOp op = function[value].op;
+        if (op == IR_PHI || on_stack[value] || ir_rematerializable(op)) continue;
+        if (ir_terminator(op)) emit_terminator(value, block, next);
+        else emit_root(value);
+    }
+}
+
+void IrLowering::emit_root(IrValue value) {
+    const IrValue* operands = function.operands_of(value);
+    switch (function[value].op) {
+        case IR_PARAMETER: break;
+        case IR_ADD_ASSIGN:
+        case IR_SUBTRACT_ASSIGN:
+        case IR_MULTIPLY_ASSIGN:
+        case IR_DIVIDE_ASSIGN: {
+            emit_value(operands[1]);
+            if (slots[operands[0]] != slots[value]) {
+                emit_value(operands[0]);
+                emit_store(slots[value]);
+            }
+            static const uint8_t opcodes[] = {OP_ADD_ASSIGN, OP_SUBTRACT_ASSIGN, OP_MULTIPLY_ASSIGN, OP_DIVIDE_ASSIGN};
+            static const uint8_t unchecked_opcodes[] = {OP_ADD_ASSIGN_NN, OP_SUBTRACT_ASSIGN_NN, OP_MULTIPLY_ASSIGN_NN, OP_DIVIDE_ASSIGN_NN};
+            bool unchecked = numeric[operands[0]] && numeric[operands[1]];
+            compiler.emit_bytes((unchecked ? unchecked_opcodes : opcodes)[function[value].op - IR_ADD_ASSIGN], slots[value]);
+            compiler.emit_byte(OP_POP);
+            break;
+        }
+        case IR_PRINT:
+            emit_value(operands[0]);
+            compiler.emit_byte(OP_PRINT);
+            break;
+        default:
+            emit_tree(value);
+            if (dense[value] != IR_NONE) emit_store(slots[value]);
+            else compiler.emit_byte(OP_POP);
+            break;
+    }
+}
+
+void IrLowering::emit_value(IrValue value) {
+    const IrInstruction& instruction = function[value];
+    if (instruction.op == IR_CONSTANT) {
+        Value constant = function.constants[instruction.index];
+        if (IS_NIL(constant)) compiler.emit_byte(OP_NIL);
+        else compiler.emit_constant(constant);
+    } else if (instruction.op == IR_STRING) {
+        compiler.emit_string(compiler.token(instruction.token));
+    } else if (on_stack[value]) {
+        emit_tree(value);
+    } else {
+        emit_get(slots[value]);
+    }
+}
+
+void IrLowering::emit_tree(IrValue value) {
+    const IrInstruction& instruction = function[value];
+    const IrValue* operands = function.operands_of(value);
+    for (uint32_t i = 0; i < instruction.operand_count; i++) {
+        emit_value(operands[i]);
+    }
+    bool unchecked = instruction.operand_count == 2 && numeric[operands[0]] && numeric[operands[1]];
+    switch (instruction.op) {
+        case IR_ADD: compiler.emit_byte(unchecked ? OP_ADD_NN : OP_ADD); break;
+        case IR_SUBTRACT: compiler.emit_byte(unchecked ? OP_SUBTRACT_NN : OP_SUBTRACT); break;
+        case IR_MULTIPLY: compiler.emit_byte(unchecked ? OP_MULTIPLY_NN : OP_MULTIPLY); break;
+        case IR_DIVIDE: compiler.emit_byte(unchecked ? OP_DIVIDE_NN : OP_DIVIDE); break;
+        case IR_MODULO: compiler.emit_byte(OP_MODULO); break;
+        case IR_EQUAL: compiler.emit_byte(OP_EQUAL); break;
+        case IR_NOT_EQUAL: compiler.emit_byte(OP_NOT_EQUAL); break;
+        case IR_GREATER: compiler.emit_byte(unchecked ? OP_GREATER_NN : OP_GREATER); break;
+        case IR_GREATER_EQUAL: compiler.emit_byte(unchecked ? OP_GREATER_EQUAL_NN : OP_GREATER_EQUAL); break;
+        case IR_LESS: compiler.emit_byte(unchecked ? OP_LESS_NN : OP_LESS); break;
+        case IR_LESS_EQUAL: compiler.emit_byte(unchecked ? OP_LESS_EQUAL_NN : OP_LESS_EQUAL); break;
+        case IR_NOT: compiler.emit_byte(OP_NOT); break;
+        case IR_NEGATE: compiler.emit_byte(OP_NEGATE); break;
+        case IR_CALL:
+            compiler.emit_byte(OP_CALL);
+            compiler.emit_short(instruction.index);
+            break;
+        case IR_CALL_NATIVE:
+            compiler.emit_byte(OP_CALL_NATIVE);
+            compiler.emit_short(instruction.index);
+            break;
+        default: break;
+    }
+}
+
+void IrLowering::emit_terminator(IrValue value, IrBlockIndex block, IrBlockIndex next) {
+    const IrInstruction& instruction = function[value];
+    switch (instruction.op) {
+        case IR_JUMP:
+            emit_phi_copies(block, instruction.successors[0]);
+            if (instruction.successors[0] != next) emit_jump(instruction.successors[0], OP_JUMP);
+            break;
+        case IR_BRANCH:
+            emit_value(function.operands_of(value)[0]);
+            emit_jump(instruction.successors[1], OP_JUMP_IF_FALSE);
+            if (instruction.successors[0] != next) emit_jump(instruction.successors[0], OP_JUMP);
+            break;
+        default:
+            emit_value(function.operands_of(value)[0]);
+            compiler.emit_byte(OP_RETURN);
+            break;
+    }
+}
+
+// Every source is pushed before any phi is written, so phis that swap
+// slots read each other's old values.
+void IrLowering::emit_phi_copies(IrBlockIndex from, IrBlockIndex to) {
+    const IrBlock& target = function.blocks[to];
+    size_t edge = std::find(target.predecessors.begin(), target.predecessors.end(), from) -
+                  target.predecessors.begin();
+    std::vector<int> destinations;
+    for (IrValue phi : target.instructions) {
+        if (function[phi].op != IR_PHI) break;
+        IrValue source = function.operands_of(phi)[edge];
+        if (slots[source] == slots[phi]) continue;
+        emit_value(source);
+        destinations.push_back(slots[phi]);
+    }
+    for (auto slot = destinations.rbegin(); slot != destinations.rend(); slot++) {
+        emit_store(*slot);
+    }
+}
+
+void IrLowering::emit_jump(IrBlockIndex target, uint8_t instruction) {
+    if (block_starts[target] != -1) compiler.emit_loop(block_starts[target]);
+    else pending_jumps[target].push_back(compiler.emit_jump(instruction));
+}
+
+void IrLowering::emit_get(int slot) {
+    Chunk& chunk = compiler.chunk();
+    if (slot == stored_slot && chunk.code.size() == stored_end) {
+        chunk.code.pop_back();
+        chunk.lines.pop_back();
+        stored_slot = -1;
+        return;
+    }
+    compiler.emit_bytes(OP_GET_LOCAL, slot);
+}
+
+void IrLowering::emit_store(int slot) {
+    compiler.emit_bytes(OP_SET_LOCAL, slot);
+    compiler.emit_byte(OP_POP);
+    stored_slot = slot;
+    stored_end = compiler.chunk().code.size();
+}
@@ -0,0 +1,73 @@
+#ifndef MOSAIC_ECS_IR_LOWERING_H
+#define MOSAIC_ECS_IR_LOWERING_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "ir.h"
+
+class Compiler;
+
+// Emits an IrFunction as bytecode into the Compiler's current function.
+// Values used once, right where they are computed, never leave the stack.
+// The rest get frame slots by coloring their interference graph, after
+// coalescing phis and compound assignments with their operands wherever
+// the live ranges allow, so most of them need no moves.
+class IrLowering {
+public:
+    IrLowering(Compiler& compiler, IrFunction& function);
+    void lower();
+private:
+    void split_critical_edges();
+    void select_stack_values();
+    void compute_liveness();
+    void build_interference();
+    void coalesce();
+    void assign_slots();
+
+    void emit_block(IrBlockIndex block, IrBlockIndex next);
+    void emit_root(IrValue value);
+    void emit_value(IrValue value);
+    void emit_tree(IrValue value);
+    void emit_terminator(IrValue value, IrBlockIndex block, IrBlockIndex next);
+    void emit_phi_copies(IrBlockIndex from, IrBlockIndex to);
+    void emit_jump(IrBlockIndex target, uint8_t instruction);
+    void emit_get(int slot);
+    void emit_store(int slot);
+
+    bool stack_operand(IrValue user, uint32_t operand) const;
+    uint64_t* row(std::vector<uint64_t>& bits, uint32_t index) { return bits.data() + index * words; }
+    void interfere(uint32_t a, uint32_t b);
+    uint32_t find(uint32_t index);
+    void merge(IrValue a, IrValue b);
+
+    Compiler& compiler;
+    IrFunction& function;
+    std::vector<uint32_t> uses;
+    // Operands proven numbers get the unchecked _NN opcodes.
+    std::vector<bool> numeric;
+    // Computed by the instruction that uses them, straight onto the stack.
+    std::vector<bool> on_stack;
+
+    // Values kept in slots are numbered densely for the bitsets below.
+    std::vector<uint32_t> dense;
+    std::vector<IrValue> slotted;
+    size_t words;
+    std::vector<uint64_t> live_in;
+    std::vector<uint64_t> live_out;
+    std::vector<uint64_t> interference;
+    // Coalesced classes as a union-find, with parameters fixed to theirs.
+    std::vector<uint32_t> parent;
+    std::vector<int> fixed_slot;
+    std::vector<int> slots;
+    int slot_count;
+
+    std::vector<int> block_starts;
+    std::vector<std::vector<int>> pending_jumps;
+    // Where the last `SET_LOCAL slot; POP` ended, so a GET_LOCAL of that
+    // slot right after it can leave the value on the stack instead.
+    int stored_slot;
+    size_t stored_end;
+};
+
+#endif
@@ -0,0 +1,259 @@
+#include <algorithm>
+#include <unordered_map>
+
+#include "ir_optimizer.h"
+
+IrOptimizer::IrOptimizer(IrFunction& function) : function(function) {}
+
+void IrOptimizer::optimize() {
+    propagate_copies();
+    eliminate_common_subexpressions();
+    // Merged values can leave phis with a single input again.
+    propagate_copies();
+    hoist_loop_invariants();
+    eliminate_dead_stores();
+}
+
+void IrOptimizer::propagate_copies() {
+    forwarding.assign(function.instructions.size(), IR_NONE);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (IrBlockIndex block : function.layout) {
+            for (IrValue value : function.blocks[block].instructions) {
+                const IrInstruction& instruction = function[value];
+                if (forwarding[value] != IR_NONE) continue;
+                const IrValue* operands = function.operands_of(value);
+                if (instruction.op == IR_COPY) {
+                    forwarding[value] = resolve(operands[0]);
+                    changed = true;
+                } else if (instruction.op == IR_PHI) {
+                    // A phi of one value, and maybe itself around a loop, is that value.
+                    IrValue same = IR_NONE;
+                    bool trivial = true;
+                    for (uint32_t i = 0; i < instruction.operand_count && trivial; i++) {
+                        IrValue operand = resolve(operands[i]);
+                        if (operand == value || operand == same) continue;
+                        if (same != IR_NONE) trivial = false;
+                        same = operand;
+                    }
+                    if (trivial && same != IR_NONE) {
+                        forwarding[value] = same;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+    apply_forwarding();
+}
+
+struct IrKey {
+    IrOp op;
+    uint32_t index;
+    IrValue left;
+    IrValue right;
+    bool operator==(const IrKey& other) const = default;
+};
+
+struct IrKeyHash {
+    size_t operator()(const IrKey& key) const {
+        size_t hash = key.op;
+        hash = hash * 0x9e3779b97f4a7c15 + key.index;
+        hash = hash * 0x9e3779b97f4a7c15 + key.left;
+        hash = hash * 0x9e3779b97f4a7c15 + key.right;
+        return hash ^ (hash >> 29);
+    }
+};
+
+// Walks the dominator tree with a scoped table of available expressions, so
+// an expression is only ever replaced by one that has already run.
+void IrOptimizer::eliminate_common_subexpressions() {
+    forwarding.assign(function.instructions.size(), IR_NONE);
+    std::vector<IrBlockIndex> idom = function.dominators();
+    std::vector<std::vector<IrBlockIndex>> children(function.blocks.size());
+    for (size_t i = 1; i < function.layout.size(); i++) {
+        children[idom[function.layout[i]]].push_back(function.layout[i]);
+    }
+
+    std::unordered_map<IrKey, IrValue, IrKeyHash> available;
+    std::vector<IrKey> added;
+    auto visit = [&](IrBlockIndex block) {
+        for (IrValue value : function.blocks[block].instructions) {
+            const IrInstruction& instruction = function[value];
+            const IrValue* operands = function.operands_of(value);
+            IrKey key = {instruction.op, 0, IR_NONE, IR_NONE};
+            switch (instruction.op) {
+                case IR_CONSTANT: key.index = instruction.index; break;
+                case IR_ADD:
+                case IR_SUBTRACT:
+                case IR_DIVIDE:
+                case IR_MODULO:
+                case IR_GREATER:
+                case IR_GREATER_EQUAL:
+                case IR_LESS:
+                case IR_LESS_EQUAL:
+                    key.left = resolve(operands[0]);
+                    key.right = resolve(operands[1]);
+                    break;
+                // Strings make + order-sensitive, but not these.
+                case IR_MULTIPLY:
+                case IR_EQUAL:
+                case IR_NOT_EQUAL:
+                    key.left = std::min(resolve(operands[0]), resolve(operands[1]));
+                    key.right = std::max(resolve(operands[0]), resolve(operands[1]));
+                    break;
+                case IR_NOT:
+                case IR_NEGATE:
+                    key.left = resolve(operands[0]);
+                    break;
+                default: continue;
+            }
+            auto [existing, inserted] = available.try_emplace(key, value);
+            if (inserted) added.push_back(key);
+            else forwarding[value] = existing->second;
+        }
+    };
+
+    struct Frame {
+        IrBlockIndex block;
+        size_t added;
+        size_t next_child;
+    };
+    std::vector<Frame> stack;
+    stack.push_back({function.layout[0], 0, 0});
+    visit(function.layout[0]);
+    while (!stack.empty()) {
+        Frame& frame = stack.back();
+        if (frame.next_child < children[frame.block].size()) {
+            IrBlockIndex child = children[frame.block][frame.next_child++];
+            size_t mark = added.size();
+            visit(child);
+            stack.push_back({child, mark, 0});
+        } else {
+            while (added.size() > frame.added) {
+                available.erase(added.back());
+                added.pop_back();
+            }
+            stack.pop_back();
+        }
+    }
+    apply_forwarding();
+}
+
+bool IrOptimizer::hoistable(IrValue value, const std::vector<bool>& numeric) const {
+    switch (function[value].op) {
+        case IR_CONSTANT:
+        case IR_STRING:
+            return true;
+        case IR_ADD:
+        case IR_SUBTRACT:
+        case IR_MULTIPLY:
+        case IR_DIVIDE:
+        case IR_MODULO:
+        case IR_EQUAL:
+        case IR_NOT_EQUAL:
+        case IR_GREATER:
+        case IR_GREATER_EQUAL:
+        case IR_LESS:
+        case IR_LESS_EQUAL:
+        case IR_NOT:
+        case IR_NEGATE:
+            // The loop may not run at all, or fail before getting here.
+            return ir_speculatable(function, value, numeric);
+        default: return false;
+    }
+}
+
+// Inner loops go first, so code hoisted into an inner preheader can move
+// on out of the enclosing loop.
+void IrOptimizer::hoist_loop_invariants() {
+    std::vector<bool> numeric = ir_numeric_values(function);
+    std::vector<uint32_t> position = function.positions();
+    for (const IrLoop& loop : function.loops) {
+        uint32_t first = position[loop.header];
+        uint32_t last = position[loop.latch];
+        auto inside = [&](IrValue value) {
+            uint32_t block = position[function[value].block];
+            return block >= first && block <= last;
+        };
+
+        std::vector<IrValue> hoisted;
+        for (uint32_t i = first; i <= last; i++) {
+            std::vector<IrValue>& instructions = function.blocks[function.layout[i]].instructions;
+            std::erase_if(instructions, [&](IrValue value) {
+                if (!hoistable(value, numeric)) return false;
+                const IrValue* operands = function.operands_of(value);
+                for (uint32_t j = 0; j < function[value].operand_count; j++) {
+                    if (inside(operands[j])) return false;
+                }
+                function[value].block = loop.preheader;
+                hoisted.push_back(value);
+                return true;
+            });
+        }
+
+        std::vector<IrValue>& preheader = function.blocks[loop.preheader].instructions;
+        preheader.insert(preheader.end() - 1, hoisted.begin(), hoisted.end());
+    }
+}
+
+void IrOptimizer::eliminate_dead_stores() {
+    std::vector<bool> numeric = ir_numeric_values(function);
+    std::vector<bool> live(function.instructions.size(), false);
+    std::vector<IrValue> work;
+    for (IrBlockIndex block : function.layout) {
+        for (IrValue value : function.blocks[block].instructions) {
+            if (!ir_speculatable(function, value, numeric)) {
+                live[value] = true;
+                work.push_back(value);
+            }
+        }
+    }
+    while (!work.empty()) {
+        IrValue value = work.back();
+        work.pop_back();
+        const IrValue* operands = function.operands_of(value);
+        for (uint32_t i = 0; i < function[value].operand_count; i++) {
+            if (!live[operands[i]]) {
+                live[operands[i]] = true;
+                work.push_back(operands[i]);
+            }
+        }
+    }
+    for (IrBlockIndex block : function.layout) {
+        std::erase_if(function.blocks[block].instructions, [&](IrValue value) {
+            if (live[value]) return false;
+            function[value].dead = true;
+            return true;
+        });
+    }
+}
+
+IrValue IrOptimizer::resolve(IrValue value) {
+    IrValue target = value;
+    while (forwarding[target] != IR_NONE) target = forwarding[target];
+    while (forwarding[value] != IR_NONE && forwarding[value] != target) {
+        IrValue next = forwarding[value];
+        forwarding[value] = target;
+        value = next;
+    }
+    return target;
+}
+
+void IrOptimizer::apply_forwarding() {
+    for (IrBlockIndex block : function.layout) {
+        std::vector<IrValue>& instructions = function.blocks[block].instructions;
+        std::erase_if(instructions, [&](IrValue value) {
+            if (forwarding[value] == IR_NONE) return false;
+            function[value].dead = true;
+            return true;
+        });
+        for (IrValue value : instructions) {
+            IrValue* operands = function.operands_of(value);
+            for (uint32_t i = 0; i < function[value].operand_count; i++) {
+                operands[i] = resolve(operands[i]);
+            }
+        }
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef MOSAIC_ECS_IR_OPTIMIZER_H
+#define MOSAIC_ECS_IR_OPTIMIZER_H
+
+#include <vector>
+
+#include "ir.h"
+
+// Rewrites an IrFunction in place, in order:
+//  - copy propagation, which also drops phis merging a single value,
+//  - common subexpression elimination over the dominator tree,
+//  - loop-invariant code motion into each loop's preheader,
+//  - dead store elimination: definitions nothing reads are removed, along
+//    with whatever only they used.
+// Only computations that can't fail are moved or removed, so a script
+// that stops with a runtime error still stops at the same point.
+class IrOptimizer {
+public:
+    IrOptimizer(IrFunction& function);
+    void optimize();
+private:
+    void propagate_copies();
+    void eliminate_common_subexpressions();
+    void hoist_loop_invariants();
+    void eliminate_dead_stores();
+    bool hoistable(IrValue value, const std::vector<bool>& numeric) const;
+    IrValue resolve(IrValue value);
+    void apply_forwarding();
+
+    IrFunction& function;
+    // What each replaced value was replaced with, or IR_NONE.
+    std::vector<IrValue> forwarding;
+};
+
+#endif
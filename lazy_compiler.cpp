@@ -0,0 +1,37 @@
+#include "lazy_compiler.h"
+#include "tessera.h"
+
+LazyCompiler::LazyCompiler(std::string_view source, const FFI& ffi, int optimize, int debug_flags)
+        : source(source), ffi(ffi), optimize(optimize), debug_flags(debug_flags) {}
+
+std::shared_ptr<Image> LazyCompiler::compile_script() {
+    if (!parse_program(source, ast, debug_flags, optimize)) return nullptr;
+    compiler = std::make_unique<Compiler>(ast, ffi, optimize, debug_flags, 1);
+    std::shared_ptr<Image> image = std::make_shared<Image>();
+    if (!compiler->compile_functions({0}) || !image->load(compiler->image())) return nullptr;
+    if (debug_flags & DEBUG_BYTECODE) compiler->disassemble();
+    images.assign(image->function_count(), nullptr);
+    images[0] = image;
+    return image;
+}
+
+std::shared_ptr<const Image> LazyCompiler::compile(int function) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (images[function]) return images[function];
+
+    std::shared_ptr<Image> image = std::make_shared<Image>();
+    if (!compiler->compile_functions({function}) || !image->load(compiler->image({function}))) return nullptr;
+    images[function] = image;
+    compiled++;
+    return image;
+}
+
+size_t LazyCompiler::function_count() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return images.empty() ? 0 : images.size() - 1;
+}
+
+size_t LazyCompiler::compiled_count() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return compiled;
+}
@@ -0,0 +1,46 @@
+#ifndef MOSAIC_ECS_LAZY_COMPILER_H
+#define MOSAIC_ECS_LAZY_COMPILER_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ast.h"
+#include "compiler.h"
+#include "ffi.h"
+#include "image.h"
+
+// Compiles a program's function bodies the first time they are called
+// rather than up front. The program's image declares every function but
+// only holds the script's code; the VM asks for the rest as it calls them.
+// Keeps its own copy of the source and the parsed tree for that. Shared by
+// every VM running the program, from any thread.
+class LazyCompiler {
+public:
+    LazyCompiler(std::string_view source, const FFI& ffi, int optimize, int debug_flags);
+    LazyCompiler(const LazyCompiler&) = delete;
+    LazyCompiler& operator=(const LazyCompiler&) = delete;
+    // Parses the source and compiles the script's top level.
+    std::shared_ptr<Image> compile_script();
+    // An image holding function's code, compiled on the first request.
+    // Null, having reported why, if it doesn't compile.
+    std::shared_ptr<const Image> compile(int function);
+    // Functions declared and compiled so far, not counting the script.
+    size_t function_count() const;
+    size_t compiled_count() const;
+private:
+    std::string source;
+    Ast ast;
+    FFI ffi;
+    int optimize;
+    int debug_flags;
+    std::unique_ptr<Compiler> compiler;
+
+    mutable std::mutex mutex;
+    std::vector<std::shared_ptr<const Image>> images;
+    size_t compiled = 0;
+};
+
+#endif
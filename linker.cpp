@@ -0,0 +1,180 @@
+#include <iostream>
+#include <unordered_map>
+
+#include "linker.h"
+
+// A unit's functions and natives by their index in its image, as they are
+// numbered once linked, or -1 where they don't resolve.
+struct Relocation {
+    std::vector<int> functions;
+    std::vector<int> natives;
+};
+
+static bool relocate(const LinkUnit& unit, const Relocation& relocation, const FFI& ffi,
+                     std::shared_ptr<const Image>& linked) {
+    const Image& image = *unit.image;
+    bool resolved = true;
+    auto unresolved_native = [&](uint16_t native) {
+        std::cerr << "Could not link \"" << unit.name << "\": it calls native '"
+                  << (native < image.native_count() ? image.native_name(native) : "?")
+                  << "', which the host doesn't define with the same arity." << std::endl;
+        resolved = false;
+    };
+    auto function = [&](uint16_t index) {
+        return index < relocation.functions.size() ? relocation.functions[index] : -1;
+    };
+    auto native = [&](uint16_t index) {
+        return index < relocation.natives.size() ? relocation.natives[index] : -1;
+    };
+
+    std::vector<ObjFunction> functions;
+    for (size_t i = 0; i < image.function_count(); i++) {
+        const ImageFunction& entry = image.function(i);
+        if (entry.flags & FUNCTION_IMPORTED) continue;
+        Token name = {TOKEN_IDENTIFIER, 0, 0, 0, image.function_name(i)};
+        ObjFunction linked_function = ObjFunction(name, entry.arity);
+        linked_function.flags = entry.flags;
+        Chunk& chunk = linked_function.chunk;
+        chunk.code.assign(image.code(i), image.code(i) + entry.code_size);
+        chunk.lines.assign(image.lines(i), image.lines(i) + entry.code_size);
+
+        for (size_t offset = 0; offset < chunk.code.size(); offset += instruction_size(&chunk.code[offset])) {
+            uint8_t instruction = chunk.code[offset];
+            if (instruction != OP_CALL && instruction != OP_CALL_NATIVE) continue;
+            uint16_t operand = (uint16_t)(chunk.code[offset + 1] << 8) | chunk.code[offset + 2];
+            int target = instruction == OP_CALL ? function(operand) : native(operand);
+            if (target == -1) {
+                if (instruction == OP_CALL_NATIVE) unresolved_native(operand);
+                else resolved = false;
+                continue;
+            }
+            chunk.code[offset + 1] = (target >> 8) & 0xff;
+            chunk.code[offset + 2] = target & 0xff;
+        }
+        functions.push_back(std::move(linked_function));
+    }
+
+    std::vector<Value> constants;
+    for (size_t i = 0; i < image.constant_count(); i++) {
+        Value value = decode_constant(image.constants()[i]);
+        if (IS_FUNCTION_INDEX(value)) {
+            FunctionIndex& index = AS_FUNCTION_INDEX(value);
+            if (index.user_index != -1) {
+                int target = function(index.user_index);
+                if (target == -1) resolved = false;
+                index.user_index = target;
+            } else {
+                int target = native(index.native_index);
+                if (target == -1) unresolved_native(index.native_index);
+                index.native_index = target;
+            }
+        }
+        constants.push_back(value);
+    }
+    if (!resolved) return false;
+
+    std::shared_ptr<Image> relocated = std::make_shared<Image>();
+    std::vector<ComponentDeclaration> components;
+    for (size_t i = 0; i < image.component_count(); i++) {
+        const ImageComponent& component = image.component(i);
+        components.push_back(
+                ComponentDeclaration{std::string(image.component_name(i)), component.field_count, component.flags});
+    }
+    std::vector<SystemDeclaration> systems;
+    for (size_t i = 0; i < image.system_count(); i++) {
+        systems.push_back(SystemDeclaration{(uint32_t)function(image.system(i).function),
+                                            std::string(image.system_stage(i)), image.system(i).flags});
+    }
+    if (!relocated->load(write_image(functions, constants, std::string(image.strings(), image.strings_size()),
+                                     ffi.native_functions, {}, components, systems))) {
+        std::cerr << "Could not link \"" << unit.name << "\": " << relocated->error() << std::endl;
+        return false;
+    }
+    linked = std::move(relocated);
+    return true;
+}
+
+bool link_program(const std::vector<LinkUnit>& units, const FFI& ffi, Program& program) {
+    // Each unit's own functions, its script first, take the next stretch of
+    // the table; the exported ones are found by name.
+    std::vector<int> bases(units.size());
+    std::vector<std::unordered_map<std::string_view, int>> exports(units.size());
+    std::vector<uint32_t> arities;
+    int next = 0;
+    for (size_t u = 0; u < units.size(); u++) {
+        const Image& image = *units[u].image;
+        bases[u] = next;
+        for (size_t i = 0; i < image.function_count(); i++) {
+            if (image.function(i).flags & FUNCTION_IMPORTED) continue;
+            if (image.function(i).flags & FUNCTION_EXPORTED) exports[u][image.function_name(i)] = next;
+            arities.push_back(image.function(i).arity);
+            next++;
+        }
+    }
+    if (next > UINT16_MAX + 1) {
+        std::cerr << "Could not link: more than " << UINT16_MAX + 1 << " functions." << std::endl;
+        return false;
+    }
+    // Later definitions of a native win, as they do for the compiler.
+    std::unordered_map<std::string_view, int> natives;
+    for (size_t i = 0; i < ffi.native_functions.size(); i++) {
+        natives[ffi.native_functions[i].name] = i;
+    }
+
+    // One world, laid out by the script, and one set of stages.
+    for (size_t u = 1; u < units.size(); u++) {
+        if (units[u].image->component_count() != 0 || units[u].image->system_count() != 0) {
+            std::cerr << "Could not link \"" << units[u].name
+                      << "\": components and systems are declared in the script, not in modules." << std::endl;
+            return false;
+        }
+    }
+
+    std::vector<Relocation> relocations(units.size());
+
+    bool linked = true;
+    for (size_t u = 0; u < units.size(); u++) {
+        const LinkUnit& unit = units[u];
+        const Image& image = *unit.image;
+        Relocation& relocation = relocations[u];
+        int own = bases[u];
+        for (size_t i = 0; i < image.function_count(); i++) {
+            const ImageFunction& entry = image.function(i);
+            if (!(entry.flags & FUNCTION_IMPORTED)) {
+                relocation.functions.push_back(own++);
+                continue;
+            }
+            int target = -1;
+            for (size_t module : unit.imports) {
+                auto exported = exports[module].find(image.function_name(i));
+                if (exported != exports[module].end()) target = exported->second;
+            }
+            if (target == -1 || arities[target] != entry.arity) {
+                std::cerr << "Could not link \"" << unit.name << "\": '" << image.function_name(i)
+                          << "' with " << entry.arity << " parameters isn't exported by a module it imports."
+                          << std::endl;
+                linked = false;
+            }
+            relocation.functions.push_back(target);
+        }
+        for (size_t i = 0; i < image.native_count(); i++) {
+            auto native = natives.find(image.native_name(i));
+            bool matches = native != natives.end() &&
+                           ffi.native_functions[native->second].arity == (int)image.native(i).arity;
+            relocation.natives.push_back(matches ? native->second : -1);
+        }
+    }
+    if (!linked) return false;
+
+    std::vector<std::shared_ptr<const Image>> images(units.size());
+    for (size_t u = 0; u < units.size(); u++) {
+        if (!relocate(units[u], relocations[u], ffi, images[u])) linked = false;
+    }
+    if (!linked) return false;
+
+    program.image = images[0];
+    program.ffi = ffi;
+    program.lazy = nullptr;
+    program.modules.assign(images.begin() + 1, images.end());
+    return true;
+}
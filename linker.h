@@ -0,0 +1,33 @@
+#ifndef MOSAIC_ECS_LINKER_H
+#define MOSAIC_ECS_LINKER_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ffi.h"
+#include "image.h"
+#include "program.h"
+
+// A separately compiled module, as the linker takes it.
+struct LinkUnit {
+    // For reporting what doesn't resolve.
+    std::string name;
+    std::shared_ptr<const Image> image;
+    // The units its imported functions are exported from, by index.
+    std::vector<size_t> imports;
+};
+
+// Resolves separately compiled modules against each other and against the
+// host's natives, into one Program. units[0] is the script; the others
+// follow it in the function table, in the order their top levels run.
+//
+// Every unit's own functions are renumbered to their place in the table,
+// each function it imports becomes the function of the same name exported
+// by one of its imports, and each native it calls the host's native of the
+// same name and arity. OP_CALL, OP_CALL_NATIVE and function constants are
+// rewritten to match; nothing else about the code changes. False, having
+// reported why, if something it calls doesn't resolve.
+bool link_program(const std::vector<LinkUnit>& units, const FFI& ffi, Program& program);
+
+#endif
@@ -1,71 +1,148 @@
+#include <cstdlib>
 #include <iostream>
-#include <fstream>
-#include <sstream>
 
-#include "compiler.h"
-#include "parser.h"
-#include "scanner.h"
-#include "stmt.h"
-#include "vm.h"
+#include "cache.h"
+#include "hot_reload.h"
+#include "repl.h"
+#include "source.h"
+#include "tessera.h"
 
-static void repl() {
+// Whether a line starts a block, whose indented lines follow it.
+static bool opens_block(const std::string& line) {
+    for (const char* keyword : {"fun ", "noinline ", "sys ", "if ", "else", "while "}) {
+        if (line.starts_with(keyword)) return true;
+    }
+    return false;
+}
+
+static void repl(int debug_flags, int optimize) {
+    Repl session(FFI(), optimize, debug_flags);
     std::string line;
+    std::string entry;
     for (;;) {
-        std::cout << "> ";
+        std::cout << (entry.empty() ? "> " : "... ");
 
-        std::getline(std::cin, line);
-
-        if (line.empty()) {
+        if (!std::getline(std::cin, line)) {
+            printf("\n");
+            break;
+        }
+        // A block runs once an empty line ends it.
+        if (!entry.empty()) {
+            if (!line.empty()) {
+                entry += line + "\n";
+                continue;
+            }
+        } else if (line.empty()) {
             printf("\n");
             break;
+        } else {
+            entry = line + "\n";
+            if (opens_block(line)) continue;
         }
 
-        std::cout << line << std::endl;
+        session.evaluate(entry);
+        entry.clear();
     }
 }
 
-static std::string read_file(const char* path) {
-    std::ifstream file(path);
-
-    if (file) {
-        std::ostringstream ss;
-
-        ss << file.rdbuf();
-        std::string file_contents = ss.str();
-
-        return file_contents;
-    } else {
+static void compile_file(const char* path, int debug_flags, int optimize, bool use_cache, bool watch, bool lazy,
+                         unsigned threads) {
+    SourceFile file;
+    if (!file.open(path)) {
         std::cerr << "Could not open file " << "\"" << path << "\"." << std::endl;
         exit(74);
     }
-}
-
-static void compile_file(const char* path) {
-    std::string source = read_file(path);
-
-    Scanner scanner = Scanner(source);
-    std::vector<Token> tokens = scanner.scan_tokens();
-
-    Parser parser = Parser(tokens);
-    std::vector<StmtPtr> stmts = parser.parse();
+    std::string_view source = file.text();
+    FFI ffi;
+    // What gets reloaded must not have been inlined anywhere.
+    if (watch) optimize = std::min(optimize, OPTIMIZE_DEFAULT);
+
+    // The dumps need the stages a cache hit would skip.
+    if (debug_flags & (DEBUG_TOKENS | DEBUG_AST | DEBUG_IR | DEBUG_INLINE | DEBUG_BYTECODE)) use_cache = false;
+    // A lazy program's image is missing every function not yet called.
+    if (lazy) use_cache = false;
+
+    CompileCache cache;
+    std::string key;
+    Program program;
+    if (has_imports(source)) {
+        // Each module is cached on its own.
+        if (watch || lazy) std::cerr << "--watch and --lazy don't apply to a script that imports modules." << std::endl;
+        watch = lazy = false;
+        ModuleBuilder builder = ModuleBuilder(ffi, optimize, debug_flags, use_cache ? &cache : nullptr);
+        if (builder.build(path, program) != COMPILER_RESULT_OK) exit(65);
+    } else if (use_cache) {
+        key = cache.key(source, ffi, optimize);
+        std::shared_ptr<Image> image = std::make_shared<Image>();
+        if (image->open(cache.path(key).c_str())) {
+            if (debug_flags & DEBUG_CACHE) std::cerr << "[cache] hit " << key << std::endl;
+            program = Program{image, ffi};
+        } else if (debug_flags & DEBUG_CACHE) {
+            std::cerr << "[cache] miss " << key << std::endl;
+        }
+    }
 
-    Compiler compiler = Compiler(stmts);
-    compiler.compile();
+    if (!program.image) {
+        if (compile_program(source, ffi, program, debug_flags, optimize, lazy) != COMPILER_RESULT_OK) exit(65);
+        if (use_cache) cache.store(key, *program.image);
+    }
 
-    VM vm = VM();
-    vm.run();
+    VM vm = VM(program);
+    vm.set_threads(threads);
+    if ((debug_flags & DEBUG_SCHEDULE) && !vm.dump_schedule(std::cout)) exit(70);
+    std::unique_ptr<HotReloader> reloader;
+    if (watch) {
+        reloader = std::make_unique<HotReloader>(path, source, vm, ffi, optimize);
+        if (!reloader->start()) std::cerr << "Could not watch file \"" << path << "\"." << std::endl;
+    }
+    RuntimeResult result = vm.run(debug_flags & DEBUG_VM);
+    if (program.lazy && (debug_flags & DEBUG_LAZY)) {
+        std::cerr << "[lazy] compiled " << program.lazy->compiled_count() << " of "
+                  << program.lazy->function_count() << " functions" << std::endl;
+    }
+    if (result != RUNTIME_OK) exit(70);
+}
 
-    //if (result == COMPILER_RESULT_ERROR) exit(65);
+static void usage() {
+    std::cerr << "Usage: tessera [-O0|-O1|-O2] [--no-cache] [--trace-cache] [--watch] [--lazy] [--trace-lazy] [--threads N] [--dump-tokens] [--dump-ast] [--dump-ir] [--dump-inlining] [--dump-bytecode] [--dump-schedule] [--trace-vm] [path]" << std::endl;
+    exit(64);
 }
 
 int main(int argc, const char* argv[]) {
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        compile_file(argv[1]);
+    int debug_flags = DEBUG_NONE;
+    int optimize = OPTIMIZE_DEFAULT;
+    bool use_cache = true;
+    bool watch = false;
+    bool lazy = false;
+    unsigned threads = 0;
+    const char* path = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--dump-tokens") debug_flags |= DEBUG_TOKENS;
+        else if (arg == "--dump-ast") debug_flags |= DEBUG_AST;
+        else if (arg == "--dump-ir") debug_flags |= DEBUG_IR;
+        else if (arg == "--dump-inlining") debug_flags |= DEBUG_INLINE;
+        else if (arg == "--dump-bytecode") debug_flags |= DEBUG_BYTECODE;
+        else if (arg == "--dump-schedule") debug_flags |= DEBUG_SCHEDULE;
+        else if (arg == "--threads" && i + 1 < argc) threads = std::atoi(argv[++i]);
+        else if (arg == "--trace-vm") debug_flags |= DEBUG_VM;
+        else if (arg == "--trace-cache") debug_flags |= DEBUG_CACHE;
+        else if (arg == "--no-cache") use_cache = false;
+        else if (arg == "--watch") watch = true;
+        else if (arg == "--lazy") lazy = true;
+        else if (arg == "--trace-lazy") debug_flags |= DEBUG_LAZY;
+        else if (arg == "-O0") optimize = OPTIMIZE_NONE;
+        else if (arg == "-O1") optimize = OPTIMIZE_DEFAULT;
+        else if (arg == "-O2") optimize = OPTIMIZE_SSA;
+        else if (arg.starts_with("--") || path) usage();
+        else path = argv[i];
+    }
+
+    if (!path) {
+        repl(debug_flags, optimize);
     } else {
-        std::cerr << "Usage: tessera [path]" << std::endl;
-        exit(64);
+        compile_file(path, debug_flags, optimize, use_cache, watch, lazy, threads);
     }
     return 0;
 }
@@ -0,0 +1,276 @@
+#include <atomic>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+
+#include "image.h"
+#include "linker.h"
+#include "module.h"
+#include "source.h"
+#include "tessera.h"
+
+struct ModuleBuilder::Module {
+    std::string path;
+    // As imported; the script's is its path.
+    std::string name;
+    SourceFile file;
+    std::string key;
+    // Compiled, or from the cache.
+    std::shared_ptr<Image> unit;
+    // A cached unit compiled against imports that have changed since.
+    // Kept, as the names below may point into it.
+    std::shared_ptr<Image> stale;
+    bool parsed = false;
+    Ast ast;
+    // As written, and the modules they resolved to.
+    std::vector<std::string_view> import_names;
+    std::vector<size_t> imports;
+    // What a cached unit's imports exported when it was compiled.
+    std::vector<uint64_t> import_interfaces;
+    // Point into the source, or into a cached unit.
+    std::vector<ModuleFunction> exports;
+    uint64_t interface = 0;
+};
+
+// Runs work(i) for every i below count, on up to threads threads.
+template<typename Work>
+static void parallel_for(size_t count, unsigned threads, Work work) {
+    std::atomic<size_t> next = 0;
+    auto run = [&]() {
+        for (size_t i; (i = next.fetch_add(1)) < count;) {
+            work(i);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < std::min<size_t>(threads, count); i++) {
+        pool.emplace_back(run);
+    }
+    run();
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+}
+
+// One path per file, however it was reached.
+static std::string module_path(const std::filesystem::path& path) {
+    std::error_code error;
+    std::filesystem::path canonical = std::filesystem::weakly_canonical(path, error);
+    return error ? path.lexically_normal().string() : canonical.string();
+}
+
+uint64_t module_interface(const std::vector<ModuleFunction>& exports) {
+    std::string interface;
+    for (const ModuleFunction& function : exports) {
+        interface += function.name;
+        interface += '/';
+        interface += std::to_string(function.arity);
+        interface += '\0';
+    }
+    return image_checksum((const uint8_t*)interface.data(), interface.size());
+}
+
+bool has_imports(std::string_view source) {
+    for (size_t at = source.find("import"); at != std::string_view::npos; at = source.find("import", at + 1)) {
+        if (at != 0 && source[at - 1] != '\n') continue;
+        if (at + 6 < source.size() && (source[at + 6] == ' ' || source[at + 6] == '\t')) return true;
+    }
+    return false;
+}
+
+ModuleBuilder::ModuleBuilder(const FFI& ffi, int optimize, int debug_flags, const CompileCache* cache)
+        : ffi(ffi), optimize(optimize), debug_flags(debug_flags), cache(cache) {}
+
+ModuleBuilder::~ModuleBuilder() = default;
+
+CompilerResult ModuleBuilder::build(const char* path, Program& program) {
+    modules.clear();
+    compiled = 0;
+    cached = 0;
+    modules.push_back(std::make_unique<Module>());
+    modules[0]->path = module_path(path);
+    modules[0]->name = path;
+
+    // The dumps print as they go, so they go one module at a time.
+    unsigned threads = std::thread::hardware_concurrency();
+    if (debug_flags & (DEBUG_TOKENS | DEBUG_AST | DEBUG_IR | DEBUG_INLINE | DEBUG_BYTECODE)) threads = 1;
+
+    // Each wave loads the modules the last one imported, which is all a
+    // module needs before it can be compiled.
+    for (size_t loaded = 0; loaded < modules.size();) {
+        size_t wave = modules.size();
+        std::vector<char> ok(wave - loaded);
+        parallel_for(wave - loaded, threads, [&](size_t i) { ok[i] = load(*modules[loaded + i]); });
+        for (size_t i = loaded; i < wave; i++) {
+            if (!ok[i - loaded]) return COMPILER_RESULT_ERROR;
+            resolve_imports(i);
+        }
+        loaded = wave;
+    }
+
+    // Imports before the modules importing them, the script last.
+    std::vector<int> state(modules.size(), 0);
+    std::vector<size_t> stack;
+    std::vector<size_t> sorted;
+    if (!order(0, state, stack, sorted)) return COMPILER_RESULT_ERROR;
+
+    // A cached unit is stale once a module it imports exports something
+    // else: its stubs would no longer match.
+    std::vector<Module*> work;
+    for (std::unique_ptr<Module>& module : modules) {
+        for (size_t i = 0; module->unit && i < module->imports.size(); i++) {
+            if (modules[module->imports[i]]->interface == module->import_interfaces[i]) continue;
+            if (debug_flags & DEBUG_CACHE) {
+                std::cerr << "[cache] stale " << module->name << ": " << module->import_names[i]
+                          << " exports something else" << std::endl;
+            }
+            module->stale = std::move(module->unit);
+        }
+        if (module->unit) cached++;
+        else work.push_back(module.get());
+    }
+    // One module compiling on its own gets every thread.
+    unsigned compile_threads = work.size() > 1 || threads == 1 ? 1 : 0;
+    std::vector<char> ok(work.size());
+    parallel_for(work.size(), threads, [&](size_t i) { ok[i] = compile(*work[i], compile_threads); });
+    for (char compiled_ok : ok) {
+        if (!compiled_ok) return COMPILER_RESULT_ERROR;
+    }
+    compiled = work.size();
+
+    // The script is sorted last but must be function 0.
+    sorted.insert(sorted.begin(), sorted.back());
+    sorted.pop_back();
+    std::vector<LinkUnit> units;
+    std::vector<size_t> unit_of(modules.size());
+    for (size_t module : sorted) {
+        unit_of[module] = units.size();
+        units.push_back(LinkUnit{modules[module]->name, modules[module]->unit, {}});
+    }
+    for (size_t module = 0; module < modules.size(); module++) {
+        for (size_t imported : modules[module]->imports) {
+            units[unit_of[module]].imports.push_back(unit_of[imported]);
+        }
+    }
+    return link_program(units, ffi, program) ? COMPILER_RESULT_OK : COMPILER_RESULT_ERROR;
+}
+
+// Reads a module and finds what it imports and exports, from its cached
+// unit if it has one and by parsing it otherwise.
+bool ModuleBuilder::load(Module& module) {
+    if (!module.file.open(module.path.c_str())) {
+        std::cerr << "Could not open module \"" << module.path << "\"." << std::endl;
+        return false;
+    }
+    if (cache) {
+        module.key = cache->key(module.file.text(), optimize);
+        std::shared_ptr<Image> unit = std::make_shared<Image>();
+        if (unit->open(cache->path(module.key).c_str())) {
+            if (debug_flags & DEBUG_CACHE) std::cerr << "[cache] hit " << module.name << " " << module.key << std::endl;
+            for (size_t i = 0; i < unit->import_count(); i++) {
+                module.import_names.push_back(unit->import_name(i));
+                module.import_interfaces.push_back(unit->module_import(i).interface);
+            }
+            for (size_t i = 0; i < unit->function_count(); i++) {
+                if (!(unit->function(i).flags & FUNCTION_EXPORTED)) continue;
+                module.exports.push_back(ModuleFunction{unit->function_name(i), (int)unit->function(i).arity});
+            }
+            module.interface = module_interface(module.exports);
+            module.unit = std::move(unit);
+            return true;
+        }
+        if (debug_flags & DEBUG_CACHE) std::cerr << "[cache] miss " << module.name << " " << module.key << std::endl;
+    }
+
+    if (!parse(module)) return false;
+    for (TokenIndex name : module.ast.imports) {
+        module.import_names.push_back(module.ast.token(name).lexeme);
+    }
+    const StmtIndex* stmts = module.ast.list(module.ast.script);
+    for (uint32_t i = 0; i < module.ast.script_count; i++) {
+        const Stmt& stmt = module.ast.stmt(stmts[i]);
+        if (stmt.type != STMT_FUN) continue;
+        module.exports.push_back(ModuleFunction{module.ast.token(stmt.fun.name).lexeme, stmt.fun.arity});
+    }
+    module.interface = module_interface(module.exports);
+    return true;
+}
+
+bool ModuleBuilder::parse(Module& module) {
+    if (module.parsed) return true;
+    if (!parse_program(module.file.text(), module.ast, debug_flags, optimize)) {
+        std::cerr << "In module \"" << module.path << "\"." << std::endl;
+        return false;
+    }
+    module.parsed = true;
+    return true;
+}
+
+bool ModuleBuilder::compile(Module& module, unsigned threads) {
+    if (!parse(module)) return false;
+    Compiler compiler = Compiler(module.ast, ffi, optimize, debug_flags, threads);
+    for (size_t i = 0; i < module.imports.size(); i++) {
+        const Module& imported = *modules[module.imports[i]];
+        if (!compiler.import_module(module.import_names[i], imported.interface, imported.exports)) {
+            std::cerr << "In module \"" << module.path << "\"." << std::endl;
+            return false;
+        }
+    }
+    if (compiler.compile() != COMPILER_RESULT_OK) {
+        std::cerr << "In module \"" << module.path << "\"." << std::endl;
+        return false;
+    }
+    if (debug_flags & DEBUG_BYTECODE) compiler.disassemble();
+
+    std::shared_ptr<Image> unit = std::make_shared<Image>();
+    if (!unit->load(compiler.image())) {
+        std::cerr << "In module \"" << module.path << "\": " << unit->error() << std::endl;
+        return false;
+    }
+    if (cache) cache->store(module.key, *unit);
+    module.unit = std::move(unit);
+    return true;
+}
+
+// Finds the file each of a module's imports names, beside the module,
+// and loads it next wave unless an earlier one has.
+void ModuleBuilder::resolve_imports(size_t index) {
+    std::filesystem::path directory = std::filesystem::path(modules[index]->path).parent_path();
+    for (std::string_view name : modules[index]->import_names) {
+        std::string path = module_path(directory / (std::string(name) + ".te"));
+        size_t imported = 0;
+        while (imported < modules.size() && modules[imported]->path != path) imported++;
+        if (imported == modules.size()) {
+            modules.push_back(std::make_unique<Module>());
+            modules.back()->path = path;
+            modules.back()->name = name;
+        }
+        modules[index]->imports.push_back(imported);
+    }
+}
+
+// Depth first, so every module comes after the ones it imports. state is
+// 1 while a module's imports are being visited and 2 once it is sorted, so
+// meeting a 1 means the imports go round in a circle.
+bool ModuleBuilder::order(size_t index, std::vector<int>& state, std::vector<size_t>& path,
+                          std::vector<size_t>& sorted) {
+    if (state[index] == 2) return true;
+    path.push_back(index);
+    if (state[index] == 1) {
+        std::cerr << "Import cycle:";
+        size_t start = 0;
+        while (path[start] != index) start++;
+        for (size_t i = start; i < path.size(); i++) {
+            std::cerr << (i == start ? " " : " -> ") << modules[path[i]]->name;
+        }
+        std::cerr << std::endl;
+        return false;
+    }
+    state[index] = 1;
+    for (size_t imported : modules[index]->imports) {
+        if (!order(imported, state, path, sorted)) return false;
+    }
+    state[index] = 2;
+    path.pop_back();
+    sorted.push_back(index);
+    return true;
+}
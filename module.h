@@ -0,0 +1,68 @@
+#ifndef MOSAIC_ECS_MODULE_H
+#define MOSAIC_ECS_MODULE_H
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "cache.h"
+#include "compiler.h"
+#include "debug.h"
+#include "ffi.h"
+#include "optimizer.h"
+#include "program.h"
+
+// Builds a script that imports other modules. `import name` names name.te
+// beside the importing file, and makes the functions it declares at its top
+// level callable. Every module compiles on its own to an image of its own,
+// a unit, which calls what it imports through stubs for the linker to
+// resolve. So a module compiles again only when its own text changes, or
+// when a module it imports changes the functions it exports; the rest come
+// from the cache.
+//
+// Compiling a module needs only the names and arities of what it imports,
+// not their code, so modules are read, scanned, parsed and compiled in
+// parallel, a wave of newly found imports at a time. A module's top level
+// runs once, before that of the modules importing it.
+class ModuleBuilder {
+public:
+    // Units are kept in cache, if given.
+    ModuleBuilder(const FFI& ffi, int optimize = OPTIMIZE_DEFAULT, int debug_flags = DEBUG_NONE,
+                  const CompileCache* cache = nullptr);
+    ModuleBuilder(const ModuleBuilder&) = delete;
+    ModuleBuilder& operator=(const ModuleBuilder&) = delete;
+    ~ModuleBuilder();
+    // Builds the script at path and every module it imports, however
+    // indirectly, into program. Reports what fails.
+    CompilerResult build(const char* path, Program& program);
+    // Modules the last build compiled, and found in the cache.
+    size_t compiled_count() const { return compiled; }
+    size_t cached_count() const { return cached; }
+private:
+    struct Module;
+    bool load(Module& module);
+    bool parse(Module& module);
+    bool compile(Module& module, unsigned threads);
+    void resolve_imports(size_t index);
+    bool order(size_t index, std::vector<int>& state, std::vector<size_t>& path, std::vector<size_t>& sorted);
+
+    FFI ffi;
+    int optimize;
+    int debug_flags;
+    const CompileCache* cache;
+    std::vector<std::unique_ptr<Module>> modules;
+    size_t compiled = 0;
+    size_t cached = 0;
+};
+
+// A hash of the functions a module exports, their names and arities in
+// order: what the modules importing it were compiled against.
+uint64_t module_interface(const std::vector<ModuleFunction>& exports);
+
+// Whether a script imports modules, and so needs a ModuleBuilder. Cheap:
+// an import always starts a line.
+bool has_imports(std::string_view source);
+
+#endif
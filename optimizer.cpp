@@ -0,0 +1,388 @@
+#include <algorithm>
+#include <cmath>
+
+#include "optimizer.h"
+
+// Matches VM::is_falsey.
+static bool is_falsey(const Value& value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+Optimizer::Optimizer(Ast& ast) : ast(ast), frame(0), frame_count(0) {
+    symbol_bindings.assign(ast.symbols.size(), -1);
+    expr_bindings.assign(ast.exprs.size(), -1);
+}
+
+void Optimizer::optimize() {
+    // Every read has to be resolved before any is replaced: a let is only
+    // constant if nothing anywhere in its scope assigns to it.
+    begin_scope();
+    resolve_stmts(ast.list(ast.script), ast.script_count);
+    end_scope();
+
+    ast.script_count = rewrite_stmts(ast.lists.data() + ast.script, ast.script_count);
+}
+
+// Scoping mirrors the Compiler: blocks open a scope, functions start a new
+// frame that can't see their caller's locals.
+void Optimizer::resolve_stmts(const StmtIndex* stmts, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        resolve_stmt(stmts[i]);
+    }
+}
+
+void Optimizer::resolve_stmt(StmtIndex index) {
+    const Stmt& stmt = ast.stmt(index);
+    switch (stmt.type) {
+        case STMT_BLOCK:
+            begin_scope();
+            resolve_stmts(ast.list(stmt.block.stmts), stmt.block.count);
+            end_scope();
+            break;
+        case STMT_COMP: break;
+        case STMT_EXPR: resolve_expr(stmt.expr_stmt.expr); break;
+        case STMT_FUN: {
+            int enclosing = frame;
+            frame = ++frame_count;
+            begin_scope();
+            const TokenIndex* parameters = ast.list(stmt.fun.parameters);
+            for (uint32_t i = 0; i < stmt.fun.arity; i++) {
+                bind(parameters[i], AST_NONE);
+            }
+            resolve_stmt(stmt.fun.body);
+            end_scope();
+            frame = enclosing;
+            break;
+        }
+        case STMT_IF:
+            resolve_expr(stmt.if_stmt.condition);
+            resolve_stmt(stmt.if_stmt.then_branch);
+            if (stmt.if_stmt.else_branch != AST_NONE) resolve_stmt(stmt.if_stmt.else_branch);
+            break;
+        case STMT_LET:
+            // Bound before the initializer, as the Compiler does.
+            bind(stmt.let.name, stmt.let.initializer);
+            if (stmt.let.initializer != AST_NONE) resolve_expr(stmt.let.initializer);
+            break;
+        case STMT_PRINT: resolve_expr(stmt.print.value); break;
+        case STMT_QUERY: queries.push_back({frame, index}); break;
+        case STMT_RETURN: resolve_expr(stmt.return_stmt.value); break;
+        case STMT_RUN: {
+            // The query's bindings hide any local of the same name.
+            begin_scope();
+            if (StmtIndex query = query_of(stmt.run); query != AST_NONE) {
+                const QueryStmt& terms = ast.stmt(query).query;
+                for (uint32_t i = 0; i < terms.term_count; i++) {
+                    bind(ast.list(terms.terms)[2 * i], AST_NONE);
+                }
+            }
+            resolve_stmt(stmt.run.body);
+            end_scope();
+            break;
+        }
+        case STMT_WHILE:
+            resolve_expr(stmt.while_stmt.condition);
+            resolve_stmt(stmt.while_stmt.body);
+            break;
+    }
+}
+
+// The query a run block in the current function runs, as the Compiler
+// finds it, or AST_NONE.
+StmtIndex Optimizer::query_of(const RunStmt& run) const {
+    for (auto query = queries.rbegin(); query != queries.rend(); query++) {
+        if (query->first != frame) continue;
+        const QueryStmt& declared = ast.stmt(query->second).query;
+        if (run.query == AST_NONE || ast.token(declared.name).symbol == ast.token(run.query).symbol) {
+            return query->second;
+        }
+    }
+    return AST_NONE;
+}
+
+void Optimizer::resolve_expr(ExprIndex index) {
+    const Expr& expr = ast.expr(index);
+    switch (expr.type) {
+        case EXPR_ASSIGN: {
+            int binding = lookup(expr.assign.name);
+            if (binding != -1) bindings[binding].reassigned = true;
+            resolve_expr(expr.assign.value);
+            break;
+        }
+        case EXPR_COMPOUND_ASSIGN: {
+            int binding = lookup(expr.compound_assign.name);
+            if (binding != -1) bindings[binding].reassigned = true;
+            resolve_expr(expr.compound_assign.value);
+            break;
+        }
+        case EXPR_BINARY:
+            resolve_expr(expr.binary.left);
+            resolve_expr(expr.binary.right);
+            break;
+        case EXPR_CALL: {
+            const ExprIndex* arguments = ast.list(expr.call.arguments);
+            for (uint32_t i = 0; i < expr.call.argument_count; i++) {
+                resolve_expr(arguments[i]);
+            }
+            break;
+        }
+        case EXPR_COMMAND: {
+            // What remove() takes after the entity are component names.
+            uint32_t count = ast.token(expr.command.keyword).type == TOKEN_REMOVE ? 1 : expr.command.argument_count;
+            const ExprIndex* arguments = ast.list(expr.command.arguments);
+            for (uint32_t i = 0; i < std::min(count, expr.command.argument_count); i++) {
+                resolve_expr(arguments[i]);
+            }
+            break;
+        }
+        case EXPR_GET: break;
+        case EXPR_LITERAL: break;
+        case EXPR_LOGICAL:
+            resolve_expr(expr.logical.left);
+            resolve_expr(expr.logical.right);
+            break;
+        case EXPR_SET: resolve_expr(expr.set.value); break;
+        case EXPR_UNARY: resolve_expr(expr.unary.right); break;
+        case EXPR_VARIABLE: expr_bindings[index] = lookup(expr.variable.name); break;
+    }
+}
+
+void Optimizer::bind(TokenIndex name, ExprIndex initializer) {
+    uint32_t symbol = ast.token(name).symbol;
+    int binding = bindings.size();
+    bindings.push_back(OptimizerBinding{symbol, frame, symbol_bindings[symbol], initializer, false});
+    symbol_bindings[symbol] = binding;
+    scope_bindings.push_back(binding);
+}
+
+int Optimizer::lookup(TokenIndex name) {
+    int binding = symbol_bindings[ast.token(name).symbol];
+    if (binding == -1 || bindings[binding].frame != frame) return -1;
+    return binding;
+}
+
+void Optimizer::begin_scope() {
+    scopes.push_back(scope_bindings.size());
+}
+
+void Optimizer::end_scope() {
+    while (scope_bindings.size() > scopes.back()) {
+        const OptimizerBinding& binding = bindings[scope_bindings.back()];
+        symbol_bindings[binding.symbol] = binding.shadowed;
+        scope_bindings.pop_back();
+    }
+    scopes.pop_back();
+}
+
+// Rewrites a statement list in place and returns how many statements remain.
+uint32_t Optimizer::rewrite_stmts(uint32_t* stmts, uint32_t count) {
+    uint32_t kept = 0;
+    bool returned = false;
+    for (uint32_t i = 0; i < count; i++) {
+        StmtIndex index = stmts[i];
+        if (returned && !declares_function(index)) continue;
+        rewrite_stmt(index);
+        stmts[kept++] = index;
+        if (always_returns(index)) returned = true;
+    }
+    return kept;
+}
+
+void Optimizer::rewrite_stmt(StmtIndex index) {
+    // A copy: the node itself may be overwritten below.
+    Stmt stmt = ast.stmt(index);
+    switch (stmt.type) {
+        case STMT_BLOCK:
+            ast.stmts[index].block.count = rewrite_stmts(ast.lists.data() + stmt.block.stmts, stmt.block.count);
+            break;
+        case STMT_COMP: break;
+        case STMT_EXPR: rewrite_expr(stmt.expr_stmt.expr); break;
+        case STMT_FUN: rewrite_stmt(stmt.fun.body); break;
+        case STMT_IF: {
+            const If& if_stmt = stmt.if_stmt;
+            rewrite_expr(if_stmt.condition);
+            Value condition;
+            if (constant(if_stmt.condition, condition)) {
+                bool taken = !is_falsey(condition);
+                StmtIndex kept = taken ? if_stmt.then_branch : if_stmt.else_branch;
+                StmtIndex dropped = taken ? if_stmt.else_branch : if_stmt.then_branch;
+                if (dropped == AST_NONE || !declares_function(dropped)) {
+                    if (kept == AST_NONE) {
+                        make_empty(index);
+                    } else {
+                        rewrite_stmt(kept);
+                        ast.stmts[index] = ast.stmts[kept];
+                    }
+                    break;
+                }
+            }
+            rewrite_stmt(if_stmt.then_branch);
+            if (if_stmt.else_branch != AST_NONE) rewrite_stmt(if_stmt.else_branch);
+            break;
+        }
+        case STMT_LET:
+            if (stmt.let.initializer != AST_NONE) rewrite_expr(stmt.let.initializer);
+            break;
+        case STMT_PRINT: rewrite_expr(stmt.print.value); break;
+        case STMT_QUERY: break;
+        case STMT_RETURN: rewrite_expr(stmt.return_stmt.value); break;
+        case STMT_RUN: rewrite_stmt(stmt.run.body); break;
+        case STMT_WHILE: {
+            rewrite_expr(stmt.while_stmt.condition);
+            Value condition;
+            if (constant(stmt.while_stmt.condition, condition) && is_falsey(condition) &&
+                !declares_function(stmt.while_stmt.body)) {
+                make_empty(index);
+                break;
+            }
+            rewrite_stmt(stmt.while_stmt.body);
+            break;
+        }
+    }
+}
+
+void Optimizer::rewrite_expr(ExprIndex index) {
+    Expr expr = ast.expr(index);
+    switch (expr.type) {
+        case EXPR_ASSIGN: rewrite_expr(expr.assign.value); break;
+        case EXPR_COMPOUND_ASSIGN: rewrite_expr(expr.compound_assign.value); break;
+        case EXPR_BINARY: {
+            rewrite_expr(expr.binary.left);
+            rewrite_expr(expr.binary.right);
+            Value left, right;
+            if (!constant(expr.binary.left, left) || !constant(expr.binary.right, right)) break;
+
+            TokenType op = ast.token(expr.binary.op).type;
+            if (op == TOKEN_EQUAL_EQUAL || op == TOKEN_BANG_EQUAL) {
+                bool equal = values_equal(left, right);
+                make_constant(index, expr.binary.op, op == TOKEN_EQUAL_EQUAL ? equal : !equal);
+                break;
+            }
+            // Anything else on non-numbers is left for the VM to report.
+            if (!IS_NUMBER(left) || !IS_NUMBER(right)) break;
+            double a = AS_NUMBER(left);
+            double b = AS_NUMBER(right);
+            switch (op) {
+                case TOKEN_PLUS: make_constant(index, expr.binary.op, a + b); break;
+                case TOKEN_MINUS: make_constant(index, expr.binary.op, a - b); break;
+                case TOKEN_STAR: make_constant(index, expr.binary.op, a * b); break;
+                case TOKEN_SLASH: make_constant(index, expr.binary.op, a / b); break;
+                case TOKEN_MODULO:
+                    // The VM truncates to long; only fold where that is defined.
+                    if (std::fabs(a) < 9.0e18 && std::fabs(b) < 9.0e18 && (long)b != 0) {
+                        make_constant(index, expr.binary.op, (double)((long)a % (long)b));
+                    }
+                    break;
+                case TOKEN_LESS: make_constant(index, expr.binary.op, a < b); break;
+                case TOKEN_LESS_EQUAL: make_constant(index, expr.binary.op, a <= b); break;
+                case TOKEN_GREATER: make_constant(index, expr.binary.op, a > b); break;
+                case TOKEN_GREATER_EQUAL: make_constant(index, expr.binary.op, a >= b); break;
+                default: break;
+            }
+            break;
+        }
+        case EXPR_CALL: {
+            const ExprIndex* arguments = ast.list(expr.call.arguments);
+            for (uint32_t i = 0; i < expr.call.argument_count; i++) {
+                rewrite_expr(arguments[i]);
+            }
+            break;
+        }
+        case EXPR_COMMAND: {
+            uint32_t count = ast.token(expr.command.keyword).type == TOKEN_REMOVE ? 1 : expr.command.argument_count;
+            const ExprIndex* arguments = ast.list(expr.command.arguments);
+            for (uint32_t i = 0; i < std::min(count, expr.command.argument_count); i++) {
+                rewrite_expr(arguments[i]);
+            }
+            break;
+        }
+        case EXPR_GET: break;
+        case EXPR_LITERAL: break;
+        case EXPR_LOGICAL: {
+            rewrite_expr(expr.logical.left);
+            rewrite_expr(expr.logical.right);
+            Value left;
+            if (!constant(expr.logical.left, left)) break;
+            // `a || b` is a when a is truthy, `a && b` is a when it is falsey.
+            bool short_circuits = (ast.token(expr.logical.op).type == TOKEN_OR) != is_falsey(left);
+            ast.exprs[index] = ast.expr(short_circuits ? expr.logical.left : expr.logical.right);
+            break;
+        }
+        case EXPR_SET: rewrite_expr(expr.set.value); break;
+        case EXPR_UNARY: {
+            rewrite_expr(expr.unary.right);
+            Value right;
+            if (!constant(expr.unary.right, right)) break;
+            if (ast.token(expr.unary.op).type == TOKEN_BANG) {
+                make_constant(index, expr.unary.op, is_falsey(right));
+            } else if (IS_NUMBER(right)) {
+                make_constant(index, expr.unary.op, -AS_NUMBER(right));
+            }
+            break;
+        }
+        case EXPR_VARIABLE: {
+            int binding = expr_bindings[index];
+            if (binding == -1 || bindings[binding].reassigned) break;
+            ExprIndex initializer = bindings[binding].initializer;
+            // Copying the literal node also carries string literals over.
+            if (initializer != AST_NONE && ast.expr(initializer).type == EXPR_LITERAL) {
+                ast.exprs[index] = ast.expr(initializer);
+            }
+            break;
+        }
+    }
+}
+
+bool Optimizer::constant(ExprIndex index, Value& value) const {
+    const Expr& expr = ast.expr(index);
+    return expr.type == EXPR_LITERAL && literal_value(ast, expr.literal, value);
+}
+
+void Optimizer::make_constant(ExprIndex index, TokenIndex token, Value value) {
+    ast.values.push_back(value);
+    ast.exprs[index] = Expr{.type = EXPR_LITERAL, .literal = {token, (uint32_t)ast.values.size() - 1}};
+}
+
+void Optimizer::make_empty(StmtIndex index) {
+    ast.stmts[index] = Stmt{.type = STMT_BLOCK, .block = {0, 0}};
+}
+
+bool Optimizer::declares_function(StmtIndex index) const {
+    const Stmt& stmt = ast.stmt(index);
+    switch (stmt.type) {
+        // Components too, as they are declared for the whole script.
+        case STMT_COMP:
+        case STMT_FUN: return true;
+        case STMT_BLOCK: {
+            const StmtIndex* stmts = ast.list(stmt.block.stmts);
+            for (uint32_t i = 0; i < stmt.block.count; i++) {
+                if (declares_function(stmts[i])) return true;
+            }
+            return false;
+        }
+        case STMT_IF:
+            return declares_function(stmt.if_stmt.then_branch) ||
+                   (stmt.if_stmt.else_branch != AST_NONE && declares_function(stmt.if_stmt.else_branch));
+        case STMT_RUN: return declares_function(stmt.run.body);
+        case STMT_WHILE: return declares_function(stmt.while_stmt.body);
+        default: return false;
+    }
+}
+
+bool Optimizer::always_returns(StmtIndex index) const {
+    const Stmt& stmt = ast.stmt(index);
+    switch (stmt.type) {
+        case STMT_RETURN: return true;
+        case STMT_BLOCK: {
+            const StmtIndex* stmts = ast.list(stmt.block.stmts);
+            for (uint32_t i = 0; i < stmt.block.count; i++) {
+                if (always_returns(stmts[i])) return true;
+            }
+            return false;
+        }
+        case STMT_IF:
+            return stmt.if_stmt.else_branch != AST_NONE &&
+                   always_returns(stmt.if_stmt.then_branch) && always_returns(stmt.if_stmt.else_branch);
+        default: return false;
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef MOSAIC_ECS_OPTIMIZER_H
+#define MOSAIC_ECS_OPTIMIZER_H
+
+#include <utility>
+#include <vector>
+
+#include "ast.h"
+
+// -O0 compiles the tree as parsed, -O1 runs the Optimizer first, and -O2
+// also takes function bodies through the SSA IR.
+#define OPTIMIZE_NONE 0
+#define OPTIMIZE_DEFAULT 1
+#define OPTIMIZE_SSA 2
+
+struct OptimizerBinding {
+    uint32_t symbol;
+    int frame;
+    // The binding of the same symbol this one hides, or -1.
+    int shadowed;
+    // AST_NONE for parameters.
+    ExprIndex initializer;
+    bool reassigned;
+};
+
+// Rewrites an Ast in place between parsing and compilation:
+//  - folds Unary, Binary and Logical expressions over constant operands,
+//  - replaces reads of never-reassigned lets bound to a constant with it,
+//  - drops if/while branches a constant condition can never take,
+//  - drops statements after a return in the same block.
+// Nodes are only ever overwritten with a literal or with one of their own
+// children, so every index into the tree stays valid. Anything that
+// declares a function is kept, since functions are visible to the rest of
+// the script no matter where they are declared.
+class Optimizer {
+public:
+    Optimizer(Ast& ast);
+    void optimize();
+private:
+    void resolve_stmts(const StmtIndex* stmts, uint32_t count);
+    void resolve_stmt(StmtIndex index);
+    void resolve_expr(ExprIndex index);
+    void bind(TokenIndex name, ExprIndex initializer);
+    StmtIndex query_of(const RunStmt& run) const;
+    int lookup(TokenIndex name);
+    void begin_scope();
+    void end_scope();
+
+    uint32_t rewrite_stmts(uint32_t* stmts, uint32_t count);
+    void rewrite_stmt(StmtIndex index);
+    void rewrite_expr(ExprIndex index);
+    bool constant(ExprIndex index, Value& value) const;
+    void make_constant(ExprIndex index, TokenIndex token, Value value);
+    void make_empty(StmtIndex index);
+    bool declares_function(StmtIndex index) const;
+    bool always_returns(StmtIndex index) const;
+
+    Ast& ast;
+    std::vector<OptimizerBinding> bindings;
+    // Innermost binding per symbol, or -1.
+    std::vector<int> symbol_bindings;
+    // What each variable read resolved to, by ExprIndex.
+    std::vector<int> expr_bindings;
+    // Bindings in scope, innermost last, with the start of each scope.
+    std::vector<int> scope_bindings;
+    std::vector<size_t> scopes;
+    // Every query seen so far and the function declaring it.
+    std::vector<std::pair<int, StmtIndex>> queries;
+    // The function being resolved, and how many have been seen.
+    int frame;
+    int frame_count;
+};
+
+#endif
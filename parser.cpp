@@ -1,274 +1,452 @@
-#include "debug.h"
+#include <iostream>
+#include <unordered_map>
+
 #include "parser.h"
 
-Parser::Parser(std::vector<Token> tokens) : tokens(tokens), current(0), scope_depth(0) {
+Parser::Parser(std::vector<Token> tokens) : tokens(ast.tokens), current(0), scope_depth(0) {
+    ast.tokens = std::move(tokens);
+    // Sized so that typical scripts never regrow the node arrays.
+    ast.exprs.reserve(ast.tokens.size() / 2);
+    ast.stmts.reserve(ast.tokens.size() / 4);
+    ast.lists.reserve(ast.tokens.size() / 8);
+    start();
+}
+
+Parser::Parser(std::vector<Token> tokens, Ast ast)
+        : ast(std::move(ast)), tokens(this->ast.tokens), current(this->ast.tokens.size()), scope_depth(0) {
+    this->tokens.insert(this->tokens.end(), tokens.begin(), tokens.end());
+    start();
+}
+
+void Parser::start() {
+    // Intern identifiers up front so the compiler resolves names by id.
+    for (size_t i = current; i < tokens.size(); i++) {
+        Token& token = tokens[i];
+        if (token.type != TOKEN_IDENTIFIER) continue;
+        auto [symbol, inserted] = ast.symbol_ids.try_emplace(token.lexeme, ast.symbols.size());
+        if (inserted) ast.symbols.push_back(token.lexeme);
+        token.symbol = symbol->second;
+    }
     panic_mode = false;
     had_error = false;
 }
 
-std::vector<StmtPtr> Parser::parse() {
+Ast Parser::parse() {
     while (!is_at_end()) {
         try {
-            stmts.push_back(declaration());
+            if (match(TOKEN_IMPORT)) {
+                import_declaration();
+                continue;
+            }
+            if (match(TOKEN_COMP)) scratch.push_back(comp_declaration());
+            else if (match(TOKEN_SYS)) scratch.push_back(sys_declaration(AST_NONE));
+            else if (match(TOKEN_SERIAL)) {
+                TokenIndex serial = previous_index();
+                consume(TOKEN_SYS, "Expect 'sys' after 'serial'.");
+                scratch.push_back(sys_declaration(serial));
+            }
+            else scratch.push_back(declaration());
         } catch (const std::exception& e) {
             std::cerr << "[line " << previous().line << "] " << e.what() << std::endl;
-            exit(-1);
+            had_error = true;
+            break;
         }
     }
-#ifdef STMT_DEBUG
-    std::cout << "==<AST>==" << std::endl;
-    for (auto stmt : stmts) {
-        std::cout << *stmt << std::endl;
-    }
-#endif
-    return stmts;
+    ast.script_count = scratch.size();
+    ast.script = end_list(0);
+    return std::move(ast);
 }
 
-StmtPtr Parser::declaration() {
-    if (match(TOKEN_FUN)) return fun_declaration();
+// Each import starts a line of its own at the top level, so whether a
+// file imports anything can be told without scanning it.
+void Parser::import_declaration() {
+    if (previous().column != 1) error("An import must start its own line.");
+    consume(TOKEN_IDENTIFIER, "Expect module name after 'import'.");
+    ast.imports.push_back(previous_index());
+}
+
+StmtIndex Parser::declaration() {
+    if (match(TOKEN_FUN)) return fun_declaration(false);
+    if (match(TOKEN_NOINLINE)) {
+        consume(TOKEN_FUN, "Expect 'fun' after 'noinline'.");
+        return fun_declaration(true);
+    }
     if (match(TOKEN_LET)) return let_declaration();
     else return statement();
 }
 
-StmtPtr Parser::fun_declaration() {
+StmtIndex Parser::fun_declaration(bool noinline) {
     consume(TOKEN_IDENTIFIER, "Expect function_index name.");
-    Token name = previous();
+    TokenIndex name = previous_index();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after function_index name.");
-    std::vector<Token> parameters;
+    size_t base = scratch.size();
     if (check(TOKEN_IDENTIFIER)) {
         do {
-            if (parameters.size() >= 255) {
+            if (scratch.size() - base >= 255) {
                 error_at_current("Can't have more than 255 parameters.");
             }
             consume(TOKEN_IDENTIFIER, "Expect parameter name.");
-            parameters.push_back(previous());
+            scratch.push_back(previous_index());
         } while (match(TOKEN_COMMA));
     }
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-    StmtPtr body = statement();
-    return Stmt::ptr(FunStmt(name, parameters, body));
+    uint32_t arity = scratch.size() - base;
+    ListIndex parameters = end_list(base);
+    StmtIndex body = statement();
+    return add(Stmt{.type = STMT_FUN, .fun = {name, parameters, (uint16_t)arity, noinline, false, body}});
+}
+
+// A component is a name and the fields below it, one per line. A field may
+// say what it holds, for the reader; every field holds any value. The name
+// may be followed by the storage, `: table`, the default, or `: sparse`.
+StmtIndex Parser::comp_declaration() {
+    consume(TOKEN_IDENTIFIER, "Expect component name.");
+    TokenIndex name = previous_index();
+    bool sparse = false;
+    if (match(TOKEN_COLON)) {
+        consume(TOKEN_IDENTIFIER, "Expect storage after ':'.");
+        sparse = previous().lexeme == "sparse";
+        if (!sparse && previous().lexeme != "table") error("Storage is either 'table' or 'sparse'.");
+    }
+    size_t base = scratch.size();
+    if (match(TOKEN_INDENT)) {
+        while (!check(TOKEN_DEDENT) && !is_at_end()) {
+            if (!match(TOKEN_IDENTIFIER)) throw std::runtime_error("Expect field name.");
+            if (scratch.size() - base >= 255) error("Can't have more than 255 fields.");
+            scratch.push_back(previous_index());
+            if (match(TOKEN_COLON) && !match({TOKEN_IDENTIFIER, TOKEN_ENTITY})) {
+                throw std::runtime_error("Expect field type after ':'.");
+            }
+        }
+        if (!is_at_end()) consume(TOKEN_DEDENT, "Expect 'Dedent' at end of block.");
+    }
+    uint32_t count = scratch.size() - base;
+    return add(Stmt{.type = STMT_COMP, .comp = {name, end_list(base), count, sparse}});
+}
+
+// A system is a function without parameters, which is never inlined.
+// `sys Name: stage` puts it in a stage other than update, and `serial sys`
+// keeps its run blocks on one thread.
+StmtIndex Parser::sys_declaration(TokenIndex serial) {
+    consume(TOKEN_IDENTIFIER, "Expect system name.");
+    TokenIndex name = previous_index();
+    size_t base = scratch.size();
+    if (match(TOKEN_COLON)) {
+        consume(TOKEN_IDENTIFIER, "Expect stage after ':'.");
+        scratch.push_back(previous_index());
+    } else {
+        scratch.push_back(AST_NONE);
+    }
+    scratch.push_back(serial);
+    ListIndex parameters = end_list(base);
+    StmtIndex body = statement();
+    return add(Stmt{.type = STMT_FUN, .fun = {name, parameters, 0, true, true, body}});
 }
 
-StmtPtr Parser::let_declaration() {
+StmtIndex Parser::let_declaration() {
     consume(TOKEN_IDENTIFIER, "Expected variable name.");
-    Token name = previous();
+    TokenIndex name = previous_index();
 
-    ExprPtr initializer = Expr::ptr(Literal(previous(), Nil{}));
+    ExprIndex initializer = AST_NONE;
     if (match(TOKEN_EQUAL)) initializer = expression();
-    return Stmt::ptr(Let(name, initializer));
+    return add(Stmt{.type = STMT_LET, .let = {name, initializer}});
 }
 
-StmtPtr Parser::statement() {
+StmtIndex Parser::statement() {
     if (match(TOKEN_IF)) return if_statement();
     if (match(TOKEN_INDENT)) return block_statement();
     if (match(TOKEN_PRINT)) return print_statement();
     if (match(TOKEN_RETURN)) return return_statement();
     if (match(TOKEN_WHILE)) return while_statement();
+    if (match(TOKEN_QUERY)) return query_statement();
+    if (match(TOKEN_RUN)) return run_statement();
+    if (match(TOKEN_IMPORT)) throw std::runtime_error("Imports go at the top level.");
+    if (match({TOKEN_COMP, TOKEN_SYS, TOKEN_SERIAL})) {
+        throw std::runtime_error("Components and systems go at the top level.");
+    }
     return expr_statement();
 }
 
-StmtPtr Parser::if_statement() {
-    ExprPtr condition = expression();
-    StmtPtr then_branch = statement();
-    StmtPtr else_branch = nullptr;
+StmtIndex Parser::if_statement() {
+    ExprIndex condition = expression();
+    StmtIndex then_branch = statement();
+    StmtIndex else_branch = AST_NONE;
 
     if (match(TOKEN_ELSE)) {
         else_branch = statement();
     }
 
-    return Stmt::ptr(If(condition, then_branch, else_branch));
+    return add(Stmt{.type = STMT_IF, .if_stmt = {condition, then_branch, else_branch}});
+}
+
+StmtIndex Parser::print_statement() {
+    ExprIndex value = expression();
+    return add(Stmt{.type = STMT_PRINT, .print = {value}});
+}
+
+// The bindings go below the query's name, one `name: Component` or
+// `name: Entity` per line, and so do the filters, `with Component` and
+// `without Component`. A filter is listed as its keyword and component.
+StmtIndex Parser::query_statement() {
+    consume(TOKEN_IDENTIFIER, "Expect query name.");
+    TokenIndex name = previous_index();
+    if (!match(TOKEN_INDENT)) throw std::runtime_error("Expect the query's bindings below it.");
+    size_t base = scratch.size();
+    while (!check(TOKEN_DEDENT) && !is_at_end()) {
+        if (match({TOKEN_WITH, TOKEN_WITHOUT})) {
+            scratch.push_back(previous_index());
+            consume(TOKEN_IDENTIFIER, "Expect component after 'with' or 'without'.");
+            scratch.push_back(previous_index());
+            continue;
+        }
+        if (!match(TOKEN_IDENTIFIER)) throw std::runtime_error("Expect binding name.");
+        scratch.push_back(previous_index());
+        consume(TOKEN_COLON, "Expect ':' after binding name.");
+        if (!match({TOKEN_IDENTIFIER, TOKEN_ENTITY})) throw std::runtime_error("Expect component after ':'.");
+        scratch.push_back(previous_index());
+    }
+    if (!is_at_end()) consume(TOKEN_DEDENT, "Expect 'Dedent' at end of block.");
+    uint32_t count = (scratch.size() - base) / 2;
+    return add(Stmt{.type = STMT_QUERY, .query = {name, end_list(base), count}});
 }
 
-StmtPtr Parser::print_statement() {
-    ExprPtr value = expression();
-    return Stmt::ptr(Print(value));
+StmtIndex Parser::run_statement() {
+    TokenIndex keyword = previous_index();
+    TokenIndex query = match(TOKEN_IDENTIFIER) ? previous_index() : AST_NONE;
+    StmtIndex body = statement();
+    return add(Stmt{.type = STMT_RUN, .run = {keyword, query, body}});
 }
 
-StmtPtr Parser::return_statement() {
-    Token debug = previous();
-    ExprPtr value = expression();
-    return Stmt::ptr(Return(debug, value));
+StmtIndex Parser::return_statement() {
+    TokenIndex debug = previous_index();
+    ExprIndex value = expression();
+    return add(Stmt{.type = STMT_RETURN, .return_stmt = {debug, value}});
 }
 
-StmtPtr Parser::block_statement() {
-    std::vector<StmtPtr> block;
+StmtIndex Parser::block_statement() {
+    size_t base = scratch.size();
     while (!check(TOKEN_DEDENT) && !is_at_end()) {
-        block.push_back(declaration());
+        scratch.push_back(declaration());
     }
     if (!is_at_end()) {
         consume(TOKEN_DEDENT, "Expect 'Dedent' at end of block.");
     }
-    return Stmt::ptr(Block(block));
+    uint32_t count = scratch.size() - base;
+    return add(Stmt{.type = STMT_BLOCK, .block = {end_list(base), count}});
 }
 
-StmtPtr Parser::while_statement() {
-    ExprPtr condition = expression();
-    StmtPtr body = statement();
+StmtIndex Parser::while_statement() {
+    ExprIndex condition = expression();
+    StmtIndex body = statement();
 
-    return Stmt::ptr(While(condition, body));
+    return add(Stmt{.type = STMT_WHILE, .while_stmt = {condition, body}});
 }
 
-StmtPtr Parser::expr_statement() {
-    return Stmt::ptr(ExprStmt(expression()));
+StmtIndex Parser::expr_statement() {
+    return add(Stmt{.type = STMT_EXPR, .expr_stmt = {expression()}});
 }
 
-ExprPtr Parser::expression() {
+ExprIndex Parser::expression() {
     return assignment();
 }
 
-ExprPtr Parser::assignment() {
-    ExprPtr expr = or_();
+ExprIndex Parser::assignment() {
+    ExprIndex expr = or_();
 
     if (match(TOKEN_EQUAL)) {
-        if (expr->is_type(EXPR_VARIABLE)) {
+        if (ast.expr(expr).type == EXPR_VARIABLE) {
             // Unsure about the recursion here.
-            ExprPtr value = assignment();
-            expr = Expr::ptr(Assign(expr->as<Variable>().name, value));
+            ExprIndex value = assignment();
+            expr = add(Expr{.type = EXPR_ASSIGN, .assign = {ast.expr(expr).variable.name, value}});
+        } else if (ast.expr(expr).type == EXPR_GET) {
+            TokenIndex op = previous_index();
+            ExprIndex value = assignment();
+            expr = add(Expr{.type = EXPR_SET, .set = {expr, op, value}});
         }
     } else if (match({TOKEN_PLUS_EQUAL, TOKEN_MINUS_EQUAL, TOKEN_STAR_EQUAL, TOKEN_SLASH_EQUAL, TOKEN_MODULO_EQUAL})) {
-        Token op = previous();
-        if (expr->is_type(EXPR_VARIABLE)) {
+        TokenIndex op = previous_index();
+        if (ast.expr(expr).type == EXPR_VARIABLE) {
             // Unsure about the recursion here.
-            ExprPtr value = assignment();
-            expr = Expr::ptr(CompoundAssign(expr->as<Variable>().name, op, value));
+            ExprIndex value = assignment();
+            expr = add(Expr{.type = EXPR_COMPOUND_ASSIGN, .compound_assign = {ast.expr(expr).variable.name, op, value}});
+        } else if (ast.expr(expr).type == EXPR_GET) {
+            ExprIndex value = assignment();
+            expr = add(Expr{.type = EXPR_SET, .set = {expr, op, value}});
         }
     }
 
     return expr;
 }
 
-ExprPtr Parser::or_() {
-    ExprPtr expr = and_();
+ExprIndex Parser::or_() {
+    ExprIndex expr = and_();
 
     while (match(TOKEN_OR)) {
-        Token op = previous();
-        ExprPtr right = and_();
-        expr = Expr::ptr(Logical(expr, op, right));
+        TokenIndex op = previous_index();
+        ExprIndex right = and_();
+        expr = add(Expr{.type = EXPR_LOGICAL, .logical = {expr, op, right}});
     }
 
     return expr;
 }
 
-ExprPtr Parser::and_() {
-    ExprPtr expr = equality();
+ExprIndex Parser::and_() {
+    ExprIndex expr = equality();
 
     while (match(TOKEN_AND)) {
-        Token op = previous();
-        ExprPtr right = equality();
-        expr = Expr::ptr(Logical(expr, op, right));
+        TokenIndex op = previous_index();
+        ExprIndex right = equality();
+        expr = add(Expr{.type = EXPR_LOGICAL, .logical = {expr, op, right}});
     }
 
     return expr;
 }
 
-ExprPtr Parser::equality() {
-    ExprPtr expr = comparison();
+ExprIndex Parser::equality() {
+    ExprIndex expr = comparison();
 
     while (match({TOKEN_BANG_EQUAL, TOKEN_EQUAL_EQUAL})) {
-        Token op = previous();
-        ExprPtr right = comparison();
-        expr = Expr::ptr(Binary(expr, op, right));
+        TokenIndex op = previous_index();
+        ExprIndex right = comparison();
+        expr = add(Expr{.type = EXPR_BINARY, .binary = {expr, op, right}});
     }
 
     return expr;
 }
 
-ExprPtr Parser::comparison() {
-    ExprPtr expr = term();
+ExprIndex Parser::comparison() {
+    ExprIndex expr = term();
 
     while (match({TOKEN_LESS, TOKEN_LESS_EQUAL, TOKEN_GREATER, TOKEN_GREATER_EQUAL})) {
-        Token op = previous();
-        ExprPtr right = term();
-        expr = Expr::ptr(Binary(expr, op, right));
+        TokenIndex op = previous_index();
+        ExprIndex right = term();
+        expr = add(Expr{.type = EXPR_BINARY, .binary = {expr, op, right}});
     }
 
     return expr;
 }
 
-ExprPtr Parser::term() {
-    ExprPtr expr = factor();
+ExprIndex Parser::term() {
+    ExprIndex expr = factor();
 
     while (match({TOKEN_MINUS, TOKEN_PLUS})) {
-        Token op = previous();
-        ExprPtr right = factor();
-        expr = Expr::ptr(Binary(expr, op, right));
+        TokenIndex op = previous_index();
+        ExprIndex right = factor();
+        expr = add(Expr{.type = EXPR_BINARY, .binary = {expr, op, right}});
     }
 
     return expr;
 }
 
-ExprPtr Parser::factor() {
-    ExprPtr expr = unary();
+ExprIndex Parser::factor() {
+    ExprIndex expr = unary();
 
     while (match({TOKEN_STAR, TOKEN_SLASH, TOKEN_MODULO})) {
-        Token op = previous();
-        ExprPtr right = unary();
-        expr = Expr::ptr(Binary(expr, op, right));
+        TokenIndex op = previous_index();
+        ExprIndex right = unary();
+        expr = add(Expr{.type = EXPR_BINARY, .binary = {expr, op, right}});
     }
 
     return expr;
 }
 
-ExprPtr Parser::unary() {
+ExprIndex Parser::unary() {
     if (match({TOKEN_BANG, TOKEN_MINUS})) {
-        Token op = previous();
-        ExprPtr right = call();
-        return Expr::ptr(Unary(op, right));
+        TokenIndex op = previous_index();
+        ExprIndex right = call();
+        return add(Expr{.type = EXPR_UNARY, .unary = {op, right}});
     }
 
     return call();
 }
 
-ExprPtr Parser::call() {
-    ExprPtr expr = primary();
+ExprIndex Parser::call() {
+    ExprIndex expr = primary();
 
     if (match(TOKEN_LEFT_PAREN)) {
-        Token paren = previous();
-        std::vector<ExprPtr> arguments;
+        size_t base = scratch.size();
 
         while (!check(TOKEN_RIGHT_PAREN)) {
-            if (arguments.size() >= 255) {
+            if (scratch.size() - base >= 255) {
                 error_at_current("Can't have more than 255 arguments.");
             }
-            arguments.push_back(expression());
+            scratch.push_back(expression());
             if (!match(TOKEN_COMMA)) break;
         }
 
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after call.");
-        if (!expr->is_type(EXPR_VARIABLE)) error_at_current("Invalid callee.");
-        return Expr::ptr(Call(expr->as<Variable>().name, arguments));
+        uint32_t count = scratch.size() - base;
+        ListIndex arguments = end_list(base);
+        if (ast.expr(expr).type != EXPR_VARIABLE) {
+            error_at_current("Invalid callee.");
+            return expr;
+        }
+        return add(Expr{.type = EXPR_CALL, .call = {ast.expr(expr).variable.name, arguments, count}});
+    }
+    if (match(TOKEN_DOT)) {
+        consume(TOKEN_IDENTIFIER, "Expect field name after '.'.");
+        if (ast.expr(expr).type != EXPR_VARIABLE) {
+            error("Only a query binding has fields.");
+            return expr;
+        }
+        return add(Expr{.type = EXPR_GET, .get = {ast.expr(expr).variable.name, previous_index()}});
     }
 
     return expr;
 }
 
-ExprPtr Parser::primary() {
-    if (match(TOKEN_NIL)) {
-        return Expr::ptr(Literal(previous(), Nil{}));
-    }
-    if (match(TOKEN_NUMBER)) {
-        double number = std::stod(previous().lexeme);
-        return Expr::ptr(Literal(previous(), number));
-    }
-    if (match(TOKEN_STRING)) {
-        // Value given in compiler when string is interned
-        return Expr::ptr(Literal(previous(), StringIndex{0}));
+// Structural changes to the world read like calls: spawn(Position(0, 0)),
+// insert(e, Frozen()), remove(e, Frozen), despawn(e).
+ExprIndex Parser::command() {
+    TokenIndex keyword = previous_index();
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after command.");
+    size_t base = scratch.size();
+    while (!check(TOKEN_RIGHT_PAREN) && !is_at_end()) {
+        if (scratch.size() - base >= 255) {
+            error_at_current("Can't have more than 255 arguments.");
+        }
+        scratch.push_back(expression());
+        if (!match(TOKEN_COMMA)) break;
     }
-    if (match({TOKEN_TRUE, TOKEN_FALSE})) {
-        if (previous().type == TOKEN_TRUE) return Expr::ptr(Literal(previous(), true));
-        else return Expr::ptr(Literal(previous(), false));
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    uint32_t count = scratch.size() - base;
+    return add(Expr{.type = EXPR_COMMAND, .command = {keyword, end_list(base), count}});
+}
+
+ExprIndex Parser::primary() {
+    if (match({TOKEN_NIL, TOKEN_NUMBER, TOKEN_STRING, TOKEN_TRUE, TOKEN_FALSE})) {
+        return add(Expr{.type = EXPR_LITERAL, .literal = {previous_index(), AST_NONE}});
     }
     if (match(TOKEN_IDENTIFIER)) {
-        return Expr::ptr(Variable(previous()));
+        return add(Expr{.type = EXPR_VARIABLE, .variable = {previous_index()}});
     }
+    if (match({TOKEN_SPAWN, TOKEN_DESPAWN, TOKEN_INSERT, TOKEN_REMOVE})) return command();
     if (match(TOKEN_LEFT_PAREN)) {
-        ExprPtr expr = expression();
+        ExprIndex expr = expression();
         consume(TOKEN_RIGHT_PAREN, "Expect ')', after expression.");
         return expr;
     }
     throw std::runtime_error("Expected expression.");
 }
 
+ExprIndex Parser::add(Expr expr) {
+    ast.exprs.push_back(expr);
+    return ast.exprs.size() - 1;
+}
+
+StmtIndex Parser::add(Stmt stmt) {
+    ast.stmts.push_back(stmt);
+    return ast.stmts.size() - 1;
+}
+
+// Moves the children pushed since base into the Ast as one contiguous list.
+ListIndex Parser::end_list(size_t base) {
+    ListIndex index = ast.lists.size();
+    ast.lists.insert(ast.lists.end(), scratch.begin() + base, scratch.end());
+    scratch.resize(base);
+    return index;
+}
+
 Token& Parser::previous() {
     return tokens[current - 1];
 }
@@ -277,7 +455,7 @@ bool Parser::is_at_end() {
     return tokens[current].type == TOKEN_EOF;
 }
 
-bool Parser::match(std::vector<TokenType> types) {
+bool Parser::match(std::initializer_list<TokenType> types) {
     for (TokenType type : types ) {
         if (check(type)) {
             advance();
@@ -302,7 +480,7 @@ void Parser::advance() {
         current++;
         if (tokens[current].type != TOKEN_ERROR) break;
 
-        error_at_current(tokens[current].lexeme.c_str());
+        error_at_current(std::string(tokens[current].lexeme).c_str());
     }
 }
 
@@ -322,7 +500,7 @@ void Parser::error_at(Token& token, const char* message) {
     } else if (token.type == TOKEN_ERROR) {
         // Nothing.
     } else {
-        fprintf(stderr, " at '%s'", token.lexeme.c_str());
+        fprintf(stderr, " at '%.*s'", (int)token.lexeme.size(), token.lexeme.data());
     }
 
     fprintf(stderr, ": %s\n", message);
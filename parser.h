@@ -1,40 +1,58 @@
 #ifndef MOSAIC_ECS_PARSER_H
 #define MOSAIC_ECS_PARSER_H
 
+#include <initializer_list>
 #include <vector>
 
-#include "stmt.h"
+#include "ast.h"
 #include "token.h"
 
 class Parser {
 public:
     Parser(std::vector<Token> tokens);
-    std::vector<StmtPtr> parse();
+    // Parses more source into ast, after the nodes it already holds, for
+    // the REPL.
+    Parser(std::vector<Token> tokens, Ast ast);
+    // The Ast takes over the tokens. Stops at the first error, having
+    // reported it; failed() then tells.
+    Ast parse();
+    bool failed() const { return had_error; }
 private:
-    StmtPtr declaration();
-    StmtPtr fun_declaration();
-    StmtPtr let_declaration();
-    StmtPtr statement();
-    StmtPtr if_statement();
-    StmtPtr block_statement();
-    StmtPtr print_statement();
-    StmtPtr return_statement();
-    StmtPtr while_statement();
-    StmtPtr expr_statement();
-    ExprPtr expression();
-    ExprPtr assignment();
-    ExprPtr or_();
-    ExprPtr and_();
-    ExprPtr equality();
-    ExprPtr comparison();
-    ExprPtr term();
-    ExprPtr factor();
-    ExprPtr unary();
-    ExprPtr call();
-    ExprPtr primary();
+    void start();
+    void import_declaration();
+    StmtIndex declaration();
+    StmtIndex fun_declaration(bool noinline);
+    StmtIndex comp_declaration();
+    StmtIndex sys_declaration(TokenIndex serial);
+    StmtIndex let_declaration();
+    StmtIndex statement();
+    StmtIndex if_statement();
+    StmtIndex block_statement();
+    StmtIndex print_statement();
+    StmtIndex query_statement();
+    StmtIndex run_statement();
+    StmtIndex return_statement();
+    StmtIndex while_statement();
+    StmtIndex expr_statement();
+    ExprIndex expression();
+    ExprIndex assignment();
+    ExprIndex or_();
+    ExprIndex and_();
+    ExprIndex equality();
+    ExprIndex comparison();
+    ExprIndex term();
+    ExprIndex factor();
+    ExprIndex unary();
+    ExprIndex call();
+    ExprIndex command();
+    ExprIndex primary();
+    ExprIndex add(Expr expr);
+    StmtIndex add(Stmt stmt);
+    ListIndex end_list(size_t base);
     Token& previous();
+    TokenIndex previous_index() const { return current - 1; }
     bool is_at_end();
-    bool match(std::vector<TokenType> types);
+    bool match(std::initializer_list<TokenType> types);
     bool match(TokenType type);
     bool check(TokenType type);
     void advance();
@@ -43,8 +61,10 @@ private:
     void error_at(Token& token, const char* message);
     void error_at_current(const char* message);
 
-    std::vector<StmtPtr> stmts;
-    std::vector<Token> tokens;
+    Ast ast;
+    std::vector<Token>& tokens;
+    // Children of the lists being parsed; nested lists stack on top.
+    std::vector<uint32_t> scratch;
     int current;
     int scope_depth;
 
@@ -0,0 +1,25 @@
+#ifndef MOSAIC_ECS_PROGRAM_H
+#define MOSAIC_ECS_PROGRAM_H
+
+#include <memory>
+#include <vector>
+
+#include "ffi.h"
+#include "image.h"
+
+class LazyCompiler;
+
+// A compiled script held in memory, together with the natives it was
+// compiled against. Copies share the image, so any number of VMs can run
+// the same Program.
+struct Program {
+    std::shared_ptr<const Image> image;
+    FFI ffi;
+    // Set when function bodies are compiled as they are first called.
+    std::shared_ptr<LazyCompiler> lazy = nullptr;
+    // The modules the script imports, linked, in the order their top levels
+    // run. Their functions follow the image's in the function table.
+    std::vector<std::shared_ptr<const Image>> modules = {};
+};
+
+#endif
@@ -0,0 +1,97 @@
+#include <iostream>
+
+#include "parser.h"
+#include "repl.h"
+#include "scanner.h"
+#include "type_inference.h"
+
+// A VM has to start from a program; the session's starts empty.
+static Program empty_program(Compiler& compiler, const FFI& ffi) {
+    std::shared_ptr<Image> image = std::make_shared<Image>();
+    image->load(compiler.image());
+    return Program{image, ffi};
+}
+
+// Whether a statement outside any function returns, which would end the
+// script's frame and take the session's locals with it.
+static bool returns(const Ast& ast, StmtIndex index) {
+    const Stmt& stmt = ast.stmt(index);
+    switch (stmt.type) {
+        case STMT_BLOCK: {
+            const StmtIndex* stmts = ast.list(stmt.block.stmts);
+            for (uint32_t i = 0; i < stmt.block.count; i++) {
+                if (returns(ast, stmts[i])) return true;
+            }
+            return false;
+        }
+        case STMT_IF:
+            return returns(ast, stmt.if_stmt.then_branch) ||
+                   (stmt.if_stmt.else_branch != AST_NONE && returns(ast, stmt.if_stmt.else_branch));
+        case STMT_RETURN: return true;
+        case STMT_RUN: return returns(ast, stmt.run.body);
+        case STMT_WHILE: return returns(ast, stmt.while_stmt.body);
+        default: return false;
+    }
+}
+
+Repl::Repl(const FFI& ffi, int optimize, int debug_flags)
+        : ffi(ffi), optimize(optimize), debug_flags(debug_flags), compiler(ast, ffi, optimize, debug_flags, 1),
+          vm(empty_program(compiler, ffi)) {}
+
+bool Repl::evaluate(std::string_view source) {
+    sources.emplace_back(source);
+    Scanner scanner = Scanner(sources.back());
+    std::vector<Token> tokens = scanner.scan_tokens();
+    if (debug_flags & DEBUG_TOKENS) dump_tokens(tokens);
+    size_t imports = ast.imports.size();
+    Parser parser = Parser(std::move(tokens), std::move(ast));
+    ast = parser.parse();
+    if (parser.failed()) return false;
+    if (ast.imports.size() > imports) {
+        ast.imports.resize(imports);
+        std::cerr << "Modules can't be imported at the REPL." << std::endl;
+        return false;
+    }
+
+    const StmtIndex* stmts = ast.list(ast.script);
+    for (uint32_t i = 0; i < ast.script_count; i++) {
+        // The world was laid out when the REPL started.
+        if (ast.stmts[stmts[i]].type == STMT_COMP) {
+            std::cerr << "Components can't be declared at the REPL." << std::endl;
+            return false;
+        }
+        // So were the stages.
+        if (ast.stmts[stmts[i]].type == STMT_FUN && ast.stmts[stmts[i]].fun.system) {
+            std::cerr << "Systems can't be declared at the REPL." << std::endl;
+            return false;
+        }
+        if (!returns(ast, stmts[i])) continue;
+        std::cerr << "Can't return from the top level." << std::endl;
+        return false;
+    }
+    // Echo a lone expression, unless all it does is assign.
+    if (ast.script_count == 1 && ast.stmts[stmts[0]].type == STMT_EXPR) {
+        Stmt& stmt = ast.stmts[stmts[0]];
+        ExprType type = ast.expr(stmt.expr_stmt.expr).type;
+        if (type != EXPR_ASSIGN && type != EXPR_COMPOUND_ASSIGN && type != EXPR_SET) {
+            stmt = Stmt{.type = STMT_PRINT, .print = {stmt.expr_stmt.expr}};
+        }
+    }
+    if (optimize > OPTIMIZE_NONE) {
+        Optimizer optimizer = Optimizer(ast);
+        optimizer.optimize();
+        TypeInference inference = TypeInference(ast);
+        inference.infer();
+    }
+    if (debug_flags & DEBUG_AST) dump_ast(ast);
+
+    std::vector<int> declared;
+    if (!compiler.compile_entry(declared)) return false;
+    std::shared_ptr<Image> image = std::make_shared<Image>();
+    if (!image->load(compiler.image(declared))) return false;
+    if (vm.run_entry(image, declared, debug_flags & DEBUG_VM) != RUNTIME_OK) {
+        compiler.abandon_entry();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,41 @@
+#ifndef MOSAIC_ECS_REPL_H
+#define MOSAIC_ECS_REPL_H
+
+#include <deque>
+#include <string>
+#include <string_view>
+
+#include "ast.h"
+#include "compiler.h"
+#include "debug.h"
+#include "ffi.h"
+#include "optimizer.h"
+#include "vm.h"
+
+// An interactive session. Each entry, a line or an indented block, is
+// parsed onto the end of one tree and compiled by one Compiler as the next
+// piece of the same script, then run on one VM. What earlier entries
+// declared stays in scope without being compiled again: functions in the
+// Compiler's tables and the VM's, locals on the VM's stack, strings in its
+// intern table. Nothing is written to disk.
+class Repl {
+public:
+    Repl(const FFI& ffi = FFI(), int optimize = OPTIMIZE_DEFAULT, int debug_flags = DEBUG_NONE);
+    Repl(const Repl&) = delete;
+    Repl& operator=(const Repl&) = delete;
+    // Compiles and runs an entry; an entry that is a lone expression
+    // prints its value. False, having reported why, if it doesn't compile
+    // or stops on an error, in which case its locals are dropped.
+    bool evaluate(std::string_view source);
+private:
+    // Tokens point into every entry typed so far.
+    std::deque<std::string> sources;
+    Ast ast;
+    FFI ffi;
+    int optimize;
+    int debug_flags;
+    Compiler compiler;
+    VM vm;
+};
+
+#endif
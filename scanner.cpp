@@ -1,39 +1,188 @@
-#include <iostream>
-#include <sstream>
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <iterator>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-#include "debug.h"
 #include "scanner.h"
 
-Scanner::Scanner(std::string source) : source(source), indent_depth(0), start(0), current(0), line(1), column(0) {
-    keywords = {
-            { "else",   TOKEN_ELSE },
-            { "false",  TOKEN_FALSE },
-            { "fun",    TOKEN_FUN },
-            { "if",     TOKEN_IF },
-            { "nil",    TOKEN_NIL },
-            { "print",  TOKEN_PRINT },
-            { "return", TOKEN_RETURN },
-            { "this",   TOKEN_THIS },
-            { "true",   TOKEN_TRUE },
-            { "let",    TOKEN_LET },
-            { "while",  TOKEN_WHILE },
-            { "World",  TOKEN_WORLD },
-            { "Scene",  TOKEN_SCENE },
-            { "Layer",  TOKEN_LAYER },
-            { "Entity", TOKEN_ENTITY },
-            { "comp",   TOKEN_COMP },
-            { "sys",    TOKEN_SYS },
-            { "Res",    TOKEN_RES },
-            { "init",   TOKEN_INIT },
-            { "run",    TOKEN_RUN },
-            { "query", TOKEN_QUERY },
-            { "with", TOKEN_WITH },
-            { "without", TOKEN_WITHOUT }
-
-    };
+struct Keyword {
+    std::string_view name;
+    TokenType type;
+};
+
+static constexpr Keyword keywords[] = {
+        { "else",   TOKEN_ELSE },
+        { "false",  TOKEN_FALSE },
+        { "fun",    TOKEN_FUN },
+        { "if",     TOKEN_IF },
+        { "nil",    TOKEN_NIL },
+        { "print",  TOKEN_PRINT },
+        { "return", TOKEN_RETURN },
+        { "this",   TOKEN_THIS },
+        { "true",   TOKEN_TRUE },
+        { "let",    TOKEN_LET },
+        { "while",  TOKEN_WHILE },
+        { "noinline", TOKEN_NOINLINE },
+        { "import", TOKEN_IMPORT },
+        { "World",  TOKEN_WORLD },
+        { "Scene",  TOKEN_SCENE },
+        { "Layer",  TOKEN_LAYER },
+        { "Entity", TOKEN_ENTITY },
+        { "comp",   TOKEN_COMP },
+        { "sys",    TOKEN_SYS },
+        { "serial", TOKEN_SERIAL },
+        { "Res",    TOKEN_RES },
+        { "init",   TOKEN_INIT },
+        { "run",    TOKEN_RUN },
+        { "query", TOKEN_QUERY },
+        { "with", TOKEN_WITH },
+        { "without", TOKEN_WITHOUT },
+        { "spawn", TOKEN_SPAWN },
+        { "despawn", TOKEN_DESPAWN },
+        { "insert", TOKEN_INSERT },
+        { "remove", TOKEN_REMOVE }
+};
+
+// Keywords are found through a perfect hash: the multiplier is searched for
+// at compile time until every keyword has a slot of its own, so a lookup is
+// one multiply and at most one comparison.
+#define KEYWORD_SLOT_BITS 6
+
+struct KeywordTable {
+    uint32_t seed;
+    size_t min_length;
+    size_t max_length;
+    int8_t slots[1 << KEYWORD_SLOT_BITS];
+};
+
+// Only called on names of at least two characters.
+static constexpr uint32_t keyword_hash(std::string_view name, uint32_t seed) {
+    uint32_t key = (uint32_t)(uint8_t)name[0] << 24 | (uint32_t)(uint8_t)name[1] << 16 |
+                   (uint32_t)(uint8_t)name.back() << 8 | (uint32_t)name.size();
+    return (key * seed) >> (32 - KEYWORD_SLOT_BITS);
+}
+
+static constexpr KeywordTable build_keyword_table() {
+    KeywordTable table = {};
+    table.min_length = SIZE_MAX;
+    for (const Keyword& keyword : keywords) {
+        table.min_length = std::min(table.min_length, keyword.name.size());
+        table.max_length = std::max(table.max_length, keyword.name.size());
+    }
+    for (uint32_t seed = 0x9E3779B1u; seed != 0x9E3779B1u + 2 * 100000; seed += 2) {
+        for (int8_t& slot : table.slots) slot = -1;
+        bool perfect = true;
+        for (size_t i = 0; i < std::size(keywords) && perfect; i++) {
+            int8_t& slot = table.slots[keyword_hash(keywords[i].name, seed)];
+            if (slot != -1) perfect = false;
+            slot = (int8_t)i;
+        }
+        if (perfect) {
+            table.seed = seed;
+            return table;
+        }
+    }
+    return table;
+}
+
+static constexpr KeywordTable keyword_table = build_keyword_table();
+static_assert(keyword_table.seed != 0, "No perfect hash for the keyword set.");
+static_assert(keyword_table.min_length >= 2, "keyword_hash reads two leading characters.");
+
+// Fast paths over runs of bytes. Each returns the first position in
+// [p, end) that does not continue the run, or end. Whole vectors are only
+// loaded while they lie inside the range; the tail is finished byte by byte.
+static bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static bool is_identifier_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+#if defined(__AVX2__)
+#define SCAN_VECTOR 32
+#define SCAN_ALL 0xFFFFFFFFu
+typedef __m256i scan_vector;
+static scan_vector scan_load(const char* p) { return _mm256_loadu_si256((const __m256i*)p); }
+static scan_vector scan_splat(char c) { return _mm256_set1_epi8(c); }
+static scan_vector scan_eq(scan_vector a, scan_vector b) { return _mm256_cmpeq_epi8(a, b); }
+static scan_vector scan_gt(scan_vector a, scan_vector b) { return _mm256_cmpgt_epi8(a, b); }
+static scan_vector scan_or(scan_vector a, scan_vector b) { return _mm256_or_si256(a, b); }
+static scan_vector scan_and(scan_vector a, scan_vector b) { return _mm256_and_si256(a, b); }
+static uint32_t scan_mask(scan_vector v) { return (uint32_t)_mm256_movemask_epi8(v); }
+#elif defined(__SSE2__)
+#define SCAN_VECTOR 16
+#define SCAN_ALL 0xFFFFu
+typedef __m128i scan_vector;
+static scan_vector scan_load(const char* p) { return _mm_loadu_si128((const __m128i*)p); }
+static scan_vector scan_splat(char c) { return _mm_set1_epi8(c); }
+static scan_vector scan_eq(scan_vector a, scan_vector b) { return _mm_cmpeq_epi8(a, b); }
+static scan_vector scan_gt(scan_vector a, scan_vector b) { return _mm_cmpgt_epi8(a, b); }
+static scan_vector scan_or(scan_vector a, scan_vector b) { return _mm_or_si128(a, b); }
+static scan_vector scan_and(scan_vector a, scan_vector b) { return _mm_and_si128(a, b); }
+static uint32_t scan_mask(scan_vector v) { return (uint32_t)_mm_movemask_epi8(v); }
+#endif
+
+#ifdef SCAN_VECTOR
+// Bytes in [lo, hi]. Comparisons are signed, so non-ASCII bytes are never in
+// an ASCII range.
+static scan_vector scan_in_range(scan_vector v, char lo, char hi) {
+    return scan_and(scan_gt(v, scan_splat(lo - 1)), scan_gt(scan_splat(hi + 1), v));
+}
+#endif
+
+static const char* skip_blanks(const char* p, const char* end) {
+#ifdef SCAN_VECTOR
+    for (; end - p >= SCAN_VECTOR; p += SCAN_VECTOR) {
+        scan_vector v = scan_load(p);
+        scan_vector blank = scan_or(scan_or(scan_eq(v, scan_splat(' ')), scan_eq(v, scan_splat('\t'))),
+                                    scan_eq(v, scan_splat('\r')));
+        uint32_t other = ~scan_mask(blank) & SCAN_ALL;
+        if (other) return p + std::countr_zero(other);
+    }
+#endif
+    while (p < end && is_blank(*p)) p++;
+    return p;
+}
+
+static const char* find_byte(const char* p, const char* end, char c) {
+#ifdef SCAN_VECTOR
+    for (; end - p >= SCAN_VECTOR; p += SCAN_VECTOR) {
+        uint32_t found = scan_mask(scan_eq(scan_load(p), scan_splat(c)));
+        if (found) return p + std::countr_zero(found);
+    }
+#endif
+    while (p < end && *p != c) p++;
+    return p;
+}
+
+static const char* skip_identifier(const char* p, const char* end) {
+#ifdef SCAN_VECTOR
+    for (; end - p >= SCAN_VECTOR; p += SCAN_VECTOR) {
+        scan_vector v = scan_load(p);
+        // Setting 0x20 folds upper case letters onto lower case ones.
+        scan_vector letter = scan_in_range(scan_or(v, scan_splat(0x20)), 'a', 'z');
+        scan_vector digit = scan_in_range(v, '0', '9');
+        scan_vector underscore = scan_eq(v, scan_splat('_'));
+        uint32_t other = ~scan_mask(scan_or(scan_or(letter, digit), underscore)) & SCAN_ALL;
+        if (other) return p + std::countr_zero(other);
+    }
+#endif
+    while (p < end && is_identifier_char(*p)) p++;
+    return p;
 }
 
+Scanner::Scanner(std::string_view source) : source(source), indent_depth(0), start(0), current(0), line(1), column(0) {}
+
 std::vector<Token> Scanner::scan_tokens() {
+    // Typical scripts average well over eight bytes per token, so this
+    // usually spares every regrowth of the vector.
+    tokens.reserve(source.size() / 8 + 16);
     while (!is_at_end()) {
         start = current;
         scan_token();
@@ -41,21 +190,7 @@ std::vector<Token> Scanner::scan_tokens() {
     // Add EOF token.
     add_token(TOKEN_EOF);
 
-#ifdef TOKEN_DEBUG
-    std::cout << "==<Tokens>==" << std::endl;
-    bool had_error = false;
-    std::ostringstream error_log;
-    for (auto token : tokens) {
-        std::cout << token << std::endl;
-        if (token.type == TOKEN_ERROR) {
-            had_error = true;
-            error_log << token << std::endl;
-        }
-    }
-    if (had_error) std::cerr << error_log.str();
-#endif
-
-    return tokens;
+    return std::move(tokens);
 }
 
 void Scanner::scan_token() {
@@ -100,11 +235,12 @@ void Scanner::scan_token() {
             if (match('&')) { add_token(TOKEN_AND); break; }
         case '"': string(); break;
         case '/':
-            if (match('/')) while (peek() != '\n' && !is_at_end()) advance();
+            if (match('/')) skip(find_byte(position(), end(), '\n'));
             else if (match('*')) block_comment();
             else add_token( match('=') ? TOKEN_SLASH_EQUAL : TOKEN_SLASH);
             break;
-        case ' ':  case '\r': case '\t': case '{': case '}': case ';': break;
+        case ' ':  case '\r': case '\t': skip(skip_blanks(position(), end())); break;
+        case '{': case '}': case ';': break;
         case '\n': new_line(); break;
         default:
             if (is_alpha(c)) identifier();
@@ -129,12 +265,13 @@ void Scanner::string() {
 
 void Scanner::block_comment() {
     while (!is_at_end()) {
+        skip(find_byte(position(), end(), '*'));
         if (peek() == '*' && peek_next() == '/') {
             advance();
             advance();
             return;
         }
-        advance();
+        if (!is_at_end()) advance();
     }
     error_token("Unterminated block comment");
 }
@@ -146,7 +283,13 @@ void Scanner::new_line() {
     while (true) {
         char c = peek();
         switch (c) {
-            case ' ':  case '\r': case '\t': case '{': case '}': case ';':
+            case ' ':  case '\r': case '\t': {
+                const char* to = skip_blanks(position(), end());
+                whitespace += to - position();
+                skip(to);
+                break;
+            }
+            case '{': case '}': case ';':
                 advance();
                 whitespace++;
                 break;
@@ -175,13 +318,18 @@ void Scanner::new_line() {
 }
 
 void Scanner::identifier() {
-    while (is_alpha(peek()) || is_digit(peek())) advance();
+    skip(skip_identifier(position(), end()));
     add_token(identifier_type());
 }
 
 TokenType Scanner::identifier_type() {
-    std::string lexeme = source.substr(start, current - start);
-    return (keywords.contains(lexeme)) ? keywords[lexeme] : TOKEN_IDENTIFIER;
+    std::string_view lexeme = source.substr(start, current - start);
+    if (lexeme.size() < keyword_table.min_length || lexeme.size() > keyword_table.max_length) {
+        return TOKEN_IDENTIFIER;
+    }
+    int8_t index = keyword_table.slots[keyword_hash(lexeme, keyword_table.seed)];
+    if (index < 0 || keywords[index].name != lexeme) return TOKEN_IDENTIFIER;
+    return keywords[index].type;
 }
 
 void Scanner::number() {
@@ -203,12 +351,19 @@ char Scanner::advance() {
     return source[current++];
 }
 
+void Scanner::skip(const char* to) {
+    int count = to - position();
+    column += count;
+    current += count;
+}
+
 char Scanner::peek() {
+    if (is_at_end()) return '\0';
     return source[current];
 }
 
 char Scanner::peek_next() {
-    if (is_at_end()) return '\0';
+    if (current + 1 >= (int)source.length()) return '\0';
     return source[current + 1];
 }
 
@@ -223,6 +378,7 @@ void Scanner::add_token(TokenType type) {
     Token token;
     token.type = type;
     token.line = line;
+    token.symbol = 0;
     if (type == TOKEN_INDENT || type == TOKEN_DEDENT  || type == TOKEN_EOF) {
         token.lexeme = "";
         token.column = 0;
@@ -236,6 +392,7 @@ void Scanner::add_token(TokenType type) {
 void Scanner::error_token(const char* message) {
     Token token;
     token.type = TOKEN_ERROR;
+    token.symbol = 0;
     token.lexeme = message;
     token.line = line;
     token.column = column - (current - start) + 1;
@@ -1,15 +1,14 @@
 #ifndef MOSAIC_ECS_SCANNER_H
 #define MOSAIC_ECS_SCANNER_H
 
-#include <string>
-#include <unordered_map>
+#include <string_view>
 #include <vector>
 
 #include "token.h"
 
 class Scanner {
 public:
-    Scanner(std::string source);
+    Scanner(std::string_view source);
     std::vector<Token> scan_tokens();
 private:
     void scan_token();
@@ -20,6 +19,10 @@ private:
     void identifier();
     TokenType identifier_type();
     char advance();
+    // Jumps ahead to `to`, counting columns the way advance() would.
+    void skip(const char* to);
+    const char* position() const { return source.data() + current; }
+    const char* end() const { return source.data() + source.size(); }
     char peek();
     char peek_next();
     bool match(char expected);
@@ -30,14 +33,13 @@ private:
     bool is_at_end();
 
     std::vector<Token> tokens;
-    std::string source;
+    std::string_view source;
     int indent_depth;
     std::vector<int> indents;
     int start;
     int current;
     int line;
     int column;
-    std::unordered_map<std::string, TokenType> keywords;
 };
 
 #endif
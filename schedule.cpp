@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <iterator>
+
+#include "chunk.h"
+#include "schedule.h"
+
+static void add_component(std::vector<uint16_t>& components, uint16_t component) {
+    auto at = std::lower_bound(components.begin(), components.end(), component);
+    if (at == components.end() || *at != component) components.insert(at, component);
+}
+
+static bool intersect(const std::vector<uint16_t>& a, const std::vector<uint16_t>& b) {
+    for (size_t i = 0, j = 0; i < a.size() && j < b.size();) {
+        if (a[i] == b[j]) return true;
+        if (a[i] < b[j]) i++;
+        else j++;
+    }
+    return false;
+}
+
+// Run blocks don't nest, so a field is always the last query's.
+void scan_access(const uint8_t* code, size_t size, World& world, SystemAccess& access, std::vector<int>& callees) {
+    const uint8_t* terms = nullptr;
+    uint8_t term_count = 0;
+    for (size_t offset = 0; offset < size; offset += instruction_size(code + offset)) {
+        const uint8_t* instruction = code + offset;
+        switch (*instruction) {
+            case OP_QUERY_BEGIN:
+                terms = instruction + 2;
+                term_count = instruction[1];
+                world.prepare(terms, term_count);
+                access.resources |= RESOURCE_WORLD;
+                for (uint8_t i = 0; i < term_count; i++) {
+                    const uint8_t* term = terms + 3 * i;
+                    if (term[0] == QUERY_TERM_BIND) add_component(access.reads, (uint16_t)(term[1] << 8) | term[2]);
+                }
+                break;
+            case OP_SET_FIELD: {
+                uint32_t slot = instruction[1];
+                for (uint8_t i = 0; terms && i < term_count; i++) {
+                    const uint8_t* term = terms + 3 * i;
+                    if (term[0] != QUERY_TERM_BIND) continue;
+                    uint16_t component = (uint16_t)(term[1] << 8) | term[2];
+                    if (slot < world.component(component).field_count) {
+                        add_component(access.writes, component);
+                        break;
+                    }
+                    slot -= world.component(component).field_count;
+                }
+                break;
+            }
+            case OP_PRINT: access.resources |= RESOURCE_OUTPUT; break;
+            case OP_CALL_NATIVE: access.resources |= RESOURCE_HOST; break;
+            case OP_SPAWN:
+            case OP_DESPAWN:
+            case OP_INSERT:
+            case OP_REMOVE:
+                access.resources |= RESOURCE_STRUCTURE;
+                break;
+            case OP_RUN_STAGE: access.resources |= RESOURCE_STAGE; break;
+            case OP_CALL: callees.push_back((instruction[1] << 8) | instruction[2]); break;
+            default: break;
+        }
+    }
+}
+
+bool conflicts(const SystemAccess& a, const SystemAccess& b) {
+    if (a.resources & b.resources & (RESOURCE_OUTPUT | RESOURCE_HOST)) return true;
+    bool a_world = a.resources & (RESOURCE_WORLD | RESOURCE_STRUCTURE);
+    bool b_world = b.resources & (RESOURCE_WORLD | RESOURCE_STRUCTURE);
+    if (((a.resources & RESOURCE_STRUCTURE) && b_world) || ((b.resources & RESOURCE_STRUCTURE) && a_world)) {
+        return true;
+    }
+    return intersect(a.writes, b.reads) || intersect(b.writes, a.reads);
+}
+
+void build_schedule(Schedule& schedule) {
+    schedule.splits = false;
+    std::vector<uint32_t> wave_sizes;
+    for (uint32_t i = 0; i < schedule.systems.size(); i++) {
+        ScheduledSystem& system = schedule.systems[i];
+        system.after.clear();
+        system.before.clear();
+        system.wave = 0;
+        schedule.splits |= system.splits;
+        for (uint32_t j = 0; j < i; j++) {
+            if (!conflicts(schedule.systems[j].access, system.access)) continue;
+            system.after.push_back(j);
+            schedule.systems[j].before.push_back(i);
+            system.wave = std::max(system.wave, schedule.systems[j].wave + 1);
+        }
+        if (system.wave >= wave_sizes.size()) wave_sizes.resize(system.wave + 1, 0);
+        wave_sizes[system.wave]++;
+    }
+    schedule.width = wave_sizes.empty() ? 0 : *std::max_element(wave_sizes.begin(), wave_sizes.end());
+    schedule.built = true;
+}
+
+static void print_components(std::ostream& out, const char* label, const std::vector<uint16_t>& components,
+                             const World& world) {
+    if (components.empty()) return;
+    out << " " << label;
+    for (uint16_t component : components) {
+        out << " " << world.component(component).name;
+    }
+    out << ";";
+}
+
+// A wave at a time, each system with what it touches and what it waits on.
+void print_schedule(std::ostream& out, const Schedule& schedule, const World& world) {
+    uint32_t waves = 0;
+    for (const ScheduledSystem& system : schedule.systems) {
+        waves = std::max(waves, system.wave + 1);
+    }
+    out << "== " << schedule.stage << ": " << schedule.systems.size() << " systems in " << waves << " waves ==\n";
+    for (uint32_t wave = 0; wave < waves; wave++) {
+        out << "wave " << wave << "\n";
+        for (const ScheduledSystem& system : schedule.systems) {
+            if (system.wave != wave) continue;
+            out << "  " << system.name << ":";
+            std::vector<uint16_t> read_only;
+            std::set_difference(system.access.reads.begin(), system.access.reads.end(), system.access.writes.begin(),
+                                system.access.writes.end(), std::back_inserter(read_only));
+            print_components(out, "reads", read_only, world);
+            print_components(out, "writes", system.access.writes, world);
+            if (system.access.resources & RESOURCE_OUTPUT) out << " output;";
+            if (system.access.resources & RESOURCE_HOST) out << " host;";
+            if (system.access.resources & RESOURCE_STRUCTURE) out << " structure;";
+            if (system.splits) out << " may split;";
+            if (!system.after.empty()) {
+                out << " after";
+                for (uint32_t earlier : system.after) {
+                    out << " " << schedule.systems[earlier].name;
+                }
+                out << ";";
+            }
+            out << "\n";
+        }
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef MOSAIC_ECS_SCHEDULE_H
+#define MOSAIC_ECS_SCHEDULE_H
+
+#include <ostream>
+#include <stdint.h>
+#include <string_view>
+#include <vector>
+
+#include "ecs.h"
+
+// A stage's systems run in the order they are declared, except that those
+// that can't interfere with each other may run at once. What a system
+// touches is read off its code, and that of every function it calls,
+// before the stage first runs: the components its run blocks read and
+// write, and the rest of the VM it uses, its resources. A system waits on
+// every earlier system it conflicts with, which makes each stage a
+// dependency graph; systems ready at the same time run on a thread pool.
+//
+// A system's run block may instead be split by chunk across the pool, when
+// the block touches nothing but the entity it is on and its own locals;
+// the structural changes it makes are recorded a thread at a time and
+// applied once every thread is done.
+// Splitting uses every thread on one system rather than one thread per
+// system, so a stage with a system that may split runs its systems one
+// after another.
+
+// What a system uses beyond the components it reads and writes.
+enum SystemResource : uint32_t {
+    // Prints, so its lines come out in declaration order.
+    RESOURCE_OUTPUT = 1 << 0,
+    // Calls the host's natives, which may not be thread-safe.
+    RESOURCE_HOST = 1 << 1,
+    // Spawns, despawns, inserts or removes, so moves entities under every
+    // query: nothing else that touches the world runs alongside it.
+    RESOURCE_STRUCTURE = 1 << 2,
+    // Runs a stage itself, which a system may not.
+    RESOURCE_STAGE = 1 << 3,
+    // Runs a query, so walks the world's archetypes even when it binds no
+    // component: with and without only filter them.
+    RESOURCE_WORLD = 1 << 4,
+};
+
+struct SystemAccess {
+    // Sorted. The components it writes are among those it reads.
+    std::vector<uint16_t> reads;
+    std::vector<uint16_t> writes;
+    // SystemResources.
+    uint32_t resources = 0;
+};
+
+struct ScheduledSystem {
+    int function;
+    std::string_view name;
+    // Declared `serial sys`.
+    bool serial;
+    // Has a run block that may be split across threads.
+    bool splits = false;
+    SystemAccess access;
+    // The earlier systems it conflicts with, which finish before it
+    // starts, and the later ones waiting on it in turn.
+    std::vector<uint32_t> after;
+    std::vector<uint32_t> before;
+    // The longest chain of systems it waits on: those of a wave can all
+    // run at once.
+    uint32_t wave = 0;
+};
+
+struct Schedule {
+    std::string_view stage;
+    // In declaration order.
+    std::vector<ScheduledSystem> systems;
+    // The most systems in a wave; above 1 the stage runs in parallel,
+    // unless a system splits.
+    uint32_t width = 0;
+    bool splits = false;
+    // Cleared when code the systems may run changes.
+    bool built = false;
+};
+
+// Adds what one function's code touches directly to access, and the
+// functions it calls to callees. The queries it runs are compiled in
+// world, so systems running at once only ever look them up.
+void scan_access(const uint8_t* code, size_t size, World& world, SystemAccess& access, std::vector<int>& callees);
+bool conflicts(const SystemAccess& a, const SystemAccess& b);
+// Links every system to the earlier ones it conflicts with, from their
+// access.
+void build_schedule(Schedule& schedule);
+void print_schedule(std::ostream& out, const Schedule& schedule, const World& world);
+
+#endif
@@ -0,0 +1,49 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "source.h"
+
+// Below this, a read is cheaper than setting up and tearing down a mapping.
+#define SOURCE_MAP_THRESHOLD (64 * 1024)
+
+SourceFile::~SourceFile() {
+    if (mapping) munmap(mapping, size);
+}
+
+bool SourceFile::open(const char* path) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        ::close(fd);
+        return false;
+    }
+
+    size_t length = info.st_size;
+    if (length >= SOURCE_MAP_THRESHOLD) {
+        void* memory = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (memory != MAP_FAILED) {
+            ::close(fd);
+            mapping = memory;
+            data = (const char*)memory;
+            size = length;
+            return true;
+        }
+    }
+
+    buffer.resize(length);
+    size_t total = 0;
+    while (total < length) {
+        ssize_t count = read(fd, buffer.data() + total, length - total);
+        if (count <= 0) break;
+        total += count;
+    }
+    ::close(fd);
+    buffer.resize(total);
+    data = buffer.data();
+    size = buffer.size();
+    return true;
+}
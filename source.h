@@ -0,0 +1,26 @@
+#ifndef MOSAIC_ECS_SOURCE_H
+#define MOSAIC_ECS_SOURCE_H
+
+#include <string>
+#include <string_view>
+
+// The single buffer a script's text lives in. Tokens point into it, so it
+// must outlive scanning, parsing and compilation. Large files are mapped
+// rather than read, small ones take a single allocation.
+class SourceFile {
+public:
+    SourceFile() = default;
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+    ~SourceFile();
+
+    bool open(const char* path);
+    std::string_view text() const { return std::string_view(data, size); }
+private:
+    const char* data = "";
+    size_t size = 0;
+    void* mapping = nullptr;
+    std::string buffer;
+};
+
+#endif
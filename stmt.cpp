@@ -1,91 +1,98 @@
-#include <iostream>
-#include "stmt.h"
+#include "ast.h"
 
-std::ostream& operator<<(std::ostream& os, const Stmt& stmt) {
+void print_stmt(std::ostream& os, const Ast& ast, StmtIndex index) {
+    const Stmt& stmt = ast.stmt(index);
     switch (stmt.type) {
         case STMT_BLOCK: {
-            Block& block = stmt.as<Block>();
+            const uint32_t* stmts = ast.list(stmt.block.stmts);
             os << "Block(";
-            for (int i = 0; i < block.stmts.size(); i++) {
-                os << *block.stmts[i];
-                if (i + 1 < block.stmts.size()) os << ", ";
+            for (uint32_t i = 0; i < stmt.block.count; i++) {
+                print_stmt(os, ast, stmts[i]);
+                if (i + 1 < stmt.block.count) os << ", ";
             }
             os << ")";
             break;
         }
-        case STMT_EXPR: os << *stmt.as<ExprStmt>().expr; break;
+        case STMT_COMP: {
+            const uint32_t* fields = ast.list(stmt.comp.fields);
+            os << "Comp(" << ast.token(stmt.comp.name).lexeme << (stmt.comp.sparse ? ": sparse" : "");
+            for (uint32_t i = 0; i < stmt.comp.field_count; i++) {
+                os << ", " << ast.token(fields[i]).lexeme;
+            }
+            os << ")";
+            break;
+        }
+        case STMT_EXPR: print_expr(os, ast, stmt.expr_stmt.expr); break;
         case STMT_FUN: {
-            FunStmt& fun = stmt.as<FunStmt>();
-            os << "Fun(" << "<fn " << fun.name.lexeme << ">(";
-            for (int i = 0; i < fun.parameters.size(); i++) {
-                os << fun.parameters[i].lexeme;
-                if (i + 1 < fun.parameters.size()) os << ", ";
+            const FunStmt& fun = stmt.fun;
+            const uint32_t* parameters = ast.list(fun.parameters);
+            const char* kind = fun.noinline ? "NoinlineFun(" : "Fun(";
+            if (fun.system) kind = parameters[1] != AST_NONE ? "SerialSys(" : "Sys(";
+            os << kind << "<fn " << ast.token(fun.name).lexeme << ">(";
+            for (uint32_t i = 0; i < fun.arity; i++) {
+                os << ast.token(parameters[i]).lexeme;
+                if (i + 1 < fun.arity) os << ", ";
             }
-            os << "), " << *fun.body << ")";
+            os << "), ";
+            if (fun.system && parameters[0] != AST_NONE) os << ast.token(parameters[0]).lexeme << ", ";
+            print_stmt(os, ast, fun.body);
+            os << ")";
             break;
         }
         case STMT_IF: {
-            If& if_stmt = stmt.as<If>();
-            os << "If(" << *if_stmt.condition << ", Then(" << *if_stmt.then_branch << ")";
-            if (if_stmt.else_branch) os << ", Else(" << *if_stmt.else_branch << ")";
+            const If& if_stmt = stmt.if_stmt;
+            os << "If(";
+            print_expr(os, ast, if_stmt.condition);
+            os << ", Then(";
+            print_stmt(os, ast, if_stmt.then_branch);
+            os << ")";
+            if (if_stmt.else_branch != AST_NONE) {
+                os << ", Else(";
+                print_stmt(os, ast, if_stmt.else_branch);
+                os << ")";
+            }
+            os << ")";
+            break;
+        }
+        case STMT_LET:
+            os << "Let(" << ast.token(stmt.let.name).lexeme << ", ";
+            if (stmt.let.initializer != AST_NONE) print_expr(os, ast, stmt.let.initializer);
+            else os << "nil";
+            os << ")";
+            break;
+        case STMT_PRINT:
+            os << "Print(";
+            print_expr(os, ast, stmt.print.value);
+            os << ")";
+            break;
+        case STMT_QUERY: {
+            const uint32_t* terms = ast.list(stmt.query.terms);
+            os << "Query(" << ast.token(stmt.query.name).lexeme;
+            for (uint32_t i = 0; i < stmt.query.term_count; i++) {
+                const Token& first = ast.token(terms[2 * i]);
+                bool filter = first.type == TOKEN_WITH || first.type == TOKEN_WITHOUT;
+                os << ", " << first.lexeme << (filter ? " " : ": ") << ast.token(terms[2 * i + 1]).lexeme;
+            }
             os << ")";
             break;
         }
-        case STMT_LET: os << "Let(" << stmt.as<Let>().name.lexeme << ", " << *stmt.as<Let>().initializer << ")"; break;
-        case STMT_PRINT: os << "Print(" << *stmt.as<Print>().value << ")"; break;
-        case STMT_RETURN: os << "Return(" << *stmt.as<Return>().value << ")"; break;
-        case STMT_WHILE: os << "While(" << *stmt.as<While>().condition << ", " << *stmt.as<While>().body << ")"; break;
+        case STMT_RETURN:
+            os << "Return(";
+            print_expr(os, ast, stmt.return_stmt.value);
+            os << ")";
+            break;
+        case STMT_RUN:
+            os << "Run(";
+            if (stmt.run.query != AST_NONE) os << ast.token(stmt.run.query).lexeme << ", ";
+            print_stmt(os, ast, stmt.run.body);
+            os << ")";
+            break;
+        case STMT_WHILE:
+            os << "While(";
+            print_expr(os, ast, stmt.while_stmt.condition);
+            os << ", ";
+            print_stmt(os, ast, stmt.while_stmt.body);
+            os << ")";
+            break;
     }
-    return os;
-}
-
-bool Stmt::is_type(StmtType type) const {
-    return this->type == type;
-}
-
-Block::Block(std::vector<StmtPtr> &stmts) {
-    this->type = STMT_BLOCK;
-    this->stmts = stmts;
-}
-
-ExprStmt::ExprStmt(ExprPtr expr) {
-    this->type = STMT_EXPR;
-    this->expr = expr;
-}
-
-FunStmt::FunStmt(Token name, std::vector<Token>& parameters, StmtPtr body) {
-    this->type = STMT_FUN;
-    this->name = name;
-    this->parameters = parameters;
-    this->body = body;
-}
-
-If::If(ExprPtr condition, StmtPtr then_branch, StmtPtr else_branch) {
-    this->type = STMT_IF;
-    this->condition = condition;
-    this->then_branch = then_branch;
-    this->else_branch = else_branch;
-}
-
-Let::Let(Token name, ExprPtr initializer) {
-    this->type = STMT_LET;
-    this->name = name;
-    this->initializer = initializer;
-}
-
-Print::Print(ExprPtr value) {
-    this->type = STMT_PRINT;
-    this->value = value;
-}
-
-Return::Return(Token debug, ExprPtr value) {
-    this->type = STMT_RETURN;
-    this->debug = debug;
-    this->value = value;
-}
-
-While::While(ExprPtr condition, StmtPtr body) {
-    this->type = STMT_WHILE;
-    this->condition = condition;
-    this->body = body;
 }
@@ -1,98 +1,116 @@
 #ifndef MOSAIC_ECS_STMT_H
 #define MOSAIC_ECS_STMT_H
 
-#include <variant>
-#include <vector>
-
 #include "expr.h"
 
-enum StmtType {
+enum StmtType : uint32_t {
     STMT_BLOCK,
+    STMT_COMP,
     STMT_EXPR,
     STMT_FUN,
     STMT_IF,
     STMT_LET,
     STMT_PRINT,
+    STMT_QUERY,
     STMT_RETURN,
+    STMT_RUN,
     STMT_WHILE,
 };
 
-class Stmt {
-public:
-    virtual ~Stmt() = default;
-    bool is_type(StmtType type) const;
-
-    template<class T>
-    T& as() const {
-        return *(T*)this;
-    }
-
-    template<class T>
-    static std::shared_ptr<Stmt> ptr(T stmt) {
-        return std::make_shared<T>(stmt);
-    }
+struct Block {
+    // StmtIndex entries in Ast::lists.
+    ListIndex stmts;
+    uint32_t count;
+};
 
-    StmtType type;
+struct CompStmt {
+    TokenIndex name;
+    // TokenIndex entries in Ast::lists.
+    ListIndex fields;
+    uint32_t field_count;
+    // Declared `comp Name: sparse`, so kept in a sparse set rather than in
+    // the archetypes.
+    bool sparse;
 };
 
-using StmtPtr = std::shared_ptr<Stmt>;
+struct ExprStmt {
+    ExprIndex expr;
+};
 
-class Block : public Stmt {
-public:
-    std::vector<StmtPtr> stmts;
-    Block(std::vector<StmtPtr>& stmts);
+struct FunStmt {
+    TokenIndex name;
+    // TokenIndex entries in Ast::lists.
+    ListIndex parameters;
+    uint16_t arity;
+    // Declared `noinline fun`, so calls to it are never inlined.
+    bool noinline;
+    // Declared `sys`: no parameters, and never inlined either. A system's
+    // parameters list holds its stage instead, the name or AST_NONE for
+    // update, then its `serial` keyword or AST_NONE.
+    bool system;
+    StmtIndex body;
 };
 
-class ExprStmt : public Stmt {
-public:
-    ExprPtr expr;
-    ExprStmt(ExprPtr expr);
+struct If {
+    ExprIndex condition;
+    StmtIndex then_branch;
+    // AST_NONE without an else.
+    StmtIndex else_branch;
 };
 
-class FunStmt : public Stmt {
-public:
-    Token name;
-    std::vector<Token> parameters;
-    StmtPtr body;
-    FunStmt(Token name, std::vector<Token>& parameters, StmtPtr body);
+struct Let {
+    TokenIndex name;
+    // AST_NONE when the variable starts out nil.
+    ExprIndex initializer;
 };
 
-class If : public Stmt {
-public:
-    ExprPtr condition;
-    StmtPtr then_branch;
-    StmtPtr else_branch;
-    If(ExprPtr condition, StmtPtr then_branch, StmtPtr else_branch);
+struct Print {
+    ExprIndex value;
 };
 
+struct QueryStmt {
+    TokenIndex name;
+    // Pairs of TokenIndex entries in Ast::lists: a binding and the
+    // component, or Entity, it binds, or `with` or `without` and the
+    // component it filters on.
+    ListIndex terms;
+    uint32_t term_count;
+};
 
-class Let : public Stmt {
-public:
-    Token name;
-    ExprPtr initializer;
-    Let(Token name, ExprPtr initializer);
+struct Return {
+    TokenIndex debug;
+    ExprIndex value;
 };
 
-class Print : public Stmt {
-public:
-    ExprPtr value;
-    Print(ExprPtr value);
+struct RunStmt {
+    TokenIndex keyword;
+    // AST_NONE runs the query declared last.
+    TokenIndex query;
+    StmtIndex body;
 };
 
-class Return : public Stmt {
-public:
-    Token debug;
-    ExprPtr value;
-    Return(Token debug, ExprPtr value);
+struct While {
+    ExprIndex condition;
+    StmtIndex body;
 };
 
-class While : public Stmt {
-public:
-    ExprPtr condition;
-    StmtPtr body;
-    While(ExprPtr condition, StmtPtr body);
+struct Stmt {
+    StmtType type;
+    union {
+        Block block;
+        CompStmt comp;
+        ExprStmt expr_stmt;
+        FunStmt fun;
+        If if_stmt;
+        Let let;
+        Print print;
+        QueryStmt query;
+        Return return_stmt;
+        RunStmt run;
+        While while_stmt;
+    };
 };
 
-std::ostream& operator<<(std::ostream& os, const Stmt& stmt);
+static_assert(sizeof(Stmt) == 20);
 
 #endif
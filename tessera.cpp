@@ -0,0 +1,58 @@
+#include <iostream>
+
+#include "parser.h"
+#include "scanner.h"
+#include "tessera.h"
+#include "type_inference.h"
+
+bool parse_program(std::string_view source, Ast& ast, int debug_flags, int optimize) {
+    Scanner scanner = Scanner(source);
+    std::vector<Token> tokens = scanner.scan_tokens();
+    if (debug_flags & DEBUG_TOKENS) dump_tokens(tokens);
+
+    Parser parser = Parser(std::move(tokens));
+    ast = parser.parse();
+    if (parser.failed()) {
+        if (debug_flags & DEBUG_AST) dump_ast(ast);
+        return false;
+    }
+
+    if (optimize > OPTIMIZE_NONE) {
+        Optimizer optimizer = Optimizer(ast);
+        optimizer.optimize();
+        TypeInference inference = TypeInference(ast);
+        inference.infer();
+    }
+    if (debug_flags & DEBUG_AST) dump_ast(ast);
+    return true;
+}
+
+CompilerResult compile_program(std::string_view source, const FFI& ffi, Program& program, int debug_flags,
+                               int optimize, bool lazy) {
+    if (lazy) {
+        std::shared_ptr<LazyCompiler> compiler = std::make_shared<LazyCompiler>(source, ffi, optimize, debug_flags);
+        std::shared_ptr<Image> image = compiler->compile_script();
+        if (!image) return COMPILER_RESULT_ERROR;
+        program = Program{image, ffi, compiler};
+        return COMPILER_RESULT_OK;
+    }
+
+    Ast ast;
+    if (!parse_program(source, ast, debug_flags, optimize)) return COMPILER_RESULT_ERROR;
+    if (!ast.imports.empty()) {
+        std::cerr << "A script that imports modules is built from its path, by a ModuleBuilder." << std::endl;
+        return COMPILER_RESULT_ERROR;
+    }
+
+    Compiler compiler = Compiler(ast, ffi, optimize, debug_flags);
+    if (compiler.compile() != COMPILER_RESULT_OK) return COMPILER_RESULT_ERROR;
+    if (debug_flags & DEBUG_BYTECODE) compiler.disassemble();
+
+    std::shared_ptr<Image> image = std::make_shared<Image>();
+    if (!image->load(compiler.image())) return COMPILER_RESULT_ERROR;
+
+    program.image = image;
+    program.ffi = ffi;
+    program.lazy = nullptr;
+    return COMPILER_RESULT_OK;
+}
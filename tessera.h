@@ -0,0 +1,50 @@
+#ifndef MOSAIC_ECS_TESSERA_H
+#define MOSAIC_ECS_TESSERA_H
+
+// Host API for embedding scripts. Everything stays in memory:
+//
+//     FFI ffi;
+//     ffi.define_function("draw_text", draw_text_native, 4);
+//
+//     Program program;
+//     if (compile_program(source, ffi, program) != COMPILER_RESULT_OK) ...
+//
+//     VM vm = VM(program);
+//     vm.run();
+//     int update = vm.find_function("update");
+//     while (running) {
+//         Value result;
+//         vm.call_function(update, {dt}, result);
+//     }
+//
+// A script that imports modules is built from its path instead:
+//
+//     ModuleBuilder builder = ModuleBuilder(ffi);
+//     if (builder.build("game.te", program) != COMPILER_RESULT_OK) ...
+
+#include <string_view>
+
+#include "compiler.h"
+#include "debug.h"
+#include "ffi.h"
+#include "lazy_compiler.h"
+#include "module.h"
+#include "optimizer.h"
+#include "program.h"
+#include "value.h"
+#include "vm.h"
+
+// source only needs to live for the duration of the call. optimize is one
+// of the OPTIMIZE_ levels; all of them must produce the same behaviour. A
+// lazy program compiles only the script's top level here, and each
+// function when it is first called, which is also when a function's
+// compile errors are reported.
+CompilerResult compile_program(std::string_view source, const FFI& ffi, Program& program,
+                               int debug_flags = DEBUG_NONE, int optimize = OPTIMIZE_DEFAULT, bool lazy = false);
+
+// Scans and parses source into ast, then optimizes it above OPTIMIZE_NONE.
+// ast points into source. False, having reported why, on a syntax error.
+bool parse_program(std::string_view source, Ast& ast, int debug_flags = DEBUG_NONE,
+                   int optimize = OPTIMIZE_DEFAULT);
+
+#endif
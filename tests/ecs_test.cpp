@@ -0,0 +1,91 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "tessera.h"
+
+static int failures = 0;
+
+// Compiling source fails, reporting expected.
+static void check_error(const char* name, const std::string& source, const char* expected) {
+    std::ostringstream captured;
+    std::streambuf* cerr = std::cerr.rdbuf(captured.rdbuf());
+    Program program;
+    CompilerResult result = compile_program(source, FFI(), program);
+    std::cerr.rdbuf(cerr);
+    if (result == COMPILER_RESULT_ERROR && captured.str().find(expected) != std::string::npos) return;
+    std::cerr << "FAIL " << name << "\n" << captured.str();
+    failures++;
+}
+
+static const char* POSITION = "comp Position\n    x: Number\n\n";
+
+static void return_from_run_block() {
+    check_error("return_from_run_block", std::string(POSITION) + R"(fun first()
+    query all
+        pos: Position
+    run all
+        return pos.x
+    return 0
+)", "Can't return from a run block.");
+}
+
+static void component_bound_twice() {
+    check_error("component_bound_twice", std::string(POSITION) + R"(query all
+    pos: Position
+    pos: Position
+run all
+    print pos.x
+)", "Query all binds pos twice.");
+}
+
+static void nested_run_blocks() {
+    check_error("nested_run_blocks", std::string(POSITION) + R"(query all
+    pos: Position
+run all
+    run all
+        print pos.x
+)", "Run blocks don't nest.");
+}
+
+static void too_many_fields() {
+    std::string source = "comp Big\n";
+    for (int i = 0; i < 130; i++) {
+        source += "    f" + std::to_string(i) + ": Number\n";
+    }
+    source += "query all\n    a: Big\n    b: Big\nrun all\n    print a.f0\n";
+    check_error("too_many_fields", source, "Query all reads too many fields.");
+}
+
+static void assign_to_binding() {
+    check_error("assign_to_binding", std::string(POSITION) + R"(query all
+    pos: Position
+run all
+    pos = 1
+)", "Can't assign to a query binding.");
+}
+
+static void needs_and_excludes() {
+    check_error("binds_and_excludes", std::string(POSITION) + R"(query all
+    pos: Position
+    without Position
+run all
+    print pos.x
+)", "Query all both needs and excludes Position.");
+    check_error("filters_and_excludes", std::string(POSITION) + R"(query all
+    with Position
+    without Position
+run all
+    print 1
+)", "Query all both needs and excludes Position.");
+}
+
+int main() {
+    return_from_run_block();
+    component_bound_twice();
+    nested_run_blocks();
+    too_many_fields();
+    assign_to_binding();
+    needs_and_excludes();
+    return failures == 0 ? 0 : 1;
+}
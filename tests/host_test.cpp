@@ -0,0 +1,66 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "tessera.h"
+
+static int failures = 0;
+
+static void check(bool passed, const char* name, const std::string& detail = "") {
+    if (passed) return;
+    std::cerr << "FAIL " << name << "\n" << detail;
+    failures++;
+}
+
+// Compiles source, with what the compiler reports kept in errors.
+static CompilerResult compile(const char* source, std::string& errors) {
+    std::ostringstream captured;
+    std::streambuf* cerr = std::cerr.rdbuf(captured.rdbuf());
+    Program program;
+    CompilerResult result = compile_program(source, FFI(), program);
+    std::cerr.rdbuf(cerr);
+    errors = captured.str();
+    return result;
+}
+
+// A bad script returns an error to the host rather than ending it.
+static void undeclared_variable_is_returned() {
+    std::string errors;
+    check(compile("print x\n", errors) == COMPILER_RESULT_ERROR, "undeclared_variable_is_returned", errors);
+    check(errors.find("Undeclared variable: x") != std::string::npos, "undeclared_variable_is_reported", errors);
+}
+
+static void undeclared_function_is_returned() {
+    std::string errors;
+    check(compile("missing(1)\n", errors) == COMPILER_RESULT_ERROR, "undeclared_function_is_returned", errors);
+    check(errors.find("Undeclared function: missing") != std::string::npos, "undeclared_function_is_reported",
+          errors);
+}
+
+static void syntax_error_is_returned() {
+    std::string errors;
+    check(compile("let = 1\n", errors) == COMPILER_RESULT_ERROR, "syntax_error_is_returned", errors);
+}
+
+static void every_error_is_reported() {
+    std::string errors;
+    check(compile("print x\nprint y\n", errors) == COMPILER_RESULT_ERROR, "every_error_is_returned", errors);
+    check(errors.find("Undeclared variable: y") != std::string::npos, "every_error_is_reported", errors);
+}
+
+static void good_script_compiles_and_runs() {
+    Program program;
+    check(compile_program("let a = 1\nprint a + 1\n", FFI(), program) == COMPILER_RESULT_OK,
+          "good_script_compiles");
+    VM vm = VM(program);
+    check(vm.run() == RUNTIME_OK, "good_script_runs");
+}
+
+int main() {
+    undeclared_variable_is_returned();
+    undeclared_function_is_returned();
+    syntax_error_is_returned();
+    every_error_is_reported();
+    good_script_compiles_and_runs();
+    return failures == 0 ? 0 : 1;
+}
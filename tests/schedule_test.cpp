@@ -0,0 +1,74 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "tessera.h"
+
+static int failures = 0;
+
+static void check(bool passed, const char* name, const std::string& schedule) {
+    if (passed) return;
+    std::cerr << "FAIL " << name << "\n" << schedule;
+    failures++;
+}
+
+static std::string schedule_of(const char* source) {
+    Program program;
+    if (compile_program(source, FFI(), program) != COMPILER_RESULT_OK) return "compile error\n";
+    VM vm = VM(program);
+    std::ostringstream out;
+    if (!vm.dump_schedule(out)) return "schedule error\n";
+    return out.str();
+}
+
+// A query that only filters still walks the archetypes a spawn may move.
+static void filter_only_query_waits_on_spawn() {
+    std::string schedule = schedule_of(R"(comp Tag
+comp Position
+    x: Number
+
+sys Count
+    let n = 0
+    query tagged
+        with Tag
+    run tagged
+        n += 1
+
+sys Spawner
+    let i = 0
+    while i < 100
+        spawn(Position(i), Tag())
+        i += 1
+)");
+    check(schedule.find("2 systems in 2 waves") != std::string::npos &&
+              schedule.find("Spawner: structure; after Count;") != std::string::npos,
+          "filter_only_query_waits_on_spawn", schedule);
+}
+
+// Systems on disjoint components still share a wave.
+static void disjoint_systems_share_a_wave() {
+    std::string schedule = schedule_of(R"(comp Position
+    x: Number
+comp Health
+    hp: Number
+
+sys Move
+    query movers
+        pos: Position
+    run movers
+        pos.x += 1
+
+sys Heal
+    query wounded
+        health: Health
+    run wounded
+        health.hp += 1
+)");
+    check(schedule.find("2 systems in 1 waves") != std::string::npos, "disjoint_systems_share_a_wave", schedule);
+}
+
+int main() {
+    filter_only_query_waits_on_spawn();
+    disjoint_systems_share_a_wave();
+    return failures == 0 ? 0 : 1;
+}
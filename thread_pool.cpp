@@ -0,0 +1,52 @@
+#include <algorithm>
+
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(unsigned threads) {
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned thread = 1; thread < threads; thread++) {
+        this->threads.emplace_back(&ThreadPool::loop, this, thread);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+void ThreadPool::run(const std::function<void(unsigned)>& work) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->work = &work;
+        generation++;
+        running = threads.size();
+    }
+    wake.notify_all();
+    work(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return running == 0; });
+    this->work = nullptr;
+}
+
+void ThreadPool::loop(unsigned thread) {
+    uint64_t seen = 0;
+    while (true) {
+        const std::function<void(unsigned)>* work;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            work = this->work;
+        }
+        (*work)(thread);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--running == 0) done.notify_one();
+    }
+}
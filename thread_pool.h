@@ -0,0 +1,39 @@
+#ifndef MOSAIC_ECS_THREAD_POOL_H
+#define MOSAIC_ECS_THREAD_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+// Threads kept waiting for work, so handing them some costs a wake-up
+// rather than a thread start, as a stage does every frame. The thread
+// calling run() works too.
+class ThreadPool {
+public:
+    // threads counts the caller's; 0 is every hardware thread.
+    explicit ThreadPool(unsigned threads = 0);
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool();
+    unsigned size() const { return threads.size() + 1; }
+    // Runs work(thread) once on every thread, the caller's being 0, and
+    // returns once they all have.
+    void run(const std::function<void(unsigned)>& work);
+private:
+    void loop(unsigned thread);
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(unsigned)>* work = nullptr;
+    // Counts the calls to run(), so a thread knows new work from the last.
+    uint64_t generation = 0;
+    unsigned running = 0;
+    bool stopping = false;
+};
+
+#endif
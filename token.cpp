@@ -1,6 +1,3 @@
-#include "debug.h"
-
-#ifdef TOKEN_DEBUG
 #include <iostream>
 #include <unordered_map>
 
@@ -51,6 +48,8 @@ std::unordered_map<TokenType, std::string> TokenTypeStrings = {
         {TOKEN_TRUE,   "TOKEN_TRUE"},
         {TOKEN_LET,    "TOKEN_LET"},
         {TOKEN_WHILE,  "TOKEN_WHILE"},
+        {TOKEN_NOINLINE, "TOKEN_NOINLINE"},
+        {TOKEN_IMPORT, "TOKEN_IMPORT"},
 
         {TOKEN_WORLD,  "TOKEN_WORLD"},
         {TOKEN_SCENE,  "TOKEN_SCENE"},
@@ -58,12 +57,17 @@ std::unordered_map<TokenType, std::string> TokenTypeStrings = {
         {TOKEN_ENTITY, "TOKEN_ENTITY"},
         {TOKEN_COMP,   "TOKEN_COMP"},
         {TOKEN_SYS,    "TOKEN_SYS"},
+        {TOKEN_SERIAL, "TOKEN_SERIAL"},
         {TOKEN_RES,    "TOKEN_RES"},
         {TOKEN_INIT,   "TOKEN_INIT"},
-        {TOKEN_RUN, "TOKEN_INIT"},
+        {TOKEN_RUN,    "TOKEN_RUN"},
         {TOKEN_QUERY, "TOKEN_QUERY"},
         {TOKEN_WITH, "TOKEN_WITH"},
         {TOKEN_WITHOUT, "TOKEN_WITHOUT"},
+        {TOKEN_SPAWN, "TOKEN_SPAWN"},
+        {TOKEN_DESPAWN, "TOKEN_DESPAWN"},
+        {TOKEN_INSERT, "TOKEN_INSERT"},
+        {TOKEN_REMOVE, "TOKEN_REMOVE"},
 
         {TOKEN_ERROR, "TOKEN_ERROR"},
         {TOKEN_EOF, "TOKEN_EOF"}
@@ -73,4 +77,3 @@ std::ostream& operator<<(std::ostream& os, const Token& token) {
     os << token.line << ":" << token.column << " " << TokenTypeStrings[token.type] << " " << token.lexeme;
     return os;
 }
-#endif
@@ -1,7 +1,9 @@
 #ifndef MOSAIC_ECS_TOKEN_H
 #define MOSAIC_ECS_TOKEN_H
 
+#include <stdint.h>
 #include <string>
+#include <string_view>
 
 typedef enum {
     // Single-character tokens.
@@ -28,22 +30,31 @@ typedef enum {
     TOKEN_FUN, TOKEN_IF, TOKEN_NIL,
     TOKEN_PRINT, TOKEN_RETURN, TOKEN_THIS,
     TOKEN_TRUE, TOKEN_LET, TOKEN_WHILE,
+    TOKEN_NOINLINE, TOKEN_IMPORT,
     // ECS Keywords.
     TOKEN_WORLD, TOKEN_SCENE, TOKEN_LAYER,
-    TOKEN_ENTITY, TOKEN_COMP, TOKEN_SYS,
+    TOKEN_ENTITY, TOKEN_COMP, TOKEN_SYS, TOKEN_SERIAL,
     TOKEN_RES, TOKEN_INIT, TOKEN_RUN,
     TOKEN_QUERY, TOKEN_WITH, TOKEN_WITHOUT,
+    TOKEN_SPAWN, TOKEN_DESPAWN,
+    TOKEN_INSERT, TOKEN_REMOVE,
 
     TOKEN_ERROR, TOKEN_EOF
 } TokenType;
 
 struct Token {
     TokenType type;
-    std::string lexeme;
     int line;
     int column;
+    // Identifiers only: the name's id in Ast::symbols, set by the parser.
+    uint32_t symbol;
+    // Points into the source buffer, or at a static error message.
+    std::string_view lexeme;
 
     friend std::ostream& operator<<(std::ostream& os, const Token& dt);
 };
 
+// Scripts are tokenized by the million; keep a token to half a cache line.
+static_assert(sizeof(Token) == 32);
+
 #endif
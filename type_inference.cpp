@@ -0,0 +1,285 @@
+#include <algorithm>
+
+#include "type_inference.h"
+
+TypeInference::TypeInference(Ast& ast) : ast(ast), frame(0), frame_count(0) {
+    symbol_bindings.assign(ast.symbols.size(), -1);
+    marks.assign(ast.exprs.size(), 0);
+    mark_frames.assign(ast.exprs.size(), 0);
+    untrusted_frames.assign(1, false);
+}
+
+void TypeInference::infer() {
+    begin_scope();
+    infer_stmts(ast.list(ast.script), ast.script_count);
+    end_scope();
+
+    ast.numeric.assign(ast.exprs.size(), false);
+    for (size_t i = 0; i < marks.size(); i++) {
+        ast.numeric[i] = marks[i] == 1 && !untrusted_frames[mark_frames[i]];
+    }
+}
+
+void TypeInference::infer_stmts(const StmtIndex* stmts, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        infer_stmt(stmts[i]);
+    }
+}
+
+// Scoping mirrors the Compiler, as in the Optimizer: only blocks open a
+// scope, and functions can't see their caller's locals.
+void TypeInference::infer_stmt(StmtIndex index) {
+    const Stmt& stmt = ast.stmt(index);
+    switch (stmt.type) {
+        case STMT_BLOCK:
+            begin_scope();
+            infer_stmts(ast.list(stmt.block.stmts), stmt.block.count);
+            end_scope();
+            break;
+        case STMT_COMP: break;
+        case STMT_EXPR: infer_expr(stmt.expr_stmt.expr); break;
+        case STMT_FUN: {
+            int enclosing = frame;
+            size_t first = bindings.size();
+            frame = ++frame_count;
+            untrusted_frames.push_back(false);
+            begin_scope();
+            const TokenIndex* parameters = ast.list(stmt.fun.parameters);
+            for (uint32_t i = 0; i < stmt.fun.arity; i++) {
+                bind(parameters[i]);
+            }
+            infer_stmt(stmt.fun.body);
+            end_scope();
+            // Nothing refers to them again, and every join would copy them.
+            bindings.resize(first);
+            numeric.resize(first);
+            frame = enclosing;
+            break;
+        }
+        case STMT_IF: {
+            infer_expr(stmt.if_stmt.condition);
+            size_t count = bindings.size();
+            std::vector<bool> before = numeric;
+            infer_stmt(stmt.if_stmt.then_branch);
+            std::vector<bool> after_then = numeric;
+            restore(before);
+            if (stmt.if_stmt.else_branch != AST_NONE) infer_stmt(stmt.if_stmt.else_branch);
+            join(after_then, count);
+            break;
+        }
+        case STMT_LET: {
+            // Bound before the initializer, as the Compiler does.
+            int binding = bind(stmt.let.name);
+            bool is_numeric = stmt.let.initializer != AST_NONE && infer_expr(stmt.let.initializer);
+            numeric[binding] = is_numeric;
+            break;
+        }
+        case STMT_PRINT: infer_expr(stmt.print.value); break;
+        case STMT_RETURN: infer_expr(stmt.return_stmt.value); break;
+        case STMT_QUERY: queries.push_back({frame, index}); break;
+        case STMT_RUN: {
+            // The query's bindings hide any local of the same name; only
+            // an entity is known to be a number.
+            begin_scope();
+            if (StmtIndex query = query_of(stmt.run); query != AST_NONE) {
+                const QueryStmt& terms = ast.stmt(query).query;
+                for (uint32_t i = 0; i < terms.term_count; i++) {
+                    const TokenIndex* term = ast.list(terms.terms) + 2 * i;
+                    numeric[bind(term[0])] = ast.token(term[1]).type == TOKEN_ENTITY;
+                }
+            }
+            // The block runs once per entity, as often as a loop body.
+            infer_loop(AST_NONE, stmt.run.body);
+            end_scope();
+            break;
+        }
+        case STMT_WHILE: infer_loop(stmt.while_stmt.condition, stmt.while_stmt.body); break;
+    }
+}
+
+// The body may run any number of times, after condition each time if
+// there is one.
+void TypeInference::infer_loop(ExprIndex condition, StmtIndex body) {
+    // Locals only ever lose their number type, so this settles.
+    size_t count = bindings.size();
+    std::vector<bool> header = numeric;
+    while (true) {
+        restore(header);
+        if (condition != AST_NONE) infer_expr(condition);
+        std::vector<bool> exit = numeric;
+        infer_stmt(body);
+        bool changed = false;
+        for (size_t i = 0; i < count; i++) {
+            if (header[i] && !numeric[i]) {
+                header[i] = false;
+                changed = true;
+            }
+        }
+        if (!changed) {
+            restore(exit);
+            break;
+        }
+    }
+}
+
+// The query a run block in the current function runs, or AST_NONE.
+StmtIndex TypeInference::query_of(const RunStmt& run) const {
+    for (auto query = queries.rbegin(); query != queries.rend(); query++) {
+        if (query->first != frame) continue;
+        const QueryStmt& declared = ast.stmt(query->second).query;
+        if (run.query == AST_NONE || ast.token(declared.name).symbol == ast.token(run.query).symbol) {
+            return query->second;
+        }
+    }
+    return AST_NONE;
+}
+
+bool TypeInference::infer_expr(ExprIndex index) {
+    const Expr& expr = ast.expr(index);
+    switch (expr.type) {
+        case EXPR_ASSIGN: {
+            int binding = lookup(expr.assign.name);
+            bool is_numeric = infer_expr(expr.assign.value);
+            if (binding != -1) numeric[binding] = is_numeric;
+            return is_numeric;
+        }
+        case EXPR_COMPOUND_ASSIGN: {
+            int binding = lookup(expr.compound_assign.name);
+            bool is_numeric = infer_expr(expr.compound_assign.value);
+            // The Compiler emits nothing for %=.
+            if (binding == -1 || ast.token(expr.compound_assign.op).type == TOKEN_MODULO_EQUAL) return is_numeric;
+            mark(index, numeric[binding] && is_numeric);
+            // Anything but a number stops the VM here.
+            numeric[binding] = true;
+            return is_numeric;
+        }
+        case EXPR_BINARY: {
+            bool left = infer_expr(expr.binary.left);
+            bool right = infer_expr(expr.binary.right);
+            switch (ast.token(expr.binary.op).type) {
+                case TOKEN_PLUS:
+                    mark(index, left && right);
+                    return left && right;
+                case TOKEN_MINUS:
+                case TOKEN_STAR:
+                case TOKEN_SLASH:
+                    mark(index, left && right);
+                    return true;
+                case TOKEN_GREATER:
+                case TOKEN_GREATER_EQUAL:
+                case TOKEN_LESS:
+                case TOKEN_LESS_EQUAL:
+                    mark(index, left && right);
+                    return false;
+                case TOKEN_MODULO: return true;
+                default: return false;
+            }
+        }
+        case EXPR_CALL: {
+            const ExprIndex* arguments = ast.list(expr.call.arguments);
+            for (uint32_t i = 0; i < expr.call.argument_count; i++) {
+                infer_expr(arguments[i]);
+            }
+            return false;
+        }
+        case EXPR_COMMAND: {
+            TokenType keyword = ast.token(expr.command.keyword).type;
+            uint32_t count = keyword == TOKEN_REMOVE ? std::min(1u, expr.command.argument_count)
+                                                     : expr.command.argument_count;
+            const ExprIndex* arguments = ast.list(expr.command.arguments);
+            for (uint32_t i = 0; i < count; i++) {
+                infer_expr(arguments[i]);
+            }
+            // A spawned entity's id.
+            return keyword == TOKEN_SPAWN;
+        }
+        case EXPR_GET: return false;
+        case EXPR_LITERAL: {
+            Value value;
+            return literal_value(ast, expr.literal, value) && IS_NUMBER(value);
+        }
+        case EXPR_LOGICAL: {
+            // The right side may not run.
+            bool left = infer_expr(expr.logical.left);
+            size_t count = bindings.size();
+            std::vector<bool> after_left = numeric;
+            bool right = infer_expr(expr.logical.right);
+            join(after_left, count);
+            return left && right;
+        }
+        case EXPR_SET: {
+            bool is_numeric = infer_expr(expr.set.value);
+            return ast.token(expr.set.op).type == TOKEN_EQUAL && is_numeric;
+        }
+        case EXPR_UNARY: {
+            infer_expr(expr.unary.right);
+            return ast.token(expr.unary.op).type == TOKEN_MINUS;
+        }
+        case EXPR_VARIABLE: {
+            int binding = lookup(expr.variable.name);
+            return binding != -1 && numeric[binding];
+        }
+    }
+    return false;
+}
+
+void TypeInference::mark(ExprIndex index, bool numeric_operands) {
+    if (marks[index] == 0 || !numeric_operands) marks[index] = numeric_operands ? 1 : 2;
+    mark_frames[index] = frame;
+}
+
+// Keeps what holds on both paths; bindings made since count exist on one
+// path only.
+void TypeInference::join(const std::vector<bool>& other, size_t count) {
+    for (size_t i = 0; i < numeric.size(); i++) {
+        numeric[i] = i < count && numeric[i] && other[i];
+    }
+}
+
+void TypeInference::restore(const std::vector<bool>& saved) {
+    for (size_t i = 0; i < numeric.size(); i++) {
+        numeric[i] = i < saved.size() && saved[i];
+    }
+}
+
+int TypeInference::bind(TokenIndex name) {
+    uint32_t symbol = ast.token(name).symbol;
+    int binding = bindings.size();
+    bindings.push_back(TypeBinding{symbol, frame, symbol_bindings[symbol]});
+    numeric.push_back(false);
+    symbol_bindings[symbol] = binding;
+    scope_bindings.push_back(binding);
+
+    // Past 256 locals the Compiler stops making slots.
+    size_t locals = 0;
+    for (auto other = scope_bindings.rbegin(); other != scope_bindings.rend(); other++) {
+        if (bindings[*other].frame != frame) break;
+        locals++;
+    }
+    if (locals > UINT8_MAX + 1) untrusted_frames[frame] = true;
+    return binding;
+}
+
+// Names that aren't locals of the current function are functions, read
+// as values.
+int TypeInference::lookup(TokenIndex name) {
+    int binding = symbol_bindings[ast.token(name).symbol];
+    if (binding == -1 || bindings[binding].frame != frame) {
+        untrusted_frames[frame] = true;
+        return -1;
+    }
+    return binding;
+}
+
+void TypeInference::begin_scope() {
+    scopes.push_back(scope_bindings.size());
+}
+
+void TypeInference::end_scope() {
+    while (scope_bindings.size() > scopes.back()) {
+        const TypeBinding& binding = bindings[scope_bindings.back()];
+        symbol_bindings[binding.symbol] = binding.shadowed;
+        scope_bindings.pop_back();
+    }
+    scopes.pop_back();
+}
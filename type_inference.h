@@ -0,0 +1,64 @@
+#ifndef MOSAIC_ECS_TYPE_INFERENCE_H
+#define MOSAIC_ECS_TYPE_INFERENCE_H
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+#include "ast.h"
+
+struct TypeBinding {
+    uint32_t symbol;
+    int frame;
+    // The binding of the same symbol this one hides, or -1.
+    int shadowed;
+};
+
+// Finds the arithmetic, comparisons and compound assignments whose operands
+// are numbers on every path that reaches them, and marks them in
+// Ast::numeric so the Compiler can emit the unchecked _NN opcodes.
+// Flow-sensitive: each local's type is tracked through assignments, joined
+// where if/else and && / || paths meet, and iterated to a fixpoint around
+// loops. Anything a local might hold besides a number makes it unknown.
+class TypeInference {
+public:
+    TypeInference(Ast& ast);
+    void infer();
+private:
+    void infer_stmts(const StmtIndex* stmts, uint32_t count);
+    void infer_stmt(StmtIndex index);
+    // Whether the expression certainly evaluates to a number, if it
+    // evaluates at all.
+    bool infer_expr(ExprIndex index);
+    void infer_loop(ExprIndex condition, StmtIndex body);
+    StmtIndex query_of(const RunStmt& run) const;
+    void mark(ExprIndex index, bool numeric_operands);
+    void join(const std::vector<bool>& other, size_t count);
+    void restore(const std::vector<bool>& saved);
+    int bind(TokenIndex name);
+    int lookup(TokenIndex name);
+    void begin_scope();
+    void end_scope();
+
+    Ast& ast;
+    std::vector<TypeBinding> bindings;
+    // Whether each binding holds a number at the current point.
+    std::vector<bool> numeric;
+    // Innermost binding per symbol, or -1.
+    std::vector<int> symbol_bindings;
+    std::vector<int> scope_bindings;
+    std::vector<size_t> scopes;
+    // Every query seen so far and the function declaring it.
+    std::vector<std::pair<int, StmtIndex>> queries;
+    // Per expression: 0 unseen, 1 numeric operands every time so far, 2 not.
+    std::vector<uint8_t> marks;
+    // The function each marked expression is in.
+    std::vector<int> mark_frames;
+    // Functions that read a function's name as a variable, which makes the
+    // Compiler's slots drift; nothing in them is trusted.
+    std::vector<bool> untrusted_frames;
+    int frame;
+    int frame_count;
+};
+
+#endif
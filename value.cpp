@@ -1,5 +1,6 @@
 #include "value.h"
 #include "ffi.h"
+#include "image.h"
 
 ValType value_type(const Value& value) {
     if (IS_BOOL(value)) return VAL_BOOL;
@@ -24,12 +25,16 @@ bool values_equal(Value& a, Value& b) {
     }
 }
 
-void print_value(const Value& value, std::string& strings, std::vector<ObjFunction>& functions, FFI& ffi) {
+void print_value(const Value& value, const std::string& strings, const Image& image, FFI& ffi) {
     switch (value_type(value)) {
         case VAL_FUNCTION_INDEX: {
             const FunctionIndex& fn_index = AS_FUNCTION_INDEX(value);
             if (fn_index.user_index != -1) {
-                std::cout << "<fn " << functions[AS_FUNCTION_INDEX(value).user_index].name.lexeme << ">"; break;
+                // A REPL's functions outgrow the image it started with.
+                if ((size_t)fn_index.user_index >= image.function_count()) {
+                    std::cout << "<fn #" << fn_index.user_index << ">"; break;
+                }
+                std::cout << "<fn " << image.function_name(fn_index.user_index) << ">"; break;
             } else {
                 std::cout << "<native " << ffi.native_functions[AS_FUNCTION_INDEX(value).native_index].name << ">"; break;
             }
@@ -54,6 +54,8 @@ typedef std::variant<bool, double, FunctionIndex, Nil, StringIndex> Value;
 #define AS_BOOL(value) std::get<bool>(value)
 #define AS_FUNCTION_INDEX(value) std::get<FunctionIndex>(value)
 #define AS_NUMBER(value) std::get<double>(value)
+// Only for values already proven numbers.
+#define AS_NUMBER_UNCHECKED(value) (*std::get_if<double>(&(value)))
 #define AS_STRING_INDEX(value) std::get<StringIndex>(value)
 
 enum ValType {
@@ -66,7 +68,7 @@ enum ValType {
 
 ValType value_type(const Value& value);
 bool values_equal(Value& a, Value& b);
-void print_value(const Value& value, std::string& strings, std::vector<ObjFunction>& functions, class FFI& ffi );
+void print_value(const Value& value, const std::string& strings, const class Image& image, class FFI& ffi);
 
 struct ValueHash {
     template <class T>
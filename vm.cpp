@@ -1,18 +1,229 @@
-#include <fstream>
+#include <algorithm>
+#include <condition_variable>
 
 #include "debug.h"
+#include "lazy_compiler.h"
 #include "vm.h"
 
-VM::VM() {
-    frames.push_back(CallFrame(0, 0));
-    read();
+static std::vector<ComponentInfo> world_components(const Image& image) {
+    std::vector<ComponentInfo> components;
+    for (size_t i = 0; i < image.component_count(); i++) {
+        const ImageComponent& component = image.component(i);
+        components.push_back(ComponentInfo{std::string(image.component_name(i)), component.field_count,
+                                           component.flags});
+    }
+    return components;
+}
+
+VM::VM(const Program& program)
+        : program(program.image), image(*this->program), lazy(program.lazy),
+          shared(std::make_shared<VmShared>(world_components(image))), world(shared->world),
+          strings(shared->strings), string_intern(shared->string_intern), ffi(program.ffi) {
+    strings.assign(image.strings(), image.strings_size());
+    std::vector<int> all(image.function_count());
+    for (size_t i = 0; i < all.size(); i++) {
+        all[i] = i;
+    }
+    functions.resize(all.size());
+    load(this->program, all);
+    for (const std::shared_ptr<const Image>& module : program.modules) {
+        all.resize(module->function_count());
+        for (size_t i = 0; i < all.size(); i++) {
+            all[i] = functions.size() + i;
+        }
+        module_scripts.push_back(functions.size());
+        functions.resize(functions.size() + all.size());
+        load(module, all);
+    }
+
+    for (size_t i = 0; i < image.system_count(); i++) {
+        std::string_view name = image.system_stage(i);
+        auto stage = std::find_if(stages.begin(), stages.end(), [&](const Schedule& s) { return s.stage == name; });
+        if (stage == stages.end()) {
+            stages.push_back(Schedule{name, {}, 0, false, false});
+            stage = stages.end() - 1;
+        }
+        int function = image.system(i).function;
+        bool serial = image.system(i).flags & SYSTEM_SERIAL;
+        stage->systems.push_back(ScheduledSystem{function, function_name(function), serial, false, {}, {}, {}, 0});
+    }
+}
+
+VM::VM(Image image) : VM(Program{std::make_shared<Image>(std::move(image)), FFI()}) {}
+
+VM::VM(VM& owner)
+        : program(owner.program), image(*program), functions(owner.functions), shared(owner.shared),
+          world(shared->world), strings(shared->strings), string_intern(shared->string_intern), threads(1),
+          ffi(owner.ffi) {}
+
+VM::~VM() = default;
+
+RuntimeResult VM::run(bool trace) {
+    apply_reloads();
+    size_t base = frames.size();
+    for (int script : module_scripts) {
+        frames.push_back(CallFrame(functions[script], value_stack.size()));
+        RuntimeResult result = execute(base, trace);
+        if (result != RUNTIME_OK) return result;
+        pop();
+    }
+    frames.push_back(CallFrame(functions[0], value_stack.size()));
+    RuntimeResult result = execute(base, trace);
+    // The script's return value.
+    if (result == RUNTIME_OK) pop();
+    return result;
+}
+
+RuntimeResult VM::run_entry(std::shared_ptr<const Image> entry, const std::vector<int>& functions,
+                            bool trace) {
+    apply_reloads();
+    if ((size_t)functions.back() >= this->functions.size()) this->functions.resize(functions.back() + 1);
+    load(std::move(entry), functions);
+    size_t stack_size = value_stack.size();
+    size_t base = frames.size();
+    frames.push_back(CallFrame(this->functions[0], 0));
+    RuntimeResult result = trace ? execute<true>(base) : execute<false>(base);
+    if (result != RUNTIME_OK) reset(base, stack_size);
+    return result;
+}
+
+int VM::find_function(std::string_view name) const {
+    // Function 0 is the script itself.
+    for (size_t i = 1; i < functions.size(); i++) {
+        if (function_name(i) == name) return i;
+    }
+    return -1;
+}
+
+std::string_view VM::function_name(int function_index) const {
+    const VmFunction& function = *functions[function_index];
+    return function.image->function_name(function.index);
+}
+
+RuntimeResult VM::call_function(int function_index, const std::vector<Value>& args, Value& result, bool trace) {
+    if (function_index <= 0 || (size_t)function_index >= functions.size()) {
+        runtime_error("Undefined function.");
+        return RUNTIME_ERROR;
+    }
+    if (args.size() != functions[function_index]->arity) {
+        runtime_error("Wrong number of arguments.");
+        return RUNTIME_ERROR;
+    }
+
+    size_t base = frames.size();
+    size_t stack_size = value_stack.size();
+    for (const Value& arg : args) push(arg);
+    apply_reloads();
+    RuntimeResult status = call(function_index) ? execute(base, trace) : RUNTIME_ERROR;
+    if (status == RUNTIME_OK) result = pop();
+    reset(base, stack_size);
+    return status;
+}
+
+Value VM::make_string(std::string_view text) {
+    std::lock_guard<std::shared_mutex> lock(shared->strings_mutex);
+    std::string string(text);
+    auto interned = string_intern.find(string);
+    if (interned != string_intern.end()) return StringIndex{interned->second};
+
+    size_t index = strings.size();
+    string_intern[string] = index;
+    strings.append(string);
+    strings.push_back('\0');
+    return StringIndex{index};
+}
+
+const char* VM::as_string(Value value) const {
+    if (!IS_STRING_INDEX(value)) return nullptr;
+    return &strings[AS_STRING_INDEX(value).index];
+}
+
+void VM::reload(std::shared_ptr<const Image> patch, std::vector<int> functions) {
+    std::lock_guard<std::mutex> lock(reload_mutex);
+    pending_reloads.push_back(PendingReload{std::move(patch), std::move(functions)});
+    reload_pending.store(true, std::memory_order_release);
+}
+
+void VM::reset(size_t frame_count, size_t stack_size) {
+    frames.resize(frame_count, CallFrame(nullptr, 0));
+    value_stack.resize(stack_size);
+    while (!cursors.empty() && cursors.back().frame >= frame_count) cursors.pop_back();
+    // What a run block cut short recorded is dropped with it.
+    if (cursors.empty()) commands.clear();
 }
 
+RuntimeResult VM::run_stage(std::string_view name) {
+    for (size_t stage = 0; stage < stages.size(); stage++) {
+        if (stages[stage].stage == name) {
+            apply_reloads();
+            return run_stage((uint8_t)stage);
+        }
+    }
+    runtime_error("Undefined stage.");
+    return RUNTIME_ERROR;
+}
+
+void VM::set_threads(unsigned threads) {
+    this->threads = threads;
+    pool.reset();
+    workers.clear();
+}
 
-RuntimeResult VM::run() {
-#ifdef VM_DEBUG
-    std::cout << "==<VM>==";
-#endif
+bool VM::dump_schedule(std::ostream& out) {
+    for (Schedule& stage : stages) {
+        if (!prepare_stage(stage)) return false;
+        print_schedule(out, stage, world);
+    }
+    return true;
+}
+
+// The image's functions, in order, become the given ones.
+void VM::load(std::shared_ptr<const Image> image, const std::vector<int>& functions) {
+    for (size_t index = 0; index < functions.size(); index++) {
+        const ImageFunction& function = image->function(index);
+        // Every compiled function ends in a return, so only a lazy
+        // program's stubs are empty.
+        const uint8_t* code = function.code_size ? image->code(index) : nullptr;
+        loaded.push_back(VmFunction{index, image.get(), code, image->constants(), image->strings(), function.arity});
+        this->functions[functions[index]] = &loaded.back();
+    }
+    images.push_back(std::move(image));
+    // The systems may call different code now.
+    for (Schedule& stage : stages) {
+        stage.built = false;
+    }
+    split_blocks.clear();
+}
+
+// Runs on the VM's thread, between calls, so nothing is half way through
+// an instruction of the code being replaced.
+void VM::apply_reloads() {
+    if (!reload_pending.load(std::memory_order_acquire)) return;
+    std::vector<PendingReload> reloads;
+    {
+        std::lock_guard<std::mutex> lock(reload_mutex);
+        reloads.swap(pending_reloads);
+        reload_pending.store(false, std::memory_order_relaxed);
+    }
+    for (PendingReload& reload : reloads) {
+        if (reload.patch->function_count() != reload.functions.size()) {
+            runtime_error("Reload doesn't match the running functions.");
+            continue;
+        }
+        load(std::move(reload.patch), reload.functions);
+    }
+}
+
+RuntimeResult VM::execute(size_t base, bool trace) {
+    RuntimeResult result = trace ? execute<true>(base) : execute<false>(base);
+    if (result != RUNTIME_OK) reset(base, frames.size() > base ? frames[base].slots : value_stack.size());
+    return result;
+}
+
+// Runs until the frame at depth base returns, leaving its result on the stack.
+template<bool TRACE>
+RuntimeResult VM::execute(size_t base) {
+    if constexpr (TRACE) std::cout << "==<VM>==";
 #define BINARY_OP(op) \
     while (true) {              \
       if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
@@ -34,19 +245,32 @@ RuntimeResult VM::run() {
       AS_NUMBER(value) op AS_NUMBER(peek(0)); \
       break; \
     }
+// The _NN variants trust TypeInference and skip the checks.
+#define NUMERIC_OP(op) \
+    do { \
+      double b = AS_NUMBER_UNCHECKED(value_stack.back()); \
+      value_stack.pop_back(); \
+      Value& a = value_stack.back(); \
+      a = AS_NUMBER_UNCHECKED(a) op b; \
+    } while (false)
+#define COMPOUND_NUMERIC_OP(op) \
+    do { \
+      Value& value = stack()[read_byte()]; \
+      AS_NUMBER_UNCHECKED(value) op AS_NUMBER_UNCHECKED(value_stack.back()); \
+    } while (false)
 
     while (true) {
-#ifdef VM_DEBUG
-        printf("          ");
-        for (Value& value : value_stack) {
-            std::cout << "[ ";
-            print_value(value, strings, functions, ffi);
-            std::cout << " ]";
+        if constexpr (TRACE) {
+            printf("          ");
+            for (Value& value : value_stack) {
+                std::cout << "[ ";
+                print(value);
+                std::cout << " ]";
+            }
+            std::cout << std::endl;
+            Debugger debugger(*frame().function->image, frame().function->index, ffi, strings, &image);
+            debugger.disassemble_instruction(frame().ip);
         }
-        std::cout << std::endl;
-        Debugger debugger(functions[frame().function_index].chunk, functions, ffi, constants, strings);
-        debugger.disassemble_instruction(frame().ip);
-#endif
         switch (read_byte()) {
             case OP_CONSTANT: push(read_constant()); break;
             case OP_NIL: push(Nil{}); break;
@@ -121,7 +345,7 @@ RuntimeResult VM::run() {
                 push(!values_equal(a, b));
                 break;
             }
-            case OP_PRINT: print_value(pop(), strings, functions, ffi); std::cout << std::endl; break;
+            case OP_PRINT: print(pop()); std::cout << std::endl; break;
             case OP_JUMP: {
                 uint16_t offset = read_short();
                 frame().ip += offset;
@@ -140,12 +364,13 @@ RuntimeResult VM::run() {
                 break;
             }
             case OP_CALL: {
-                uint8_t function_index = read_byte();
-                call(function_index);
+                uint16_t function_index = read_short();
+                apply_reloads();
+                if (!call(function_index)) return RUNTIME_ERROR;
                 break;
             }
             case OP_CALL_NATIVE: {
-                uint8_t function_index = read_byte();
+                uint16_t function_index = read_short();
                 call_native(function_index);
                 break;
             }
@@ -153,47 +378,173 @@ RuntimeResult VM::run() {
                 Value result = pop();
                 size_t slots = frame().slots;
                 frames.pop_back();
-                if (frames.empty()) {
-                    pop();
-                    return RUNTIME_OK;
-                }
 
                 //vm.stackTop = frame->slots;
                 while (value_stack.size() > slots) {
                     pop();
                 }
                 push(result);
+                if (frames.size() == base) return RUNTIME_OK;
                 //frame = &vm.frames[vm.frameCount - 1];
                 break;
             }
+            case OP_ADD_NN: NUMERIC_OP(+); break;
+            case OP_SUBTRACT_NN: NUMERIC_OP(-); break;
+            case OP_MULTIPLY_NN: NUMERIC_OP(*); break;
+            case OP_DIVIDE_NN: NUMERIC_OP(/); break;
+            case OP_LESS_NN: NUMERIC_OP(<); break;
+            case OP_LESS_EQUAL_NN: NUMERIC_OP(<=); break;
+            case OP_GREATER_NN: NUMERIC_OP(>); break;
+            case OP_GREATER_EQUAL_NN: NUMERIC_OP(>=); break;
+            case OP_ADD_ASSIGN_NN: COMPOUND_NUMERIC_OP(+=); break;
+            case OP_SUBTRACT_ASSIGN_NN: COMPOUND_NUMERIC_OP(-=); break;
+            case OP_MULTIPLY_ASSIGN_NN: COMPOUND_NUMERIC_OP(*=); break;
+            case OP_DIVIDE_ASSIGN_NN: COMPOUND_NUMERIC_OP(/=); break;
+            case OP_QUERY_BEGIN: {
+                const uint8_t* begin = frame().code + frame().ip - 1;
+                uint8_t term_count = read_byte();
+                cursors.emplace_back();
+                world.begin(cursors.back(), frame().code + frame().ip, term_count, frames.size() - 1);
+                frame().ip += 3 * term_count;
+                if (threads != 1 && run_split(begin) != RUNTIME_OK) return RUNTIME_ERROR;
+                break;
+            }
+            case OP_QUERY_NEXT: {
+                uint16_t offset = read_short();
+                QueryCursor& cursor = cursors.back();
+                if (cursor.next < cursor.rows) cursor.row = cursor.next++;
+                else if (!world.advance(cursor)) frame().ip += offset;
+                break;
+            }
+            case OP_QUERY_END:
+                // Where a worker's part of a split run block ends; its owner
+                // applies what it recorded.
+                if (cursors.back().split) {
+                    cursors.pop_back();
+                    return RUNTIME_OK;
+                }
+                cursors.pop_back();
+                if (cursors.empty() && !commands.empty()) world.apply({&commands});
+                break;
+            case OP_GET_FIELD: {
+                const QueryCursor& cursor = cursors.back();
+                push(cursor.columns[read_byte()][cursor.row]);
+                break;
+            }
+            case OP_SET_FIELD: {
+                const QueryCursor& cursor = cursors.back();
+                cursor.columns[read_byte()][cursor.row] = value_stack.back();
+                break;
+            }
+            case OP_GET_ENTITY: push((double)cursors.back().entities[cursors.back().row]); break;
+            case OP_SPAWN: {
+                uint16_t ids[UINT8_MAX];
+                uint8_t count = read_components(ids);
+                size_t fields = 0;
+                for (uint8_t i = 0; i < count; i++) fields += world.component(ids[i]).field_count;
+                Value* values = value_stack.data() + value_stack.size() - fields;
+                Entity entity;
+                if (cursors.empty()) {
+                    entity = world.spawn(ids, count, values);
+                } else {
+                    entity = world.reserve();
+                    commands.spawn(entity, ids, count, values, fields);
+                }
+                value_stack.resize(value_stack.size() - fields);
+                push((double)entity);
+                break;
+            }
+            case OP_DESPAWN: {
+                Entity entity;
+                if (!read_entity(value_stack.back(), entity, false)) return RUNTIME_ERROR;
+                if (cursors.empty()) world.despawn(entity);
+                else commands.despawn(entity);
+                value_stack.back() = Nil{};
+                break;
+            }
+            case OP_INSERT: {
+                uint16_t ids[UINT8_MAX];
+                uint8_t count = read_components(ids);
+                size_t fields = 0;
+                for (uint8_t i = 0; i < count; i++) fields += world.component(ids[i]).field_count;
+                Entity entity;
+                Value* values = value_stack.data() + value_stack.size() - fields;
+                if (!read_entity(values[-1], entity, true)) return RUNTIME_ERROR;
+                if (cursors.empty()) world.insert(entity, ids, count, values);
+                else commands.insert(entity, ids, count, values, fields);
+                value_stack.resize(value_stack.size() - fields);
+                value_stack.back() = Nil{};
+                break;
+            }
+            case OP_REMOVE: {
+                uint16_t ids[UINT8_MAX];
+                uint8_t count = read_components(ids);
+                Entity entity;
+                if (!read_entity(value_stack.back(), entity, true)) return RUNTIME_ERROR;
+                if (cursors.empty()) world.remove(entity, ids, count);
+                else commands.remove(entity, ids, count);
+                value_stack.back() = Nil{};
+                break;
+            }
+            case OP_RUN_STAGE:
+                if (run_stage(read_byte()) != RUNTIME_OK) return RUNTIME_ERROR;
+                push(Nil{});
+                break;
+            case OP_SUSPEND:
+                frames.pop_back();
+                if (frames.size() == base) return RUNTIME_OK;
+                break;
             default: return RUNTIME_ERROR;
         }
     }
 #undef BINARY_OP
 #undef COMPOUND_BINARY_OP
+#undef NUMERIC_OP
+#undef COMPOUND_NUMERIC_OP
 }
 
 void VM::string() {
     size_t index = read_byte();
-    auto result = string_intern.find(&strings[index]);
+    const VmFunction& function = *frame().function;
+    const char* literal = function.literals + index;
+    std::unique_lock<std::shared_mutex> lock(shared->strings_mutex);
+    auto result = string_intern.find(literal);
 
     if (result != string_intern.end()) {
         push(StringIndex{result->second});
         return;
     }
-    string_intern[&strings[index]] = index;
+    // The first image's literals start strings, at the same offsets; a
+    // reloaded function's are added as they are first used.
+    if (function.image != &image) {
+        lock.unlock();
+        push(make_string(literal));
+        return;
+    }
+    string_intern[literal] = index;
     push(StringIndex{index});
 }
 
 bool VM::call(int function_index) {
-    ObjFunction& function = functions[function_index];
-    frames.push_back(CallFrame(function_index, value_stack.size() - functions[function_index].arity));
+    if (!functions[function_index]->code && !compile(function_index)) return false;
+    const VmFunction* function = functions[function_index];
+    frames.push_back(CallFrame(function, value_stack.size() - function->arity));
     return true;
 }
+bool VM::compile(int function_index) {
+    std::shared_ptr<const Image> patch = lazy ? lazy->compile(function_index) : nullptr;
+    if (!patch) {
+        runtime_error("Function failed to compile.");
+        return false;
+    }
+    load(std::move(patch), {function_index});
+    return true;
+}
+
 bool VM::call_native(int function_index) {
     NativeFunction& native_fn = ffi.native_functions[function_index];
     NativeFn native = native_fn.native_fn;
-    Value result = native(native_fn.arity, stack() - native_fn.arity);
+    Value result = native(native_fn.arity, value_stack.data() + value_stack.size() - native_fn.arity);
     for (int i = 0; i < native_fn.arity; i++) {
         value_stack.pop_back();
     }
@@ -201,7 +552,234 @@ bool VM::call_native(int function_index) {
     return true;
 }
 
+// What an instruction in a run block split across threads can't do
+// alongside the other threads.
+static bool shared_effect(uint8_t instruction) {
+    switch (instruction) {
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_PRINT:
+        case OP_CALL_NATIVE:
+        case OP_RUN_STAGE:
+        case OP_SUSPEND:
+            return true;
+        default: return false;
+    }
+}
+
+// Reads what each system touches off its code and that of every function
+// it calls, compiling those a lazy program hasn't yet, and links the
+// systems that conflict.
+bool VM::prepare_stage(Schedule& stage) {
+    if (stage.built) return true;
+    for (ScheduledSystem& system : stage.systems) {
+        system.access = SystemAccess();
+        std::vector<bool> visited(functions.size(), false);
+        std::vector<int> work = {system.function};
+        visited[system.function] = true;
+        while (!work.empty()) {
+            int function = work.back();
+            work.pop_back();
+            if (!functions[function]->code && !compile(function)) return false;
+            const VmFunction& code = *functions[function];
+            std::vector<int> callees;
+            scan_access(code.code, code.image->function(code.index).code_size, world, system.access, callees);
+            for (int callee : callees) {
+                if (visited[callee]) continue;
+                visited[callee] = true;
+                work.push_back(callee);
+            }
+        }
+        if (system.access.resources & RESOURCE_STAGE) {
+            std::cerr << "System " << system.name << " runs a stage, which only the script may." << std::endl;
+            return false;
+        }
+        system.splits = false;
+        const VmFunction& code = *functions[system.function];
+        size_t size = code.image->function(code.index).code_size;
+        for (size_t offset = 0; !system.serial && offset < size; offset += instruction_size(code.code + offset)) {
+            if (code.code[offset] == OP_QUERY_BEGIN) system.splits |= split_block(code.code + offset).splits;
+        }
+    }
+    // Compiling may have cleared it.
+    build_schedule(stage);
+    return true;
+}
+
+// Makes the pool and a worker per thread of it, running this VM's current
+// code. False if there is only the one thread.
+bool VM::start_workers() {
+    if (!pool) pool = std::make_unique<ThreadPool>(threads);
+    if (pool->size() < 2) return false;
+    while (workers.size() < pool->size()) {
+        workers.push_back(std::unique_ptr<VM>(new VM(*this)));
+    }
+    for (std::unique_ptr<VM>& worker : workers) {
+        worker->functions = functions;
+    }
+    return true;
+}
+
+// Whether the run block at begin may be split across threads: nothing in
+// it or the functions it calls prints, calls a native, runs another query
+// or sets a global, and it doesn't return. Structural changes are recorded
+// a thread at a time.
+// The locals it sets are checked as it starts, against those there are.
+// Compiles the functions it calls that a lazy program hasn't yet.
+const VM::SplitBlock& VM::split_block(const uint8_t* begin) {
+    auto found = split_blocks.find(begin);
+    if (found != split_blocks.end()) return found->second;
+    SplitBlock block = {true, UINT32_MAX};
+    std::vector<int> callees;
+    for (const uint8_t* instruction = begin + instruction_size(begin); *instruction != OP_QUERY_END;
+         instruction += instruction_size(instruction)) {
+        switch (*instruction) {
+            case OP_SET_LOCAL:
+            case OP_ADD_ASSIGN:
+            case OP_SUBTRACT_ASSIGN:
+            case OP_MULTIPLY_ASSIGN:
+            case OP_DIVIDE_ASSIGN:
+            case OP_MODULO_ASSIGN:
+            case OP_ADD_ASSIGN_NN:
+            case OP_SUBTRACT_ASSIGN_NN:
+            case OP_MULTIPLY_ASSIGN_NN:
+            case OP_DIVIDE_ASSIGN_NN:
+                block.lowest_local = std::min<uint32_t>(block.lowest_local, instruction[1]);
+                break;
+            case OP_CALL: callees.push_back((instruction[1] << 8) | instruction[2]); break;
+            case OP_RETURN: block.splits = false; break;
+            default: block.splits &= !shared_effect(*instruction); break;
+        }
+    }
+    std::vector<bool> visited(functions.size(), false);
+    while (block.splits && !callees.empty()) {
+        int function = callees.back();
+        callees.pop_back();
+        if (visited[function]) continue;
+        visited[function] = true;
+        if (!functions[function]->code && !compile(function)) {
+            block.splits = false;
+            break;
+        }
+        const VmFunction& code = *functions[function];
+        size_t size = code.image->function(code.index).code_size;
+        for (size_t offset = 0; offset < size; offset += instruction_size(code.code + offset)) {
+            const uint8_t* instruction = code.code + offset;
+            if (*instruction == OP_CALL) callees.push_back((instruction[1] << 8) | instruction[2]);
+            else if (*instruction == OP_QUERY_BEGIN || shared_effect(*instruction)) block.splits = false;
+        }
+    }
+    // Compiling empties the table, so found may be stale.
+    return split_blocks[begin] = block;
+}
+
+// Runs the run block just begun, in a system that isn't serial, on every
+// thread of the pool, a chunk at a time, and leaves the frame past its
+// end. Does nothing when the block can't be split or has only a chunk.
+RuntimeResult VM::run_split(const uint8_t* begin) {
+    QueryCursor& cursor = cursors.back();
+    if (cursors.size() != 1 || cursor.joined) return RUNTIME_OK;
+    bool system = false;
+    for (const Schedule& stage : stages) {
+        for (const ScheduledSystem& scheduled : stage.systems) {
+            system |= !scheduled.serial && functions[scheduled.function] == frame().function;
+        }
+    }
+    if (!system) return RUNTIME_OK;
+    const SplitBlock& block = split_block(begin);
+    if (!block.splits || block.lowest_local < value_stack.size() - frame().slots) return RUNTIME_OK;
+    std::vector<ChunkRef> chunks = world.chunks(cursor);
+    if (chunks.size() < 2 || !start_workers()) return RUNTIME_OK;
+
+    ChunkQueue queue;
+    queue.deal(chunks, pool->size());
+    std::atomic<bool> failed{false};
+    pool->run([&](unsigned thread) {
+        // The worker starts at the block's OP_QUERY_NEXT, on a copy of the
+        // frame's locals.
+        VM& worker = *workers[thread];
+        worker.value_stack.assign(value_stack.begin() + frame().slots, value_stack.end());
+        worker.frames.assign(1, frame());
+        worker.frames[0].slots = 0;
+        worker.cursors.assign(1, cursor);
+        worker.cursors[0].frame = 0;
+        worker.cursors[0].split = &queue;
+        worker.cursors[0].thread = thread;
+        worker.split_failed = &failed;
+        if (worker.execute(0, false) != RUNTIME_OK) failed = true;
+        worker.split_failed = nullptr;
+    });
+    std::vector<CommandBuffer*> buffers;
+    for (std::unique_ptr<VM>& worker : workers) {
+        buffers.push_back(&worker->commands);
+    }
+    if (!failed) world.apply(buffers);
+    for (std::unique_ptr<VM>& worker : workers) {
+        worker->reset(0, 0);
+    }
+    const uint8_t* next = frame().code + frame().ip;
+    frame().ip += 3 + ((next[1] << 8) | next[2]);
+    return failed ? RUNTIME_ERROR : RUNTIME_OK;
+}
+
+// In declaration order on this thread, unless some systems can run at once
+// and there are threads to run them.
+RuntimeResult VM::run_stage(uint8_t index) {
+    if (!cursors.empty()) {
+        runtime_error("Can't run a stage while a query runs.");
+        return RUNTIME_ERROR;
+    }
+    Schedule& stage = stages[index];
+    if (!prepare_stage(stage)) return RUNTIME_ERROR;
+    if (stage.width > 1 && !stage.splits && threads != 1 && start_workers()) return run_parallel(stage);
+    for (const ScheduledSystem& system : stage.systems) {
+        Value result;
+        if (call_function(system.function, {}, result) != RUNTIME_OK) return RUNTIME_ERROR;
+    }
+    return RUNTIME_OK;
+}
+
+// Every thread takes the next system whose earlier conflicting systems have
+// all finished, runs it on a worker of its own and frees the systems
+// waiting on it. After an error no more start.
+RuntimeResult VM::run_parallel(const Schedule& stage) {
+    std::mutex mutex;
+    std::condition_variable ready_changed;
+    std::deque<uint32_t> ready;
+    std::vector<size_t> waiting(stage.systems.size());
+    for (uint32_t system = 0; system < stage.systems.size(); system++) {
+        waiting[system] = stage.systems[system].after.size();
+        if (waiting[system] == 0) ready.push_back(system);
+    }
+    size_t finished = 0;
+    bool failed = false;
+    pool->run([&](unsigned thread) {
+        VM& worker = *workers[thread];
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            ready_changed.wait(lock, [&] {
+                return failed || finished == stage.systems.size() || !ready.empty();
+            });
+            if (failed || ready.empty()) return;
+            uint32_t system = ready.front();
+            ready.pop_front();
+            lock.unlock();
+            Value result;
+            bool ok = worker.call_function(stage.systems[system].function, {}, result) == RUNTIME_OK;
+            lock.lock();
+            finished++;
+            if (!ok) failed = true;
+            for (uint32_t later : stage.systems[system].before) {
+                if (--waiting[later] == 0) ready.push_back(later);
+            }
+            ready_changed.notify_all();
+        }
+    });
+    return failed ? RUNTIME_ERROR : RUNTIME_OK;
+}
+
 void VM::concatenate() {
+    std::lock_guard<std::shared_mutex> lock(shared->strings_mutex);
     const char* b = &strings[AS_STRING_INDEX(pop()).index];
     std::string a_b = &strings[AS_STRING_INDEX(pop()).index];
     a_b.append(b);
@@ -212,19 +790,29 @@ void VM::concatenate() {
         return;
     }
 
-    uint8_t index = strings.size();
+    size_t index = strings.size();
     string_intern[a_b] = index;
     strings.append(a_b);
     strings.push_back('\0');
     push(StringIndex{index});
 }
 
+// Functions are named by the table, which a REPL grows past the image.
+void VM::print(const Value& value) {
+    if (IS_FUNCTION_INDEX(value) && AS_FUNCTION_INDEX(value).user_index != -1) {
+        std::cout << "<fn " << function_name(AS_FUNCTION_INDEX(value).user_index) << ">";
+        return;
+    }
+    std::shared_lock<std::shared_mutex> lock(shared->strings_mutex);
+    print_value(value, strings, image, ffi);
+}
+
 bool VM::is_falsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
 uint8_t VM::read_byte() {
-    return functions[frame().function_index].chunk.code[frame().ip++];
+    return frame().code[frame().ip++];
 }
 
 uint16_t VM::read_short() {
@@ -232,7 +820,29 @@ uint16_t VM::read_short() {
 }
 
 Value VM::read_constant() {
-    return constants[read_byte()];
+    return decode_constant(frame().function->constants[read_byte()]);
+}
+
+// A count, then that many components.
+uint8_t VM::read_components(uint16_t* ids) {
+    uint8_t count = read_byte();
+    for (uint8_t i = 0; i < count; i++) {
+        ids[i] = read_short();
+    }
+    return count;
+}
+
+bool VM::read_entity(Value value, Entity& entity, bool must_live) {
+    if (!IS_NUMBER(value) || AS_NUMBER(value) < 0 || AS_NUMBER(value) >= 9007199254740992.0) {
+        runtime_error("Entity must be a number.");
+        return false;
+    }
+    entity = (Entity)AS_NUMBER(value);
+    if (must_live && !world.alive(entity)) {
+        runtime_error("Entity has been despawned.");
+        return false;
+    }
+    return true;
 }
 
 void VM::push(Value value) {
@@ -258,47 +868,6 @@ CallFrame& VM::frame() {
 }
 
 void VM::runtime_error(const char* message) {
+    if (split_failed && split_failed->exchange(true)) return;
     std::cerr << message << std::endl;
 }
-
-void VM::read() {
-    std::ifstream in("bytecode.dat", std::ios::binary);
-
-    if (in.is_open()) {
-        // Function Count
-        size_t functions_size;
-        in.read(reinterpret_cast<char*>(&functions_size), sizeof(size_t));
-        functions.resize(functions_size);
-        for (size_t i = 0; i < functions_size; i++) {
-            // Function Name
-            size_t name_size;
-            in.read(reinterpret_cast<char*>(&name_size), sizeof(size_t));
-            functions[i].name.lexeme.resize(name_size);
-            in.read(reinterpret_cast<char*>(functions[i].name.lexeme.data()), name_size * sizeof(char));
-            // Function Arity
-            in.read(reinterpret_cast<char*>(&functions[i].arity), 1 * sizeof(int));
-            // Bytecode:
-            size_t bytecode_size;
-            in.read(reinterpret_cast<char*>(&bytecode_size), sizeof(size_t));
-            functions[i].chunk.code.resize(bytecode_size);
-            in.read(reinterpret_cast<char*>(functions[i].chunk.code.data()), bytecode_size * sizeof(uint8_t));
-            // Lines:
-            size_t lines_size;
-            in.read(reinterpret_cast<char*>(&lines_size), sizeof(size_t));
-            functions[i].chunk.lines.resize(lines_size);
-            in.read(reinterpret_cast<char*>(functions[i].chunk.lines.data()), bytecode_size * sizeof(int));
-        }
-        // Constants
-        size_t constants_size;
-        in.read(reinterpret_cast<char*>(&constants_size), sizeof(size_t));
-        constants.resize(constants_size);
-        in.read(reinterpret_cast<char*>(constants.data()), constants_size * sizeof(Value));
-        // Constants
-        size_t str_constants_size;
-        in.read(reinterpret_cast<char*>(&str_constants_size), sizeof(size_t));
-        strings.resize(str_constants_size);
-        in.read(reinterpret_cast<char*>(strings.data()), str_constants_size * sizeof(char));
-
-        in.close();
-    }
-}
\ No newline at end of file
@@ -1,34 +1,129 @@
 #ifndef MOSAIC_ECS_VM_H
 #define MOSAIC_ECS_VM_H
 
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <shared_mutex>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
+#include "ecs.h"
 #include "ffi.h"
+#include "image.h"
+#include "program.h"
+#include "schedule.h"
+#include "thread_pool.h"
 
 enum RuntimeResult {
     RUNTIME_OK,
     RUNTIME_ERROR,
 };
 
+// A function as the VM calls it, with the image its code came from. A hot
+// reload or a lazy compile points the function table at new ones; these
+// never change. code is null until a lazy program compiles the function.
+struct VmFunction {
+    // The function's index in its image.
+    size_t index;
+    const Image* image;
+    const uint8_t* code;
+    const ImageConstant* constants;
+    // The literals OP_STRING's operand indexes.
+    const char* literals;
+    uint32_t arity;
+};
+
 struct CallFrame {
-    CallFrame(size_t function_index, size_t slots) {
-       this->function_index = function_index;
+    CallFrame(const VmFunction* function, size_t slots) {
+       this->function = function;
+       this->code = function ? function->code : nullptr;
        this->slots = slots;
     }
-    size_t function_index;
+    // What the frame was called with, even if a reload has swapped the
+    // function since.
+    const VmFunction* function;
+    const uint8_t* code;
     size_t ip = 0;
     size_t slots;
 };
 
+// What a VM shares with the workers running a stage's systems for it.
+struct VmShared {
+    VmShared(std::vector<ComponentInfo> components) : world(std::move(components)) {}
+    // The entities the script spawns, laid out by its comp declarations.
+    World world;
+    // Starts as the image's literals and grows as strings are concatenated.
+    std::string strings;
+    std::unordered_map<std::string, size_t> string_intern;
+    // Held to make a string, and shared to read one, while systems run at
+    // once.
+    std::shared_mutex strings_mutex;
+};
+
 class VM {
 public:
-    VM();
-    RuntimeResult run();
+    VM(const Program& program);
+    VM(Image image);
+    VM(const VM&) = delete;
+    VM& operator=(const VM&) = delete;
+    ~VM();
+    // Runs the script's top level, after those of the modules it imports.
+    RuntimeResult run(bool trace = false);
+    // Host entry points. Function indices stay valid for the VM's lifetime,
+    // so look them up once and call as often as needed.
+    int find_function(std::string_view name) const;
+    std::string_view function_name(int function_index) const;
+    RuntimeResult call_function(int function_index, const std::vector<Value>& args, Value& result,
+                                bool trace = false);
+    Value make_string(std::string_view text);
+    const char* as_string(Value value) const;
+    // Runs a piece of a script typed in at the REPL, as compiled by
+    // Compiler::compile_entry(): entry's first function is the piece,
+    // which continues the script's frame, and the rest become the given
+    // functions. The locals the piece declares stay on the stack. After an
+    // error the stack is as it was before the piece.
+    RuntimeResult run_entry(std::shared_ptr<const Image> entry, const std::vector<int>& functions,
+                            bool trace = false);
+    // Runs the systems of the named stage; see schedule.h.
+    RuntimeResult run_stage(std::string_view stage);
+    // Threads a stage's systems may run on; 0, the default, is every
+    // hardware thread.
+    void set_threads(unsigned threads);
+    // Prints how every stage's systems will run.
+    bool dump_schedule(std::ostream& out);
+    // Swaps in patch's functions, in order, for the given ones at the next
+    // safe point: a call, or the next entry from the host. Frames already
+    // running finish on the old code; the stack and strings are left alone.
+    // Safe to call from another thread.
+    void reload(std::shared_ptr<const Image> patch, std::vector<int> functions);
 private:
+    // A worker running systems for owner, on its world and strings.
+    explicit VM(VM& owner);
+    RuntimeResult execute(size_t base, bool trace);
+    template<bool TRACE>
+    RuntimeResult execute(size_t base);
+    void reset(size_t frame_count, size_t stack_size);
+    void load(std::shared_ptr<const Image> image, const std::vector<int>& functions);
+    void apply_reloads();
+    bool compile(int function_index);
     uint8_t read_byte();
     uint16_t read_short();
     Value read_constant();
+    uint8_t read_components(uint16_t* ids);
+    bool read_entity(Value value, Entity& entity, bool must_live);
+    bool prepare_stage(Schedule& stage);
+    bool start_workers();
+    struct SplitBlock;
+    const SplitBlock& split_block(const uint8_t* begin);
+    RuntimeResult run_split(const uint8_t* begin);
+    RuntimeResult run_stage(uint8_t stage);
+    RuntimeResult run_parallel(const Schedule& stage);
     void concatenate();
+    void print(const Value& value);
     void string();
     bool call(int function_index);
     bool call_native(int function_index);
@@ -39,14 +134,55 @@ private:
     Value* stack();
     CallFrame& frame();
     void runtime_error(const char* message);
-    void read();
 
     std::vector<CallFrame> frames;
     std::vector<Value> value_stack;
-    std::vector<Value> constants;
-    std::string strings;
-    std::unordered_map<std::string, uint8_t> string_intern;
-    std::vector<ObjFunction> functions;
+    std::shared_ptr<const Image> program;
+    const Image& image;
+    // Current code per function index.
+    std::vector<const VmFunction*> functions;
+    // Every image loaded so far and its functions, kept for the frames that
+    // may still run them.
+    std::vector<std::shared_ptr<const Image>> images;
+    std::deque<VmFunction> loaded;
+    std::shared_ptr<LazyCompiler> lazy;
+    // Where each imported module's top level is in the function table.
+    std::vector<int> module_scripts;
+
+    struct PendingReload {
+        std::shared_ptr<const Image> patch;
+        std::vector<int> functions;
+    };
+    std::mutex reload_mutex;
+    std::vector<PendingReload> pending_reloads;
+    std::atomic<bool> reload_pending{false};
+    // A worker's are its owner's.
+    std::shared_ptr<VmShared> shared;
+    World& world;
+    std::string& strings;
+    std::unordered_map<std::string, size_t>& string_intern;
+    // The run blocks iterating the world, innermost last.
+    std::vector<QueryCursor> cursors;
+    // The structural changes made while they do, applied as the outermost
+    // ends.
+    CommandBuffer commands;
+    // The script's stages, in the order it first names them.
+    std::vector<Schedule> stages;
+    unsigned threads = 0;
+    std::unique_ptr<ThreadPool> pool;
+    // One per thread of the pool.
+    std::vector<std::unique_ptr<VM>> workers;
+    // What split_block() found of each run block, by its OP_QUERY_BEGIN:
+    // whether it may split, and the lowest local it sets, UINT32_MAX for
+    // none. It may split where it began with no more locals than that.
+    struct SplitBlock {
+        bool splits;
+        uint32_t lowest_local;
+    };
+    std::unordered_map<const uint8_t*, SplitBlock> split_blocks;
+    // Set on a worker running part of a split block: every part hits the
+    // same error, which the first to fail reports alone.
+    std::atomic<bool>* split_failed = nullptr;
 
     FFI ffi;
 };